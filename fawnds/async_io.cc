@@ -0,0 +1,333 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "async_io.h"
+#include "debug.h"
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <cassert>
+
+namespace fawn {
+
+    const size_t AsyncIO::queue_depth_;
+
+    static pthread_once_t context_key_once = PTHREAD_ONCE_INIT;
+    static pthread_key_t context_key;
+
+    struct ThreadContexts {
+        AsyncIO* contexts[3];
+    };
+
+    void
+    AsyncIO::create_key()
+    {
+        if (pthread_key_create(&context_key, destroy_contexts))
+            perror("AsyncIO::create_key(): cannot create a thread-specific key");
+    }
+
+    void
+    AsyncIO::destroy_contexts(void* p)
+    {
+        ThreadContexts* tc = static_cast<ThreadContexts*>(p);
+        for (size_t i = 0; i < sizeof(tc->contexts) / sizeof(tc->contexts[0]); i++)
+            delete tc->contexts[i];
+        delete tc;
+    }
+
+    AsyncIO*
+    AsyncIO::thread_context(Engine engine)
+    {
+        pthread_once(&context_key_once, create_key);
+
+        ThreadContexts* tc = static_cast<ThreadContexts*>(pthread_getspecific(context_key));
+        if (!tc) {
+            tc = new ThreadContexts();
+            memset(tc, 0, sizeof(ThreadContexts));
+            pthread_setspecific(context_key, tc);
+        }
+
+        if (!tc->contexts[engine])
+            tc->contexts[engine] = new AsyncIO(engine);
+        return tc->contexts[engine];
+    }
+
+    bool
+    AsyncIO::parse_engine(const std::string& name, Engine& engine)
+    {
+        if (name == "sync")
+            engine = ENGINE_SYNC;
+        else if (name == "libaio")
+            engine = ENGINE_LIBAIO;
+        else if (name == "io_uring" || name == "auto")
+            engine = ENGINE_IO_URING;
+        else
+            return false;
+        return true;
+    }
+
+    AsyncIO::AsyncIO(Engine engine)
+        : engine_(ENGINE_SYNC)
+    {
+#ifdef HAVE_LIBURING
+        if (engine_ == ENGINE_SYNC && engine >= ENGINE_IO_URING) {
+            int ret = io_uring_queue_init(queue_depth_, &ring_, 0);
+            if (ret == 0)
+                engine_ = ENGINE_IO_URING;
+            else
+                DPRINTF(2, "AsyncIO::AsyncIO(): cannot initialize io_uring: %s\n", strerror(-ret));
+        }
+#endif
+#ifdef HAVE_LIBAIO
+        if (engine_ == ENGINE_SYNC && engine >= ENGINE_LIBAIO) {
+            memset(&aio_ctx_, 0, sizeof(aio_ctx_));
+            int ret = io_setup(queue_depth_, &aio_ctx_);
+            if (ret == 0)
+                engine_ = ENGINE_LIBAIO;
+            else
+                DPRINTF(2, "AsyncIO::AsyncIO(): cannot initialize libaio: %s\n", strerror(-ret));
+        }
+#endif
+        (void)engine;
+    }
+
+    AsyncIO::~AsyncIO()
+    {
+#ifdef HAVE_LIBURING
+        if (engine_ == ENGINE_IO_URING)
+            io_uring_queue_exit(&ring_);
+#endif
+#ifdef HAVE_LIBAIO
+        if (engine_ == ENGINE_LIBAIO)
+            io_destroy(aio_ctx_);
+#endif
+    }
+
+    bool
+    AsyncIO::read(Request* reqs, size_t n)
+    {
+        switch (engine_) {
+#ifdef HAVE_LIBURING
+        case ENGINE_IO_URING:
+            return read_io_uring(reqs, n);
+#endif
+#ifdef HAVE_LIBAIO
+        case ENGINE_LIBAIO:
+            return read_libaio(reqs, n);
+#endif
+        default:
+            return read_sync(reqs, n);
+        }
+    }
+
+    bool
+    AsyncIO::read_sync(Request* reqs, size_t n)
+    {
+        for (size_t i = 0; i < n; i++) {
+            reqs[i].result = pread(reqs[i].fd, reqs[i].buf, reqs[i].count, reqs[i].offset);
+            if (reqs[i].result < 0)
+                reqs[i].result = -errno;
+        }
+        return true;
+    }
+
+#ifdef HAVE_LIBAIO
+    bool
+    AsyncIO::read_libaio(Request* reqs, size_t n)
+    {
+        struct iocb iocbs[queue_depth_];
+        struct iocb* iocb_ptrs[queue_depth_];
+        struct io_event events[queue_depth_];
+
+        for (size_t base = 0; base < n; base += queue_depth_) {
+            size_t batch = std::min(n - base, queue_depth_);
+
+            for (size_t i = 0; i < batch; i++) {
+                Request& req = reqs[base + i];
+                req.result = -EIO;
+                io_prep_pread(&iocbs[i], req.fd, req.buf, req.count, req.offset);
+                iocbs[i].data = &req;
+                iocb_ptrs[i] = &iocbs[i];
+            }
+
+            // io_submit() may accept only a part of the batch; the rest is not retained by the kernel
+            size_t submitted = 0;
+            size_t completed = 0;
+            bool failed = false;
+            while (submitted < batch && !failed) {
+                int ret = io_submit(aio_ctx_, batch - submitted, iocb_ptrs + submitted);
+                if (ret > 0) {
+                    submitted += ret;
+                    continue;
+                }
+                if (ret == -EINTR)
+                    continue;
+                if (ret == -EAGAIN && completed < submitted) {
+                    // out of resources; make room by reaping a completion
+                    int reaped = reap_libaio(1, events);
+                    if (reaped < 0)
+                        failed = true;
+                    else
+                        completed += reaped;
+                    continue;
+                }
+                fprintf(stderr, "AsyncIO::read_libaio(): cannot submit: %s\n", ret == 0 ? "no request accepted" : strerror(-ret));
+                failed = true;
+            }
+
+            // reap whatever has been submitted even on failure so that no buffer is left in flight
+            while (completed < submitted && !failed) {
+                int reaped = reap_libaio(submitted - completed, events);
+                if (reaped < 0)
+                    failed = true;
+                else
+                    completed += reaped;
+            }
+
+            if (failed) {
+                // io_destroy() waits for the requests that could not be reaped, so their buffers can be reused afterwards
+                reset();
+                read_sync(reqs + base + submitted, n - base - submitted);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int
+    AsyncIO::reap_libaio(size_t max_events, struct io_event* events)
+    {
+        while (true) {
+            int ret = io_getevents(aio_ctx_, 1, max_events, events, NULL);
+            if (ret == -EINTR)
+                continue;
+            if (ret < 0) {
+                fprintf(stderr, "AsyncIO::reap_libaio(): cannot get events: %s\n", strerror(-ret));
+                return ret;
+            }
+            for (int j = 0; j < ret; j++) {
+                Request* req = static_cast<Request*>(events[j].data);
+                req->result = static_cast<ssize_t>(static_cast<long>(events[j].res));
+            }
+            return ret;
+        }
+    }
+#endif
+
+#ifdef HAVE_LIBURING
+    bool
+    AsyncIO::read_io_uring(Request* reqs, size_t n)
+    {
+        for (size_t base = 0; base < n; base += queue_depth_) {
+            size_t batch = std::min(n - base, queue_depth_);
+
+            for (size_t i = 0; i < batch; i++) {
+                Request& req = reqs[base + i];
+                req.result = -EIO;
+                struct io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+                // every call leaves the ring empty (or replaces it), so a whole batch always fits
+                assert(sqe);
+                io_uring_prep_read(sqe, req.fd, req.buf, req.count, req.offset);
+                io_uring_sqe_set_data(sqe, &req);
+            }
+
+            size_t submitted = 0;
+            size_t completed = 0;
+            bool failed = false;
+            while (submitted < batch) {
+                int ret = io_uring_submit(&ring_);
+                if (ret > 0) {
+                    submitted += ret;
+                    continue;
+                }
+                if (ret == -EINTR)
+                    continue;
+                if ((ret == -EAGAIN || ret == -EBUSY) && completed < submitted) {
+                    // out of resources or completion queue space; make room by reaping a completion
+                    reap_io_uring(1);
+                    completed++;
+                    continue;
+                }
+                fprintf(stderr, "AsyncIO::read_io_uring(): cannot submit: %s\n", ret == 0 ? "no request accepted" : strerror(-ret));
+                failed = true;
+                break;
+            }
+
+            // reap whatever has been submitted even on failure so that no buffer is left in flight
+            reap_io_uring(submitted - completed);
+
+            if (failed) {
+                // unsubmitted entries would stay in the submission queue and go out with the next batch; drop them with the ring
+                reset();
+                read_sync(reqs + base + submitted, n - base - submitted);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void
+    AsyncIO::reap_io_uring(size_t count)
+    {
+        bool polling = false;
+        while (count > 0) {
+            struct io_uring_cqe* cqe;
+            int ret;
+            if (!polling)
+                ret = io_uring_wait_cqe(&ring_, &cqe);
+            else {
+                ret = io_uring_peek_cqe(&ring_, &cqe);
+                if (ret == -EAGAIN) {
+                    usleep(100);
+                    continue;
+                }
+            }
+            if (ret == -EINTR)
+                continue;
+            if (ret < 0) {
+                // the kernel still owns the buffers; wait for their completions without blocking in the kernel
+                fprintf(stderr, "AsyncIO::reap_io_uring(): cannot wait for completion: %s\n", strerror(-ret));
+                polling = true;
+                continue;
+            }
+            Request* req = static_cast<Request*>(io_uring_cqe_get_data(cqe));
+            req->result = cqe->res;
+            io_uring_cqe_seen(&ring_, cqe);
+            count--;
+        }
+    }
+#endif
+
+    void
+    AsyncIO::reset()
+    {
+        Engine engine = engine_;
+#ifdef HAVE_LIBURING
+        if (engine_ == ENGINE_IO_URING) {
+            io_uring_queue_exit(&ring_);
+            int ret = io_uring_queue_init(queue_depth_, &ring_, 0);
+            if (ret != 0) {
+                fprintf(stderr, "AsyncIO::reset(): cannot initialize io_uring: %s\n", strerror(-ret));
+                engine = ENGINE_SYNC;
+            }
+        }
+#endif
+#ifdef HAVE_LIBAIO
+        if (engine_ == ENGINE_LIBAIO) {
+            io_destroy(aio_ctx_);
+            memset(&aio_ctx_, 0, sizeof(aio_ctx_));
+            int ret = io_setup(queue_depth_, &aio_ctx_);
+            if (ret != 0) {
+                fprintf(stderr, "AsyncIO::reset(): cannot initialize libaio: %s\n", strerror(-ret));
+                engine = ENGINE_SYNC;
+            }
+        }
+#endif
+        // later reads of this thread are synchronous if the context cannot be recreated
+        engine_ = engine;
+    }
+
+} // namespace fawn
@@ -0,0 +1,84 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef _ASYNC_IO_H_
+#define _ASYNC_IO_H_
+
+#include "config.h"
+#include "file_io.h"
+#include <string>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#ifdef HAVE_LIBAIO
+#include <libaio.h>
+#endif
+
+namespace fawn {
+
+    // batched read submission for the I/O layer
+    // each thread owns one I/O context per engine, which is shared by all file stores used by that thread;
+    // an engine that is not compiled in or cannot be initialized falls back to the next one (io_uring -> libaio -> sync)
+
+    class AsyncIO {
+    public:
+        enum Engine {
+            ENGINE_SYNC = 0,
+            ENGINE_LIBAIO,
+            ENGINE_IO_URING
+        };
+
+        struct Request {
+            int fd;
+            void* buf;
+            size_t count;
+            off_t offset;
+            ssize_t result;     // bytes read, or -errno on failure
+        };
+
+        // returns the I/O context of the calling thread for the given engine
+        static AsyncIO* thread_context(Engine engine);
+
+        // "sync", "libaio", "io_uring", or "auto" (the best available engine)
+        static bool parse_engine(const std::string& name, Engine& engine);
+
+        Engine engine() const { return engine_; }
+
+        // submits all requests and waits until they complete; the result of each request is stored in its result field
+        // returns false if the engine failed; requests that could not be submitted are then read synchronously
+        // and the context is recreated, so no request is in flight when this returns
+        bool read(Request* reqs, size_t n);
+
+    protected:
+        explicit AsyncIO(Engine engine);
+        ~AsyncIO();
+
+        bool read_sync(Request* reqs, size_t n);
+#ifdef HAVE_LIBAIO
+        bool read_libaio(Request* reqs, size_t n);
+        int reap_libaio(size_t max_events, struct io_event* events);
+#endif
+#ifdef HAVE_LIBURING
+        bool read_io_uring(Request* reqs, size_t n);
+        void reap_io_uring(size_t count);
+#endif
+        void reset();
+
+        static void create_key();
+        static void destroy_contexts(void* p);
+
+    private:
+        static const size_t queue_depth_ = 128;
+
+        Engine engine_;
+
+#ifdef HAVE_LIBAIO
+        io_context_t aio_ctx_;
+#endif
+#ifdef HAVE_LIBURING
+        struct io_uring ring_;
+#endif
+    };
+
+} // namespace fawn
+
+#endif // #ifndef _ASYNC_IO_H_
@@ -0,0 +1,196 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "block_cache.h"
+#include "debug.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <tbb/queuing_mutex.h>
+
+#include <cassert>
+
+namespace fawn {
+
+    static tbb::queuing_mutex registry_mutex;
+    static std::map<std::string, BlockCache*> registry;
+
+    tbb::atomic<uint64_t> BlockCache::next_file_id_;
+
+    BlockCache*
+    BlockCache::Acquire(const std::string& name, size_t capacity)
+    {
+        tbb::queuing_mutex::scoped_lock lock(registry_mutex);
+
+        if (!name.empty()) {
+            std::map<std::string, BlockCache*>::iterator it = registry.find(name);
+            if (it != registry.end()) {
+                it->second->refs_++;
+                return it->second;
+            }
+        }
+
+        BlockCache* cache = new BlockCache(capacity);
+        cache->name_ = name;
+        cache->refs_ = 1;
+        if (!name.empty())
+            registry[name] = cache;
+
+        DPRINTF(2, "BlockCache::Acquire(): created cache \"%s\" of %zu bytes\n", name.c_str(), cache->capacity());
+        return cache;
+    }
+
+    BlockCache*
+    BlockCache::Acquire(const std::string& name)
+    {
+        tbb::queuing_mutex::scoped_lock lock(registry_mutex);
+
+        std::map<std::string, BlockCache*>::iterator it = registry.find(name);
+        if (it == registry.end())
+            return NULL;
+        it->second->refs_++;
+        return it->second;
+    }
+
+    void
+    BlockCache::Release(BlockCache* cache)
+    {
+        tbb::queuing_mutex::scoped_lock lock(registry_mutex);
+
+        assert(cache->refs_ > 0);
+        if (--cache->refs_ != 0)
+            return;
+
+        if (!cache->name_.empty())
+            registry.erase(cache->name_);
+        delete cache;
+    }
+
+    uint64_t
+    BlockCache::NewFileID()
+    {
+        return ++next_file_id_;
+    }
+
+    BlockCache::BlockCache(size_t capacity)
+    {
+        size_t num_blocks = capacity / block_size;
+        if (num_blocks == 0)
+            num_blocks = 1;
+
+        // a small cache uses fewer shards so that CLOCK has enough blocks to choose from in each shard
+        size_t num_shards = max_shards_;
+        while (num_shards > 1 && num_blocks / num_shards < min_blocks_per_shard_)
+            num_shards /= 2;
+        blocks_per_shard_ = num_blocks / num_shards;
+
+        for (size_t i = 0; i < num_shards; i++) {
+            Shard* shard = new Shard();
+            shard->index.rehash(blocks_per_shard_);
+            shard->slots = new Slot[blocks_per_shard_];
+            for (size_t j = 0; j < blocks_per_shard_; j++) {
+                shard->slots[j].valid = false;
+                shard->slots[j].referenced = false;
+            }
+            shard->data = new char[blocks_per_shard_ * block_size];
+            shard->clock_hand = 0;
+            shards_.push_back(shard);
+        }
+    }
+
+    BlockCache::~BlockCache()
+    {
+        for (size_t i = 0; i < shards_.size(); i++) {
+            delete [] shards_[i]->slots;
+            delete [] shards_[i]->data;
+            delete shards_[i];
+        }
+    }
+
+    size_t
+    BlockCache::BlockKeyHash::operator()(const BlockKey& key) const
+    {
+        uint64_t v = key.file_id * 0x9e3779b97f4a7c15LLU ^ static_cast<uint64_t>(key.offset / block_size) * 0xc2b2ae3d27d4eb4fLLU;
+        return static_cast<size_t>(v ^ (v >> 29));
+    }
+
+    BlockCache::Shard&
+    BlockCache::shard_for(const BlockKey& key) const
+    {
+        // use the upper bits for shard selection; the lower bits are used by the per-shard index
+        return *shards_[(BlockKeyHash()(key) >> 24) % shards_.size()];
+    }
+
+    bool
+    BlockCache::Get(uint64_t file_id, off_t offset, void* buf) const
+    {
+        BlockKey key = { file_id, offset };
+        Shard& shard = shard_for(key);
+
+        tbb::spin_rw_mutex::scoped_lock lock(shard.mutex, false);
+
+        std::tr1::unordered_map<BlockKey, size_t, BlockKeyHash>::const_iterator it = shard.index.find(key);
+        if (it == shard.index.end())
+            return false;
+
+        Slot& slot = shard.slots[it->second];
+        slot.referenced = true;
+        memcpy(buf, shard.data + it->second * block_size, block_size);
+        return true;
+    }
+
+    void
+    BlockCache::Put(uint64_t file_id, off_t offset, const void* buf)
+    {
+        BlockKey key = { file_id, offset };
+        Shard& shard = shard_for(key);
+
+        tbb::spin_rw_mutex::scoped_lock lock(shard.mutex, true);
+
+        size_t slot_index;
+        std::tr1::unordered_map<BlockKey, size_t, BlockKeyHash>::iterator it = shard.index.find(key);
+        if (it != shard.index.end())
+            slot_index = it->second;
+        else {
+            // CLOCK: skip recently referenced slots, clearing their reference bit
+            while (true) {
+                Slot& slot = shard.slots[shard.clock_hand];
+                if (!slot.valid || !slot.referenced)
+                    break;
+                slot.referenced = false;
+                shard.clock_hand = (shard.clock_hand + 1) % blocks_per_shard_;
+            }
+
+            slot_index = shard.clock_hand;
+            shard.clock_hand = (shard.clock_hand + 1) % blocks_per_shard_;
+
+            Slot& slot = shard.slots[slot_index];
+            if (slot.valid)
+                shard.index.erase(slot.key);
+            slot.key = key;
+            slot.valid = true;
+            shard.index[key] = slot_index;
+        }
+
+        // a new block is not marked referenced so that it is evicted first if it is never read again
+        memcpy(shard.data + slot_index * block_size, buf, block_size);
+    }
+
+    void
+    BlockCache::Invalidate(uint64_t file_id, off_t offset)
+    {
+        BlockKey key = { file_id, offset };
+        Shard& shard = shard_for(key);
+
+        tbb::spin_rw_mutex::scoped_lock lock(shard.mutex, true);
+
+        std::tr1::unordered_map<BlockKey, size_t, BlockKeyHash>::iterator it = shard.index.find(key);
+        if (it == shard.index.end())
+            return;
+
+        Slot& slot = shard.slots[it->second];
+        slot.valid = false;
+        slot.referenced = false;
+        shard.index.erase(it);
+    }
+
+} // namespace fawn
@@ -0,0 +1,83 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include "basic_types.h"
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+#include <tbb/atomic.h>
+#include <tbb/spin_rw_mutex.h>
+
+namespace fawn {
+
+    // a hash-sharded block cache with CLOCK eviction
+    // the number of shards (up to 64) shrinks with the capacity so that each shard keeps at least 16 blocks
+    // a cache can be shared by multiple file stores; blocks are keyed by (file ID, offset), and a file store obtains a new file ID whenever it opens a file
+
+    class BlockCache {
+    public:
+        static const size_t block_size = 512;
+
+        // returns a cache of the given capacity (in bytes); caches with the same non-empty name are shared
+        static BlockCache* Acquire(const std::string& name, size_t capacity);
+        // returns a shared cache created earlier by Acquire(name, capacity), or NULL if there is no such cache
+        static BlockCache* Acquire(const std::string& name);
+        static void Release(BlockCache* cache);
+
+        static uint64_t NewFileID();
+
+        // copies one block into buf if it is cached
+        bool Get(uint64_t file_id, off_t offset, void* buf) const;
+        void Put(uint64_t file_id, off_t offset, const void* buf);
+        void Invalidate(uint64_t file_id, off_t offset);
+
+        size_t capacity() const { return shards_.size() * blocks_per_shard_ * block_size; }
+
+    protected:
+        explicit BlockCache(size_t capacity);
+        ~BlockCache();
+
+        struct BlockKey {
+            uint64_t file_id;
+            off_t offset;
+            bool operator==(const BlockKey& other) const { return file_id == other.file_id && offset == other.offset; }
+        };
+
+        struct BlockKeyHash {
+            size_t operator()(const BlockKey& key) const;
+        };
+
+        struct Slot {
+            BlockKey key;
+            bool valid;
+            tbb::atomic<bool> referenced;
+        };
+
+        struct Shard {
+            mutable tbb::spin_rw_mutex mutex;
+            std::tr1::unordered_map<BlockKey, size_t, BlockKeyHash> index;
+            Slot* slots;
+            char* data;
+            size_t clock_hand;
+        };
+
+        Shard& shard_for(const BlockKey& key) const;
+
+    private:
+        static const size_t max_shards_ = 64;
+        static const size_t min_blocks_per_shard_ = 16;
+
+        std::vector<Shard*> shards_;
+        size_t blocks_per_shard_;
+
+        std::string name_;
+        size_t refs_;       // protected by the registry mutex
+
+        static tbb::atomic<uint64_t> next_file_id_;
+    };
+
+} // namespace fawn
+
+#endif  // #ifndef _BLOCK_CACHE_H_
@@ -0,0 +1,82 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "bloom_filter.h"
+#include "hashutil.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace fawn {
+
+    BloomFilter::BloomFilter(size_t expected_keys, size_t bits_per_key)
+    {
+        if (expected_keys == 0)
+            expected_keys = 1;
+        if (bits_per_key == 0)
+            bits_per_key = 1;
+
+        num_blocks_ = (expected_keys * bits_per_key + block_bits_ - 1) / block_bits_;
+
+        // k = ln 2 * (bits per key) minimizes the false positive rate
+        num_probes_ = (bits_per_key * 69 + 50) / 100;
+        if (num_probes_ < 1)
+            num_probes_ = 1;
+        else if (num_probes_ > 16)
+            num_probes_ = 16;
+
+        void* p;
+        if (posix_memalign(&p, 64, num_blocks_ * block_bits_ / 8)) {
+            perror("BloomFilter::BloomFilter(): cannot allocate memory");
+            abort();
+        }
+        bits_ = static_cast<uint64_t*>(p);
+        memset(bits_, 0, num_blocks_ * block_bits_ / 8);
+    }
+
+    BloomFilter::~BloomFilter()
+    {
+        free(bits_);
+        bits_ = NULL;
+    }
+
+    void
+    BloomFilter::hash(const ConstValue& key, uint32_t& h1, uint32_t& h2)
+    {
+        // use seeds different from Hashes so that filter false positives are independent of cuckoo tag collisions
+        h1 = HashUtil::MurmurHash(key.data(), key.size(), 0x5bd1e995);
+        h2 = HashUtil::MurmurHash(key.data(), key.size(), 0x1b873593);
+    }
+
+    void
+    BloomFilter::Insert(const ConstValue& key)
+    {
+        uint32_t h1, h2;
+        hash(key, h1, h2);
+
+        uint64_t* block = bits_ + (h1 % num_blocks_) * words_per_block_;
+        uint32_t delta = (h2 >> 17) | (h2 << 15);
+        for (size_t i = 0; i < num_probes_; i++) {
+            size_t bit = h2 % block_bits_;
+            block[bit / 64] |= static_cast<uint64_t>(1) << (bit % 64);
+            h2 += delta;
+        }
+    }
+
+    bool
+    BloomFilter::MayContain(const ConstValue& key) const
+    {
+        uint32_t h1, h2;
+        hash(key, h1, h2);
+
+        const uint64_t* block = bits_ + (h1 % num_blocks_) * words_per_block_;
+        uint32_t delta = (h2 >> 17) | (h2 << 15);
+        for (size_t i = 0; i < num_probes_; i++) {
+            size_t bit = h2 % block_bits_;
+            if ((block[bit / 64] & (static_cast<uint64_t>(1) << (bit % 64))) == 0)
+                return false;
+            h2 += delta;
+        }
+        return true;
+    }
+
+} // namespace fawn
@@ -0,0 +1,38 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef _BLOOM_FILTER_H_
+#define _BLOOM_FILTER_H_
+
+#include "basic_types.h"
+#include "value.h"
+
+namespace fawn {
+
+    // a blocked Bloom filter: all probes for a key fall in one 512-bit block (a cache line), so a lookup touches a single cache line
+    // the filter is not thread-safe for insertion; lookups can run concurrently once insertion is finished
+
+    class BloomFilter {
+    public:
+        BloomFilter(size_t expected_keys, size_t bits_per_key);
+        ~BloomFilter();
+
+        void Insert(const ConstValue& key);
+        // returns false only if the key has never been inserted
+        bool MayContain(const ConstValue& key) const;
+
+        size_t memory_use() const { return num_blocks_ * block_bits_ / 8; }
+
+    protected:
+        static void hash(const ConstValue& key, uint32_t& h1, uint32_t& h2);
+
+    private:
+        static const size_t block_bits_ = 512;
+        static const size_t words_per_block_ = block_bits_ / 64;
+
+        size_t num_blocks_;
+        size_t num_probes_;
+        uint64_t* bits_;
+    };
+
+} // namespace fawn
+
+#endif  // #ifndef _BLOOM_FILTER_H_
@@ -0,0 +1,94 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "buffer_pool.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+
+#include <cassert>
+
+namespace fawn {
+
+    static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+    static pthread_key_t pool_key;
+
+    void
+    BufferPool::create_key()
+    {
+        if (pthread_key_create(&pool_key, destroy_pool))
+            perror("BufferPool::create_key(): cannot create a thread-specific key");
+    }
+
+    void
+    BufferPool::destroy_pool(void* p)
+    {
+        delete static_cast<BufferPool*>(p);
+    }
+
+    BufferPool*
+    BufferPool::thread_pool()
+    {
+        pthread_once(&pool_key_once, create_key);
+
+        BufferPool* pool = static_cast<BufferPool*>(pthread_getspecific(pool_key));
+        if (!pool) {
+            pool = new BufferPool();
+            pthread_setspecific(pool_key, pool);
+        }
+        return pool;
+    }
+
+    BufferPool::BufferPool()
+    {
+        for (size_t i = 0; i < num_size_classes_; i++)
+            free_buffers_[i].reserve(max_free_buffers_per_class_);
+    }
+
+    BufferPool::~BufferPool()
+    {
+        for (size_t i = 0; i < num_size_classes_; i++) {
+            for (size_t j = 0; j < free_buffers_[i].size(); j++)
+                free(free_buffers_[i][j]);
+        }
+    }
+
+    size_t
+    BufferPool::size_class(size_t size)
+    {
+        size_t c = 0;
+        while ((alignment << c) < size)
+            c++;
+        return c;
+    }
+
+    void*
+    BufferPool::acquire(size_t size)
+    {
+        size_t c = size_class(size);
+        if (c < num_size_classes_) {
+            if (!free_buffers_[c].empty()) {
+                void* buf = free_buffers_[c].back();
+                free_buffers_[c].pop_back();
+                return buf;
+            }
+            size = alignment << c;
+        }
+
+        void* buf;
+        if (posix_memalign(&buf, alignment, size))
+            return NULL;
+        return buf;
+    }
+
+    void
+    BufferPool::release(void* buf, size_t size)
+    {
+        size_t c = size_class(size);
+        if (c < num_size_classes_ && free_buffers_[c].size() < max_free_buffers_per_class_) {
+            free_buffers_[c].push_back(buf);
+            return;
+        }
+        free(buf);
+    }
+
+} // namespace fawn
@@ -0,0 +1,69 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef _BUFFER_POOL_H_
+#define _BUFFER_POOL_H_
+
+#include "basic_types.h"
+#include <cstddef>
+#include <vector>
+
+namespace fawn {
+
+    // per-thread pools of aligned buffers for the read path
+    // buffers are grouped into power-of-two size classes; a released buffer goes back to the pool of the releasing thread
+    // so that steady-state lookups do not allocate memory
+
+    class BufferPool {
+    public:
+        static const size_t alignment = 512;
+
+        // returns the buffer pool of the calling thread
+        static BufferPool* thread_pool();
+
+        // returns a buffer of at least size bytes aligned to the alignment, or NULL if memory cannot be allocated
+        void* acquire(size_t size);
+        // returns a buffer obtained by acquire() with the same size
+        void release(void* buf, size_t size);
+
+    protected:
+        BufferPool();
+        ~BufferPool();
+
+        static size_t size_class(size_t size);
+
+        static void create_key();
+        static void destroy_pool(void* p);
+
+    private:
+        static const size_t num_size_classes_ = 12;            // up to alignment << 11 = 1 MiB
+        static const size_t max_free_buffers_per_class_ = 16;
+
+        std::vector<void*> free_buffers_[num_size_classes_];
+    };
+
+    // a buffer borrowed from the pool of the current thread for the lifetime of the object
+    class PooledBuffer {
+    public:
+        explicit PooledBuffer(size_t size)
+            : size_(size), buf_(BufferPool::thread_pool()->acquire(size))
+        {
+        }
+
+        ~PooledBuffer()
+        {
+            if (buf_)
+                BufferPool::thread_pool()->release(buf_, size_);
+        }
+
+        void* data() const { return buf_; }
+
+    private:
+        PooledBuffer(const PooledBuffer&);
+        PooledBuffer& operator=(const PooledBuffer&);
+
+        size_t size_;
+        void* buf_;
+    };
+
+} // namespace fawn
+
+#endif // #ifndef _BUFFER_POOL_H_
@@ -1,4 +1,5 @@
 #include "bit_vector.hpp"
+#include "serialization.hpp"
 #include <cstring>
 
 namespace cindex
@@ -63,6 +64,30 @@ namespace cindex
 			memset(reinterpret_cast<uint8_t*>(new_buf) + old_byte_size, 0, new_byte_size - old_byte_size);
 	}
 
+	template<typename BlockType>
+	bool
+	bit_vector<BlockType>::store_to_file(int fd, off_t& offset) const
+	{
+		if (!serialization::write(fd, offset, size_))
+			return false;
+		return serialization::write_raw(fd, offset, buf_, block_info<block_type>::size(size_));
+	}
+
+	template<typename BlockType>
+	bool
+	bit_vector<BlockType>::load_from_file(int fd, off_t& offset)
+	{
+		std::size_t size;
+		if (!serialization::read(fd, offset, size))
+			return false;
+
+		clear();
+		capacity_ = size;
+		resize();
+		size_ = size;
+		return serialization::read_raw(fd, offset, buf_, block_info<block_type>::size(size_));
+	}
+
 	template class bit_vector<uint8_t>;
 	template class bit_vector<uint16_t>;
 	template class bit_vector<uint32_t>;
@@ -3,6 +3,7 @@
 #include "common.hpp"
 #include "block_info.hpp"
 #include "bit_access.hpp"
+#include <sys/types.h>
 
 namespace cindex
 {
@@ -136,6 +137,9 @@ namespace cindex
 
 		void compact();
 
+		bool store_to_file(int fd, off_t& offset) const CINDEX_WARN_UNUSED_RESULT;
+		bool load_from_file(int fd, off_t& offset) CINDEX_WARN_UNUSED_RESULT;
+
 	protected:
 		void resize();
 
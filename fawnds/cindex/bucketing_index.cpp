@@ -1,4 +1,7 @@
 #include "bucketing_index.hpp"
+#include "serialization.hpp"
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 
 // for template instantiation
@@ -12,8 +15,31 @@ namespace cindex
 {
 	template<typename BucketingType>
 	bucketing_index<BucketingType>::bucketing_index(std::size_t key_len, std::size_t n, std::size_t bucket_size, std::size_t dest_base, std::size_t dest_keys_per_block, std::size_t skip_bits)
-		: key_len_(key_len), n_(n), dest_base_(dest_base), dest_keys_per_block_(dest_keys_per_block), skip_bits_(skip_bits)
 	{
+		initialize(key_len, n, bucket_size, dest_base, dest_keys_per_block, skip_bits);
+	}
+
+	template<typename BucketingType>
+	bucketing_index<BucketingType>::bucketing_index(int fd, off_t offset)
+	{
+		if (load_from_file(fd, offset) < 0)
+		{
+			// fall back to an empty, unfinalized index so that the caller can detect the failure with finalized()
+			repr_.clear();
+			initialize(1, 1, 1, 0, 1, 0);
+		}
+	}
+
+	template<typename BucketingType>
+	void
+	bucketing_index<BucketingType>::initialize(std::size_t key_len, std::size_t n, std::size_t bucket_size, std::size_t dest_base, std::size_t dest_keys_per_block, std::size_t skip_bits)
+	{
+		key_len_ = key_len;
+		n_ = n;
+		dest_base_ = dest_base;
+		dest_keys_per_block_ = dest_keys_per_block;
+		skip_bits_ = skip_bits;
+
 		bucket_bits_ = 0;
 		while ((guarded_cast<std::size_t>(1) << bucket_bits_) < (n_ / bucket_size))
 			bucket_bits_++;
@@ -32,12 +58,6 @@ namespace cindex
 		pending_key_count_ = 0;
 	}
 
-	template<typename BucketingType>
-	bucketing_index<BucketingType>::bucketing_index(int fd, off_t offset)
-	{
-		ssize_t len = load_from_file(fd, offset);
-		(void)len;
-	}
 
 	template<typename BucketingType>
 	bucketing_index<BucketingType>::~bucketing_index()
@@ -121,9 +141,11 @@ namespace cindex
 	template<typename BucketingType>
 	ssize_t bucketing_index<BucketingType>::load_from_file(int fd, off_t offset)
 	{
+		off_t start_offset = offset;
+
 		bucketing_index_state state;
-		ssize_t read_len = pread(fd, &state, sizeof(state), offset);
-		assert(read_len == sizeof(state));
+		if (!serialization::read(fd, offset, state))
+			return -1;
 
 		key_len_ = state.key_len_;
 		n_ = state.n_;
@@ -134,9 +156,18 @@ namespace cindex
 		bucket_count_ = state.bucket_count_;
 		bucket_bits_ = state.bucket_bits_;
 
-		// TODO: read bucketing information
-		// TODO: read trie information
-		return 0;
+		// the trie itself is stateless
+		if (!repr_.load_from_file(fd, offset))
+			return -1;
+		if (!bucketing_.load_from_file(fd, offset))
+			return -1;
+
+		// only finalized indexes are stored
+		last_dest_offset_ = n_;
+		pending_bucket_ = bucket_count_;
+		pending_key_count_ = 0;
+
+		return offset - start_offset;
 	}
 
 	template<typename BucketingType>
@@ -144,6 +175,8 @@ namespace cindex
 	{
 		assert(finalized());
 
+		off_t start_offset = offset;
+
 		bucketing_index_state state;
 
 		state.key_len_ = key_len_;
@@ -155,12 +188,14 @@ namespace cindex
 		state.bucket_count_ = bucket_count_;
 		state.bucket_bits_ = bucket_bits_;
 
-		ssize_t wrote_len = pwrite(fd, &state, sizeof(state), offset);
-		assert(wrote_len == sizeof(state));
+		if (!serialization::write(fd, offset, state))
+			return -1;
+		if (!repr_.store_to_file(fd, offset))
+			return -1;
+		if (!bucketing_.store_to_file(fd, offset))
+			return -1;
 
-		// TODO: write bucketing information
-		// TODO: write trie information
-		return 0;
+		return offset - start_offset;
 	}
 
 	template<typename BucketingType>
@@ -188,6 +223,49 @@ namespace cindex
         return key_index;
 	}
 
+	template<typename BucketingType>
+	void
+	bucketing_index<BucketingType>::locate_bucket(const uint8_t* key, const uint8_t* indexed_key, std::size_t& begin, std::size_t& end) const
+	{
+		assert(finalized());
+
+		if (indexed_key)
+		{
+			int cmp = compare_skipped_bits(key, indexed_key);
+			if (cmp < 0)
+			{
+				begin = end = bucketing_.dest_offset(0);
+				return;
+			}
+			else if (cmp > 0)
+			{
+				begin = end = bucketing_.dest_offset(bucket_count_);
+				return;
+			}
+		}
+
+		std::size_t bucket = find_bucket(key);
+		begin = bucketing_.dest_offset(bucket);
+		end = bucketing_.dest_offset(bucket + 1);
+	}
+
+	template<typename BucketingType>
+	int
+	bucketing_index<BucketingType>::compare_skipped_bits(const uint8_t* key, const uint8_t* other_key) const
+	{
+		std::size_t bytes = std::min(skip_bits_ / 8, key_len_);
+		int cmp = memcmp(key, other_key, bytes);
+		if (cmp != 0 || bytes == key_len_)
+			return cmp;
+
+		// bits are numbered from the MSB of each byte
+		std::size_t rest_bits = skip_bits_ % 8;
+		if (rest_bits == 0)
+			return 0;
+		uint8_t mask = static_cast<uint8_t>(0xff << (8 - rest_bits));
+		return static_cast<int>(key[bytes] & mask) - static_cast<int>(other_key[bytes] & mask);
+	}
+
 	template<typename BucketingType>
 	std::size_t
 	bucketing_index<BucketingType>::find_bucket(const uint8_t* key) const
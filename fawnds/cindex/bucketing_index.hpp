@@ -16,6 +16,7 @@ namespace cindex
 
 	public:
 		bucketing_index(std::size_t key_len, std::size_t n, std::size_t bucket_size, std::size_t dest_base = 0, std::size_t dest_keys_per_block = 1, std::size_t skip_bits = 0);
+		// a failed load leaves the index unfinalized
 		bucketing_index(int fd, off_t offset);
 		~bucketing_index();
 
@@ -24,15 +25,24 @@ namespace cindex
 		bool insert(const uint8_t* key);
 		void flush();
 
+		// returns the number of bytes written, or -1 on error
 		ssize_t store_to_file(int fd, off_t offset) CINDEX_WARN_UNUSED_RESULT;
 
 		std::size_t locate(const uint8_t* key) const CINDEX_WARN_UNUSED_RESULT;
+		// the range [begin, end) of the destinations of the bucket of the given key; as buckets are in key order,
+		// the lower bound of any key lies in [begin, end]
+		// buckets ignore the skipped bits, which all indexed keys share; if indexed_key (any indexed key) is given and
+		// its skipped bits differ from those of the key, the range is empty at the start or the end of the index
+		void locate_bucket(const uint8_t* key, const uint8_t* indexed_key, std::size_t& begin, std::size_t& end) const;
 
 		std::size_t bit_size_trie_only() const CINDEX_WARN_UNUSED_RESULT;
 		std::size_t bit_size() const CINDEX_WARN_UNUSED_RESULT;
 
 	protected:
+		void initialize(std::size_t key_len, std::size_t n, std::size_t bucket_size, std::size_t dest_base, std::size_t dest_keys_per_block, std::size_t skip_bits);
+
 		std::size_t find_bucket(const uint8_t* key) const CINDEX_WARN_UNUSED_RESULT;
+		int compare_skipped_bits(const uint8_t* key, const uint8_t* other_key) const CINDEX_WARN_UNUSED_RESULT;
 		void index_pending_keys();
 
 		ssize_t load_from_file(int fd, off_t offset) CINDEX_WARN_UNUSED_RESULT;
@@ -1,4 +1,5 @@
 #include "flat_absoff_bucketing.hpp"
+#include "serialization.hpp"
 #include <iostream>
 
 namespace cindex
@@ -67,6 +68,24 @@ namespace cindex
 		return bucket_info_.size() * 2 * sizeof(value_type) * 8;
 	}
 
+	template<typename ValueType>
+	bool
+	flat_absoff_bucketing<ValueType>::store_to_file(int fd, off_t& offset) const
+	{
+		return serialization::write(fd, offset, size_) &&
+			serialization::write_vector(fd, offset, bucket_info_) &&
+			serialization::write(fd, offset, current_i_);
+	}
+
+	template<typename ValueType>
+	bool
+	flat_absoff_bucketing<ValueType>::load_from_file(int fd, off_t& offset)
+	{
+		return serialization::read(fd, offset, size_) &&
+			serialization::read_vector(fd, offset, bucket_info_) &&
+			serialization::read(fd, offset, current_i_);
+	}
+
 	template class flat_absoff_bucketing<>;
 }
 
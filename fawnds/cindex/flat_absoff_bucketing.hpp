@@ -27,6 +27,9 @@ namespace cindex
 
 		std::size_t bit_size() const CINDEX_WARN_UNUSED_RESULT;
 
+		bool store_to_file(int fd, off_t& offset) const CINDEX_WARN_UNUSED_RESULT;
+		bool load_from_file(int fd, off_t& offset) CINDEX_WARN_UNUSED_RESULT;
+
 	private:
 		std::size_t size_;
 
@@ -1,4 +1,5 @@
 #include "semi_direct_16_absoff_bucketing.hpp"
+#include "serialization.hpp"
 #include <iostream>
 
 namespace cindex
@@ -156,5 +157,25 @@ namespace cindex
 	{
 		return bucket_info_.size() * 2 * sizeof(uint32_t) * 8;
 	}
+
+	bool
+	semi_direct_16_absoff_bucketing::store_to_file(int fd, off_t& offset) const
+	{
+		return serialization::write(fd, offset, size_) &&
+			serialization::write_vector(fd, offset, bucket_info_) &&
+			serialization::write(fd, offset, current_i_) &&
+			serialization::write(fd, offset, last_index_offsets_) &&
+			serialization::write(fd, offset, last_dest_offsets_);
+	}
+
+	bool
+	semi_direct_16_absoff_bucketing::load_from_file(int fd, off_t& offset)
+	{
+		return serialization::read(fd, offset, size_) &&
+			serialization::read_vector(fd, offset, bucket_info_) &&
+			serialization::read(fd, offset, current_i_) &&
+			serialization::read(fd, offset, last_index_offsets_) &&
+			serialization::read(fd, offset, last_dest_offsets_);
+	}
 }
 
@@ -1,4 +1,5 @@
 #include "semi_direct_16_reloff_bucketing.hpp"
+#include "serialization.hpp"
 #include "expected_size.hpp"
 #include <cstring>
 #include <iostream>
@@ -235,5 +236,35 @@ namespace cindex
 		bit_size += (sizeof(overflow_table::key_type) + sizeof(overflow_table::mapped_type)) * 8 * overflow_.size() * 2;
 		return bit_size;
 	}
+
+	bool
+	semi_direct_16_reloff_bucketing::store_to_file(int fd, off_t& offset) const
+	{
+		return serialization::write(fd, offset, size_) &&
+			serialization::write(fd, offset, keys_per_bucket_) &&
+			serialization::write(fd, offset, keys_per_block_) &&
+			serialization::write(fd, offset, bits_per_key_) &&
+			serialization::write(fd, offset, bits_per_bucket_) &&
+			serialization::write_vector(fd, offset, bucket_info_) &&
+			serialization::write(fd, offset, current_i_) &&
+			serialization::write(fd, offset, last_index_offsets_) &&
+			serialization::write(fd, offset, last_dest_offsets_) &&
+			serialization::write_map(fd, offset, overflow_);
+	}
+
+	bool
+	semi_direct_16_reloff_bucketing::load_from_file(int fd, off_t& offset)
+	{
+		return serialization::read(fd, offset, size_) &&
+			serialization::read(fd, offset, keys_per_bucket_) &&
+			serialization::read(fd, offset, keys_per_block_) &&
+			serialization::read(fd, offset, bits_per_key_) &&
+			serialization::read(fd, offset, bits_per_bucket_) &&
+			serialization::read_vector(fd, offset, bucket_info_) &&
+			serialization::read(fd, offset, current_i_) &&
+			serialization::read(fd, offset, last_index_offsets_) &&
+			serialization::read(fd, offset, last_dest_offsets_) &&
+			serialization::read_map(fd, offset, overflow_);
+	}
 }
 
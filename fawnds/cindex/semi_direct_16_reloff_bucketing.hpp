@@ -24,6 +24,9 @@ namespace cindex
 
 		std::size_t bit_size() const CINDEX_WARN_UNUSED_RESULT;
 
+		bool store_to_file(int fd, off_t& offset) const CINDEX_WARN_UNUSED_RESULT;
+		bool load_from_file(int fd, off_t& offset) CINDEX_WARN_UNUSED_RESULT;
+
 	protected:
 		void store(const std::size_t& idx, const std::size_t& type, const std::size_t& mask, const std::size_t& shift, const std::size_t& v);
 		std::size_t load(const std::size_t& idx, const std::size_t& type, const std::size_t& mask, const std::size_t& shift) const;
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "common.hpp"
+#include <vector>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace cindex
+{
+	// helpers for store_to_file()/load_from_file(); each advances offset past the bytes written/read and returns false on a short I/O
+
+	class serialization
+	{
+	public:
+		static bool
+		write_raw(int fd, off_t& offset, const void* buf, std::size_t len)
+		{
+			const uint8_t* p = reinterpret_cast<const uint8_t*>(buf);
+			while (len > 0)
+			{
+				ssize_t wrote_len = pwrite(fd, p, len, offset);
+				if (wrote_len <= 0)
+					return false;
+				p += wrote_len;
+				len -= static_cast<std::size_t>(wrote_len);
+				offset += wrote_len;
+			}
+			return true;
+		}
+
+		static bool
+		read_raw(int fd, off_t& offset, void* buf, std::size_t len)
+		{
+			uint8_t* p = reinterpret_cast<uint8_t*>(buf);
+			while (len > 0)
+			{
+				ssize_t read_len = pread(fd, p, len, offset);
+				if (read_len <= 0)
+					return false;
+				p += read_len;
+				len -= static_cast<std::size_t>(read_len);
+				offset += read_len;
+			}
+			return true;
+		}
+
+		template<typename T>
+		static bool
+		write(int fd, off_t& offset, const T& v)
+		{
+			return write_raw(fd, offset, &v, sizeof(T));
+		}
+
+		template<typename T>
+		static bool
+		read(int fd, off_t& offset, T& v)
+		{
+			return read_raw(fd, offset, &v, sizeof(T));
+		}
+
+		// vectors of POD types only
+		template<typename T>
+		static bool
+		write_vector(int fd, off_t& offset, const std::vector<T>& v)
+		{
+			std::size_t size = v.size();
+			if (!write(fd, offset, size))
+				return false;
+			if (size == 0)
+				return true;
+			return write_raw(fd, offset, &v[0], sizeof(T) * size);
+		}
+
+		template<typename T>
+		static bool
+		read_vector(int fd, off_t& offset, std::vector<T>& v)
+		{
+			std::size_t size;
+			if (!read(fd, offset, size))
+				return false;
+			v.resize(size);
+			if (size == 0)
+				return true;
+			return read_raw(fd, offset, &v[0], sizeof(T) * size);
+		}
+
+		template<typename MapType>
+		static bool
+		write_map(int fd, off_t& offset, const MapType& m)
+		{
+			std::size_t size = m.size();
+			if (!write(fd, offset, size))
+				return false;
+			for (typename MapType::const_iterator it = m.begin(); it != m.end(); ++it)
+			{
+				if (!write(fd, offset, it->first) || !write(fd, offset, it->second))
+					return false;
+			}
+			return true;
+		}
+
+		template<typename MapType>
+		static bool
+		read_map(int fd, off_t& offset, MapType& m)
+		{
+			std::size_t size;
+			if (!read(fd, offset, size))
+				return false;
+			m.clear();
+			for (std::size_t i = 0; i < size; i++)
+			{
+				typename MapType::key_type k;
+				typename MapType::mapped_type v;
+				if (!read(fd, offset, k) || !read(fd, offset, v))
+					return false;
+				m[k] = v;
+			}
+			return true;
+		}
+	};
+}
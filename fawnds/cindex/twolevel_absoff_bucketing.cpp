@@ -1,4 +1,5 @@
 #include "twolevel_absoff_bucketing.hpp"
+#include "serialization.hpp"
 #include <iostream>
 
 namespace cindex
@@ -106,6 +107,30 @@ namespace cindex
 		return bit_size;
 	}
 
+	template<typename ValueType, typename UpperValueType>
+	bool
+	twolevel_absoff_bucketing<ValueType, UpperValueType>::store_to_file(int fd, off_t& offset) const
+	{
+		return serialization::write(fd, offset, size_) &&
+			serialization::write(fd, offset, keys_per_bucket_) &&
+			serialization::write(fd, offset, upper_bucket_size_) &&
+			serialization::write_vector(fd, offset, bucket_info_) &&
+			serialization::write_vector(fd, offset, upper_bucket_info_) &&
+			serialization::write(fd, offset, current_i_);
+	}
+
+	template<typename ValueType, typename UpperValueType>
+	bool
+	twolevel_absoff_bucketing<ValueType, UpperValueType>::load_from_file(int fd, off_t& offset)
+	{
+		return serialization::read(fd, offset, size_) &&
+			serialization::read(fd, offset, keys_per_bucket_) &&
+			serialization::read(fd, offset, upper_bucket_size_) &&
+			serialization::read_vector(fd, offset, bucket_info_) &&
+			serialization::read_vector(fd, offset, upper_bucket_info_) &&
+			serialization::read(fd, offset, current_i_);
+	}
+
 	template class twolevel_absoff_bucketing<>;
 }
 
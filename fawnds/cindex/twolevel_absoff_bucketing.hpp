@@ -28,6 +28,9 @@ namespace cindex
 
 		std::size_t bit_size() const CINDEX_WARN_UNUSED_RESULT;
 
+		bool store_to_file(int fd, off_t& offset) const CINDEX_WARN_UNUSED_RESULT;
+		bool load_from_file(int fd, off_t& offset) CINDEX_WARN_UNUSED_RESULT;
+
 	protected:
 		std::size_t upper_index_offset(std::size_t i) const CINDEX_WARN_UNUSED_RESULT;
 		std::size_t upper_dest_offset(std::size_t i) const CINDEX_WARN_UNUSED_RESULT;
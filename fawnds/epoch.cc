@@ -0,0 +1,127 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "epoch.h"
+#include "rate_limiter.h"
+
+#include <cstdio>
+#include <pthread.h>
+
+#include <cassert>
+
+namespace fawn {
+
+    static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+    static pthread_key_t slot_key;
+
+    tbb::atomic<uint64_t> Epoch::global_epoch_;
+    tbb::atomic<Epoch::Slot*> Epoch::slots_;
+
+    void
+    Epoch::create_key()
+    {
+        if (pthread_key_create(&slot_key, release_slot))
+            perror("Epoch::create_key(): cannot create a thread-specific key");
+    }
+
+    void
+    Epoch::release_slot(void* p)
+    {
+        // slots are never freed because writers may be scanning them; an exiting thread leaves its slot to a new thread
+        Slot* slot = static_cast<Slot*>(p);
+        assert(slot->depth == 0);
+        slot->epoch = 0;
+        slot->in_use = false;
+    }
+
+    Epoch::Slot*
+    Epoch::thread_slot()
+    {
+        pthread_once(&slot_key_once, create_key);
+
+        Slot* slot = static_cast<Slot*>(pthread_getspecific(slot_key));
+        if (slot)
+            return slot;
+
+        // reuse the slot of an exited thread if any
+        for (slot = slots_; slot; slot = slot->next) {
+            if (!slot->in_use && slot->in_use.compare_and_swap(true, false) == false)
+                break;
+        }
+
+        if (!slot) {
+            slot = new Slot();
+            slot->epoch = 0;
+            slot->depth = 0;
+            slot->in_use = true;
+            while (true) {
+                Slot* head = slots_;
+                slot->next = head;
+                if (slots_.compare_and_swap(slot, head) == head)
+                    break;
+            }
+        }
+
+        pthread_setspecific(slot_key, slot);
+        return slot;
+    }
+
+    void
+    Epoch::enter()
+    {
+        Slot* slot = thread_slot();
+        if (slot->depth++ != 0)
+            return;
+
+        if (global_epoch_ == 0)
+            global_epoch_.compare_and_swap(1, 0);   // once; 0 marks an idle slot
+
+        slot->epoch = global_epoch_;
+        // the slot must be visible to writers before any shared pointer is read (pairs with the fence in advance())
+        __sync_synchronize();
+    }
+
+    void
+    Epoch::exit()
+    {
+        Slot* slot = static_cast<Slot*>(pthread_getspecific(slot_key));
+        assert(slot && slot->depth > 0);
+        if (--slot->depth != 0)
+            return;
+
+        // a release store; all reads in the critical section happen before it
+        slot->epoch = 0;
+    }
+
+    uint64_t
+    Epoch::advance()
+    {
+        if (global_epoch_ == 0)
+            global_epoch_.compare_and_swap(1, 0);
+
+        // a full fence: the publication of the new version is visible before the slots are scanned
+        return global_epoch_.fetch_and_increment();
+    }
+
+    bool
+    Epoch::quiescent(uint64_t epoch)
+    {
+        for (Slot* slot = slots_; slot; slot = slot->next) {
+            uint64_t slot_epoch = slot->epoch;
+            if (slot_epoch != 0 && slot_epoch <= epoch)
+                return false;
+        }
+        return true;
+    }
+
+    void
+    Epoch::synchronize()
+    {
+        assert(thread_slot()->depth == 0);
+
+        uint64_t epoch = advance();
+
+        RateLimiter rate_limiter(0, 1, 1, 100000L);     // poll every 100 us or more
+        while (!quiescent(epoch))
+            rate_limiter.remove_tokens(1);
+    }
+
+} // namespace fawn
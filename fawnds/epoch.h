@@ -0,0 +1,57 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include "basic_types.h"
+#include <tbb/atomic.h>
+
+namespace fawn {
+
+    // epoch-based protection of shared data that readers access without locks
+    // a reader stays in a critical section while it uses the data; a writer publishes a new version and frees the old one
+    // only after every reader that may have seen it has left (a grace period)
+    // entering and leaving a critical section writes only to a slot owned by the calling thread; there is no atomic read-modify-write
+
+    class Epoch {
+    public:
+        // a critical section of the calling thread; critical sections may be nested
+        class Guard {
+        public:
+            Guard() { Epoch::enter(); }
+            ~Guard() { Epoch::exit(); }
+        private:
+            Guard(const Guard&);
+            Guard& operator=(const Guard&);
+        };
+
+        static void enter();
+        static void exit();
+
+        // must be called after a new version is published; returns the epoch of the old version
+        static uint64_t advance();
+        // true if no reader that entered at or before the epoch is still in its critical section
+        static bool quiescent(uint64_t epoch);
+        // waits for a grace period; must not be called inside a critical section
+        static void synchronize();
+
+    protected:
+        struct Slot {
+            tbb::atomic<uint64_t> epoch;    // 0 if not in a critical section
+            size_t depth;                   // accessed by the owner only
+            tbb::atomic<bool> in_use;
+            Slot* next;
+            char padding[64];               // keep slots of different threads on different cache lines
+        };
+
+        static Slot* thread_slot();
+        static void create_key();
+        static void release_slot(void* p);
+
+    private:
+        static tbb::atomic<uint64_t> global_epoch_;
+        static tbb::atomic<Slot*> slots_;   // append-only list of all slots
+    };
+
+} // namespace fawn
+
+#endif  // #ifndef _EPOCH_H_
@@ -2,6 +2,7 @@
 #include "fawnds.h"
 #include "configuration.h"
 #include <iostream>
+#include <algorithm>
 
 namespace fawn {
 
@@ -117,6 +118,17 @@ namespace fawn {
         return UNSUPPORTED;
     }
 
+    FawnDS_Return
+    FawnDS::MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const
+    {
+        // fallback for stores without a batched lookup path
+        out.resize(keys.size());
+        rets.resize(keys.size());
+        for (size_t i = 0; i < keys.size(); i++)
+            rets[i] = Get(keys[i], out[i]);
+        return OK;
+    }
+
     FawnDS_ConstIterator
     FawnDS::Enumerate() const
     {
@@ -131,6 +143,52 @@ namespace fawn {
         return FawnDS_Iterator();
     }
 
+    FawnDS_Return
+    FawnDS::EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size) const
+    {
+        // fallback for stores without a native bulk scan; entries are copied out of the iterator into one buffer per batch
+        if (batch_size == 0)
+            batch_size = 1;
+
+        std::vector<char> buf;
+        std::vector<size_t> offsets(batch_size * 2);
+        std::vector<FawnDS_Span> keys(batch_size);
+        std::vector<FawnDS_Span> data(batch_size);
+        std::vector<FawnDS_Return> states(batch_size);
+
+        FawnDS_ConstIterator it = Enumerate();
+        while (true) {
+            buf.clear();
+            size_t n = 0;
+            for (; n < batch_size && (it.IsOK() || it.IsKeyDeleted()); ++it, n++) {
+                states[n] = it->state;
+                keys[n].size = it->key.size();
+                offsets[n * 2] = buf.size();
+                buf.insert(buf.end(), it->key.data(), it->key.data() + it->key.size());
+                data[n].size = it->data.size();
+                offsets[n * 2 + 1] = buf.size();
+                buf.insert(buf.end(), it->data.data(), it->data.data() + it->data.size());
+            }
+
+            if (n != 0) {
+                // spans are set after the buffer has stopped growing
+                const char* base = buf.empty() ? NULL : &buf[0];
+                for (size_t i = 0; i < n; i++) {
+                    keys[i].data = base + offsets[i * 2];
+                    data[i].data = base + offsets[i * 2 + 1];
+                }
+                FawnDS_Batch batch = { n, &keys[0], &data[0], &states[0] };
+                if (!callback.Process(batch))
+                    return OK;
+            }
+
+            if (it.IsEnd())
+                return OK;
+            if (n < batch_size)
+                return ERROR;
+        }
+    }
+
     FawnDS_ConstIterator
     FawnDS::Find(const ConstValue& key) const
     {
@@ -147,5 +205,17 @@ namespace fawn {
         return FawnDS_Iterator();
     }
 
+    FawnDS_Return
+    FawnDS::MultiFind(const std::vector<ConstValue>& keys, std::vector<FawnDS_ConstIterator>& out) const
+    {
+        out.resize(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            FawnDS_ConstIterator it = Find(keys[i]);
+            // move without cloning the iterator element
+            std::swap(out[i].elem, it.elem);
+        }
+        return OK;
+    }
+
 } // namespace fawn
 
@@ -6,6 +6,7 @@
 #include "fawnds_types.h"
 #include "value.h"
 #include "fawnds_iterator.h"
+#include <vector>
 
 namespace fawn {
 
@@ -41,12 +42,23 @@ namespace fawn {
         virtual FawnDS_Return Length(const ConstValue& key, size_t& len) const;
         virtual FawnDS_Return Get(const ConstValue& key, Value& data, size_t offset = 0, size_t len = -1) const;
 
+        // batched Get(); rets[i] and out[i] hold the result for keys[i]
+        virtual FawnDS_Return MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const;
+
         virtual FawnDS_ConstIterator Enumerate() const;
         virtual FawnDS_Iterator Enumerate();
 
+        // bulk scan; hands out the entries of Enumerate() in batches of up to batch_size entries
+        // returns OK when all entries have been handed out or the callback stops the enumeration
+        virtual FawnDS_Return EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size = 1024) const;
+
         virtual FawnDS_ConstIterator Find(const ConstValue& key) const;
         virtual FawnDS_Iterator Find(const ConstValue& key);
 
+        // batched Find(); out[i] is the iterator for keys[i]
+        // hash tables override this to overlap the memory accesses of different keys
+        virtual FawnDS_Return MultiFind(const std::vector<ConstValue>& keys, std::vector<FawnDS_ConstIterator>& out) const;
+
     protected:
         const Configuration* config_;
     };
@@ -1,21 +1,33 @@
 /* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "fawnds_combi.h"
 #include "fawnds_factory.h"
+#include "fawnds_sf.h"
+#include "sorter.h"
 #include "debug.h"
 #include "global_limits.h"
+#include "bit_access.hpp"
 #include <cassert>
 //#include "print.h"
 
 #include <sys/time.h>
 #include <stdio.h>
+#include <string.h>
 #include <sstream>
+#include <algorithm>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <tbb/concurrent_queue.h>
 
 namespace fawn {
 
     FawnDS_Combi::FawnDS_Combi()
-        : open_(false)
+        : open_(false), block_cache_(NULL)
     {
+        current_stores_ = NULL;
+
         for (size_t stage = 0; stage < 4; stage++) {
             for (size_t i = 0; i < latency_track_store_count_; i++) {
                 latencies_[stage][i] = 0;
@@ -36,51 +48,14 @@ namespace fawn {
         if (open_)
             return ERROR;
 
-        id_ = config_->GetStringValue("child::id");
-
-        if (config_->ExistsNode("child::key-len") == 0)
-            key_len_ = atoi(config_->GetStringValue("child::key-len").c_str());
-        else
-            key_len_ = 0;
-
-        if (config_->ExistsNode("child::data-len") == 0)
-            data_len_ = atoi(config_->GetStringValue("child::data-len").c_str());
-        else
-            data_len_ = 0;
-
-        if (config_->ExistsNode("child::temp-file") == 0)
-            temp_file_ = config_->GetStringValue("child::temp-file");
-        else
-            temp_file_ = "/tmp";
-
-        if (config_->ExistsNode("child::stage-limit") == 0)
-            stage_limit_ = atoi(config_->GetStringValue("child::stage-limit").c_str());
-        else
-            stage_limit_ = 2;
-
-        if (config_->ExistsNode("child::store0-high-watermark") == 0)
-            store0_high_watermark_ = atoi(config_->GetStringValue("child::store0-high-watermark").c_str());
-        else
-            store0_high_watermark_ = 2;
-
-        if (config_->ExistsNode("child::store0-low-watermark") == 0)
-            store0_low_watermark_ = atoi(config_->GetStringValue("child::store0-low-watermark").c_str());
-        else
-            store0_low_watermark_ = 1;
-        if (store0_low_watermark_ < 1 || store0_high_watermark_ <= store0_low_watermark_)
+        if (parse_config() != OK)
             return ERROR;
 
-        if (config_->ExistsNode("child::store1-high-watermark") == 0)
-            store1_high_watermark_ = atoi(config_->GetStringValue("child::store1-high-watermark").c_str());
-        else
-            store1_high_watermark_ = 1;
+        // the stores of an old manifest are not reused
+        if (config_->ExistsNode("child::file") == 0)
+            unlink(manifest_filename().c_str());
 
-        if (config_->ExistsNode("child::store1-low-watermark") == 0)
-            store1_low_watermark_ = atoi(config_->GetStringValue("child::store1-low-watermark").c_str());
-        else
-            store1_low_watermark_ = 0;
-        if (store1_high_watermark_ <= store1_low_watermark_)
-            return ERROR;
+        setup_block_cache();
 
         next_ids_.push_back(0);
         next_ids_.push_back(0);
@@ -90,13 +65,19 @@ namespace fawn {
         all_stores_.push_back(std::vector<FawnDS*>());
         all_stores_.push_back(std::vector<FawnDS*>());
 
-        all_stores_[0].push_back(alloc_store(0));
-        all_stores_[0].back()->Create();
+        FawnDS* front_store = alloc_store(0);
+        if (!front_store || front_store->Create() != OK) {
+            fprintf(stderr, "FawnDS_Combi::Create(): cannot create a front store\n");
+            delete front_store;
+            return ERROR;
+        }
+        all_stores_[0].push_back(front_store);
 
-        back_store_size_ = 0;
+        publish_stores();
 
         convert_task_running_ = false;
         merge_task_running_ = false;
+        task_failed_ = false;
 
         open_ = true;
 
@@ -109,53 +90,10 @@ namespace fawn {
         if (open_)
             return ERROR;
 
-        // TODO: store and load next IDs for persistency
-
-        id_ = config_->GetStringValue("child::id");
-
-        if (config_->ExistsNode("child::key-len") == 0)
-            key_len_ = atoi(config_->GetStringValue("child::key-len").c_str());
-        else
-            key_len_ = 0;
-
-        if (config_->ExistsNode("child::data-len") == 0)
-            data_len_ = atoi(config_->GetStringValue("child::data-len").c_str());
-        else
-            data_len_ = 0;
-
-        if (config_->ExistsNode("child::temp-file") == 0)
-            temp_file_ = config_->GetStringValue("child::temp-file");
-        else
-            temp_file_ = "/tmp";
-
-        if (config_->ExistsNode("child::stage-limit") == 0)
-            stage_limit_ = atoi(config_->GetStringValue("child::stage-limit").c_str());
-        else
-            stage_limit_ = 2;
-
-        if (config_->ExistsNode("child::store0-high-watermark") == 0)
-            store0_high_watermark_ = atoi(config_->GetStringValue("child::store0-high-watermark").c_str());
-        else
-            store0_high_watermark_ = 2;
-
-        if (config_->ExistsNode("child::store0-low-watermark") == 0)
-            store0_low_watermark_ = atoi(config_->GetStringValue("child::store0-low-watermark").c_str());
-        else
-            store0_low_watermark_ = 1;
-        if (store0_low_watermark_ < 1 || store0_high_watermark_ <= store0_low_watermark_)
+        if (parse_config() != OK)
             return ERROR;
 
-        if (config_->ExistsNode("child::store1-high-watermark") == 0)
-            store1_high_watermark_ = atoi(config_->GetStringValue("child::store1-high-watermark").c_str());
-        else
-            store1_high_watermark_ = 1;
-
-        if (config_->ExistsNode("child::store1-low-watermark") == 0)
-            store1_low_watermark_ = atoi(config_->GetStringValue("child::store1-low-watermark").c_str());
-        else
-            store1_low_watermark_ = 0;
-        if (store1_high_watermark_ <= store1_low_watermark_)
-            return ERROR;
+        setup_block_cache();
 
         next_ids_.push_back(0);
         next_ids_.push_back(0);
@@ -165,13 +103,37 @@ namespace fawn {
         all_stores_.push_back(std::vector<FawnDS*>());
         all_stores_.push_back(std::vector<FawnDS*>());
 
-        all_stores_[0].push_back(alloc_store(0));
-        all_stores_[0].back()->Create();
-
-        back_store_size_ = 0;
-
         convert_task_running_ = false;
         merge_task_running_ = false;
+        task_failed_ = false;
+
+        FawnDS_Return ret = OK;
+        if (config_->ExistsNode("child::file") == 0)
+            ret = open_stores();
+
+        if (ret == OK) {
+            // reopened front stores are not written any more; a new front store takes writes and starts a conversion at the watermark
+            tbb::queuing_rw_mutex::scoped_lock lock(mutex_, true);
+            ret = add_front_store();
+        }
+
+        if (ret != OK) {
+            for (size_t stage = 0; stage < all_stores_.size(); stage++) {
+                for (size_t i = 0; i < all_stores_[stage].size(); i++) {
+                    all_stores_[stage][i]->Close();
+                    delete all_stores_[stage][i];
+                }
+            }
+            all_stores_.clear();
+            next_ids_.clear();
+            segments_.clear();
+            delete current_stores_.fetch_and_store(NULL);
+            if (block_cache_) {
+                BlockCache::Release(block_cache_);
+                block_cache_ = NULL;
+            }
+            return ERROR;
+        }
 
         open_ = true;
 
@@ -208,12 +170,29 @@ namespace fawn {
                                 (stage_limit_ >= 2 && all_stores_[1].size() >= store1_high_watermark_)
                             ))
                             break;
+                        if (task_failed_) {
+                            // no task will be rescheduled until the next front store switch
+                            lock.release();
+                            GlobalLimits::instance().enable();
+                            fprintf(stderr, "FawnDS_Combi::Flush(): background conversion or merge failed\n");
+                            return ERROR;
+                        }
                     }
                     lock.release();
                 }
 
                 rate_limiter.remove_tokens(1);
             }
+
+            // the list of stores cannot change while no task runs and the lock is held
+            if (config_->ExistsNode("child::file") == 0) {
+                FawnDS_Return ret = write_manifest();
+                if (ret != OK) {
+                    lock.release();
+                    GlobalLimits::instance().enable();
+                    return ret;
+                }
+            }
         }
 
         GlobalLimits::instance().enable();
@@ -242,6 +221,23 @@ namespace fawn {
         return OK;
     }
 
+    static void
+    destroy_store(FawnDS* store)
+    {
+        store->Close();
+        store->Destroy();
+        delete store;
+    }
+
+    static size_t
+    store_size(const FawnDS* store)
+    {
+        Value status;
+        if (store->Status(NUM_DATA, status) != OK)
+            return 0;
+        return atoll(status.str().c_str());
+    }
+
     FawnDS_Return
     FawnDS_Combi::Close()
     {
@@ -249,8 +245,12 @@ namespace fawn {
             return ERROR;
 
         FawnDS_Return ret = Flush();
-        if (ret != OK)
-            return ret;
+        if (ret != OK) {
+            // a failed background task leaves its stores in place, which can be closed as usual
+            tbb::queuing_rw_mutex::scoped_lock lock(mutex_, false);
+            if (convert_task_running_ || merge_task_running_)
+                return ret;
+        }
 
         for (size_t stage = 0; stage < all_stores_.size(); stage++) {
             for (size_t i = 0; i < all_stores_[stage].size(); i++) {
@@ -260,10 +260,36 @@ namespace fawn {
         }
 
         all_stores_.clear();
+        next_ids_.clear();
+        segments_.clear();
+
+        // no operation may be in progress, so old lists can be freed without a grace period
+        delete current_stores_.fetch_and_store(NULL);
+        for (size_t i = 0; i < retired_lists_.size(); i++)
+            delete retired_lists_[i].second;
+        retired_lists_.clear();
+
+        {
+            // iterators should have been released; stores that they still pin are destroyed anyway
+            tbb::queuing_mutex::scoped_lock lock(snapshot_mutex_);
+            for (size_t i = 0; i < retired_stores_.size(); i++)
+                destroy_store(retired_stores_[i]);
+            retired_stores_.clear();
+            pins_.clear();
+        }
+
+        for (std::map<const FawnDS*, BloomFilter*>::iterator it = filters_.begin(); it != filters_.end(); ++it)
+            delete it->second;
+        filters_.clear();
+
+        if (block_cache_) {
+            BlockCache::Release(block_cache_);
+            block_cache_ = NULL;
+        }
 
         open_ = false;
 
-        return OK;
+        return ret;
     }
 
     FawnDS_Return
@@ -332,34 +358,26 @@ namespace fawn {
 
         FawnDS_Return ret;
         while (true) {
-            tbb::queuing_rw_mutex::scoped_lock lock(mutex_, false);
-            FawnDS* front_store = all_stores_[0][0];
+            FawnDS* front_store;
+            {
+                Epoch::Guard guard;
+                const StoreList* list = current_stores_;
+                front_store = list->stores[0][0];
 
-            ret = front_store->Put(key, data);
+                ret = front_store->Put(key, data);
+            }
             if (ret != INSUFFICIENT_SPACE)
                 break;
 
-            lock.upgrade_to_writer();
+            tbb::queuing_rw_mutex::scoped_lock lock(mutex_, true);
 
             if (front_store != all_stores_[0][0]) {
                 // other thread already made a new front store
                 continue;
             }
 
-            FawnDS* new_store = alloc_store(0);
-            new_store->Create();
-
-            all_stores_[0].insert(all_stores_[0].begin(), new_store);
-
-            if (stage_limit_ >= 1 &&
-                !convert_task_running_ &&
-                all_stores_[0].size() >= store0_high_watermark_) {
-                convert_task_running_ = true;
-
-                ConvertTask* t = new ConvertTask();
-                t->fawnds = this;
-                task_scheduler_convert_.enqueue_task(t);
-            }
+            if (add_front_store() != OK)
+                return ERROR;
         }
 
         return ret;
@@ -376,34 +394,26 @@ namespace fawn {
 
         FawnDS_Return ret;
         while (true) {
-            tbb::queuing_rw_mutex::scoped_lock lock(mutex_, false);
-            FawnDS* front_store = all_stores_[0][0];
+            FawnDS* front_store;
+            {
+                Epoch::Guard guard;
+                const StoreList* list = current_stores_;
+                front_store = list->stores[0][0];
 
-            ret = front_store->Append(key, data);
+                ret = front_store->Append(key, data);
+            }
             if (ret != INSUFFICIENT_SPACE)
                 break;
 
-            lock.upgrade_to_writer();
+            tbb::queuing_rw_mutex::scoped_lock lock(mutex_, true);
 
             if (front_store != all_stores_[0][0]) {
                 // other thread already made a new front store
                 continue;
             }
 
-            FawnDS* new_store = alloc_store(0);
-            new_store->Create();
-
-            all_stores_[0].insert(all_stores_[0].begin(), new_store);
-
-            if (stage_limit_ >= 1 &&
-                !convert_task_running_ &&
-                all_stores_[0].size() >= store0_high_watermark_) {
-                convert_task_running_ = true;
-
-                ConvertTask* t = new ConvertTask();
-                t->fawnds = this;
-                task_scheduler_convert_.enqueue_task(t);
-            }
+            if (add_front_store() != OK)
+                return ERROR;
         }
 
         return ret;
@@ -415,9 +425,31 @@ namespace fawn {
         if (key_len_ != key.size())
             return INVALID_KEY;
 
-        tbb::queuing_rw_mutex::scoped_lock lock(mutex_, false); // Delete() does not change the all_stores_ structure
+        FawnDS_Return ret;
+        while (true) {
+            FawnDS* front_store;
+            {
+                Epoch::Guard guard;
+                const StoreList* list = current_stores_;
+                front_store = list->stores[0][0];
+
+                // a deletion marker takes space in the front store as a put does
+                ret = front_store->Delete(key);
+            }
+            if (ret != INSUFFICIENT_SPACE)
+                break;
+
+            tbb::queuing_rw_mutex::scoped_lock lock(mutex_, true);
+
+            if (front_store != all_stores_[0][0]) {
+                // other thread already made a new front store
+                continue;
+            }
+
+            if (add_front_store() != OK)
+                return ERROR;
+        }
 
-        FawnDS_Return ret = all_stores_[0][0]->Delete(key);
         if (ret == OK || ret == KEY_NOT_FOUND)
             return OK;
         else
@@ -430,11 +462,29 @@ namespace fawn {
         if (key_len_ != key.size())
             return INVALID_KEY;
 
-        tbb::queuing_rw_mutex::scoped_lock lock(mutex_, false);
-
-        for (size_t stage = 0; stage < all_stores_.size(); stage++) {
-            for (size_t i = 0; i < all_stores_[stage].size(); i++) {
-                FawnDS_Return ret = all_stores_[stage][i]->Contains(key);
+        size_t segment = segment_of(key);
+
+        Epoch::Guard guard;
+        const StoreList* list = current_stores_;
+
+        for (size_t stage = 0; stage < list->stores.size(); stage++) {
+            for (size_t i = 0; i < list->stores[stage].size(); i++) {
+                if (stage == 2 && list->segments[i] != segment)
+                    continue;
+                if (!filter_may_contain(list, list->stores[stage][i], key))
+                    continue;
+                FawnDS_Return ret;
+                if (prefixed(stage)) {
+                    Value data;
+                    ret = get_prefixed(list->stores[stage][i], key, data);
+                }
+                else {
+                    // Contains() of a store reports a deleted key as not found, which would expose older stores
+                    size_t len;
+                    ret = list->stores[stage][i]->Length(key, len);
+                }
+                if (ret == KEY_DELETED)
+                    return KEY_NOT_FOUND;   // a deletion marker hides older stores
                 if (ret != KEY_NOT_FOUND)
                     return ret;
             }
@@ -449,11 +499,26 @@ namespace fawn {
         if (key_len_ != key.size())
             return INVALID_KEY;
 
-        tbb::queuing_rw_mutex::scoped_lock lock(mutex_, false);
-
-        for (size_t stage = 0; stage < all_stores_.size(); stage++) {
-            for (size_t i = 0; i < all_stores_[stage].size(); i++) {
-                FawnDS_Return ret = all_stores_[stage][i]->Length(key, len);
+        size_t segment = segment_of(key);
+
+        Epoch::Guard guard;
+        const StoreList* list = current_stores_;
+
+        for (size_t stage = 0; stage < list->stores.size(); stage++) {
+            for (size_t i = 0; i < list->stores[stage].size(); i++) {
+                if (stage == 2 && list->segments[i] != segment)
+                    continue;
+                if (!filter_may_contain(list, list->stores[stage][i], key))
+                    continue;
+                FawnDS_Return ret;
+                if (prefixed(stage)) {
+                    Value data;
+                    ret = get_prefixed(list->stores[stage][i], key, data);
+                    if (ret == OK)
+                        len = data.size();
+                }
+                else
+                    ret = list->stores[stage][i]->Length(key, len);
                 if (ret != KEY_NOT_FOUND)
                     return ret;
             }
@@ -473,11 +538,22 @@ namespace fawn {
         if (key_len_ != key.size())
             return INVALID_KEY;
 
-        tbb::queuing_rw_mutex::scoped_lock lock(mutex_, false);
+        size_t segment = segment_of(key);
 
-        for (size_t stage = 0; stage < all_stores_.size(); stage++) {
-            for (size_t i = 0; i < all_stores_[stage].size(); i++) {
-                FawnDS_Return ret = all_stores_[stage][i]->Get(key, data, offset, len);
+        Epoch::Guard guard;
+        const StoreList* list = current_stores_;
+
+        for (size_t stage = 0; stage < list->stores.size(); stage++) {
+            for (size_t i = 0; i < list->stores[stage].size(); i++) {
+                if (stage == 2 && list->segments[i] != segment)
+                    continue;
+                if (!filter_may_contain(list, list->stores[stage][i], key))
+                    continue;
+                FawnDS_Return ret;
+                if (prefixed(stage))
+                    ret = get_prefixed(list->stores[stage][i], key, data, offset, len);
+                else
+                    ret = list->stores[stage][i]->Get(key, data, offset, len);
                 if (ret != KEY_NOT_FOUND) {
                     clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
                     int64_t current_time = static_cast<int64_t>(ts.tv_sec) * 1000000000Lu + static_cast<int64_t>(ts.tv_nsec);
@@ -499,12 +575,118 @@ namespace fawn {
         return KEY_NOT_FOUND;
     }
 
+    FawnDS_Return
+    FawnDS_Combi::MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        int64_t last_time = static_cast<int64_t>(ts.tv_sec) * 1000000000Lu + static_cast<int64_t>(ts.tv_nsec);
+
+        out.resize(keys.size());
+        rets.assign(keys.size(), KEY_NOT_FOUND);
+
+        std::vector<size_t> pending;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (key_len_ != keys[i].size())
+                rets[i] = INVALID_KEY;
+            else
+                pending.push_back(i);
+        }
+
+        // back stores only see the keys of their segment
+        std::vector<size_t> segments;
+        if (segment_bits_ != 0) {
+            segments.resize(keys.size());
+            for (size_t i = 0; i < keys.size(); i++)
+                segments[i] = segment_of(keys[i]);
+        }
+
+        // the whole batch uses one store list; each store only sees keys that are still unresolved
+        Epoch::Guard guard;
+        const StoreList* list = current_stores_;
+
+        std::vector<size_t> probed;
+        std::vector<ConstValue> store_keys;
+        std::vector<Value> store_out;
+        std::vector<FawnDS_Return> store_rets;
+        for (size_t stage = 0; stage < list->stores.size(); stage++) {
+            for (size_t i = 0; i < list->stores[stage].size(); i++) {
+                if (pending.size() == 0)
+                    break;
+
+                // keys ruled out by the store's filter are neither sent to the store nor removed from the pending list
+                probed.clear();
+                store_keys.clear();
+                for (size_t j = 0; j < pending.size(); j++) {
+                    if (stage == 2 && !segments.empty() && list->segments[i] != segments[pending[j]])
+                        continue;
+                    if (!filter_may_contain(list, list->stores[stage][i], keys[pending[j]]))
+                        continue;
+                    probed.push_back(j);
+                    store_keys.push_back(keys[pending[j]]);
+                }
+                if (store_keys.empty())
+                    continue;
+
+                FawnDS_Return ret = list->stores[stage][i]->MultiGet(store_keys, store_out, store_rets);
+                if (ret != OK) {
+                    // the keys not resolved yet cannot be looked up in older stores
+                    for (size_t j = 0; j < pending.size(); j++)
+                        rets[pending[j]] = ret;
+                    return ret;
+                }
+
+                if (prefixed(stage)) {
+                    for (size_t k = 0; k < probed.size(); k++) {
+                        if (store_rets[k] == OK)
+                            store_rets[k] = strip_flag(store_out[k]);
+                    }
+                }
+
+                clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+                int64_t current_time = static_cast<int64_t>(ts.tv_sec) * 1000000000Lu + static_cast<int64_t>(ts.tv_nsec);
+
+                for (size_t k = 0; k < probed.size(); k++) {
+                    if (store_rets[k] == KEY_NOT_FOUND)
+                        continue;
+
+                    size_t j = probed[k];
+                    out[pending[j]] = store_out[k];
+                    rets[pending[j]] = store_rets[k];
+                    if (stage < 3 && i < latency_track_store_count_) {
+                        latencies_[stage][i] += current_time - last_time;
+                        ++counts_[stage][i];
+                    }
+                }
+
+                size_t remaining = 0;
+                for (size_t j = 0; j < pending.size(); j++) {
+                    if (rets[pending[j]] == KEY_NOT_FOUND)
+                        pending[remaining++] = pending[j];
+                }
+                pending.resize(remaining);
+            }
+        }
+
+        if (pending.size() != 0) {
+            clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+            int64_t current_time = static_cast<int64_t>(ts.tv_sec) * 1000000000Lu + static_cast<int64_t>(ts.tv_nsec);
+            latencies_[3][0] += (current_time - last_time) * pending.size();
+            counts_[3][0] += pending.size();
+        }
+
+        return OK;
+    }
+
     FawnDS_ConstIterator
     FawnDS_Combi::Enumerate() const
     {
-        IteratorElem* elem = new IteratorElem(this);
-        elem->current_stage = 0;
-        elem->current_store = static_cast<size_t>(-1);
+        Snapshot* snapshot = acquire_snapshot();
+        if (!snapshot)
+            return FawnDS_ConstIterator();
+
+        IteratorElem* elem = new IteratorElem(this, snapshot, !snapshot->streamable);
         elem->Next();
         return FawnDS_ConstIterator(elem);
     }
@@ -512,15 +694,29 @@ namespace fawn {
     FawnDS_Iterator
     FawnDS_Combi::Enumerate()
     {
-        IteratorElem* elem = new IteratorElem(this);
-        elem->current_stage = 0;
-        elem->current_store = static_cast<size_t>(-1);
+        Snapshot* snapshot = acquire_snapshot();
+        if (!snapshot)
+            return FawnDS_Iterator();
+
+        IteratorElem* elem = new IteratorElem(this, snapshot, !snapshot->streamable);
         elem->Next();
         return FawnDS_Iterator(elem);
     }
 
+    FawnDS_ConstIterator
+    FawnDS_Combi::EnumerateInOrder() const
+    {
+        Snapshot* snapshot = acquire_snapshot();
+        if (!snapshot)
+            return FawnDS_ConstIterator();
+
+        IteratorElem* elem = new IteratorElem(this, snapshot, true);
+        elem->Next();
+        return FawnDS_ConstIterator(elem);
+    }
+
     FawnDS*
-    FawnDS_Combi::alloc_store(size_t stage, size_t size)
+    FawnDS_Combi::alloc_store(size_t stage, size_t size, size_t skip_bits, size_t number)
     {
         char buf[1024];
         snprintf(buf, sizeof(buf), "%zu", stage);
@@ -528,13 +724,16 @@ namespace fawn {
         Configuration* config = new Configuration(config_, true);
         config->SetContextNode(std::string("child::store") + buf);
 
-        snprintf(buf, sizeof(buf), "%s_%zu", config_->GetStringValue("child::id").c_str(), next_ids_[stage]++);
+        // a reopened store keeps its number; a new store takes the next one
+        if (number == static_cast<size_t>(-1))
+            number = next_ids_[stage]++;
+        snprintf(buf, sizeof(buf), "%s_%zu", config_->GetStringValue("child::id").c_str(), number);
         config->SetStringValue("child::id", buf);
 
         snprintf(buf, sizeof(buf), "%zu", key_len_);
         config->SetStringValue("child::key-len", buf);
 
-        snprintf(buf, sizeof(buf), "%zu", data_len_);
+        snprintf(buf, sizeof(buf), "%zu", prefixed(stage) ? data_len_ + 1 : data_len_);
         config->SetStringValue("child::data-len", buf);
 
         if (size != static_cast<size_t>(-1)) {
@@ -542,6 +741,20 @@ namespace fawn {
             config->SetStringValue("child::size", buf);
         }
 
+        if (skip_bits != static_cast<size_t>(-1)) {
+            snprintf(buf, sizeof(buf), "%zu", skip_bits);
+            if (config->ExistsNode("child::skip-bits") != 0)
+                config->CreateNodeAndAppend("skip-bits", ".");
+            config->SetStringValue("child::skip-bits", buf);
+        }
+
+        // make the data store use the shared cache
+        if (block_cache_ && config->ExistsNode("child::datastore") == 0) {
+            if (config->ExistsNode("child::datastore/child::block-cache") != 0)
+                config->CreateNodeAndAppend("block-cache", "child::datastore");
+            config->SetStringValue("child::datastore/child::block-cache", block_cache_name_);
+        }
+
         FawnDS* store = FawnDS_Factory::New(config);
         if (store == NULL) {
             DPRINTF(2, "failed to allocate new store\n");
@@ -550,36 +763,655 @@ namespace fawn {
         return store;
     }
 
-    void
-    FawnDS_Combi::ConvertTask::Run()
+    FawnDS_Return
+    FawnDS_Combi::add_front_store()
     {
-        //fprintf(stderr, "FawnDS_Combi::ConvertTask::Run(): converting\n");
-
-        FawnDS* front_store;
-        FawnDS* middle_store;
+        // must be called with mutex_ held as a writer
+        FawnDS* new_store = alloc_store(0);
+        if (!new_store || new_store->Create() != OK) {
+            fprintf(stderr, "FawnDS_Combi::add_front_store(): cannot create a front store\n");
+            delete new_store;
+            return ERROR;
+        }
 
-        //fprintf(stderr, "FawnDS_Combi::ConvertTask::Run(): 1\n");
+        all_stores_[0].insert(all_stores_[0].begin(), new_store);
+        publish_stores();
 
-        // get the front store
-        {
-            tbb::queuing_rw_mutex::scoped_lock lock(fawnds->mutex_, false);
+        if (stage_limit_ >= 1 &&
+            !convert_task_running_ &&
+            all_stores_[0].size() >= store0_high_watermark_) {
+            convert_task_running_ = true;
 
-            assert(fawnds->all_stores_[0].size() > fawnds->store0_low_watermark_);
+            ConvertTask* t = new ConvertTask();
+            t->fawnds = this;
+            task_scheduler_convert_.enqueue_task(t);
+        }
+        return OK;
+    }
 
-            front_store = fawnds->all_stores_[0].back();
+    void
+    FawnDS_Combi::publish_stores()
+    {
+        // must be called with mutex_ held as a writer
+        StoreList* list = new StoreList();
+        list->stores = all_stores_;
+        list->filters = filters_;
+        for (size_t i = 0; i < all_stores_[2].size(); i++)
+            list->segments.push_back(segments_[all_stores_[2][i]]);
+
+        StoreList* old_list = current_stores_.fetch_and_store(list);
+        if (old_list)
+            retired_lists_.push_back(std::make_pair(Epoch::advance(), old_list));
+
+        // free old lists that no reader can still be using; others wait for a later call or Close()
+        size_t remaining = 0;
+        for (size_t i = 0; i < retired_lists_.size(); i++) {
+            if (Epoch::quiescent(retired_lists_[i].first))
+                delete retired_lists_[i].second;
+            else
+                retired_lists_[remaining++] = retired_lists_[i];
         }
+        retired_lists_.resize(remaining);
+    }
 
-        //fprintf(stderr, "FawnDS_Combi::ConvertTask::Run(): 2\n");
+    FawnDS_Return
+    FawnDS_Combi::parse_config()
+    {
+        id_ = config_->GetStringValue("child::id");
 
-        // convert to the middle store
-        {
-            Value status;
-            size_t num_data = 0;
-            if (front_store->Status(NUM_DATA, status) == OK)
-                num_data = atoll(status.str().c_str());
-            //size_t expected_IO = (fawnds->key_len_ + fawnds->data_len_) * num_data;
+        if (config_->ExistsNode("child::key-len") == 0)
+            key_len_ = atoi(config_->GetStringValue("child::key-len").c_str());
+        else
+            key_len_ = 0;
+
+        if (config_->ExistsNode("child::data-len") == 0)
+            data_len_ = atoi(config_->GetStringValue("child::data-len").c_str());
+        else
+            data_len_ = 0;
+
+        if (config_->ExistsNode("child::temp-file") == 0)
+            temp_file_ = config_->GetStringValue("child::temp-file");
+        else
+            temp_file_ = "/tmp";
+
+        if (config_->ExistsNode("child::stage-limit") == 0)
+            stage_limit_ = atoi(config_->GetStringValue("child::stage-limit").c_str());
+        else
+            stage_limit_ = 2;
+
+        if (config_->ExistsNode("child::store0-high-watermark") == 0)
+            store0_high_watermark_ = atoi(config_->GetStringValue("child::store0-high-watermark").c_str());
+        else
+            store0_high_watermark_ = 2;
+
+        if (config_->ExistsNode("child::store0-low-watermark") == 0)
+            store0_low_watermark_ = atoi(config_->GetStringValue("child::store0-low-watermark").c_str());
+        else
+            store0_low_watermark_ = 1;
+        if (store0_low_watermark_ < 1 || store0_high_watermark_ <= store0_low_watermark_)
+            return ERROR;
+
+        if (config_->ExistsNode("child::store1-high-watermark") == 0)
+            store1_high_watermark_ = atoi(config_->GetStringValue("child::store1-high-watermark").c_str());
+        else
+            store1_high_watermark_ = 1;
+
+        if (config_->ExistsNode("child::store1-low-watermark") == 0)
+            store1_low_watermark_ = atoi(config_->GetStringValue("child::store1-low-watermark").c_str());
+        else
+            store1_low_watermark_ = 0;
+        if (store1_high_watermark_ <= store1_low_watermark_)
+            return ERROR;
+
+        if (config_->ExistsNode("child::store2-runs") == 0)
+            store2_runs_ = atoi(config_->GetStringValue("child::store2-runs").c_str());
+        else
+            store2_runs_ = 1;
+        if (store2_runs_ < 1)
+            return ERROR;
+
+        if (config_->ExistsNode("child::store2-size-ratio") == 0)
+            store2_size_ratio_ = atof(config_->GetStringValue("child::store2-size-ratio").c_str());
+        else
+            store2_size_ratio_ = 4.;
+        if (store2_size_ratio_ < 0.)
+            return ERROR;
+
+        if (config_->ExistsNode("child::filter-bits-per-key") == 0)
+            filter_bits_per_key_ = atoi(config_->GetStringValue("child::filter-bits-per-key").c_str());
+        else
+            filter_bits_per_key_ = 0;
+
+        // parse as signed integers so that negative values are rejected instead of wrapping around
+        int merge_threads;
+        if (config_->ExistsNode("child::merge-threads") == 0)
+            merge_threads = atoi(config_->GetStringValue("child::merge-threads").c_str());
+        else
+            merge_threads = 1;
+        if (merge_threads < 1 || merge_threads > static_cast<int>(max_merge_threads_)) {
+            fprintf(stderr, "FawnDS_Combi: <merge-threads> must be between 1 and %zu\n", max_merge_threads_);
+            return ERROR;
+        }
+        merge_threads_ = merge_threads;
+
+        int store2_segments;
+        if (config_->ExistsNode("child::store2-segments") == 0)
+            store2_segments = atoi(config_->GetStringValue("child::store2-segments").c_str());
+        else
+            store2_segments = 1;
+        if (store2_segments < 1 || store2_segments > static_cast<int>(max_store2_segments_)) {
+            fprintf(stderr, "FawnDS_Combi: <store2-segments> must be between 1 and %zu\n", max_store2_segments_);
+            return ERROR;
+        }
+        store2_segments_ = store2_segments;
+        segment_bits_ = 0;
+        while ((1u << segment_bits_) < store2_segments_)
+            segment_bits_++;
+        if ((1u << segment_bits_) != store2_segments_)
+            return ERROR;
+
+        // shards are selected by the key bits right after the bits that the back store ignores
+        // each segment takes whole shards
+        merge_shard_bits_ = segment_bits_;
+        while ((1u << merge_shard_bits_) < merge_threads_)
+            merge_shard_bits_++;
+        if (config_->ExistsNode("child::store2/child::skip-bits") == 0)
+            merge_skip_bits_ = atoi(config_->GetStringValue("child::store2/child::skip-bits").c_str());
+        else
+            merge_skip_bits_ = 0;
+
+        if (config_->ExistsNode("child::merge-memory-limit") == 0)
+            merge_memory_limit_ = atoll(config_->GetStringValue("child::merge-memory-limit").c_str());
+        else
+            merge_memory_limit_ = default_merge_memory_limit_;
+
+        int merge_sort_threads;
+        if (config_->ExistsNode("child::merge-sort-threads") == 0)
+            merge_sort_threads = atoi(config_->GetStringValue("child::merge-sort-threads").c_str());
+        else
+            merge_sort_threads = 1;
+        if (merge_sort_threads < 1 || merge_sort_threads > static_cast<int>(max_merge_threads_)) {
+            fprintf(stderr, "FawnDS_Combi: <merge-sort-threads> must be between 1 and %zu\n", max_merge_threads_);
+            return ERROR;
+        }
+        merge_sort_threads_ = merge_sort_threads;
+
+        if (config_->ExistsNode("child::file") == 0 && stage_limit_ >= 2 && config_->ExistsNode("child::store2/child::file") != 0) {
+            fprintf(stderr, "FawnDS_Combi: <store2> needs <file> to reopen back stores\n");
+            return ERROR;
+        }
+
+        return OK;
+    }
+
+    // the manifest lists the stores of all stages, newest first in each stage, so that Open() can reopen them
+    struct manifest_header {
+        uint64_t magic;
+        uint64_t next_ids[3];
+        uint64_t num_stores;
+    };
+
+    struct manifest_entry {
+        uint64_t stage;
+        uint64_t number;        // the suffix of the store ID assigned by alloc_store()
+        uint64_t segment;       // for back stores only
+    };
+
+    static const uint64_t manifest_magic = 0x54534546494e414dULL;   // "MANIFEST"
+
+    std::string
+    FawnDS_Combi::manifest_filename() const
+    {
+        std::string filename = config_->GetStringValue("child::file") + "_";
+        filename += config_->GetStringValue("child::id");
+        return filename;
+    }
+
+    FawnDS_Return
+    FawnDS_Combi::write_manifest() const
+    {
+        // must be called with mutex_ held as a writer while no conversion or merge is running
+        std::vector<manifest_entry> entries;
+        for (size_t stage = 0; stage < all_stores_.size(); stage++) {
+            for (size_t i = 0; i < all_stores_[stage].size(); i++) {
+                const FawnDS* store = all_stores_[stage][i];
+                // the manifest must not refer to a store whose files are not complete
+                if (all_stores_[stage][i]->Flush() != OK) {
+                    fprintf(stderr, "FawnDS_Combi::write_manifest(): cannot flush a store\n");
+                    return ERROR;
+                }
+
+                std::string id = store->GetConfig()->GetStringValue("child::id");
+                manifest_entry entry;
+                entry.stage = stage;
+                entry.number = strtoull(id.c_str() + id.rfind('_') + 1, NULL, 10);
+                entry.segment = 0;
+                if (stage == 2) {
+                    std::map<const FawnDS*, size_t>::const_iterator it = segments_.find(store);
+                    assert(it != segments_.end());
+                    entry.segment = it->second;
+                }
+                entries.push_back(entry);
+            }
+        }
+
+        std::vector<char> buf(sizeof(manifest_header) + sizeof(manifest_entry) * entries.size());
+        manifest_header* header = reinterpret_cast<manifest_header*>(&buf[0]);
+        header->magic = manifest_magic;
+        for (size_t stage = 0; stage < 3; stage++)
+            header->next_ids[stage] = next_ids_[stage];
+        header->num_stores = entries.size();
+        if (entries.size() != 0)
+            memcpy(&buf[sizeof(manifest_header)], &entries[0], sizeof(manifest_entry) * entries.size());
+
+        // write a new file and rename it so that a crash leaves either the old or the new manifest
+        std::string filename = manifest_filename();
+        std::string temp_filename = filename + ".tmp";
+
+        int fd;
+        if ((fd = open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOATIME, 0666)) == -1) {
+            perror("FawnDS_Combi::write_manifest(): could not open manifest file");
+            return ERROR;
+        }
+
+        if (pwrite(fd, &buf[0], buf.size(), 0) != static_cast<ssize_t>(buf.size()) || fdatasync(fd) == -1) {
+            fprintf(stderr, "FawnDS_Combi::write_manifest(): unable to write manifest\n");
+            close(fd);
+            return ERROR;
+        }
+        close(fd);
+
+        if (rename(temp_filename.c_str(), filename.c_str()) == -1) {
+            perror("FawnDS_Combi::write_manifest(): could not replace manifest file");
+            return ERROR;
+        }
+        return OK;
+    }
+
+    FawnDS_Return
+    FawnDS_Combi::open_stores()
+    {
+        // reopens the stores listed by the manifest; filters are not rebuilt, so lookups probe the reopened stores directly
+        std::string filename = manifest_filename();
+
+        int fd;
+        if ((fd = open(filename.c_str(), O_RDONLY | O_NOATIME)) == -1) {
+            perror("FawnDS_Combi::open_stores(): could not open manifest file");
+            return ERROR;
+        }
+
+        manifest_header header;
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != manifest_magic) {
+            fprintf(stderr, "FawnDS_Combi::open_stores(): invalid header\n");
+            close(fd);
+            return ERROR;
+        }
+
+        std::vector<manifest_entry> entries(header.num_stores);
+        ssize_t len = sizeof(manifest_entry) * entries.size();
+        if (len != 0 && pread(fd, &entries[0], len, sizeof(header)) != len) {
+            fprintf(stderr, "FawnDS_Combi::open_stores(): unable to read manifest\n");
+            close(fd);
+            return ERROR;
+        }
+        close(fd);
+
+        for (size_t stage = 0; stage < 3; stage++)
+            next_ids_[stage] = header.next_ids[stage];
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            size_t stage = entries[i].stage;
+            if (stage > 2 || entries[i].number >= next_ids_[stage] || (stage == 2 && entries[i].segment >= store2_segments_)) {
+                fprintf(stderr, "FawnDS_Combi::open_stores(): invalid store entry\n");
+                return ERROR;
+            }
+
+            FawnDS* store = alloc_store(stage, -1, -1, entries[i].number);
+            if (!store || store->Open() != OK) {
+                fprintf(stderr, "FawnDS_Combi::open_stores(): cannot open a store of stage %zu\n", stage);
+                delete store;
+                return ERROR;
+            }
+            all_stores_[stage].push_back(store);
+            if (stage == 2)
+                segments_[store] = entries[i].segment;
+        }
+
+        return OK;
+    }
+
+    void
+    FawnDS_Combi::setup_block_cache()
+    {
+        if (config_->ExistsNode("child::block-cache-size") != 0)
+            return;
+
+        char buf[1024];
+        snprintf(buf, sizeof(buf), "combi_%s_%p", id_.c_str(), static_cast<void*>(this));
+        block_cache_name_ = buf;
+
+        size_t capacity = strtoull(config_->GetStringValue("child::block-cache-size").c_str(), NULL, 10);
+        block_cache_ = BlockCache::Acquire(block_cache_name_, capacity);
+    }
+
+    // adds the keys of each batch to a filter
+    class FilterBuilder : public FawnDS_BatchCallback {
+    public:
+        explicit FilterBuilder(BloomFilter* filter)
+            : filter_(filter)
+        {
+        }
+
+        bool Process(const FawnDS_Batch& batch)
+        {
+            for (size_t i = 0; i < batch.size; i++)
+                filter_->Insert(ConstRefValue(batch.keys[i].data, batch.keys[i].size));
+            return true;
+        }
+
+    private:
+        BloomFilter* filter_;
+    };
+
+    // reads the whole store; used only when the keys cannot be collected while the store is written
+    BloomFilter*
+    FawnDS_Combi::build_filter(const FawnDS* store) const
+    {
+        Value status;
+        size_t num_data = 0;
+        if (store->Status(NUM_DATA, status) == OK)
+            num_data = atoll(status.str().c_str());
+
+        // deleted keys are also added because their deletion markers must shadow older stores
+        BloomFilter* filter = new BloomFilter(num_data, filter_bits_per_key_);
+        FilterBuilder builder(filter);
+        store->EnumerateBatch(builder);
+        return filter;
+    }
+
+    // the given number of key bits after skip_bits, as an integer
+    static size_t
+    key_prefix(const ConstValue& key, size_t skip_bits, size_t num_bits)
+    {
+        size_t prefix = 0;
+        for (size_t bits = 0; bits < num_bits; bits++) {
+            prefix <<= 1;
+            if ((skip_bits + bits) / 8 >= key.size()) {
+                // too short key; keep it in the lowest range of the current prefix
+                continue;
+            }
+            if (cindex::bit_access::get(reinterpret_cast<const uint8_t*>(key.data()), skip_bits + bits))
+                prefix |= 1;
+        }
+        return prefix;
+    }
+
+    size_t
+    FawnDS_Combi::segment_of(const ConstValue& key) const
+    {
+        // the leading bits of the merge shard
+        return key_prefix(key, merge_skip_bits_, segment_bits_);
+    }
 
-            middle_store = convert(front_store);
+    bool
+    FawnDS_Combi::prefixed(size_t stage) const
+    {
+        // a single back store never needs deletion markers, so it keeps the plain data
+        return stage == 2 && store2_runs_ > 1;
+    }
+
+    FawnDS_Return
+    FawnDS_Combi::get_prefixed(const FawnDS* store, const ConstValue& key, Value& data, size_t offset, size_t len) const
+    {
+        // the whole data is read because the flag comes first
+        FawnDS_Return ret = store->Get(key, data);
+        if (ret != OK)
+            return ret;
+
+        ret = strip_flag(data);
+        if (ret != OK)
+            return ret;
+
+        if (offset == 0 && len >= data.size())
+            return OK;
+        if (offset > data.size())
+            return END;
+        if (len > data.size() - offset)
+            len = data.size() - offset;
+        data = NewValue(data.data() + offset, len);
+        return OK;
+    }
+
+    FawnDS_Return
+    FawnDS_Combi::strip_flag(Value& data) const
+    {
+        if (data.size() == 0 || data.data()[0] == 1)
+            return KEY_DELETED;
+        data = NewValue(data.data() + 1, data.size() - 1);
+        return OK;
+    }
+
+    bool
+    FawnDS_Combi::filter_may_contain(const StoreList* list, const FawnDS* store, const ConstValue& key) const
+    {
+        std::map<const FawnDS*, BloomFilter*>::const_iterator it = list->filters.find(store);
+        if (it == list->filters.end())
+            return true;
+        return it->second->MayContain(key);
+    }
+
+    // sorter entries hold the data prefixed with its deletion flag
+    FawnDS*
+    FawnDS_Combi::new_sorter() const
+    {
+        Configuration* sorter_config = Sorter::NewConfig(key_len_, 1 + data_len_, temp_file_, merge_memory_limit_, merge_sort_threads_);
+        if (!sorter_config)
+            return NULL;
+
+        FawnDS* sorter = FawnDS_Factory::New(sorter_config);
+        if (!sorter) {
+            fprintf(stderr, "FawnDS_Combi::new_sorter(): cannot allocate a sorter\n");
+            delete sorter_config;
+            return NULL;
+        }
+        if (sorter->Create() != OK) {
+            fprintf(stderr, "FawnDS_Combi::new_sorter(): cannot create a sorter\n");
+            delete sorter;
+            return NULL;
+        }
+        return sorter;
+    }
+
+    // copies the first limit entries of a store into a sorter, prefixing the data with its deletion flag
+    class SnapshotCopier : public FawnDS_BatchCallback {
+    public:
+        SnapshotCopier(FawnDS* sorter, size_t data_len, size_t limit)
+            : error(false), sorter_(sorter), limit_(limit)
+        {
+            combined_data_.resize(1 + data_len);
+        }
+
+        bool Process(const FawnDS_Batch& batch)
+        {
+            for (size_t i = 0; i < batch.size; i++) {
+                if (limit_ == 0)
+                    return false;
+                limit_--;
+
+                combined_data_.data()[0] = batch.states[i] == KEY_DELETED ? 1 : 0;
+                memcpy(combined_data_.data() + 1, batch.data[i].data, std::min(batch.data[i].size, combined_data_.size() - 1));
+
+                if (sorter_->Put(ConstRefValue(batch.keys[i].data, batch.keys[i].size), combined_data_) != OK) {
+                    error = true;
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool error;
+
+    private:
+        FawnDS* sorter_;
+        size_t limit_;
+        Value combined_data_;
+    };
+
+    FawnDS_Combi::Snapshot*
+    FawnDS_Combi::acquire_snapshot() const
+    {
+        if (!open_)
+            return NULL;
+
+        Snapshot* snapshot = new Snapshot();
+        snapshot->refs = 1;
+
+        {
+            // stores are retired only after a grace period, so the stores of the list can be pinned inside the critical section
+            Epoch::Guard guard;
+            const StoreList* list = current_stores_;
+
+            // front stores (including sealed ones that may still finish in-flight writes) are cut at the entries written so far;
+            // visiting the newest store first ensures that an entry left out of an older store is not older than one included from a newer store
+            snapshot->streamable = true;
+            for (size_t stage = 0; stage < list->stores.size(); stage++) {
+                for (size_t i = 0; i < list->stores[stage].size(); i++) {
+                    FawnDS* store = list->stores[stage][i];
+                    const FawnDS_SF* sf = dynamic_cast<const FawnDS_SF*>(store);
+                    snapshot->stores.push_back(store);
+                    snapshot->stages.push_back(stage);
+                    snapshot->limits.push_back(stage == 0 ? store_size(store) : static_cast<size_t>(-1));
+                    snapshot->ends.push_back(stage == 0 && sf ? sf->LogEnd() : static_cast<size_t>(-1));
+                    snapshot->segments.push_back(stage == 2 ? list->segments[i] : 0);
+                    if (stage <= 1 && !sf)
+                        snapshot->streamable = false;
+                }
+            }
+
+            tbb::queuing_mutex::scoped_lock pin_lock(snapshot_mutex_);
+            for (size_t i = 0; i < snapshot->stores.size(); i++)
+                pins_[snapshot->stores[i]]++;
+        }
+
+        // sorted copies are made by enumerate_snapshot() when an iterator first reads the stores
+        snapshot->sorted.resize(snapshot->stores.size(), NULL);
+        snapshot->prefixed.resize(snapshot->stores.size(), false);
+        for (size_t i = 0; i < snapshot->stores.size(); i++)
+            snapshot->prefixed[i] = snapshot->stages[i] <= 1 || prefixed(snapshot->stages[i]);
+
+        return snapshot;
+    }
+
+    void
+    FawnDS_Combi::release_snapshot(Snapshot* snapshot) const
+    {
+        if (--snapshot->refs != 0)
+            return;
+
+        for (size_t i = 0; i < snapshot->sorted.size(); i++)
+            delete snapshot->sorted[i];
+
+        std::vector<FawnDS*> unpinned_stores;
+        {
+            tbb::queuing_mutex::scoped_lock lock(snapshot_mutex_);
+
+            for (size_t i = 0; i < snapshot->stores.size(); i++) {
+                std::map<const FawnDS*, size_t>::iterator it = pins_.find(snapshot->stores[i]);
+                assert(it != pins_.end());
+                if (--it->second != 0)
+                    continue;
+                pins_.erase(it);
+
+                std::vector<FawnDS*>::iterator it_retired = std::find(retired_stores_.begin(), retired_stores_.end(), snapshot->stores[i]);
+                if (it_retired != retired_stores_.end()) {
+                    unpinned_stores.push_back(*it_retired);
+                    retired_stores_.erase(it_retired);
+                }
+            }
+        }
+
+        for (size_t i = 0; i < unpinned_stores.size(); i++)
+            destroy_store(unpinned_stores[i]);
+
+        delete snapshot;
+    }
+
+    void
+    FawnDS_Combi::retire_store(FawnDS* store)
+    {
+        // must be called after the store is removed from all_stores_
+        {
+            tbb::queuing_mutex::scoped_lock lock(snapshot_mutex_);
+            if (pins_.find(store) != pins_.end()) {
+                retired_stores_.push_back(store);
+                return;
+            }
+        }
+
+        destroy_store(store);
+    }
+
+    FawnDS_Return
+    FawnDS_Combi::enumerate_snapshot(Snapshot* snapshot, size_t index, FawnDS_ConstIterator& it) const
+    {
+        // front stores may hold several versions of a key, and so may middle stores that keep the data store of a front store;
+        // both are sorted (stably) to keep the last version; back stores are already in key order
+        if (snapshot->stages[index] <= 1 && !snapshot->sorted[index]) {
+            FawnDS* sorter = new_sorter();
+            if (!sorter)
+                return ERROR;
+
+            SnapshotCopier copier(sorter, data_len_, snapshot->limits[index]);
+            if (snapshot->stores[index]->EnumerateBatch(copier) != OK || copier.error || sorter->Flush() != OK) {
+                fprintf(stderr, "FawnDS_Combi::enumerate_snapshot(): cannot sort store %zu of stage %zu\n", index, snapshot->stages[index]);
+                delete sorter;
+                return ERROR;
+            }
+            snapshot->sorted[index] = sorter;
+        }
+
+        if (snapshot->sorted[index])
+            it = static_cast<const FawnDS*>(snapshot->sorted[index])->Enumerate();
+        else
+            it = static_cast<const FawnDS*>(snapshot->stores[index])->Enumerate();
+        return OK;
+    }
+
+    void
+    FawnDS_Combi::ConvertTask::Run()
+    {
+        //fprintf(stderr, "FawnDS_Combi::ConvertTask::Run(): converting\n");
+
+        FawnDS* front_store;
+        FawnDS* middle_store;
+
+        //fprintf(stderr, "FawnDS_Combi::ConvertTask::Run(): 1\n");
+
+        // get the front store
+        {
+            tbb::queuing_rw_mutex::scoped_lock lock(fawnds->mutex_, false);
+
+            assert(fawnds->all_stores_[0].size() > fawnds->store0_low_watermark_);
+
+            front_store = fawnds->all_stores_[0].back();
+        }
+
+        // wait for writes that started when the store was still the front store
+        Epoch::synchronize();
+
+        //fprintf(stderr, "FawnDS_Combi::ConvertTask::Run(): 2\n");
+
+        // convert to the middle store; the filter is built before the middle store becomes visible
+        BloomFilter* filter = NULL;
+        middle_store = convert(front_store, filter);
+        if (!middle_store) {
+            // keep the front store; a later front store switch retries the conversion
+            fprintf(stderr, "FawnDS_Combi::ConvertTask::Run(): conversion failed; keeping the front store\n");
+            tbb::queuing_rw_mutex::scoped_lock lock(fawnds->mutex_, true);
+            assert(fawnds->convert_task_running_);
+            fawnds->convert_task_running_ = false;
+            fawnds->task_failed_ = true;
+            return;
         }
 
         //fprintf(stderr, "FawnDS_Combi::ConvertTask::Run(): 3\n");
@@ -591,6 +1423,10 @@ namespace fawn {
             //fprintf(stderr, "FawnDS_Combi::ConvertTask::Run(): 4\n");
             fawnds->all_stores_[0].pop_back();
             fawnds->all_stores_[1].insert(fawnds->all_stores_[1].begin(), middle_store);
+            if (filter)
+                fawnds->filters_[middle_store] = filter;
+            fawnds->publish_stores();
+            fawnds->task_failed_ = false;
 
             // check if merge is necessary
             if (fawnds->stage_limit_ >= 2 &&
@@ -604,12 +1440,9 @@ namespace fawn {
             }
         }
 
-        // destroy the front store
-        {
-            front_store->Close();
-            front_store->Destroy();
-            delete front_store;
-        }
+        // destroy the front store once no reader or snapshot uses it
+        Epoch::synchronize();
+        fawnds->retire_store(front_store);
 
         {
             tbb::queuing_rw_mutex::scoped_lock lock(fawnds->mutex_, true);
@@ -631,7 +1464,7 @@ namespace fawn {
     }
 
     FawnDS*
-    FawnDS_Combi::ConvertTask::convert(FawnDS* front_store)
+    FawnDS_Combi::ConvertTask::convert(FawnDS* front_store, BloomFilter*& filter)
     {
         {
             struct timeval tv;
@@ -653,15 +1486,37 @@ namespace fawn {
 
         // locking for alloc_store is unnecessary because there is only one thread that modifies the specific value
         FawnDS* middle_store = fawnds->alloc_store(1);
-        if (middle_store->Create() != OK) {
+        if (!middle_store || middle_store->Create() != OK) {
             fprintf(stderr, "Error while creating a middle store\n");
-            assert(false);
             delete middle_store;
             return NULL;
         }
 
-        FawnDS_Return ret = front_store->ConvertTo(middle_store);
-        assert(ret == OK);
+        FawnDS_Return ret;
+        const FawnDS_SF* front_sf = dynamic_cast<const FawnDS_SF*>(front_store);
+        if (fawnds->filter_bits_per_key_ != 0 && front_sf) {
+            // fill the filter with the keys of the entries as they are moved
+            Value status;
+            size_t num_data = 0;
+            if (front_store->Status(NUM_DATA, status) == OK)
+                num_data = atoll(status.str().c_str());
+
+            filter = new BloomFilter(num_data, fawnds->filter_bits_per_key_);
+            FilterBuilder builder(filter);
+            ret = front_sf->ConvertTo(middle_store, &builder);
+        }
+        else {
+            ret = front_store->ConvertTo(middle_store);
+            if (ret == OK && fawnds->filter_bits_per_key_ != 0)
+                filter = fawnds->build_filter(middle_store);
+        }
+        if (ret != OK) {
+            fprintf(stderr, "Error while converting a front store to a middle store\n");
+            delete filter;
+            filter = NULL;
+            destroy_store(middle_store);
+            return NULL;
+        }
 
         {
             struct timeval tv;
@@ -709,11 +1564,10 @@ namespace fawn {
             fflush(stdout);
         }
 
-        size_t num_adds = 0;
-        size_t num_dels = 0;
-
         // sort all available middle stores
-        FawnDS* sorter = NULL;
+        std::vector<FawnDS*> sorters;
+        std::vector<size_t> shard_adds;
+        std::vector<size_t> shard_dels;
         size_t sorted_middle_stores = 0;
         while (true) {
             FawnDS* middle_store_to_sort;
@@ -728,31 +1582,114 @@ namespace fawn {
             }
             sorted_middle_stores++;
 
-            sorter = sort(sorter, middle_store_to_sort, num_adds, num_dels);
-        }
+            if (!sort(sorters, middle_store_to_sort, shard_adds, shard_dels)) {
+                cancel("sorting middle stores failed");
+                return;
+            }
+        }
+
+        if (!flush_sorters(sorters)) {
+            cancel("sorting middle stores failed");
+            return;
+        }
+
+        // merge one segment at a time so that only one segment is being rewritten;
+        // the middle stores stay visible until all segments are merged, so readers see the new entries throughout
+        size_t num_adds = 0;
+        size_t num_dels = 0;
+        size_t shards_per_segment = sorters.size() >> fawnds->segment_bits_;
+        for (size_t segment = 0; segment < fawnds->store2_segments_; segment++) {
+            std::vector<FawnDS*> segment_sorters(sorters.begin() + segment * shards_per_segment, sorters.begin() + (segment + 1) * shards_per_segment);
+            size_t segment_adds = 0;
+            size_t segment_dels = 0;
+            for (size_t i = segment * shards_per_segment; i < (segment + 1) * shards_per_segment; i++) {
+                segment_adds += shard_adds[i];
+                segment_dels += shard_dels[i];
+            }
+
+            // the back stores of an untouched segment are kept as they are
+            if (segment_adds + segment_dels == 0)
+                continue;
+
+            // choose the back stores (runs) of the segment to rewrite: a prefix of the newest runs
+            std::vector<FawnDS*> runs;
+            bool keep_deletions;
+            {
+                // only the current thread modifies all_stores_[2] and segments_, but other threads may be reading them
+                std::vector<FawnDS*> all_runs;
+                {
+                    tbb::queuing_rw_mutex::scoped_lock lock(fawnds->mutex_, false);
+                    for (size_t i = 0; i < fawnds->all_stores_[2].size(); i++) {
+                        std::map<const FawnDS*, size_t>::const_iterator it = fawnds->segments_.find(fawnds->all_stores_[2][i]);
+                        assert(it != fawnds->segments_.end());
+                        if (it->second == segment)
+                            all_runs.push_back(fawnds->all_stores_[2][i]);
+                    }
+                }
+
+                size_t merged_size = segment_adds + segment_dels;
+                for (size_t i = 0; i < all_runs.size(); i++) {
+                    // the new run takes one of the slots
+                    bool too_many_runs = all_runs.size() - i + 1 > fawnds->store2_runs_;
+                    size_t run_size = store_size(all_runs[i]);
+                    if (!too_many_runs && run_size > merged_size * fawnds->store2_size_ratio_)
+                        break;
+                    runs.push_back(all_runs[i]);
+                    merged_size += run_size;
+                }
+
+                // deletion markers must hide the keys of the older runs left as they are
+                keep_deletions = runs.size() < all_runs.size();
+            }
 
-        // obtain the back store
-        FawnDS* back_store;
-        {
-            // don't need to obtain read lock because the current thread is the only thread that can modify fawnds->all_stores_[2]
-            if (fawnds->all_stores_[2].size() == 0)
-                back_store = NULL;
-            else if (fawnds->all_stores_[2].size() == 1)
-                back_store = fawnds->all_stores_[2][0];
-            else {
-                assert(false);
+            // merge the sorted middle store entries of the segment and the chosen runs into a new run
+            BloomFilter* filter = NULL;
+            FawnDS* new_back_store = merge(segment, runs, keep_deletions, segment_sorters, segment_adds, segment_dels, filter);
+            if (!new_back_store) {
+                // segments merged so far keep their new runs; the middle stores still hold all of their entries
+                for (size_t i = 0; i < sorters.size(); i++)
+                    delete sorters[i];
+                sorters.clear();
+                cancel("merging into a back store failed");
                 return;
             }
-        }
+            num_adds += segment_adds;
+            num_dels += segment_dels;
 
-        // merge the sorted middle stores into the back store 
-        FawnDS* new_back_store;
-        {
-            new_back_store = merge(back_store, sorter, num_adds, num_dels);
+            // replace the merged runs with the new run
+            std::vector<BloomFilter*> removed_filters;
+            {
+                tbb::queuing_rw_mutex::scoped_lock lock(fawnds->mutex_, true);
+
+                std::vector<FawnDS*>& all_runs = fawnds->all_stores_[2];
+                for (size_t i = 0; i < runs.size(); i++) {
+                    all_runs.erase(std::find(all_runs.begin(), all_runs.end(), runs[i]));
+                    fawnds->segments_.erase(runs[i]);
+                    removed_filters.push_back(fawnds->filters_[runs[i]]);
+                    fawnds->filters_.erase(runs[i]);
+                }
+                all_runs.insert(all_runs.begin(), new_back_store);
+                fawnds->segments_[new_back_store] = segment;
+                if (filter)
+                    fawnds->filters_[new_back_store] = filter;
+                fawnds->publish_stores();
+            }
+
+            // destroy the old runs once no reader or snapshot uses them, before the next segment takes disk space
+            Epoch::synchronize();
+            for (size_t i = 0; i < removed_filters.size(); i++)
+                delete removed_filters[i];
+            for (size_t i = 0; i < runs.size(); i++)
+                fawnds->retire_store(runs[i]);
         }
 
-        // remove the middle stores and replace the back store
+        for (size_t i = 0; i < sorters.size(); i++)
+            delete sorters[i];
+        sorters.clear();
+
+        // remove the middle stores
         std::vector<FawnDS*> removed_middle_stores;
+        std::vector<BloomFilter*> removed_filters;
         {
             tbb::queuing_rw_mutex::scoped_lock lock(fawnds->mutex_, true);
 
@@ -761,25 +1698,24 @@ namespace fawn {
                 fawnds->all_stores_[1].pop_back();
             }
 
-            fawnds->all_stores_[2].clear();
-            fawnds->all_stores_[2].push_back(new_back_store);
+            for (size_t i = 0; i < sorted_middle_stores; i++) {
+                removed_filters.push_back(fawnds->filters_[removed_middle_stores[i]]);
+                fawnds->filters_.erase(removed_middle_stores[i]);
+            }
+            fawnds->publish_stores();
+            fawnds->task_failed_ = false;
         }
 
-        // destroy middle stores and the back store
+        // destroy middle stores once no reader or snapshot uses them
+        Epoch::synchronize();
         {
-            for (size_t i = 0; i < sorted_middle_stores; i++) {
-                removed_middle_stores[i]->Close();
-                removed_middle_stores[i]->Destroy();
-                delete removed_middle_stores[i];
-            }
-            removed_middle_stores.clear();
+            for (size_t i = 0; i < removed_filters.size(); i++)
+                delete removed_filters[i];
+            removed_filters.clear();
 
-            if (back_store) {
-                back_store->Close();
-                back_store->Destroy();
-                delete back_store;
-                back_store = NULL;
-            }
+            for (size_t i = 0; i < sorted_middle_stores; i++)
+                fawnds->retire_store(removed_middle_stores[i]);
+            removed_middle_stores.clear();
         }
 
         {
@@ -787,12 +1723,13 @@ namespace fawn {
             if (gettimeofday(&tv, NULL)) {
                 perror("Error while getting the current time");
             }
-            fprintf(stdout, "%llu.%06llu: (%s) merge finished: %zu entries to back store, %zu entries deleted\n",
+            fprintf(stdout, "%llu.%06llu: (%s) merge finished: %zu entries to back store, %zu entries deleted, %zu back stores\n",
                     static_cast<long long unsigned>(tv.tv_sec),
                     static_cast<long long unsigned>(tv.tv_usec),
                     fawnds->id_.c_str(),
                     num_adds,
-                    num_dels
+                    num_dels,
+                    fawnds->all_stores_[2].size()
                 );
             fflush(stdout);
         }
@@ -815,69 +1752,96 @@ namespace fawn {
         //fprintf(stderr, "FawnDS_Combi::MergeTask::Run(): merging done\n");
     }
 
-    FawnDS*
-    FawnDS_Combi::MergeTask::sort(FawnDS* sorter, FawnDS* middle_store, size_t& num_adds, size_t& num_dels)
+    void
+    FawnDS_Combi::MergeTask::cancel(const char* reason)
     {
-        if (sorter == NULL) {
-            Configuration* sorter_config = new Configuration();
-
-            char buf[1024];
-
-            if (sorter_config->CreateNodeAndAppend("type", ".") != 0)
-                assert(false);
-            if (sorter_config->SetStringValue("type", "sorter") != 0)
-                assert(false);
-
-            if (sorter_config->CreateNodeAndAppend("key-len", ".") != 0)
-                assert(false);
-            snprintf(buf, sizeof(buf), "%zu", fawnds->key_len_);
-            if (sorter_config->SetStringValue("key-len", buf) != 0)
-                assert(false);
-
-            if (sorter_config->CreateNodeAndAppend("data-len", ".") != 0)
-                assert(false);
-            snprintf(buf, sizeof(buf), "%zu", 1 + fawnds->data_len_);
-            if (sorter_config->SetStringValue("data-len", buf) != 0)
-                assert(false);
-
-            if (sorter_config->CreateNodeAndAppend("temp-file", ".") != 0)
-                assert(false);
-            if (sorter_config->SetStringValue("temp-file", fawnds->temp_file_) != 0)
-                assert(false);
-
-            sorter = FawnDS_Factory::New(sorter_config);
-            if (!sorter) {
-                assert(false);
-                delete sorter_config;
-                return NULL;
-            }
-            if (sorter->Create() != OK) {
-                assert(false);
-                delete sorter;
-                return NULL;
-            }
+        // leaves the middle stores in place; the next conversion that reaches the watermark retries the merge
+        fprintf(stderr, "FawnDS_Combi::MergeTask::Run(): %s; keeping the middle stores\n", reason);
+
+        tbb::queuing_rw_mutex::scoped_lock lock(fawnds->mutex_, true);
+        assert(fawnds->merge_task_running_);
+        fawnds->merge_task_running_ = false;
+        fawnds->task_failed_ = true;
+    }
+
+    size_t
+    FawnDS_Combi::MergeTask::shard_of(const ConstValue& key) const
+    {
+        return key_prefix(key, fawnds->merge_skip_bits_, fawnds->merge_shard_bits_);
+    }
+
+    // puts each entry of the middle store into the sorter of its shard, prefixed with its deletion flag
+    class FawnDS_Combi::MergeTask::SortFeeder : public FawnDS_BatchCallback {
+    public:
+        SortFeeder(const MergeTask* task, std::vector<FawnDS*>& sorters, std::vector<size_t>& shard_adds, std::vector<size_t>& shard_dels)
+            : error(false), task_(task), sorters_(sorters), shard_adds_(shard_adds), shard_dels_(shard_dels)
+        {
+            combined_data_.resize(1 + task->fawnds->data_len_);
         }
 
-        FawnDS_ConstIterator it = middle_store->Enumerate();
-        while (!it.IsEnd()) {
-            Value combined_data;
-            combined_data.resize(1 + fawnds->data_len_);
-            combined_data.data()[0] = it.IsKeyDeleted() ? 1 : 0;
-            memcpy(combined_data.data() + 1, it->data.data(), it->data.size());
+        bool Process(const FawnDS_Batch& batch)
+        {
+            for (size_t i = 0; i < batch.size; i++) {
+                ConstRefValue key(batch.keys[i].data, batch.keys[i].size);
+                bool deleted = batch.states[i] == KEY_DELETED;
 
-            if (sorter->Put(it->key, combined_data) != OK) {
-                assert(false);
-                delete sorter;
-                return NULL;
+                combined_data_.data()[0] = deleted ? 1 : 0;
+                memcpy(combined_data_.data() + 1, batch.data[i].data, std::min(batch.data[i].size, combined_data_.size() - 1));
+
+                size_t shard = task_->shard_of(key);
+                if (sorters_[shard]->Put(key, combined_data_) != OK) {
+                    error = true;
+                    return false;
+                }
+
+                if (!deleted)
+                    shard_adds_[shard]++;
+                else
+                    shard_dels_[shard]++;
             }
 
-            if (!it.IsKeyDeleted())
-                num_adds++;
-            else
-                num_dels++;
+            GlobalLimits::instance().remove_merge_tokens(batch.size);
+            return true;
+        }
 
-            GlobalLimits::instance().remove_merge_tokens(1);
-            ++it;
+        bool error;
+
+    private:
+        const MergeTask* task_;
+        std::vector<FawnDS*>& sorters_;
+        std::vector<size_t>& shard_adds_;
+        std::vector<size_t>& shard_dels_;
+        Value combined_data_;
+    };
+
+    bool
+    FawnDS_Combi::MergeTask::sort(std::vector<FawnDS*>& sorters, FawnDS* middle_store, std::vector<size_t>& shard_adds, std::vector<size_t>& shard_dels)
+    {
+        if (sorters.size() == 0) {
+            // one sorter per key-range shard; shards are in key order
+            for (size_t i = 0; i < (1u << fawnds->merge_shard_bits_); i++) {
+                FawnDS* sorter = fawnds->new_sorter();
+                if (!sorter)
+                    break;
+                sorters.push_back(sorter);
+            }
+            if (sorters.size() != (1u << fawnds->merge_shard_bits_)) {
+                for (size_t i = 0; i < sorters.size(); i++)
+                    delete sorters[i];
+                sorters.clear();
+                return false;
+            }
+            shard_adds.assign(sorters.size(), 0);
+            shard_dels.assign(sorters.size(), 0);
+        }
+
+        SortFeeder feeder(this, sorters, shard_adds, shard_dels);
+        if (middle_store->EnumerateBatch(feeder) != OK || feeder.error) {
+            fprintf(stderr, "Error while sorting a middle store\n");
+            for (size_t i = 0; i < sorters.size(); i++)
+                delete sorters[i];
+            sorters.clear();
+            return false;
         }
 
         {
@@ -885,6 +1849,12 @@ namespace fawn {
             if (gettimeofday(&tv, NULL)) {
                 perror("Error while getting the current time");
             }
+            size_t num_adds = 0;
+            size_t num_dels = 0;
+            for (size_t i = 0; i < sorters.size(); i++) {
+                num_adds += shard_adds[i];
+                num_dels += shard_dels[i];
+            }
             fprintf(stdout, "%llu.%06llu: (%s) sorting: added more unsorted entries (currently %zu entries to add, %zu entries to delete)\n",
                     static_cast<long long unsigned>(tv.tv_sec),
                     static_cast<long long unsigned>(tv.tv_usec),
@@ -895,11 +1865,187 @@ namespace fawn {
             fflush(stdout);
         }
 
-        return sorter;
+        return true;
     }
 
-    FawnDS*
-    FawnDS_Combi::MergeTask::merge(FawnDS* back_store, FawnDS* sorter, size_t& num_adds, size_t& num_dels)
+    // reads the old runs and the sorted middle store entries in key order with duplicate entry supression
+    // sorters hold disjoint key ranges in key order, so they are read one after another
+    class MergeReader {
+    public:
+        // runs are given newest first; they are older than any middle store entry
+        MergeReader(const std::vector<FawnDS*>& runs, bool runs_prefixed, const std::vector<FawnDS*>& sorters, size_t data_len, bool prefix_output, bool keep_deletions)
+            : num_dels(0), runs_prefixed_(runs_prefixed), sorters_(sorters), shard_(0), data_len_(data_len), prefix_output_(prefix_output), keep_deletions_(keep_deletions)
+        {
+            for (size_t i = 0; i < runs.size(); i++)
+                it_r_.push_back(runs[i]->Enumerate());
+            it_m_ = sorters_[0]->Enumerate();
+            skip_empty_shards();
+        }
+
+        // returns false if there is no more entry to keep
+        bool next(Value& key, Value& data)
+        {
+            while (true) {
+                // find the smallest key; among the entries with that key, the middle store entries are the newest, then the runs in order
+                size_t newest = it_r_.size();   // it_r_.size() for the middle store entries
+                bool found = !it_m_.IsEnd();
+                for (size_t i = 0; i < it_r_.size(); i++) {
+                    if (it_r_[i].IsEnd())
+                        continue;
+                    if (!found || it_r_[i]->key.compare(newest == it_r_.size() ? it_m_->key : it_r_[newest]->key) < 0) {
+                        newest = i;
+                        found = true;
+                    }
+                }
+                if (!found)
+                    return false;
+
+                bool deleted;
+
+                if (newest == it_r_.size()) {
+                    while (true) {
+                        key = it_m_->key;
+                        deleted = it_m_->data.data()[0] == 1;
+                        if (!deleted)
+                            data = NewValue(it_m_->data.data() + 1, data_len_);
+                        else
+                            data.resize(0);
+
+                        // this data is from sorter, which uses another storage,
+                        // so it should not be rate-limited
+                        ++it_m_;
+                        skip_empty_shards();
+
+                        // ignore duplicate key from the middle store
+                        // by taking the last key fro the middle store only
+                        if (!it_m_.IsEnd() && key == it_m_->key) {
+                            num_dels++;
+                            continue;
+                        }
+                        else
+                            break;
+                    }
+                }
+                else {
+                    // a run is assumed to have no duplicate entry
+                    key = it_r_[newest]->key;
+                    if (runs_prefixed_) {
+                        deleted = it_r_[newest]->data.data()[0] == 1;
+                        if (!deleted)
+                            data = NewValue(it_r_[newest]->data.data() + 1, data_len_);
+                        else
+                            data.resize(0);
+                    }
+                    else {
+                        data = it_r_[newest]->data;
+                        deleted = false;
+                    }
+                    GlobalLimits::instance().remove_merge_tokens(1);
+                    ++it_r_[newest];
+                }
+
+                // ignore duplicate keys from older runs
+                for (size_t i = (newest == it_r_.size() ? 0 : newest + 1); i < it_r_.size(); i++) {
+                    if (!it_r_[i].IsEnd() && it_r_[i]->key == key) {
+                        GlobalLimits::instance().remove_merge_tokens(1);
+                        ++it_r_[i];
+                        num_dels++;
+                    }
+                }
+
+                if (deleted && !keep_deletions_) {
+                    num_dels++;
+                    continue;
+                }
+
+                if (prefix_output_) {
+                    Value record;
+                    record.resize(1 + data_len_);
+                    record.data()[0] = deleted ? 1 : 0;
+                    if (!deleted)
+                        memcpy(record.data() + 1, data.data(), data_len_);
+                    else
+                        memset(record.data() + 1, 0, data_len_);
+                    data = record;
+                }
+                return true;
+            }
+        }
+
+        size_t num_dels;
+
+    private:
+        void skip_empty_shards()
+        {
+            while (it_m_.IsEnd() && shard_ + 1 < sorters_.size())
+                it_m_ = sorters_[++shard_]->Enumerate();
+        }
+
+        std::vector<FawnDS_ConstIterator> it_r_;
+        bool runs_prefixed_;
+        FawnDS_ConstIterator it_m_;
+        const std::vector<FawnDS*>& sorters_;
+        size_t shard_;
+        size_t data_len_;
+        bool prefix_output_;
+        bool keep_deletions_;
+    };
+
+    // merged entries are handed from the reader thread to the writer in batches of fixed-length records (key followed by data)
+    // a NULL batch marks the end of entries
+    typedef tbb::concurrent_bounded_queue<std::vector<char>*> MergeBatchQueue;
+
+    struct MergeReadArgs {
+        MergeReader* reader;
+        size_t key_len;
+        size_t data_len;
+        MergeBatchQueue* queue;
+    };
+
+    static const size_t merge_batch_entries = 4096;
+    static const size_t merge_queue_batches = 16;
+
+    static void*
+    flush_sorter_main(void* arg)
+    {
+        FawnDS* sorter = static_cast<FawnDS*>(arg);
+        if (sorter->Flush() != OK)
+            return arg;
+        return NULL;
+    }
+
+    static void*
+    merge_read_main(void* arg)
+    {
+        MergeReadArgs* args = static_cast<MergeReadArgs*>(arg);
+        size_t record_len = args->key_len + args->data_len;
+
+        // Values are not shared with the writer because their share counts are not atomic
+        Value key;
+        Value data;
+        std::vector<char>* batch = NULL;
+        while (args->reader->next(key, data)) {
+            assert(key.size() == args->key_len);
+            assert(data.size() == args->data_len);
+            if (!batch) {
+                batch = new std::vector<char>();
+                batch->reserve(merge_batch_entries * record_len);
+            }
+            batch->insert(batch->end(), key.data(), key.data() + key.size());
+            batch->insert(batch->end(), data.data(), data.data() + data.size());
+            if (batch->size() >= merge_batch_entries * record_len) {
+                args->queue->push(batch);
+                batch = NULL;
+            }
+        }
+        if (batch)
+            args->queue->push(batch);
+        args->queue->push(NULL);
+        return NULL;
+    }
+
+    bool
+    FawnDS_Combi::MergeTask::flush_sorters(std::vector<FawnDS*>& sorters)
     {
         DPRINTF(2, "FawnDS_Combi::MergeTask::Merge(): sorting middle store entries\n");
 
@@ -918,17 +2064,71 @@ namespace fawn {
             fflush(stdout);
         }
 
-        if (sorter->Flush() != OK) {
-            assert(false);
-            delete sorter;
-            return NULL;
+        // sort shards in parallel, up to <merge-threads> shards at a time (there can be more shards than threads for segments)
+        bool failed = false;
+        if (fawnds->merge_threads_ == 1) {
+            for (size_t i = 0; i < sorters.size(); i++) {
+                if (flush_sorter_main(sorters[i]) != NULL)
+                    failed = true;
+            }
+        }
+        else {
+            for (size_t first = 0; first < sorters.size(); first += fawnds->merge_threads_) {
+                size_t last = std::min(first + fawnds->merge_threads_, sorters.size());
+                std::vector<pthread_t> tids(last - first);
+                std::vector<bool> started(last - first, false);
+                for (size_t i = first; i < last; i++) {
+                    int ret = pthread_create(&tids[i - first], NULL, flush_sorter_main, sorters[i]);
+                    if (ret == 0)
+                        started[i - first] = true;
+                    else
+                        fprintf(stderr, "Error while creating a sorting thread; sorting the shard in this thread: %s\n", strerror(ret));
+                }
+                // shards without a thread are sorted here while the other threads run
+                for (size_t i = first; i < last; i++) {
+                    if (!started[i - first] && flush_sorter_main(sorters[i]) != NULL)
+                        failed = true;
+                }
+                for (size_t i = first; i < last; i++) {
+                    if (!started[i - first])
+                        continue;
+                    void* ret;
+                    pthread_join(tids[i - first], &ret);
+                    if (ret)
+                        failed = true;
+                }
+            }
         }
+        if (failed) {
+            fprintf(stderr, "Error while sorting middle store entries\n");
+            for (size_t i = 0; i < sorters.size(); i++)
+                delete sorters[i];
+            sorters.clear();
+            return false;
+        }
+        return true;
+    }
 
+    FawnDS*
+    FawnDS_Combi::MergeTask::merge(size_t segment, const std::vector<FawnDS*>& runs, bool keep_deletions, const std::vector<FawnDS*>& sorters, size_t& num_adds, size_t& num_dels, BloomFilter*& filter)
+    {
         DPRINTF(2, "FawnDS_Combi::MergeTask::Merge(): merging sorted entries into the back store with duplicate entry supression\n");
 
+        // only runs keep deletion markers
+        assert(!keep_deletions || fawnds->prefixed(2));
+
+        size_t runs_size = 0;
+        for (size_t i = 0; i < runs.size(); i++)
+            runs_size += store_size(runs[i]);
+
         // note that this is just a guess, not an accurate estimate.
         // the actual size can vary if there are many updates or duplicate deletions.
-        ssize_t estimated_new_back_store_size = static_cast<ssize_t>(fawnds->back_store_size_) + static_cast<ssize_t>(num_adds) - static_cast<ssize_t>(num_dels);
+        // kept deletion markers take entries as well
+        ssize_t estimated_new_back_store_size = static_cast<ssize_t>(runs_size) + static_cast<ssize_t>(num_adds);
+        if (keep_deletions)
+            estimated_new_back_store_size += static_cast<ssize_t>(num_dels);
+        else
+            estimated_new_back_store_size -= static_cast<ssize_t>(num_dels);
         size_t max_new_back_store_size;
         if (estimated_new_back_store_size <= 0)
             max_new_back_store_size = 0;
@@ -936,194 +2136,316 @@ namespace fawn {
             max_new_back_store_size = estimated_new_back_store_size;
 
         // locking for alloc_store is unnecessary because there is only one thread that modifies the specific value
-        FawnDS* new_back_store = fawnds->alloc_store(2, max_new_back_store_size);
-        if (new_back_store->Create() != OK) {
-            fprintf(stderr, "Error while creating a back store\n");
-            assert(false);
-            delete back_store;
-            delete sorter;
+        // the key bits that select the segment are the same for all keys of the store, so its index skips them
+        FawnDS* new_back_store;
+        if (fawnds->segment_bits_ == 0)
+            new_back_store = fawnds->alloc_store(2, max_new_back_store_size);
+        else
+            new_back_store = fawnds->alloc_store(2, max_new_back_store_size, fawnds->merge_skip_bits_ + fawnds->segment_bits_);
+        if (!new_back_store || new_back_store->Create() != OK) {
+            fprintf(stderr, "Error while creating a back store for segment %zu\n", segment);
+            delete new_back_store;
             return NULL;
         }
 
+        // the new run will hold at most all entries of the merged runs and all sorted entries
+        if (fawnds->filter_bits_per_key_ != 0)
+            filter = new BloomFilter(runs_size + num_adds + (keep_deletions ? num_dels : 0), fawnds->filter_bits_per_key_);
+
         num_adds = 0;
         num_dels = 0;
 
-        bool first = true;
-
+        bool failed = false;
         {
-            FawnDS_ConstIterator it_b;
-            if (back_store)
-               it_b = back_store->Enumerate();
-            FawnDS_ConstIterator it_m = sorter->Enumerate();
-
-            if (first) {
-                first = false;
+            MergeReader reader(runs, fawnds->prefixed(2), sorters, fawnds->data_len_, fawnds->prefixed(2), keep_deletions);
+            size_t new_data_len = fawnds->prefixed(2) ? fawnds->data_len_ + 1 : fawnds->data_len_;
 
-                {
-                    struct timeval tv;
-                    if (gettimeofday(&tv, NULL)) {
-                        perror("Error while getting the current time");
-                    }
-                    fprintf(stdout, "%llu.%06llu: (%s) sorting: started retrieving sorted entries\n",
-                            static_cast<long long unsigned>(tv.tv_sec),
-                            static_cast<long long unsigned>(tv.tv_usec),
-                            fawnds->id_.c_str()
-                        );
-                    fflush(stdout);
+            {
+                struct timeval tv;
+                if (gettimeofday(&tv, NULL)) {
+                    perror("Error while getting the current time");
                 }
+                fprintf(stdout, "%llu.%06llu: (%s) sorting: started retrieving sorted entries\n",
+                        static_cast<long long unsigned>(tv.tv_sec),
+                        static_cast<long long unsigned>(tv.tv_usec),
+                        fawnds->id_.c_str()
+                    );
+                fflush(stdout);
             }
 
-            while (true) {
-                bool select_middle_store;
-
-                if (!it_m.IsEnd()) {
-                    if (!it_b.IsEnd()) {
-                        int cmp = it_m->key.compare(it_b->key);
-                        if (cmp < 0)
-                            select_middle_store = true;
-                        else if (cmp == 0) {
-                            select_middle_store = true;
-                            // ignore duplicate key from the back store
-                            // by taking the key fro the middle store only
-                            GlobalLimits::instance().remove_merge_tokens(1);
-                            ++it_b;
-                            num_dels++;
-                        }
-                        else
-                            select_middle_store = false;
-                    }
-                    else
-                        select_middle_store = true;
-                }
-                else {
-                    if (!it_b.IsEnd())
-                        select_middle_store = false;
-                    else
-                        break;
+            // pipeline reading and merging the inputs with writing the new back store (index construction and appending to the data store)
+            MergeBatchQueue queue;
+            queue.set_capacity(merge_queue_batches);
+
+            MergeReadArgs args;
+            args.reader = &reader;
+            args.key_len = fawnds->key_len_;
+            args.data_len = new_data_len;
+            args.queue = &queue;
+
+            pthread_t tid;
+            bool pipelined = fawnds->merge_threads_ > 1;
+            if (pipelined) {
+                int ret = pthread_create(&tid, NULL, merge_read_main, &args);
+                if (ret != 0) {
+                    fprintf(stderr, "Error while creating a merge reader thread; merging in this thread: %s\n", strerror(ret));
+                    pipelined = false;
                 }
+            }
 
+            if (!pipelined) {
                 Value key;
                 Value data;
-                bool deleted;
-
-                if (select_middle_store) {
-                    while (true) {
-                        key = it_m->key;
-                        deleted = it_m->data.data()[0] == 1;
-                        if (!deleted)
-                            data = NewValue(it_m->data.data() + 1, fawnds->data_len_);
-                        else
-                            data.resize(0);
-
-                        //GlobalLimits::instance().remove_merge_tokens(1);
-                        // this data is from sorter, which uses another storage,
-                        // so it should not be rate-limited
-                        ++it_m;
-
-                        // ignore duplicate key from the middle store
-                        // by taking the last key fro the middle store only
-                        if (!it_m.IsEnd() && key == it_m->key) {
-                            //fprintf(stderr, "dup key: ");
-                            //print_payload((const u_char*)key.data(), key.size(), 0);
-                            //if (data == it_m->data)
-                            //    fprintf(stderr, "dup data!\n");
-                            //else
-                            //    fprintf(stderr, "non-dup data!\n");
-                            num_dels++;
-                            continue;
-                        }
-                        else
-                            break;
+                while (reader.next(key, data)) {
+                    if (new_back_store->Put(key, data) != OK) {
+                        failed = true;
+                        break;
                     }
+                    if (filter)
+                        filter->Insert(key);
+                    num_adds++;
                 }
-                else {
-                    // the back store is assumed to have no duplicate entry
-                    key = it_b->key;
-                    data = it_b->data;
-                    deleted = false;
-                    GlobalLimits::instance().remove_merge_tokens(1);
-                    ++it_b;
+            }
+            else {
+                size_t record_len = fawnds->key_len_ + new_data_len;
+                while (true) {
+                    std::vector<char>* batch;
+                    queue.pop(batch);
+                    if (!batch)
+                        break;
+                    // after a failure, batches are still taken so that the reader thread finishes
+                    for (size_t off = 0; off < batch->size() && !failed; off += record_len) {
+                        ConstRefValue key(&(*batch)[off], fawnds->key_len_);
+                        ConstRefValue data(&(*batch)[off + fawnds->key_len_], new_data_len);
+                        if (new_back_store->Put(key, data) != OK) {
+                            failed = true;
+                            break;
+                        }
+                        if (filter)
+                            filter->Insert(key);
+                        num_adds++;
+                    }
+                    delete batch;
                 }
 
-                if (!deleted) {
-                    FawnDS_Return ret = new_back_store->Put(key, data);
-                    assert(ret == OK);
-                    num_adds++;
-                }
-                else
-                    num_dels++;
+                pthread_join(tid, NULL);
             }
-        }
 
-        delete sorter;
-        sorter = NULL;
+            num_dels = reader.num_dels;
+        }
 
         //fprintf(stderr, "FawnDS_Combi::MergeTask::Merge(): %zu keys kept, %zu keys deleted\n", num_adds, num_dels);
 
         DPRINTF(2, "FawnDS_Combi::MergeTask::Merge(): flushing\n");
 
-        new_back_store->Flush();
-
-        fawnds->back_store_size_ = num_adds;
+        if (failed || new_back_store->Flush() != OK) {
+            fprintf(stderr, "Error while writing a back store for segment %zu\n", segment);
+            delete filter;
+            filter = NULL;
+            destroy_store(new_back_store);
+            return NULL;
+        }
 
         return new_back_store;
     }
 
-    FawnDS_Combi::IteratorElem::IteratorElem(const FawnDS_Combi* fawnds)
+    // reads the entry at the iterator and advances the iterator past its key
+    // sorted copies and runs with deletion markers hold data prefixed with its deletion flag
+    // a sorted copy may hold several versions of a key in write order, of which the last one is taken
+    static void
+    take_entry(FawnDS_ConstIterator& it, bool prefixed, Value& key, Value& data, bool& deleted)
+    {
+        key = NewValue(it->key.data(), it->key.size());
+
+        if (!prefixed) {
+            deleted = it->state == KEY_DELETED;
+            data = NewValue(it->data.data(), it->data.size());
+            ++it;
+            return;
+        }
+
+        while (true) {
+            deleted = it->data.data()[0] == 1;
+            if (!deleted)
+                data = NewValue(it->data.data() + 1, it->data.size() - 1);
+            else
+                data.resize(0);
+
+            ++it;
+            if (it.IsEnd() || key != it->key)
+                break;
+        }
+    }
+
+    FawnDS_Combi::IteratorElem::IteratorElem(const FawnDS_Combi* fawnds, Snapshot* snapshot, bool in_order)
+        : snapshot(snapshot), in_order(in_order), current(0)
     {
         this->fawnds = fawnds;
-        lock = new tbb::queuing_rw_mutex::scoped_lock(fawnds->mutex_, false);
     }
 
     FawnDS_Combi::IteratorElem::~IteratorElem()
     {
-        delete lock;
-        lock = NULL;
+        // the store iterators must go before the snapshot releases its stores
+        store_its.clear();
+        current_it = FawnDS_ConstIterator();
+        static_cast<const FawnDS_Combi*>(fawnds)->release_snapshot(snapshot);
     }
 
     FawnDS_IteratorElem*
     FawnDS_Combi::IteratorElem::Clone() const
     {
-        IteratorElem* elem = new IteratorElem(static_cast<const FawnDS_Combi*>(fawnds));
-        tbb::queuing_rw_mutex::scoped_lock* elem_lock = elem->lock;
+        ++snapshot->refs;
+        IteratorElem* elem = new IteratorElem(static_cast<const FawnDS_Combi*>(fawnds), snapshot, in_order);
         *elem = *this;
-        elem->lock = elem_lock;
         return elem;
     }
 
     void
     FawnDS_Combi::IteratorElem::Next()
+    {
+        if (in_order)
+            NextInOrder();
+        else
+            NextUnordered();
+    }
+
+    void
+    FawnDS_Combi::IteratorElem::NextUnordered()
     {
         const FawnDS_Combi* fawnds_combi = static_cast<const FawnDS_Combi*>(fawnds);
 
-        if (!store_it.IsEnd()) {
-            ++store_it;
+        rewritten.resize(snapshot->stores.size());
+
+        while (true) {
+            if (current == snapshot->stores.size()) {
+                state = END;
+                return;
+            }
+
+            size_t stage = snapshot->stages[current];
+            if (!current_it.elem) {
+                // front and middle stores give the last entry of each key, so no store is copied or sorted
+                if (stage <= 1)
+                    current_it = static_cast<const FawnDS_SF*>(snapshot->stores[current])->EnumerateLatest(snapshot->ends[current]);
+                else
+                    current_it = static_cast<const FawnDS*>(snapshot->stores[current])->Enumerate();
+            }
+
+            if (current_it.IsEnd()) {
+                current_it = FawnDS_ConstIterator();
+                current++;
+                continue;
+            }
+            if (current_it->state != OK && current_it->state != KEY_DELETED) {
+                state = ERROR;
+                return;
+            }
+
+            key = NewValue(current_it->key.data(), current_it->key.size());
+            bool deleted;
+            if (stage <= 1) {
+                deleted = current_it->state == KEY_DELETED;
+                data = NewValue(current_it->data.data(), current_it->data.size());
+                if (static_cast<const FawnDS_SF::IteratorElem*>(current_it.elem)->rewritten)
+                    rewritten[current].insert(key.str());
+            }
+            else if (fawnds_combi->prefixed(stage)) {
+                data = NewValue(current_it->data.data(), current_it->data.size());
+                deleted = fawnds_combi->strip_flag(data) != OK;
+            }
+            else {
+                deleted = current_it->state == KEY_DELETED;
+                data = NewValue(current_it->data.data(), current_it->data.size());
+            }
+            ++current_it;
+
+            if (deleted || shadowed())
+                continue;
+
+            state = OK;
+            return;
         }
+    }
+
+    bool
+    FawnDS_Combi::IteratorElem::shadowed() const
+    {
+        // probes the stores newer than the current one for any entry of the key in the snapshot, including deletion markers
+        const FawnDS_Combi* fawnds_combi = static_cast<const FawnDS_Combi*>(fawnds);
+        size_t segment = fawnds_combi->segment_of(key);
 
-        while (store_it.IsEnd()) {
-            current_store++;
+        for (size_t i = 0; i < current; i++) {
+            if (snapshot->stages[i] == 2 && snapshot->segments[i] != segment)
+                continue;
 
-            while (true) {
-                if (current_stage >= fawnds_combi->all_stores_.size()) {
-                    state = END;
+            {
+                // filters are freed after a grace period once their stores leave the published list, which then has no filter to check
+                Epoch::Guard guard;
+                const StoreList* list = fawnds_combi->current_stores_;
+                if (!fawnds_combi->filter_may_contain(list, snapshot->stores[i], key))
+                    continue;
+            }
+
+            if (snapshot->stages[i] <= 1) {
+                FawnDS_Return ret = static_cast<const FawnDS_SF*>(snapshot->stores[i])->FindBefore(key, snapshot->ends[i]);
+                if (ret == OK || ret == KEY_DELETED)
+                    return true;
+                if (ret == END && rewritten[i].find(key.str()) != rewritten[i].end())
+                    return true;
+            }
+            else if (snapshot->stores[i]->Contains(key) != KEY_NOT_FOUND)
+                return true;
+        }
+        return false;
+    }
+
+    void
+    FawnDS_Combi::IteratorElem::NextInOrder()
+    {
+        if (store_its.size() != snapshot->stores.size()) {
+            // the first call opens the stores; clones are made only afterwards, so the sorted copies are not shared yet
+            const FawnDS_Combi* fawnds_combi = static_cast<const FawnDS_Combi*>(fawnds);
+            store_its.resize(snapshot->stores.size());
+            for (size_t i = 0; i < snapshot->stores.size(); i++) {
+                if (fawnds_combi->enumerate_snapshot(snapshot, i, store_its[i]) != OK) {
+                    store_its.clear();
+                    state = ERROR;
                     return;
                 }
+            }
+        }
 
-                if (current_store >= fawnds_combi->all_stores_[current_stage].size()) {
-                    current_stage++;
-                    fprintf(stderr, "FawnDS_Combi::IteratorElem::Next(): enumerating stage %zu\n", current_stage);
-                    current_store = 0;
-                }
-                else
-                    break;
+        while (true) {
+            // there is one iterator per store, so a linear scan finds the smallest key quickly enough;
+            // among the iterators at the smallest key, the first one belongs to the newest store
+            size_t newest = store_its.size();
+            for (size_t i = 0; i < store_its.size(); i++) {
+                if (store_its[i].IsEnd())
+                    continue;
+                if (newest == store_its.size() || store_its[i]->key.compare(store_its[newest]->key) < 0)
+                    newest = i;
             }
 
-            store_it = fawnds_combi->all_stores_[current_stage][current_store]->Enumerate();
-        }
+            if (newest == store_its.size()) {
+                state = END;
+                return;
+            }
+
+            bool deleted;
+            take_entry(store_its[newest], snapshot->prefixed[newest], key, data, deleted);
+
+            // skip older versions in older stores
+            for (size_t i = newest + 1; i < store_its.size(); i++) {
+                while (!store_its[i].IsEnd() && store_its[i]->key == key)
+                    ++store_its[i];
+            }
+
+            if (deleted)
+                continue;
 
-        state = store_it->state;
-        key = store_it->key;
-        data = store_it->data;
+            state = OK;
+            return;
+        }
     }
 
     TaskScheduler FawnDS_Combi::task_scheduler_convert_(1, 100, TaskScheduler::CPU_LOW);
@@ -4,6 +4,14 @@
 
 #include "fawnds.h"
 #include "task.h"
+#include "block_cache.h"
+#include "bloom_filter.h"
+#include "epoch.h"
+#include <map>
+#include <set>
+#include <string>
+#include <tbb/atomic.h>
+#include <tbb/queuing_mutex.h>
 #include <tbb/queuing_rw_mutex.h>
 
 namespace fawn {
@@ -11,7 +19,7 @@ namespace fawn {
     // configuration
     //   <type>: "combi" (fixed)
     //   <id>: the ID of the store
-    //   <file>: the file name prefix to store bookkeeping information for persistency
+    //   <file>: the file name prefix of the list of stores that Flush() writes and Open() reads to reopen the stores.  If not given, Open() starts with no data.  <store2> needs its own <file> to keep the indexes of back stores.
     //   <key-len>: the length of keys -- zero for variable-length keys (default), a positive integer for fixed-length keys
     //   <data-len>: the length of data -- zero for variable-length data (default), a positive integer for fixed-length data
     //   <temp-file>: the path of the temporary files/directory. "/tmp" is the default.
@@ -20,6 +28,14 @@ namespace fawn {
     //   <store0-low-watermark>: the number of front stores to stop conversion to a middle store.  1 is default.  Must be at least 1 due to the writable store. store. store. store.
     //   <store1-high-watermark>: the number of middle stores to begin merge into the back store.  1 is default.
     //   <store1-low-watermark>: the number of middle stores to stop merge into the back store.  0 is default.
+    //   <store2-runs>: the maximum number of back stores (sorted runs) left by a merge.  1 for a single back store that each merge rewrites (default).  With more runs, back stores hold data prefixed with a deletion flag so that runs other than the oldest can keep deletion markers; lookups probe runs from the newest.
+    //   <store2-size-ratio>: a merge also rewrites the next older run if that run holds at most this many times the entries merged so far; runs beyond <store2-runs> are always rewritten.  A small ratio lets runs pile up (tiered), a large one rewrites all runs in each merge (leveled).  4 is default.
+    //   <store2-segments>: the number of key-range segments of the back stage, a power of two up to 256.  Each segment has its own back stores selected by the key bits after <skip-bits> of <store2>.  A merge rewrites one segment at a time and skips segments that received no new entries, which bounds the extra disk space of a merge by the size of a segment.  <store2-runs> applies to each segment.  1 is default.
+    //   <block-cache-size>: the capacity in bytes of a block cache shared by the data stores of all stages.  If not given, each data store uses its own cache.
+    //   <filter-bits-per-key>: the number of bits per key of the Bloom filters built for middle and back stores; lookups skip a store whose filter rules out the key.  0 disables filters (default).
+    //   <merge-threads>: the number of threads used by a merge.  Middle store entries are split into key-range shards that are sorted in parallel, and reading entries overlaps writing the new back store.  1 for a serial merge (default); at most 64.  The merge runs serially where a thread cannot be created.
+    //   <merge-memory-limit>: the <memory-limit> of each sorter used by a merge (one per shard) or by an ordered iterator (one per store to sort).  0 for no limit.  256 MiB is default.
+    //   <merge-sort-threads>: the <sort-threads> of each sorter used by a merge or by an iterator.  Shards of a merge are already sorted by up to <merge-threads> threads at a time, so this mainly helps merges with few shards and ordered iterators.  1 is default; at most 64.
     //   <store0>: the configuration for front stores
     //             <id>: will be assigned by FawnDS_Combi
     //             <key-len>: will be set by FawnDS_Combi
@@ -33,6 +49,7 @@ namespace fawn {
     //             <key-len>: will be set by FawnDS_Combi
     //             <data-len>: will be set by FawnDS_Combi
     //             <size>: will be set by FawnDS_Combi
+    //             <skip-bits>: also used to find the key bits that select a merge shard
 
     class FawnDS_Combi : public FawnDS {
     public:
@@ -57,35 +74,99 @@ namespace fawn {
         virtual FawnDS_Return Contains(const ConstValue& key) const;
         virtual FawnDS_Return Length(const ConstValue& key, size_t& len) const;
         virtual FawnDS_Return Get(const ConstValue& key, Value& data, size_t offset = 0, size_t len = -1) const;
+        virtual FawnDS_Return MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const;
 
+        // iterators enumerate a snapshot of the stores taken when they are created, returning the newest data of each key once
+        // front stores keep taking writes; a snapshot includes only the entries written to them before it was taken
+        // Enumerate() streams the stores from the newest one in no particular key order, and skips an entry if a newer store (or its filter) has the key
+        // conversions and merges are not blocked by iterators; all iterators must be released before Close()
         virtual FawnDS_ConstIterator Enumerate() const;
         virtual FawnDS_Iterator Enumerate();
 
+        // same as Enumerate(), but returns keys in order by merging sorted copies of the front and middle stores with the back stores
+        // the copies are made by sorters that spill to <temp-file> beyond <merge-memory-limit>
+        FawnDS_ConstIterator EnumerateInOrder() const;
+
         //virtual FawnDS_ConstIterator Find(const ConstValue& key) const;
         //virtual FawnDS_Iterator Find(const ConstValue& key);
-    
+
+        // stores pinned by a snapshot are destroyed only after the last iterator using the snapshot is released
+        struct Snapshot {
+            std::vector<FawnDS*> stores;    // newest first
+            std::vector<size_t> stages;
+            std::vector<size_t> limits;     // the number of entries of each front store in the snapshot; -1 for other stores
+            std::vector<size_t> ends;       // the log position (FawnDS_SF::LogEnd()) of each front store in the snapshot; -1 for other stores
+            std::vector<size_t> segments;   // the segment of each back store
+            bool streamable;                // true if the front and middle stores are FawnDS_SF stores that unordered iterators can stream
+            std::vector<FawnDS*> sorted;    // a sorter holding a sorted copy of each front and middle store, made when an ordered iterator first reads it
+            std::vector<bool> prefixed;     // true if the entries enumerated for each store hold data prefixed with its deletion flag
+            tbb::atomic<size_t> refs;
+        };
+
+        // streams the stores of a snapshot, or merges its sorted stores if in_order is set
         struct IteratorElem : public FawnDS_IteratorElem {
-            IteratorElem(const FawnDS_Combi* fawnds);
+            IteratorElem(const FawnDS_Combi* fawnds, Snapshot* snapshot, bool in_order);
             ~IteratorElem();
 
             FawnDS_IteratorElem* Clone() const;
             void Next();
 
-            tbb::queuing_rw_mutex::scoped_lock* lock;
-            size_t current_stage;
-            size_t current_store;
-            FawnDS_Iterator store_it;
+            void NextInOrder();
+            void NextUnordered();
+            bool shadowed() const;
+
+            Snapshot* snapshot;
+            bool in_order;
+
+            // for ordered iterators
+            std::vector<FawnDS_ConstIterator> store_its;
+
+            // for unordered iterators
+            size_t current;
+            FawnDS_ConstIterator current_it;
+            std::vector<std::set<std::string> > rewritten;     // keys of each front store written again after the snapshot, returned by FawnDS_SF::EnumerateLatest() last
         };
 
     protected:
-        FawnDS* alloc_store(size_t stage, size_t size = -1);
+        // an immutable copy of all_stores_ and filters_ that point operations use without taking mutex_
+        // a new list is published whenever the stores change; readers access it inside an Epoch critical section
+        struct StoreList {
+            std::vector<std::vector<FawnDS*> > stores;
+            std::map<const FawnDS*, BloomFilter*> filters;
+            std::vector<size_t> segments;   // the segment of each back store in stores[2]
+        };
+
+        FawnDS* alloc_store(size_t stage, size_t size = -1, size_t skip_bits = -1, size_t number = -1);
+        FawnDS_Return add_front_store();
+        void publish_stores();
+        FawnDS_Return parse_config();
+        std::string manifest_filename() const;
+        FawnDS_Return write_manifest() const;
+        FawnDS_Return open_stores();
+        void setup_block_cache();
+
+        FawnDS* new_sorter() const;
+
+        Snapshot* acquire_snapshot() const;
+        void release_snapshot(Snapshot* snapshot) const;
+        FawnDS_Return enumerate_snapshot(Snapshot* snapshot, size_t index, FawnDS_ConstIterator& it) const;
+        void retire_store(FawnDS* store);
+
+        size_t segment_of(const ConstValue& key) const;
+
+        bool prefixed(size_t stage) const;
+        FawnDS_Return get_prefixed(const FawnDS* store, const ConstValue& key, Value& data, size_t offset = 0, size_t len = -1) const;
+        FawnDS_Return strip_flag(Value& data) const;
+
+        BloomFilter* build_filter(const FawnDS* store) const;
+        bool filter_may_contain(const StoreList* list, const FawnDS* store, const ConstValue& key) const;
 
         class ConvertTask : public Task {
         public:
             virtual void Run();
             FawnDS_Combi* fawnds;
 
-            FawnDS* convert(FawnDS* front_store);
+            FawnDS* convert(FawnDS* front_store, BloomFilter*& filter);
         };
 
         class MergeTask : public Task {
@@ -93,8 +174,15 @@ namespace fawn {
             virtual void Run();
             FawnDS_Combi* fawnds;
 
-            FawnDS* sort(FawnDS* sorter, FawnDS* middle_store, size_t& num_adds, size_t& num_dels);
-            FawnDS* merge(FawnDS* back_store, FawnDS* sorter, size_t& num_adds, size_t& num_dels);
+            bool sort(std::vector<FawnDS*>& sorters, FawnDS* middle_store, std::vector<size_t>& shard_adds, std::vector<size_t>& shard_dels);
+            bool flush_sorters(std::vector<FawnDS*>& sorters);
+            FawnDS* merge(size_t segment, const std::vector<FawnDS*>& runs, bool keep_deletions, const std::vector<FawnDS*>& sorters, size_t& num_adds, size_t& num_dels, BloomFilter*& filter);
+
+        protected:
+            void cancel(const char* reason);
+            size_t shard_of(const ConstValue& key) const;
+
+            class SortFeeder;
         };
 
     private:
@@ -115,21 +203,50 @@ namespace fawn {
         size_t store1_high_watermark_;
         size_t store1_low_watermark_;
 
+        BlockCache* block_cache_;
+        std::string block_cache_name_;
+
         mutable tbb::queuing_rw_mutex mutex_;
 
         std::vector<std::vector<FawnDS*> > all_stores_;     // protected by mutex_
         std::vector<size_t> next_ids_;                      // protected by mutex_
 
-        size_t back_store_size_;
+        size_t filter_bits_per_key_;
+        std::map<const FawnDS*, BloomFilter*> filters_;     // protected by mutex_
+
+        tbb::atomic<StoreList*> current_stores_;                            // written with mutex_ held as a writer
+        std::vector<std::pair<uint64_t, StoreList*> > retired_lists_;       // old lists and their epochs; protected by mutex_
+
+        size_t store2_runs_;
+        double store2_size_ratio_;
+
+        size_t store2_segments_;
+        size_t segment_bits_;
+        std::map<const FawnDS*, size_t> segments_;      // the segment of each back store; protected by mutex_
+
+        size_t merge_threads_;
+        size_t merge_shard_bits_;
+        size_t merge_skip_bits_;
+        size_t merge_memory_limit_;
+        size_t merge_sort_threads_;
+
+        mutable tbb::queuing_mutex snapshot_mutex_;
+        mutable std::map<const FawnDS*, size_t> pins_;     // the number of snapshots using each store; protected by snapshot_mutex_
+        mutable std::vector<FawnDS*> retired_stores_;      // removed stores still pinned by snapshots; protected by snapshot_mutex_
 
         tbb::atomic<bool> convert_task_running_;    // also protected by mutex_
         tbb::atomic<bool> merge_task_running_;      // also protected by mutex_
+        bool task_failed_;                          // the last conversion or merge gave up; protected by mutex_
 
         friend class MergeTask;
 
         static TaskScheduler task_scheduler_convert_;
         static TaskScheduler task_scheduler_merge_;
 
+        static const size_t max_merge_threads_ = 64;
+        static const size_t default_merge_memory_limit_ = 256 * 1024 * 1024;
+        static const size_t max_store2_segments_ = 256;
+
         static const size_t latency_track_store_count_ = 100;
         mutable tbb::atomic<uint64_t> latencies_[4][latency_track_store_count_];
         mutable tbb::atomic<uint64_t> counts_[4][latency_track_store_count_];
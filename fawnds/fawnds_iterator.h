@@ -81,6 +81,30 @@ namespace fawn {
         FawnDS_IteratorElem* operator->();
     };
 
+    // a key or data within a batch handed out by FawnDS::EnumerateBatch()
+    struct FawnDS_Span {
+        const char* data;
+        size_t size;
+    };
+
+    // consecutive entries handed out by FawnDS::EnumerateBatch()
+    // keys[i], data[i], and states[i] (OK or KEY_DELETED) describe the i-th entry;
+    // they refer to memory owned by the store and are valid only until the callback returns
+    struct FawnDS_Batch {
+        size_t size;
+        const FawnDS_Span* keys;
+        const FawnDS_Span* data;
+        const FawnDS_Return* states;
+    };
+
+    class FawnDS_BatchCallback {
+    public:
+        virtual ~FawnDS_BatchCallback() {}
+
+        // returns false to stop the enumeration
+        virtual bool Process(const FawnDS_Batch& batch) = 0;
+    };
+
 } // namespace fawn
 
 #endif  // #ifndef _FAWNDS_ITERATOR_H_
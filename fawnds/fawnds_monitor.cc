@@ -119,6 +119,13 @@ namespace fawn {
         return this->FawnDS_Proxy::Get(key, data, offset, len);
     }
 
+    FawnDS_Return
+    FawnDS_Monitor::MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const
+    {
+        read_ops_ += keys.size();
+        return this->FawnDS_Proxy::MultiGet(keys, out, rets);
+    }
+
     void*
     FawnDS_Monitor::thread_main(void* arg)
     {
@@ -31,6 +31,7 @@ namespace fawn {
         virtual FawnDS_Return Contains(const ConstValue& key) const;
         virtual FawnDS_Return Length(const ConstValue& key, size_t& len) const;
         virtual FawnDS_Return Get(const ConstValue& key, Value& data, size_t offset = 0, size_t len = -1) const;
+        virtual FawnDS_Return MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const;
 
     protected:
         static void* thread_main(void* arg);
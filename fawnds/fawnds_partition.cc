@@ -1,114 +1,403 @@
 /* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "fawnds_partition.h"
 #include "fawnds_factory.h"
+#include "epoch.h"
 #include "debug.h"
-#include "bit_access.hpp"
+#include "rate_limiter.h"
 #include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+#include <algorithm>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <tbb/atomic.h>
+#include <tbb/concurrent_queue.h>
+#include <tbb/queuing_mutex.h>
 
 namespace fawn {
 
+    // hands partitions to threads one at a time; the calling thread also works
+    struct PartitionWork {
+        FawnDS_Return (*func)(PartitionWork* work, FawnDS* store);
+        const std::vector<FawnDS*>* stores;
+        tbb::atomic<size_t> next_partition;
+        std::vector<FawnDS_Return> rets;
+
+        // used by scans only
+        FawnDS_BatchCallback* callback;
+        size_t batch_size;
+        tbb::atomic<bool> stopped;
+    };
+
+    static void*
+    partition_thread_main(void* arg)
+    {
+        PartitionWork* work = static_cast<PartitionWork*>(arg);
+        while (true) {
+            size_t partition = work->next_partition++;
+            if (partition >= work->stores->size())
+                break;
+            work->rets[partition] = work->func(work, (*work->stores)[partition]);
+        }
+        return NULL;
+    }
+
+    // returns the error of the first failed partition, if any
+    static FawnDS_Return
+    run_partition_work(PartitionWork* work, size_t num_threads)
+    {
+        work->next_partition = 0;
+        work->rets.assign(work->stores->size(), OK);
+
+        std::vector<pthread_t> tids;
+        for (size_t i = 1; i < num_threads && i < work->stores->size(); i++) {
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, partition_thread_main, work) != 0) {
+                perror("FawnDS_Partition: cannot create a partition thread");
+                break;
+            }
+            tids.push_back(tid);
+        }
+
+        partition_thread_main(work);
+
+        for (size_t i = 0; i < tids.size(); i++)
+            pthread_join(tids[i], NULL);
+
+        for (size_t i = 0; i < work->rets.size(); i++) {
+            if (work->rets[i] != OK)
+                return work->rets[i];
+        }
+        return OK;
+    }
+
+    static FawnDS_Return
+    create_partition(PartitionWork* work, FawnDS* store)
+    {
+        (void)work;
+        return store->Create();
+    }
+
+    static FawnDS_Return
+    open_partition(PartitionWork* work, FawnDS* store)
+    {
+        (void)work;
+        return store->Open();
+    }
+
+    static FawnDS_Return
+    flush_partition(PartitionWork* work, FawnDS* store)
+    {
+        (void)work;
+        return store->Flush();
+    }
+
+    static FawnDS_Return
+    close_partition(PartitionWork* work, FawnDS* store)
+    {
+        (void)work;
+        if (!store)
+            return OK;
+        return store->Close();
+    }
+
+    // per-core dispatch: a request is executed by the worker that owns its partition
+    // the caller waits for completion by spinning briefly on the pending count and then sleeping until the last request finishes
+    // the caller must not wait inside an Epoch critical section: the owner may be busy with a Flush() that waits for a grace period
+
+    static const size_t completion_spin_count = 1000;
+
+    struct FawnDS_Partition::Completion {
+        Completion(size_t num_requests)
+        {
+            pending = num_requests;
+            pthread_mutex_init(&mutex, NULL);
+            pthread_cond_init(&cond, NULL);
+        }
+
+        ~Completion()
+        {
+            pthread_cond_destroy(&cond);
+            pthread_mutex_destroy(&mutex);
+        }
+
+        // called by a worker for each finished request; the completion may be freed as soon as the mutex is released
+        void done()
+        {
+            pthread_mutex_lock(&mutex);
+            if (--pending == 0)
+                pthread_cond_signal(&cond);
+            pthread_mutex_unlock(&mutex);
+        }
+
+        void wait()
+        {
+            // short requests finish before a sleep would pay off
+            for (size_t i = 0; i < completion_spin_count && pending != 0; i++)
+                ;
+            // taking the mutex also waits for the last done() to stop touching the completion
+            pthread_mutex_lock(&mutex);
+            while (pending != 0)
+                pthread_cond_wait(&cond, &mutex);
+            pthread_mutex_unlock(&mutex);
+        }
+
+        tbb::atomic<size_t> pending;    // updated under mutex
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+    };
+
+    struct FawnDS_Partition::Request {
+        Request(RequestOp op, FawnDS* store)
+            : op(op), store(store), key(NULL), data(NULL), append_key(NULL), out(NULL), offset(0), len(0), length(NULL),
+              keys(NULL), outs(NULL), rets(NULL), ret(OK), completion(NULL)
+        {
+        }
+
+        RequestOp op;
+        FawnDS* store;      // for operations on whole stores; key-value operations look up the routing table when they are executed
+
+        const ConstValue* key;
+        const ConstValue* data;
+        Value* append_key;
+        Value* out;
+        size_t offset;
+        size_t len;
+        size_t* length;
+
+        // used by OP_MULTI_GET only
+        const std::vector<ConstValue>* keys;
+        std::vector<Value>* outs;
+        std::vector<FawnDS_Return>* rets;
+
+        FawnDS_Return ret;
+        Completion* completion;
+    };
+
+    struct FawnDS_Partition::Worker {
+        const FawnDS_Partition* fawnds;
+        pthread_t tid;
+        long cpu;       // -1 if not pinned
+        tbb::concurrent_bounded_queue<Request*> queue;  // a NULL request stops the worker
+    };
+
+    static const size_t dispatch_batch_size = 64;
+
+    // a split copies the source store into two new stores; writes to the source are applied to the new stores under the split mutex
+    // writers take the split mutex only after writing the source, so the copy may hold an iterator on the source while holding the mutex
+    struct FawnDS_Partition::Split {
+        FawnDS* source;
+        FawnDS* lower;          // key prefixes below mid
+        FawnDS* upper;          // key prefixes at or above mid
+        uint32_t mid;
+        size_t lower_number;
+        size_t upper_number;
+        tbb::queuing_mutex mutex;
+    };
+
+    static const size_t split_batch_size = 256;
+
+    struct routing_header {
+        uint64_t magic;
+        uint64_t num_partitions;
+        uint64_t next_store_number;
+    };
+
+    struct routing_entry {
+        uint64_t bound;
+        uint64_t store_number;
+    };
+
+    static const uint64_t routing_magic = 0x474e4954554f52ULL;   // "ROUTING"
+
+    static void
+    destroy_store(FawnDS* store)
+    {
+        store->Close();
+        store->Destroy();
+        delete store;
+    }
+
     FawnDS_Partition::FawnDS_Partition()
+        : partitions_(0), threads_(1), per_core_(false), dispatch_threads_(0), next_store_number_(0)
     {
+        current_routing_ = NULL;
+        num_splits_ = 0;
     }
 
     FawnDS_Partition::~FawnDS_Partition()
     {
         Close();
+        stop_workers();
     }
 
     FawnDS_Return
     FawnDS_Partition::Create()
     {
-        if (stores_.size())
+        if (current_routing_)
             return ERROR;
 
-        alloc_stores();
+        if (alloc_stores(false) != OK)
+            return ERROR;
 
-        for (size_t i = 0; i < partitions_; i++) {
-            if (stores_[i]->Create() != OK) {
+        const Routing* routing = current_routing_;
+        if (per_core_) {
+            std::vector<FawnDS_Return> rets;
+            if (start_workers(num_workers(routing->stores.size())) != OK || call_all_owners(*routing, OP_CREATE, rets) != OK)
+                return ERROR;
+        }
+        else {
+            PartitionWork work;
+            work.func = create_partition;
+            work.stores = &routing->stores;
+            if (run_partition_work(&work, threads_) != OK)
                 return ERROR;
-            }
         }
 
+        if (config_->ExistsNode("child::file") == 0)
+            return write_routing(routing);
         return OK;
     }
 
     FawnDS_Return
     FawnDS_Partition::Open()
     {
-        if (stores_.size())
+        if (current_routing_)
             return ERROR;
 
-        alloc_stores();
+        if (alloc_stores(true) != OK)
+            return ERROR;
 
-        for (size_t i = 0; i < partitions_; i++) {
-            if (stores_[i]->Open() != OK) {
+        const Routing* routing = current_routing_;
+        if (per_core_) {
+            std::vector<FawnDS_Return> rets;
+            if (start_workers(num_workers(routing->stores.size())) != OK || call_all_owners(*routing, OP_OPEN, rets) != OK)
                 return ERROR;
-            }
+            return OK;
         }
 
+        PartitionWork work;
+        work.func = open_partition;
+        work.stores = &routing->stores;
+        if (run_partition_work(&work, threads_) != OK)
+            return ERROR;
+
         return OK;
     }
 
     FawnDS_Return
     FawnDS_Partition::Flush()
     {
-        if (!stores_.size())
-            return ERROR;
+        wait_for_splits();
 
-        for (std::vector<FawnDS*>::iterator it = stores_.begin(); it != stores_.end(); ++it) {
-            FawnDS_Return ret = (*it)->Flush();
-            if (ret != OK)
-                return ret;
+        // stores may wait for a grace period while flushing, so they are flushed outside the critical section;
+        // a store retired by a split that completes meanwhile stays open until Close()
+        Routing routing;
+        {
+            Epoch::Guard guard;
+            const Routing* current = current_routing_;
+            if (!current)
+                return ERROR;
+            routing = *current;
         }
-        return OK;
+
+        if (!workers_.empty()) {
+            std::vector<FawnDS_Return> rets;
+            return call_all_owners(routing, OP_FLUSH, rets);
+        }
+
+        PartitionWork work;
+        work.func = flush_partition;
+        work.stores = &routing.stores;
+        return run_partition_work(&work, threads_);
     }
 
     FawnDS_Return
     FawnDS_Partition::Close()
     {
-        if (!stores_.size())
+        if (!current_routing_)
             return ERROR;
 
-        for (std::vector<FawnDS*>::iterator it = stores_.begin(); it != stores_.end(); ++it) {
-            if (*it) {
-                FawnDS_Return ret = (*it)->Close();
-                if (ret != OK)
-                    return ret;
-                delete *it;
-                *it = NULL;
+        wait_for_splits();
+
+        // no operation may be in progress, so the current table can be updated in place
+        Routing* routing = current_routing_;
+
+        FawnDS_Return ret;
+        std::vector<FawnDS_Return> rets;
+        if (!workers_.empty())
+            ret = call_all_owners(*routing, OP_CLOSE, rets);
+        else {
+            PartitionWork work;
+            work.func = close_partition;
+            work.stores = &routing->stores;
+            ret = run_partition_work(&work, threads_);
+            rets.swap(work.rets);
+        }
+
+        // stores that failed to close are kept so that Close() can be retried
+        for (size_t i = 0; i < routing->stores.size(); i++) {
+            if (routing->stores[i] && rets[i] == OK) {
+                delete routing->stores[i];
+                routing->stores[i] = NULL;
             }
         }
-        stores_.clear();
+        if (ret != OK)
+            return ret;
+
+        stop_workers();
+
+        delete current_routing_.fetch_and_store(NULL);
+        for (size_t i = 0; i < retired_routings_.size(); i++)
+            delete retired_routings_[i].second;
+        retired_routings_.clear();
+
+        // the data of split source stores lives in the new stores now
+        for (size_t i = 0; i < retired_stores_.size(); i++)
+            destroy_store(retired_stores_[i]);
+        retired_stores_.clear();
         return OK;
     }
 
     FawnDS_Return
     FawnDS_Partition::Destroy()
     {
-        for (size_t i = 0; i < partitions_; i++) {
-            Configuration* storeConfig = new Configuration(config_, true);
-            storeConfig->SetContextNode("child::store");
-
-            char buf[1024];
-            snprintf(buf, sizeof(buf), "%s_%zu", config_->GetStringValue("child::id").c_str(), i);
-            storeConfig->SetStringValue("child::id", buf);
+        std::vector<uint32_t> bounds;
+        std::vector<size_t> numbers;
+        size_t next_store_number;
+        if (config_->ExistsNode("child::file") != 0 || read_routing(bounds, numbers, next_store_number) != OK) {
+            numbers.clear();
+            size_t partitions = atoi(config_->GetStringValue("child::partitions").c_str());
+            for (size_t i = 0; i < partitions; i++)
+                numbers.push_back(i);
+        }
 
-            FawnDS* store = FawnDS_Factory::New(storeConfig);
-            if (!store) {
-                delete storeConfig;
+        for (size_t i = 0; i < numbers.size(); i++) {
+            FawnDS* store = new_store(numbers[i]);
+            if (!store)
                 return ERROR;
-            }
             store->Destroy();
             delete store;
         }
 
+        if (config_->ExistsNode("child::file") == 0)
+            unlink(routing_filename().c_str());
+
         return OK;
     }
 
 	FawnDS_Return
 	FawnDS_Partition::Status(const FawnDS_StatusType& type, Value& status) const
 	{
+        Epoch::Guard guard;
+        const Routing* routing = current_routing_;
+        if (!routing)
+            return ERROR;
+
         std::ostringstream oss;
         switch (type) {
         case NUM_DATA:
@@ -120,7 +409,7 @@ namespace fawn {
                 bool first = true;
                 Value status_part;
                 oss << '[';
-                for (std::vector<FawnDS*>::const_iterator it = stores_.begin(); it != stores_.end(); ++it) {
+                for (std::vector<FawnDS*>::const_iterator it = routing->stores.begin(); it != routing->stores.end(); ++it) {
                     if (first)
                         first = false;
                     else
@@ -143,67 +432,172 @@ namespace fawn {
     FawnDS_Return
     FawnDS_Partition::Put(const ConstValue& key, const ConstValue& data)
     {
-        if (!stores_.size())
-            return ERROR;
-
-        size_t p = get_partition(key);
-        return stores_[p]->Put(key, data);
+        Request req(OP_PUT, NULL);
+        req.key = &key;
+        req.data = &data;
+        return dispatch(req);
     }
 
     FawnDS_Return
     FawnDS_Partition::Append(Value& key, const ConstValue& data)
     {
-        if (!stores_.size())
-            return ERROR;
-
-        size_t p = get_partition(key);
-        return stores_[p]->Append(key, data);
+        Request req(OP_APPEND, NULL);
+        req.key = &key;
+        req.append_key = &key;
+        req.data = &data;
+        return dispatch(req);
     }
 
     FawnDS_Return
     FawnDS_Partition::Delete(const ConstValue& key)
     {
-        if (!stores_.size())
-            return ERROR;
-
-        size_t p = get_partition(key);
-        return stores_[p]->Delete(key);
+        Request req(OP_DELETE, NULL);
+        req.key = &key;
+        return dispatch(req);
     }
 
     FawnDS_Return
     FawnDS_Partition::Contains(const ConstValue& key) const
     {
-        if (!stores_.size())
-            return ERROR;
-
-        size_t p = get_partition(key);
-        return stores_[p]->Contains(key);
+        Request req(OP_CONTAINS, NULL);
+        req.key = &key;
+        return dispatch(req);
     }
 
     FawnDS_Return
     FawnDS_Partition::Length(const ConstValue& key, size_t& len) const
     {
-        if (!stores_.size())
-            return ERROR;
-
-        size_t p = get_partition(key);
-        return stores_[p]->Length(key, len);
+        Request req(OP_LENGTH, NULL);
+        req.key = &key;
+        req.length = &len;
+        return dispatch(req);
     }
 
     FawnDS_Return
     FawnDS_Partition::Get(const ConstValue& key, Value& data, size_t offset, size_t len) const
     {
-        if (!stores_.size())
+        Request req(OP_GET, NULL);
+        req.key = &key;
+        req.out = &data;
+        req.offset = offset;
+        req.len = len;
+        return dispatch(req);
+    }
+
+    FawnDS_Return
+    FawnDS_Partition::MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const
+    {
+        if (workers_.empty())
+            return multi_get(keys, out, rets);
+
+        out.resize(keys.size());
+        rets.resize(keys.size());
+
+        // split the batch by owner; each owner splits its sub-batch by partition
+        std::vector<std::vector<size_t> > indices(workers_.size());
+        {
+            Epoch::Guard guard;
+            const Routing* routing = current_routing_;
+            if (!routing)
+                return ERROR;
+            for (size_t i = 0; i < keys.size(); i++)
+                indices[routing->owners[get_partition(routing, keys[i])]].push_back(i);
+        }
+
+        // post all sub-batches before waiting so that the owners work on them concurrently
+        std::vector<std::vector<ConstValue> > part_keys(workers_.size());
+        std::vector<std::vector<Value> > part_out(workers_.size());
+        std::vector<std::vector<FawnDS_Return> > part_rets(workers_.size());
+        std::vector<Request> reqs;
+        reqs.reserve(workers_.size());
+
+        Completion completion(0);
+        for (size_t w = 0; w < workers_.size(); w++) {
+            if (indices[w].size() == 0)
+                continue;
+            for (size_t j = 0; j < indices[w].size(); j++)
+                part_keys[w].push_back(keys[indices[w][j]]);
+
+            reqs.push_back(Request(OP_MULTI_GET, NULL));
+            reqs.back().keys = &part_keys[w];
+            reqs.back().outs = &part_out[w];
+            reqs.back().rets = &part_rets[w];
+            reqs.back().completion = &completion;
+            completion.pending++;
+        }
+
+        size_t r = 0;
+        for (size_t w = 0; w < workers_.size(); w++) {
+            if (indices[w].size() != 0)
+                workers_[w]->queue.push(&reqs[r++]);
+        }
+        completion.wait();
+
+        r = 0;
+        for (size_t w = 0; w < workers_.size(); w++) {
+            if (indices[w].size() == 0)
+                continue;
+            if (reqs[r].ret != OK)
+                return reqs[r].ret;
+            r++;
+            for (size_t j = 0; j < indices[w].size(); j++) {
+                out[indices[w][j]] = part_out[w][j];
+                rets[indices[w][j]] = part_rets[w][j];
+            }
+        }
+        return OK;
+    }
+
+    FawnDS_Return
+    FawnDS_Partition::multi_get(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const
+    {
+        Epoch::Guard guard;
+        const Routing* routing = current_routing_;
+        if (!routing)
             return ERROR;
 
-        size_t p = get_partition(key);
-        return stores_[p]->Get(key, data, offset, len);
+        out.resize(keys.size());
+        rets.resize(keys.size());
+
+        // split the batch by partition so that each store sees one sub-batch
+        std::vector<std::vector<size_t> > indices(routing->stores.size());
+        for (size_t i = 0; i < keys.size(); i++)
+            indices[get_partition(routing, keys[i])].push_back(i);
+
+        std::vector<ConstValue> part_keys;
+        std::vector<Value> part_out;
+        std::vector<FawnDS_Return> part_rets;
+        for (size_t p = 0; p < routing->stores.size(); p++) {
+            if (indices[p].size() == 0)
+                continue;
+
+            part_keys.clear();
+            for (size_t j = 0; j < indices[p].size(); j++)
+                part_keys.push_back(keys[indices[p][j]]);
+
+            FawnDS_Return ret = routing->stores[p]->MultiGet(part_keys, part_out, part_rets);
+            if (ret != OK)
+                return ret;
+
+            for (size_t j = 0; j < indices[p].size(); j++) {
+                out[indices[p][j]] = part_out[j];
+                rets[indices[p][j]] = part_rets[j];
+            }
+        }
+
+        return OK;
     }
 
     FawnDS_ConstIterator
     FawnDS_Partition::Enumerate() const
     {
         IteratorElem* elem = new IteratorElem(this);
+        {
+            Epoch::Guard guard;
+            const Routing* routing = current_routing_;
+            if (routing)
+                elem->stores = routing->stores;
+        }
         elem->next_store = 0;
         elem->Next();
         return FawnDS_ConstIterator(elem);
@@ -213,91 +607,779 @@ namespace fawn {
     FawnDS_Partition::Enumerate()
     {
         IteratorElem* elem = new IteratorElem(this);
+        {
+            Epoch::Guard guard;
+            const Routing* routing = current_routing_;
+            if (routing)
+                elem->stores = routing->stores;
+        }
         elem->next_store = 0;
         elem->Next();
         return FawnDS_Iterator(elem);
     }
 
+    // forwards batches and remembers whether the callback has stopped the enumeration
+    class PartitionBatchForwarder : public FawnDS_BatchCallback {
+    public:
+        explicit PartitionBatchForwarder(FawnDS_BatchCallback& callback)
+            : stopped(false), callback_(callback)
+        {
+        }
+
+        bool Process(const FawnDS_Batch& batch)
+        {
+            if (!callback_.Process(batch))
+                stopped = true;
+            return !stopped;
+        }
+
+        bool stopped;
+
+    private:
+        FawnDS_BatchCallback& callback_;
+    };
+
+    FawnDS_Return
+    FawnDS_Partition::EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size) const
+    {
+        std::vector<FawnDS*> stores;
+        if (!copy_stores(stores))
+            return ERROR;
+
+        PartitionBatchForwarder forwarder(callback);
+        for (size_t i = 0; i < stores.size() && !forwarder.stopped; i++) {
+            FawnDS_Return ret = stores[i]->EnumerateBatch(forwarder, batch_size);
+            if (ret != OK)
+                return ret;
+        }
+        return OK;
+    }
+
+    size_t
+    FawnDS_Partition::NumPartitions() const
+    {
+        Epoch::Guard guard;
+        const Routing* routing = current_routing_;
+        return routing ? routing->stores.size() : 0;
+    }
+
     FawnDS_ConstIterator
-    FawnDS_Partition::Find(const ConstValue& key) const
+    FawnDS_Partition::EnumeratePartition(size_t partition) const
     {
-        if (!stores_.size())
+        const FawnDS* store = partition_store(partition);
+        if (!store)
             return FawnDS_ConstIterator();
+        return store->Enumerate();
+    }
+
+    FawnDS_Return
+    FawnDS_Partition::EnumeratePartitionBatch(size_t partition, FawnDS_BatchCallback& callback, size_t batch_size) const
+    {
+        const FawnDS* store = partition_store(partition);
+        if (!store)
+            return ERROR;
+        return store->EnumerateBatch(callback, batch_size);
+    }
+
+    // forwards batches of one partition until any thread's callback stops the enumeration
+    class ParallelBatchForwarder : public FawnDS_BatchCallback {
+    public:
+        ParallelBatchForwarder(FawnDS_BatchCallback& callback, tbb::atomic<bool>& stopped)
+            : callback_(callback), stopped_(stopped)
+        {
+        }
+
+        bool Process(const FawnDS_Batch& batch)
+        {
+            if (stopped_)
+                return false;
+            if (!callback_.Process(batch))
+                stopped_ = true;
+            return !stopped_;
+        }
 
-        size_t p = get_partition(key);
-        return stores_[p]->Find(key);
+    private:
+        FawnDS_BatchCallback& callback_;
+        tbb::atomic<bool>& stopped_;
+    };
+
+    static FawnDS_Return
+    scan_partition(PartitionWork* work, FawnDS* store)
+    {
+        if (work->stopped)
+            return OK;
+        ParallelBatchForwarder forwarder(*work->callback, work->stopped);
+        return static_cast<const FawnDS*>(store)->EnumerateBatch(forwarder, work->batch_size);
+    }
+
+    FawnDS_Return
+    FawnDS_Partition::EnumerateBatchParallel(FawnDS_BatchCallback& callback, size_t batch_size) const
+    {
+        std::vector<FawnDS*> stores;
+        if (!copy_stores(stores))
+            return ERROR;
+
+        PartitionWork work;
+        work.func = scan_partition;
+        work.stores = &stores;
+        work.callback = &callback;
+        work.batch_size = batch_size;
+        work.stopped = false;
+        return run_partition_work(&work, threads_);
+    }
+
+    FawnDS_ConstIterator
+    FawnDS_Partition::Find(const ConstValue& key) const
+    {
+        FawnDS* store;
+        {
+            Epoch::Guard guard;
+            const Routing* routing = current_routing_;
+            if (!routing)
+                return FawnDS_ConstIterator();
+            store = routing->stores[get_partition(routing, key)];
+        }
+        return static_cast<const FawnDS*>(store)->Find(key);
     }
 
     FawnDS_Iterator
     FawnDS_Partition::Find(const ConstValue& key)
     {
-        if (!stores_.size())
-            return FawnDS_Iterator();
+        FawnDS* store;
+        {
+            Epoch::Guard guard;
+            const Routing* routing = current_routing_;
+            if (!routing)
+                return FawnDS_Iterator();
+            store = routing->stores[get_partition(routing, key)];
+        }
+        return store->Find(key);
+    }
 
-        size_t p = get_partition(key);
-        return stores_[p]->Find(key);
+    bool
+    FawnDS_Partition::copy_stores(std::vector<FawnDS*>& stores) const
+    {
+        // scans work on a copy of the store list; stores retired by splits stay open until Close()
+        Epoch::Guard guard;
+        const Routing* routing = current_routing_;
+        if (!routing)
+            return false;
+        stores = routing->stores;
+        return true;
+    }
+
+    const FawnDS*
+    FawnDS_Partition::partition_store(size_t partition) const
+    {
+        Epoch::Guard guard;
+        const Routing* routing = current_routing_;
+        if (!routing || partition >= routing->stores.size())
+            return NULL;
+        return routing->stores[partition];
     }
 
     FawnDS_Return
-    FawnDS_Partition::alloc_stores()
+    FawnDS_Partition::alloc_stores(bool open)
     {
-        skip_bits_ = atoi(config_->GetStringValue("child::skip_bits").c_str());
+        // <skip-bits> is the documented name; older code read <skip_bits>
+        if (config_->ExistsNode("child::skip-bits") == 0)
+            skip_bits_ = atoi(config_->GetStringValue("child::skip-bits").c_str());
+        else
+            skip_bits_ = atoi(config_->GetStringValue("child::skip_bits").c_str());
 
         partitions_ = atoi(config_->GetStringValue("child::partitions").c_str());
-        partition_bits_ = 0;
-        while ((1u << partition_bits_) < partitions_)
-            partition_bits_++;
-
         if (partitions_ == 0) {
             DPRINTF(2, "FawnDS_Partition::alloc_stores(): non-zero partitions required\n");
             return ERROR;
         }
 
-        if ((1u << partition_bits_) != partitions_) {
-            DPRINTF(2, "FawnDS_Partition::alloc_stores(): # of partitions should be power of 2\n");
-            return ERROR;
+        if (config_->ExistsNode("child::threads") == 0)
+            threads_ = atoi(config_->GetStringValue("child::threads").c_str());
+        else
+            threads_ = 1;
+        if (threads_ == 0)
+            threads_ = 1;
+
+        per_core_ = false;
+        if (config_->ExistsNode("child::dispatch") == 0) {
+            std::string dispatch = config_->GetStringValue("child::dispatch");
+            if (dispatch == "per-core")
+                per_core_ = true;
+            else if (dispatch != "shared") {
+                DPRINTF(2, "FawnDS_Partition::alloc_stores(): unknown dispatch mode: %s\n", dispatch.c_str());
+                return ERROR;
+            }
         }
 
-        for (size_t i = 0; i < partitions_; i++) {
-            Configuration* storeConfig = new Configuration(config_, true);
-            storeConfig->SetContextNode("child::store");
+        dispatch_threads_ = 0;
+        if (config_->ExistsNode("child::dispatch-threads") == 0)
+            dispatch_threads_ = atoi(config_->GetStringValue("child::dispatch-threads").c_str());
+        if (dispatch_threads_ == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            dispatch_threads_ = cpus > 0 ? cpus : 1;
+        }
 
-            char buf[1024];
-            snprintf(buf, sizeof(buf), "%s_%zu", config_->GetStringValue("child::id").c_str(), i);
-            storeConfig->SetStringValue("child::id", buf);
+        Routing* routing = new Routing();
+        if (!open || config_->ExistsNode("child::file") != 0 || read_routing(routing->bounds, routing->store_numbers, next_store_number_) != OK) {
+            // equal ranges of the 32-bit key prefix; for power of 2, this is the same as using the top bits
+            for (size_t i = 0; i < partitions_; i++) {
+                routing->bounds.push_back(static_cast<uint32_t>((static_cast<uint64_t>(i) << 32) / partitions_));
+                routing->store_numbers.push_back(i);
+            }
+            next_store_number_ = partitions_;
+        }
 
-            FawnDS* store = FawnDS_Factory::New(storeConfig);
+        size_t workers = num_workers(routing->store_numbers.size());
+        for (size_t i = 0; i < routing->store_numbers.size(); i++) {
+            FawnDS* store = new_store(routing->store_numbers[i]);
             if (!store) {
-                delete storeConfig;
+                for (size_t j = 0; j < routing->stores.size(); j++)
+                    delete routing->stores[j];
+                delete routing;
                 return ERROR;
             }
-            stores_.push_back(store);
+            routing->stores.push_back(store);
+            routing->owners.push_back(workers != 0 ? i % workers : 0);
         }
+        routing->splits.resize(routing->stores.size(), NULL);
+
+        tbb::queuing_mutex::scoped_lock lock(routing_mutex_);
+        publish_routing(routing);
         return OK;
     }
 
+    FawnDS*
+    FawnDS_Partition::new_store(size_t number) const
+    {
+        Configuration* storeConfig = new Configuration(config_, true);
+        storeConfig->SetContextNode("child::store");
+
+        char buf[1024];
+        snprintf(buf, sizeof(buf), "%s_%zu", config_->GetStringValue("child::id").c_str(), number);
+        storeConfig->SetStringValue("child::id", buf);
+
+        FawnDS* store = FawnDS_Factory::New(storeConfig);
+        if (!store)
+            delete storeConfig;
+        return store;
+    }
+
+    uint32_t
+    FawnDS_Partition::get_prefix(const ConstValue& key) const
+    {
+        // the 32 bits after skip_bits_; bits beyond the end of the key are zero
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(key.data());
+        size_t first_byte = skip_bits_ / 8;
+        uint64_t v = 0;
+        for (size_t i = 0; i < 5; i++) {
+            v <<= 8;
+            if (first_byte + i < key.size())
+                v |= data[first_byte + i];
+        }
+        return static_cast<uint32_t>(v >> (8 - skip_bits_ % 8));
+    }
+
     size_t
-    FawnDS_Partition::get_partition(const ConstValue& key) const
-    {
-        std::size_t bits = 0;
-        std::size_t index = 0;
-        while (bits < partition_bits_)
-		{
-            index <<= 1;
-            if ((skip_bits_ + bits) / 8 > key.size())
-			{
-				// too short key
-				assert(false);
-                break;
+    FawnDS_Partition::get_partition(const Routing* routing, const ConstValue& key) const
+    {
+        std::vector<uint32_t>::const_iterator it = std::upper_bound(routing->bounds.begin(), routing->bounds.end(), get_prefix(key));
+        return (it - routing->bounds.begin()) - 1;
+    }
+
+    void
+    FawnDS_Partition::publish_routing(Routing* routing)
+    {
+        // must be called with routing_mutex_ held
+        Routing* old_routing = current_routing_.fetch_and_store(routing);
+        if (old_routing)
+            retired_routings_.push_back(std::make_pair(Epoch::advance(), old_routing));
+
+        // free old tables that no reader can still be using; others wait for a later call or Close()
+        size_t remaining = 0;
+        for (size_t i = 0; i < retired_routings_.size(); i++) {
+            if (Epoch::quiescent(retired_routings_[i].first))
+                delete retired_routings_[i].second;
+            else
+                retired_routings_[remaining++] = retired_routings_[i];
+        }
+        retired_routings_.resize(remaining);
+    }
+
+    std::string
+    FawnDS_Partition::routing_filename() const
+    {
+        std::string filename = config_->GetStringValue("child::file") + "_";
+        filename += config_->GetStringValue("child::id");
+        return filename;
+    }
+
+    FawnDS_Return
+    FawnDS_Partition::write_routing(const Routing* routing) const
+    {
+        // write a new file and rename it so that a crash leaves either the old or the new routing table
+        std::string filename = routing_filename();
+        std::string temp_filename = filename + ".tmp";
+
+        std::vector<char> buf(sizeof(routing_header) + sizeof(routing_entry) * routing->stores.size());
+        routing_header* header = reinterpret_cast<routing_header*>(&buf[0]);
+        header->magic = routing_magic;
+        header->num_partitions = routing->stores.size();
+        header->next_store_number = next_store_number_;
+        routing_entry* entries = reinterpret_cast<routing_entry*>(&buf[sizeof(routing_header)]);
+        for (size_t i = 0; i < routing->stores.size(); i++) {
+            entries[i].bound = routing->bounds[i];
+            entries[i].store_number = routing->store_numbers[i];
+        }
+
+        int fd;
+        if ((fd = open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOATIME, 0666)) == -1) {
+            perror("FawnDS_Partition::write_routing(): could not open routing file");
+            return ERROR;
+        }
+
+        if (pwrite(fd, &buf[0], buf.size(), 0) != static_cast<ssize_t>(buf.size()) || fdatasync(fd) == -1) {
+            fprintf(stderr, "FawnDS_Partition::write_routing(): unable to write routing table\n");
+            close(fd);
+            return ERROR;
+        }
+        close(fd);
+
+        if (rename(temp_filename.c_str(), filename.c_str()) == -1) {
+            perror("FawnDS_Partition::write_routing(): could not replace routing file");
+            return ERROR;
+        }
+        return OK;
+    }
+
+    FawnDS_Return
+    FawnDS_Partition::read_routing(std::vector<uint32_t>& bounds, std::vector<size_t>& store_numbers, size_t& next_store_number) const
+    {
+        std::string filename = routing_filename();
+
+        int fd;
+        if ((fd = open(filename.c_str(), O_RDONLY | O_NOATIME)) == -1) {
+            if (errno != ENOENT)
+                perror("FawnDS_Partition::read_routing(): could not open routing file");
+            return ERROR;
+        }
+
+        routing_header header;
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != routing_magic || header.num_partitions == 0) {
+            fprintf(stderr, "FawnDS_Partition::read_routing(): invalid header\n");
+            close(fd);
+            return ERROR;
+        }
+
+        std::vector<routing_entry> entries(header.num_partitions);
+        ssize_t len = sizeof(routing_entry) * entries.size();
+        if (pread(fd, &entries[0], len, sizeof(header)) != len) {
+            fprintf(stderr, "FawnDS_Partition::read_routing(): unable to read routing table\n");
+            close(fd);
+            return ERROR;
+        }
+        close(fd);
+
+        bounds.clear();
+        store_numbers.clear();
+        for (size_t i = 0; i < entries.size(); i++) {
+            bounds.push_back(static_cast<uint32_t>(entries[i].bound));
+            store_numbers.push_back(entries[i].store_number);
+        }
+        next_store_number = header.next_store_number;
+        return OK;
+    }
+
+    FawnDS_Return
+    FawnDS_Partition::sync_split(Split* split, const ConstValue& key, bool overwrite) const
+    {
+        // the source store has the latest state of the key; must be called with the split mutex held
+        FawnDS* target = get_prefix(key) < split->mid ? split->lower : split->upper;
+
+        if (!overwrite && target->Contains(key) == OK)
+            return OK;
+
+        Value data;
+        FawnDS_Return ret = split->source->Get(key, data);
+        if (ret == OK)
+            return target->Put(key, data);
+        if (ret == KEY_NOT_FOUND || ret == KEY_DELETED) {
+            if (target->Contains(key) == OK)
+                return target->Delete(key);
+            return OK;
+        }
+        return ret;
+    }
+
+    void
+    FawnDS_Partition::wait_for_splits() const
+    {
+        RateLimiter rate_limiter(0, 1, 1, 10000000L); // poll status every 10 ms or more
+        while (num_splits_ != 0)
+            rate_limiter.remove_tokens(1);
+    }
+
+    FawnDS_Return
+    FawnDS_Partition::SplitPartition(size_t partition)
+    {
+        Split* split;
+        {
+            tbb::queuing_mutex::scoped_lock lock(routing_mutex_);
+
+            const Routing* routing = current_routing_;
+            if (!routing || partition >= routing->stores.size() || routing->splits[partition])
+                return ERROR;
+
+            // without a routing table on disk, Open() would not find the new stores
+            if (config_->ExistsNode("child::file") != 0) {
+                DPRINTF(2, "FawnDS_Partition::SplitPartition(): no <file> to record the split\n");
+                return ERROR;
+            }
+
+            uint64_t lo = routing->bounds[partition];
+            uint64_t hi = partition + 1 < routing->bounds.size() ? routing->bounds[partition + 1] : (1ULL << 32);
+            if (hi - lo < 2) {
+                DPRINTF(2, "FawnDS_Partition::SplitPartition(): partition %zu is too narrow\n", partition);
+                return ERROR;
+            }
+
+            split = new Split();
+            split->source = routing->stores[partition];
+            split->mid = static_cast<uint32_t>(lo + (hi - lo) / 2);
+            split->lower_number = next_store_number_++;
+            split->upper_number = next_store_number_++;
+            split->lower = new_store(split->lower_number);
+            split->upper = new_store(split->upper_number);
+            if (!split->lower || !split->upper || split->lower->Create() != OK || split->upper->Create() != OK) {
+                fprintf(stderr, "FawnDS_Partition::SplitPartition(): cannot create new stores\n");
+                if (split->lower)
+                    destroy_store(split->lower);
+                if (split->upper)
+                    destroy_store(split->upper);
+                delete split;
+                return ERROR;
             }
-            if (cindex::bit_access::get(reinterpret_cast<const uint8_t*>(key.data()), skip_bits_ + bits))
-                index |= 1;
-            bits++;
+
+            Routing* new_routing = new Routing(*routing);
+            new_routing->splits[partition] = split;
+            ++num_splits_;
+            publish_routing(new_routing);
         }
 
-        return index;
+        DPRINTF(2, "FawnDS_Partition::SplitPartition(): splitting partition %zu into stores %zu and %zu\n", partition, split->lower_number, split->upper_number);
+
+        SplitTask* t = new SplitTask();
+        t->fawnds = this;
+        t->split = split;
+        task_scheduler_split_.enqueue_task(t);
+        return OK;
     }
 
+    void
+    FawnDS_Partition::SplitTask::Run()
+    {
+        // wait for writes that do not see the split yet; later writes also update the new stores
+        Epoch::synchronize();
+
+        // snapshot the keys of the source; keys written afterwards are copied by their writers
+        std::vector<Value> keys;
+        {
+            FawnDS_ConstIterator it = static_cast<const FawnDS*>(split->source)->Enumerate();
+            for (; !it.IsEnd(); ++it)
+                keys.push_back(it->key);
+        }
+
+        // copy a batch of keys at a time with no iterator open on the source, taking the split mutex per batch to let writers in
+        FawnDS_Return ret = OK;
+        for (size_t begin = 0; begin < keys.size() && ret == OK; begin += split_batch_size) {
+            size_t end = std::min(begin + split_batch_size, keys.size());
+            tbb::queuing_mutex::scoped_lock lock(split->mutex);
+            for (size_t i = begin; i < end && ret == OK; i++)
+                ret = fawnds->sync_split(split, keys[i], false);
+        }
+        std::vector<Value>().swap(keys);
+
+        if (ret == OK)
+            ret = split->lower->Flush();
+        if (ret == OK)
+            ret = split->upper->Flush();
+
+        {
+            tbb::queuing_mutex::scoped_lock lock(fawnds->routing_mutex_);
+
+            const Routing* routing = fawnds->current_routing_;
+            size_t p = std::find(routing->stores.begin(), routing->stores.end(), split->source) - routing->stores.begin();
+            assert(p < routing->stores.size());
+
+            Routing* new_routing = new Routing(*routing);
+            new_routing->splits[p] = NULL;
+
+            if (ret == OK) {
+                // switch the routing table to the new stores; the lower half keeps the owner
+                Routing* split_routing = new Routing(*new_routing);
+                size_t upper_owner = 0;
+                if (!fawnds->workers_.empty()) {
+                    std::vector<size_t> load(fawnds->workers_.size(), 0);
+                    for (size_t i = 0; i < routing->owners.size(); i++)
+                        load[routing->owners[i]]++;
+                    upper_owner = std::min_element(load.begin(), load.end()) - load.begin();
+                }
+
+                split_routing->stores[p] = split->lower;
+                split_routing->stores.insert(split_routing->stores.begin() + p + 1, split->upper);
+                split_routing->bounds.insert(split_routing->bounds.begin() + p + 1, split->mid);
+                split_routing->store_numbers[p] = split->lower_number;
+                split_routing->store_numbers.insert(split_routing->store_numbers.begin() + p + 1, split->upper_number);
+                split_routing->owners.insert(split_routing->owners.begin() + p + 1, upper_owner);
+                split_routing->splits.insert(split_routing->splits.begin() + p + 1, static_cast<Split*>(NULL));
+
+                // the new stores are used only once the routing table on disk refers to them
+                ret = fawnds->write_routing(split_routing);
+                if (ret == OK) {
+                    delete new_routing;
+                    new_routing = split_routing;
+
+                    // iterators may still use the source store
+                    fawnds->retired_stores_.push_back(split->source);
+
+                    DPRINTF(2, "FawnDS_Partition::SplitTask::Run(): %zu partitions\n", new_routing->stores.size());
+                }
+                else
+                    delete split_routing;
+            }
+
+            if (ret != OK)
+                fprintf(stderr, "FawnDS_Partition::SplitTask::Run(): split failed; keeping the source store\n");
+
+            fawnds->publish_routing(new_routing);
+        }
+
+        // writes that saw the split may still be updating the new stores
+        Epoch::synchronize();
+
+        if (ret != OK) {
+            destroy_store(split->lower);
+            destroy_store(split->upper);
+        }
+        delete split;
+
+        // the last access to fawnds; Close() may proceed afterwards
+        --fawnds->num_splits_;
+    }
+
+    size_t
+    FawnDS_Partition::num_workers(size_t num_partitions) const
+    {
+        if (!per_core_)
+            return 0;
+        return std::min(dispatch_threads_, num_partitions);
+    }
+
+    FawnDS_Return
+    FawnDS_Partition::start_workers(size_t num)
+    {
+        if (!workers_.empty())
+            return OK;
+
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        for (size_t i = 0; i < num; i++) {
+            Worker* worker = new Worker();
+            worker->fawnds = this;
+            worker->cpu = cpus > 0 ? static_cast<long>(i % cpus) : -1;
+            if (pthread_create(&worker->tid, NULL, worker_main, worker) != 0) {
+                perror("FawnDS_Partition: cannot create a dispatch worker");
+                delete worker;
+                stop_workers();
+                return ERROR;
+            }
+            workers_.push_back(worker);
+        }
+
+        DPRINTF(2, "FawnDS_Partition::start_workers(): %zu workers\n", workers_.size());
+        return OK;
+    }
+
+    void
+    FawnDS_Partition::stop_workers()
+    {
+        for (size_t i = 0; i < workers_.size(); i++)
+            workers_[i]->queue.push(NULL);
+        for (size_t i = 0; i < workers_.size(); i++) {
+            pthread_join(workers_[i]->tid, NULL);
+            delete workers_[i];
+        }
+        workers_.clear();
+    }
+
+    FawnDS_Return
+    FawnDS_Partition::dispatch(Request& req) const
+    {
+        // the calling thread executes the request in the shared mode, and the owner of the partition in the per-core mode
+        if (workers_.empty()) {
+            execute(&req);
+            return req.ret;
+        }
+
+        size_t owner;
+        {
+            Epoch::Guard guard;
+            const Routing* routing = current_routing_;
+            if (!routing)
+                return ERROR;
+            owner = routing->owners[get_partition(routing, *req.key)];
+        }
+        return call_owner(owner, req);
+    }
+
+    FawnDS_Return
+    FawnDS_Partition::call_owner(size_t owner, Request& req) const
+    {
+        Completion completion(1);
+        req.completion = &completion;
+
+        workers_[owner]->queue.push(&req);
+        completion.wait();
+
+        return req.ret;
+    }
+
+    FawnDS_Return
+    FawnDS_Partition::call_all_owners(const Routing& routing, RequestOp op, std::vector<FawnDS_Return>& rets)
+    {
+        std::vector<Request> reqs;
+        reqs.reserve(routing.stores.size());
+
+        Completion completion(routing.stores.size());
+        for (size_t p = 0; p < routing.stores.size(); p++) {
+            reqs.push_back(Request(op, routing.stores[p]));
+            reqs.back().completion = &completion;
+        }
+
+        for (size_t p = 0; p < routing.stores.size(); p++)
+            workers_[routing.owners[p]]->queue.push(&reqs[p]);
+        completion.wait();
+
+        FawnDS_Return ret = OK;
+        rets.resize(routing.stores.size());
+        for (size_t p = 0; p < routing.stores.size(); p++) {
+            rets[p] = reqs[p].ret;
+            if (rets[p] != OK && ret == OK)
+                ret = rets[p];
+        }
+        return ret;
+    }
+
+    void*
+    FawnDS_Partition::worker_main(void* arg)
+    {
+        Worker* worker = static_cast<Worker*>(arg);
+
+#ifdef __linux__
+        if (worker->cpu >= 0) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(worker->cpu, &cpuset);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0)
+                DPRINTF(2, "FawnDS_Partition::worker_main(): cannot pin a worker to CPU %ld\n", worker->cpu);
+        }
+#endif
+
+        // drain whatever is queued, execute it, and then signal all completions of the batch at once
+        std::vector<Request*> batch;
+        batch.reserve(dispatch_batch_size);
+        bool stop = false;
+        while (!stop) {
+            Request* req;
+            worker->queue.pop(req);
+            batch.push_back(req);
+            while (batch.size() < dispatch_batch_size && worker->queue.try_pop(req))
+                batch.push_back(req);
+
+            for (size_t i = 0; i < batch.size(); i++) {
+                if (batch[i])
+                    worker->fawnds->execute(batch[i]);
+                else
+                    stop = true;
+            }
+            for (size_t i = 0; i < batch.size(); i++) {
+                // the request may be freed by its caller as soon as its completion is done
+                if (batch[i])
+                    batch[i]->completion->done();
+            }
+            batch.clear();
+        }
+        return NULL;
+    }
+
+    void
+    FawnDS_Partition::execute(Request* req) const
+    {
+        switch (req->op) {
+        case OP_CREATE:
+            req->ret = req->store->Create();
+            return;
+        case OP_OPEN:
+            req->ret = req->store->Open();
+            return;
+        case OP_FLUSH:
+            req->ret = req->store->Flush();
+            return;
+        case OP_CLOSE:
+            req->ret = req->store ? req->store->Close() : OK;
+            return;
+        case OP_MULTI_GET:
+            req->ret = multi_get(*req->keys, *req->outs, *req->rets);
+            return;
+        default:
+            break;
+        }
+
+        // key-value operations look up the current routing table; a request posted before a split completes may thus
+        // reach a store that has been handed to another owner, which is safe because stores accept concurrent operations
+        Epoch::Guard guard;
+        const Routing* routing = current_routing_;
+        if (!routing) {
+            req->ret = ERROR;
+            return;
+        }
+
+        size_t p = get_partition(routing, *req->key);
+        FawnDS* store = routing->stores[p];
+
+        switch (req->op) {
+        case OP_PUT:
+            req->ret = store->Put(*req->key, *req->data);
+            break;
+        case OP_APPEND:
+            req->ret = store->Append(*req->append_key, *req->data);
+            break;
+        case OP_DELETE:
+            req->ret = store->Delete(*req->key);
+            break;
+        case OP_CONTAINS:
+            req->ret = store->Contains(*req->key);
+            return;
+        case OP_LENGTH:
+            req->ret = store->Length(*req->key, *req->length);
+            return;
+        case OP_GET:
+            req->ret = store->Get(*req->key, *req->out, req->offset, req->len);
+            return;
+        default:
+            req->ret = ERROR;
+            return;
+        }
+
+        // a write to a partition being split is applied to its new stores as well
+        Split* split = routing->splits[p];
+        if (split && req->ret == OK) {
+            tbb::queuing_mutex::scoped_lock split_lock(split->mutex);
+            req->ret = sync_split(split, *req->key, true);
+        }
+    }
+
+    TaskScheduler FawnDS_Partition::task_scheduler_split_(1, 100, TaskScheduler::CPU_LOW);
+
     FawnDS_Partition::IteratorElem::IteratorElem(const FawnDS_Partition* fawnds)
     {
         this->fawnds = fawnds;
@@ -318,17 +1400,15 @@ namespace fawn {
     void
     FawnDS_Partition::IteratorElem::Next()
     {
-        const FawnDS_Partition* fawnds_part = static_cast<const FawnDS_Partition*>(fawnds);
-
         if (!store_it.IsEnd())
             ++store_it;
 
         while (store_it.IsEnd()) {
-            if (next_store >= fawnds_part->stores_.size()) {
+            if (next_store >= stores.size()) {
                 state = END;
                 return;
             }
-            store_it = fawnds_part->stores_[next_store++]->Enumerate();
+            store_it = stores[next_store++]->Enumerate();
         }
 
         state = store_it->state;
@@ -3,15 +3,25 @@
 #define _FAWNDS_PARTITION_H_
 
 #include "fawnds.h"
+#include "task.h"
+#include <string>
 #include <vector>
+#include <tbb/atomic.h>
+#include <tbb/queuing_mutex.h>
 
 namespace fawn {
 
     // configuration
     //   <type>: "partition" (fixed)
     //   <id>: the ID of the store
+    //   <file>: the file name prefix to store the routing table; required by SplitPartition()
     //   <skip-bits>: the number of MSBs to ignore when calculating the partition number
-    //   <partitions>: the number of partitions; must be power of 2
+    //   <partitions>: the initial number of partitions; the 32 bits following <skip-bits> are divided into equal ranges (the same layout as the top bits for power of 2)
+    //   <threads>: the number of threads that Create(), Open(), Flush(), Close(), and EnumerateBatchParallel() use to work on partitions concurrently.  1 for serial operation (default).
+    //   <dispatch>: "shared" (default): the calling thread accesses partitions directly.
+    //               "per-core": each partition is owned by a worker thread pinned to a core; key-value operations and Create(), Open(), Flush(), Close() are handed to the owner through its queue.
+    //   <dispatch-threads>: the number of worker threads in the per-core mode; worker i runs on core i modulo the number of online cores.  The number of online cores is the default.
+    //                       partition i is initially owned by worker (i % <dispatch-threads>); a split leaves the lower half with the owner and gives the upper half to the worker owning the fewest partitions.
     //   <store>: the configuration for the lower-level store
     //            <id>: will be assigned by FawnDS_Partition
 
@@ -38,13 +48,33 @@ namespace fawn {
         virtual FawnDS_Return Contains(const ConstValue& key) const;
         virtual FawnDS_Return Length(const ConstValue& key, size_t& len) const;
         virtual FawnDS_Return Get(const ConstValue& key, Value& data, size_t offset = 0, size_t len = -1) const;
+        virtual FawnDS_Return MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const;
 
         virtual FawnDS_ConstIterator Enumerate() const;
         virtual FawnDS_Iterator Enumerate();
+        virtual FawnDS_Return EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size = 1024) const;
+
+        // splittable scans; each partition can be enumerated by a different thread
+        // partition numbers shift when SplitPartition() completes
+        size_t NumPartitions() const;
+        FawnDS_ConstIterator EnumeratePartition(size_t partition) const;
+        FawnDS_Return EnumeratePartitionBatch(size_t partition, FawnDS_BatchCallback& callback, size_t batch_size = 1024) const;
+
+        // scans and Find() access partitions from the calling thread even in the per-core dispatch mode
+
+        // same as EnumerateBatch(), but hands partitions to <threads> threads
+        // the callback must be thread-safe: it is called concurrently, with each batch from a single partition
+        FawnDS_Return EnumerateBatchParallel(FawnDS_BatchCallback& callback, size_t batch_size = 1024) const;
 
         virtual FawnDS_ConstIterator Find(const ConstValue& key) const;
         virtual FawnDS_Iterator Find(const ConstValue& key);
 
+        // splits the key range of a partition into two halves in the background
+        // the partition stays online: it serves all reads and its writes are applied to the new stores as well until the routing table switches to them
+        // the keys of the source store are snapshotted and copied a batch at a time; no lock on the source is held between batches
+        // Flush() and Close() wait for pending splits
+        FawnDS_Return SplitPartition(size_t partition);
+
         struct IteratorElem : public FawnDS_IteratorElem {
             IteratorElem(const FawnDS_Partition* fawnds);
             ~IteratorElem();
@@ -52,21 +82,98 @@ namespace fawn {
             FawnDS_IteratorElem* Clone() const;
             void Next();
 
+            std::vector<FawnDS*> stores;    // stores at the creation time; kept alive by retiring split stores until Close()
             size_t next_store;
             FawnDS_Iterator store_it;
         };
 
+    protected:
+        struct Split;
+
+        class SplitTask : public Task {
+        public:
+            virtual void Run();
+            FawnDS_Partition* fawnds;
+            Split* split;
+        };
+
     private:
-        FawnDS_Return alloc_stores();
-        size_t get_partition(const ConstValue& key) const;
+        // the routing table: partition i covers key prefixes [bounds[i], bounds[i + 1]) and is stored in store number store_numbers[i]
+        // a published table is never modified; operations read it inside an Epoch critical section
+        struct Routing {
+            std::vector<FawnDS*> stores;
+            std::vector<uint32_t> bounds;
+            std::vector<size_t> store_numbers;
+            std::vector<size_t> owners;     // the worker owning each partition in the per-core mode
+            std::vector<Split*> splits;     // the split in progress of each partition, or NULL
+        };
+
+        FawnDS_Return alloc_stores(bool open);
+        FawnDS* new_store(size_t number) const;
+        uint32_t get_prefix(const ConstValue& key) const;
+        size_t get_partition(const Routing* routing, const ConstValue& key) const;
+        void publish_routing(Routing* routing);
+
+        std::string routing_filename() const;
+        FawnDS_Return write_routing(const Routing* routing) const;
+        FawnDS_Return read_routing(std::vector<uint32_t>& bounds, std::vector<size_t>& store_numbers, size_t& next_store_number) const;
+
+        FawnDS_Return sync_split(Split* split, const ConstValue& key, bool overwrite) const;
+        void wait_for_splits() const;
+
+        bool copy_stores(std::vector<FawnDS*>& stores) const;
+        const FawnDS* partition_store(size_t partition) const;
+        FawnDS_Return multi_get(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const;
+
+        enum RequestOp {
+            OP_CREATE,
+            OP_OPEN,
+            OP_FLUSH,
+            OP_CLOSE,
+            OP_PUT,
+            OP_APPEND,
+            OP_DELETE,
+            OP_CONTAINS,
+            OP_LENGTH,
+            OP_GET,
+            OP_MULTI_GET
+        };
+
+        struct Request;
+        struct Completion;
+        struct Worker;
+
+        size_t num_workers(size_t num_partitions) const;
+        FawnDS_Return start_workers(size_t num);
+        void stop_workers();
+        FawnDS_Return dispatch(Request& req) const;
+        FawnDS_Return call_owner(size_t owner, Request& req) const;
+        FawnDS_Return call_all_owners(const Routing& routing, RequestOp op, std::vector<FawnDS_Return>& rets);
+
+        static void* worker_main(void* arg);
+        void execute(Request* req) const;
 
         size_t skip_bits_;
         size_t partitions_;
-        size_t partition_bits_;
 
-        std::vector<FawnDS*> stores_;
+        size_t threads_;
+
+        bool per_core_;
+        size_t dispatch_threads_;
+        std::vector<Worker*> workers_;
+
+        tbb::atomic<Routing*> current_routing_;                             // written with routing_mutex_ held
+        tbb::queuing_mutex routing_mutex_;                                  // serializes routing table updates
+        std::vector<std::pair<uint64_t, Routing*> > retired_routings_;      // old tables and their epochs; protected by routing_mutex_
+        size_t next_store_number_;                                          // protected by routing_mutex_
+
+        tbb::atomic<size_t> num_splits_;            // splits registered and not yet finished
+        std::vector<FawnDS*> retired_stores_;       // split source stores; protected by routing_mutex_
 
         friend class IteratorElem;
+        friend class SplitTask;
+
+        static TaskScheduler task_scheduler_split_;
     };
 
 } // namespace fawn
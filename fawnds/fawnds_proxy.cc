@@ -141,6 +141,12 @@ namespace fawn {
         return store_->Get(key, data, offset, len);
     }
 
+    FawnDS_Return
+    FawnDS_Proxy::MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const
+    {
+        return store_->MultiGet(keys, out, rets);
+    }
+
     FawnDS_ConstIterator
     FawnDS_Proxy::Enumerate() const
     {
@@ -153,6 +159,12 @@ namespace fawn {
         return store_->Enumerate();
     }
 
+    FawnDS_Return
+    FawnDS_Proxy::EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size) const
+    {
+        return store_->EnumerateBatch(callback, batch_size);
+    }
+
     FawnDS_ConstIterator
     FawnDS_Proxy::Find(const ConstValue& key) const
     {
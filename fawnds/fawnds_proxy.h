@@ -35,9 +35,11 @@ namespace fawn {
         virtual FawnDS_Return Contains(const ConstValue& key) const;
         virtual FawnDS_Return Length(const ConstValue& key, size_t& len) const;
         virtual FawnDS_Return Get(const ConstValue& key, Value& data, size_t offset = 0, size_t len = -1) const;
+        virtual FawnDS_Return MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const;
 
         virtual FawnDS_ConstIterator Enumerate() const;
         virtual FawnDS_Iterator Enumerate();
+        virtual FawnDS_Return EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size = 1024) const;
 
         virtual FawnDS_ConstIterator Find(const ConstValue& key) const;
         virtual FawnDS_Iterator Find(const ConstValue& key);
@@ -8,6 +8,7 @@
 #include "global_limits.h"
 #include <algorithm>
 #include <map>
+#include <memory>
 
 #include <cerrno>
 #include <cassert>
@@ -44,9 +45,10 @@ namespace fawn {
 /***************************************************/
 
 FawnDS_SF::FawnDS_SF()
-    : header_(NULL), hash_table_(NULL), data_store_(NULL)
+    : header_(NULL), hash_table_(NULL), data_store_(NULL), log_end_(0), concurrent_(false)
 {
     pthread_rwlock_init(&fawnds_lock_, NULL);
+    pthread_mutex_init(&insert_lock_, NULL);
 }
 
 FawnDS_SF::~FawnDS_SF()
@@ -54,6 +56,7 @@ FawnDS_SF::~FawnDS_SF()
     if (header_)
         Close();
     pthread_rwlock_destroy(&fawnds_lock_);
+    pthread_mutex_destroy(&insert_lock_);
 }
 
 FawnDS_Return
@@ -87,6 +90,8 @@ FawnDS_SF::Create()
 
     DPRINTF(2, "FawnDS_SF::Create(): creating hash table\n");
 
+    concurrent_ = ConcurrentHashTable();
+
     Configuration* tableConfig = new Configuration(config_, true);
     tableConfig->SetContextNode("child::hashtable");
     tableConfig->SetStringValue("child::id", config_->GetStringValue("child::id"));
@@ -121,6 +126,7 @@ FawnDS_SF::Create()
 
     if (data_store_->Create() != OK)
         return ERROR;
+    log_end_ = 0;
 
     DPRINTF(2, "FawnDS_SF::Create(): <result> done\n");
 
@@ -150,6 +156,8 @@ FawnDS_SF::Open()
 
     DPRINTF(2, "FawnDS_SF::Open(): opening hash table\n");
 
+    concurrent_ = ConcurrentHashTable();
+
     Configuration* tableConfig = new Configuration(config_, true);
     tableConfig->SetContextNode("child::hashtable");
     tableConfig->SetStringValue("child::id", config_->GetStringValue("child::id"));
@@ -166,47 +174,209 @@ FawnDS_SF::Open()
     Configuration* storeConfig = new Configuration(config_, true);
     storeConfig->SetContextNode("child::datastore");
     storeConfig->SetStringValue("child::id", config_->GetStringValue("child::id"));
-    if (key_len_ != 0 && data_len_ != 0) {
+    // the same entry length as Create()
+    if (key_len_ == 0 || data_len_ == 0) {
+        storeConfig->SetStringValue("child::data-len", "0");
+    }
+    else {
         char buf[1024];
-        snprintf(buf, sizeof(buf), "%zu", key_len_ + data_len_);
+        snprintf(buf, sizeof(buf), "%zu", sizeof(DataHeaderSimple) + key_len_ + data_len_);
         storeConfig->SetStringValue("child::data-len", buf);
     }
     data_store_ = FawnDS_Factory::New(storeConfig);
 
     if (data_store_->Open() != OK)
         return ERROR;
+    // found by LogEnd() when needed
+    log_end_ = static_cast<size_t>(-1);
 
     DPRINTF(2, "FawnDS_SF::Open(): <result> done\n");
 
     return OK;
 }
 
+// collects the values of a hash table in enumeration order
+class HashValueCollector : public FawnDS_BatchCallback {
+public:
+    explicit HashValueCollector(std::vector<uint32_t>& vals)
+        : vals_(vals)
+    {
+    }
+
+    bool Process(const FawnDS_Batch& batch)
+    {
+        for (size_t i = 0; i < batch.size; i++)
+            vals_.push_back(ConstRefValue(batch.data[i].data, batch.data[i].size).as_number<uint32_t>());
+        GlobalLimits::instance().remove_convert_tokens(batch.size);
+        return true;
+    }
+
+private:
+    std::vector<uint32_t>& vals_;
+};
+
+// turns batches of data store entries into key-value pairs, skipping unused entries
+class FawnDS_SF::BatchParser : public FawnDS_BatchCallback {
+public:
+    BatchParser(FawnDS_BatchCallback& callback, size_t key_len)
+        : error(false), callback_(callback), key_len_(key_len)
+    {
+    }
+
+    bool Process(const FawnDS_Batch& batch)
+    {
+        keys_.resize(batch.size);
+        data_.resize(batch.size);
+        states_.resize(batch.size);
+
+        size_t n = 0;
+        for (size_t i = 0; i < batch.size; i++) {
+            const char* entry = batch.data[i].data;
+
+            size_t dhSize;
+            size_t key_len;
+            uint8_t type;
+            if (key_len_ == 0) {
+                dhSize = sizeof(DataHeaderFull);
+                key_len = reinterpret_cast<const DataHeaderFull*>(entry)->key_len;
+                type = reinterpret_cast<const DataHeaderFull*>(entry)->type;
+            }
+            else {
+                dhSize = sizeof(DataHeaderSimple);
+                key_len = key_len_;
+                type = reinterpret_cast<const DataHeaderSimple*>(entry)->type;
+            }
+
+            if (type == 0) {
+                // skip unused space
+                continue;
+            }
+            else if (type == 1)
+                states_[n] = OK;
+            else if (type == 2)
+                states_[n] = KEY_DELETED;
+            else {
+                // corrupted data?
+                assert(false);
+                error = true;
+                return false;
+            }
+
+            keys_[n].data = entry + dhSize;
+            keys_[n].size = key_len;
+            data_[n].data = entry + dhSize + key_len;
+            data_[n].size = batch.data[i].size - dhSize - key_len;
+            n++;
+        }
+
+        if (n == 0)
+            return true;
+        FawnDS_Batch parsed = { n, &keys_[0], &data_[0], &states_[0] };
+        return callback_.Process(parsed);
+    }
+
+    bool error;
+
+private:
+    FawnDS_BatchCallback& callback_;
+    size_t key_len_;
+    std::vector<FawnDS_Span> keys_;
+    std::vector<FawnDS_Span> data_;
+    std::vector<FawnDS_Return> states_;
+};
+
+// copies the data store entries of the old store to their new locations in key order
+class FawnDS_SF::DataStoreRelocator : public FawnDS_BatchCallback {
+public:
+    DataStoreRelocator(const std::vector<std::pair<uint32_t, uint32_t> >& mapping, FawnDS_SF* sf, FawnDS_BatchCallback* entry_callback)
+        : error(false), mapping_(mapping), it_(mapping.begin()), sf_(sf), entry_callback_(entry_callback)
+    {
+    }
+
+    bool Process(const FawnDS_Batch& batch)
+    {
+        relocated_.clear();
+        for (size_t i = 0; i < batch.size && it_ != mapping_.end(); i++) {
+            uint32_t from = ConstRefValue(batch.keys[i].data, batch.keys[i].size).as_number<uint32_t>();
+            if (from < (*it_).first)
+                continue;
+            if (from > (*it_).first) {
+                // the data store misses a mapped entry
+                assert(false);
+                error = true;
+                return false;
+            }
+
+            uint32_t to = (*it_).second;
+            FawnDS_Return ret = sf_->data_store_->Put(RefValue(&to), ConstRefValue(batch.data[i].data, batch.data[i].size));
+            if (ret != OK) {
+                error = true;
+                return false;
+            }
+            if (sf_->header_->num_elements < to + 1)
+                sf_->header_->num_elements = to + 1;
+            sf_->header_->num_active_elements++;
+            ++it_;
+
+            if (entry_callback_)
+                relocated_.push_back(batch.data[i]);
+        }
+
+        if (!relocated_.empty()) {
+            // only live entries are relocated; older versions of the same key are left behind
+            FawnDS_Batch relocated = { relocated_.size(), &relocated_[0], &relocated_[0], NULL };
+            if (!entry_callback_->Process(relocated)) {
+                error = true;
+                return false;
+            }
+        }
+        return it_ != mapping_.end();
+    }
+
+    bool done() const { return it_ == mapping_.end(); }
+
+    bool error;
+
+private:
+    const std::vector<std::pair<uint32_t, uint32_t> >& mapping_;
+    std::vector<std::pair<uint32_t, uint32_t> >::const_iterator it_;
+    FawnDS_SF* sf_;
+    FawnDS_BatchCallback* entry_callback_;
+    std::vector<FawnDS_Span> relocated_;
+};
+
 FawnDS_Return
 FawnDS_SF::ConvertTo(FawnDS* new_store) const
 {
-    pthread_rwlock_rdlock(&fawnds_lock_);
+    return ConvertTo(new_store, NULL);
+}
+
+FawnDS_Return
+FawnDS_SF::ConvertTo(FawnDS* new_store, FawnDS_BatchCallback* entry_callback) const
+{
+    LockForScan();
 
     FawnDS_SF* sf = dynamic_cast<FawnDS_SF*>(new_store);
     if (!sf) {
-        pthread_rwlock_unlock(&fawnds_lock_);
+        UnlockForScan();
         return ERROR;
     }
 
     if (key_len_ != sf->key_len_) {
         fprintf(stderr, "FawnDS_SF::ConvertTo(): key length mismatch\n");
-        pthread_rwlock_unlock(&fawnds_lock_);
+        UnlockForScan();
         return ERROR;
     }
 
     if (data_len_ != sf->data_len_) {
         fprintf(stderr, "FawnDS_SF::ConvertTo(): data length mismatch\n");
-        pthread_rwlock_unlock(&fawnds_lock_);
+        UnlockForScan();
         return ERROR;
     }
 
     if (hash_table_->ConvertTo(sf->hash_table_) != OK) {
         fprintf(stderr, "FawnDS_SF::ConvertTo(): could not convert hash table\n");
-        pthread_rwlock_unlock(&fawnds_lock_);
+        UnlockForScan();
         return ERROR;
     }
 
@@ -216,73 +386,67 @@ FawnDS_SF::ConvertTo(FawnDS* new_store) const
         atoi(sf->config_->GetStringValue("child::keep-datastore-on-conversion").c_str()) != 0) {
         if (data_store_->ConvertTo(sf->data_store_) != OK) {
             fprintf(stderr, "FawnDS_SF::ConvertTo(): could not convert data store\n");
-            pthread_rwlock_unlock(&fawnds_lock_);
+            UnlockForScan();
             return ERROR;
         }
 
         sf->header_->num_elements = header_->num_elements;
         sf->header_->num_active_elements = header_->num_active_elements;
 
-        pthread_rwlock_unlock(&fawnds_lock_);
-        return OK;
+        FawnDS_Return ret = OK;
+        if (entry_callback) {
+            // the data is not moved, so the entries are read once for the callback; this includes older versions of keys
+            BatchParser parser(*entry_callback, key_len_);
+            ret = data_store_->EnumerateBatch(parser);
+            if (parser.error)
+                ret = ERROR;
+        }
+
+        UnlockForScan();
+        return ret;
     }
 
     // side-by-side hash table comparison for data reorganization on data store
 
-    FawnDS_Iterator from_it = hash_table_->Enumerate();
-    FawnDS_Iterator to_it = sf->hash_table_->Enumerate();
+    std::vector<uint32_t> from_vals;
+    std::vector<uint32_t> to_vals;
+    HashValueCollector from_collector(from_vals);
+    HashValueCollector to_collector(to_vals);
+    if (hash_table_->EnumerateBatch(from_collector) != OK ||
+        sf->hash_table_->EnumerateBatch(to_collector) != OK) {
+        UnlockForScan();
+        return ERROR;
+    }
+
+    if (from_vals.size() != to_vals.size()) {
+        // hash table conversion should have failed
+        assert(false);
+        UnlockForScan();
+        return ERROR;
+    }
 
     std::vector<std::pair<uint32_t, uint32_t> > mapping;
     //std::vector<std::pair<uint32_t, uint32_t> > rev_mapping;
-
-    while (true) {
-        if (!from_it.IsEnd() && !to_it.IsEnd()) {
-            uint32_t from = from_it->data.as_number<uint32_t>();
-            uint32_t to = to_it->data.as_number<uint32_t>();
-            //fprintf(stderr, "FawnDS_SF::ConvertTo(): mapping %zu => %zu\n", static_cast<size_t>(from), static_cast<size_t>(to));
-            mapping.push_back(std::make_pair(from, to));
-            //rev_mapping.push_back(std::make_pair(to, from));
-        }
-        else if (from_it.IsEnd() && to_it.IsEnd())
-            break;
-        else {
-            // hash table conversion should have failed
-            assert(false);
-            pthread_rwlock_unlock(&fawnds_lock_);
-            return ERROR;
-        }
-        GlobalLimits::instance().remove_convert_tokens(1);
-        ++from_it;
-        GlobalLimits::instance().remove_convert_tokens(1);
-        ++to_it;
+    mapping.reserve(from_vals.size());
+    for (size_t i = 0; i < from_vals.size(); i++) {
+        //fprintf(stderr, "FawnDS_SF::ConvertTo(): mapping %zu => %zu\n", static_cast<size_t>(from_vals[i]), static_cast<size_t>(to_vals[i]));
+        mapping.push_back(std::make_pair(from_vals[i], to_vals[i]));
+        //rev_mapping.push_back(std::make_pair(to_vals[i], from_vals[i]));
     }
     std::sort(mapping.begin(), mapping.end());
     //std::sort(rev_mapping.begin(), rev_mapping.end());
 
     // sequential read, random write (hoping OS adds writeback caching)
-    std::vector<std::pair<uint32_t, uint32_t> >::const_iterator it;
-    Value data;
-
     sf->header_->num_elements = 0;
     sf->header_->num_active_elements = 0;
 
-    FawnDS_ConstIterator it_from = data_store_->Enumerate();
-    for (it = mapping.begin(); it != mapping.end(); ++it) {
-        uint32_t from = (*it).first;
-        uint32_t to = (*it).second;
-
-        while (!it_from.IsEnd() && it_from->key.as_number<uint32_t>() < from)
-            ++it_from;
-        assert(!it_from.IsEnd() && it_from->key.as_number<uint32_t>() == from);
-
-        FawnDS_Return ret = sf->data_store_->Put(RefValue(&to), it_from->data);
-        if (ret != OK) {
-            pthread_rwlock_unlock(&fawnds_lock_);
-            return ERROR;
-        }
-        if (sf->header_->num_elements < to + 1)
-            sf->header_->num_elements = to + 1;
-        sf->header_->num_active_elements++;
+    std::auto_ptr<BatchParser> parser;
+    if (entry_callback)
+        parser.reset(new BatchParser(*entry_callback, key_len_));
+    DataStoreRelocator relocator(mapping, sf, parser.get());
+    if (data_store_->EnumerateBatch(relocator) != OK || relocator.error || (parser.get() && parser->error) || !relocator.done()) {
+        UnlockForScan();
+        return ERROR;
     }
 
     /*
@@ -324,7 +488,7 @@ FawnDS_SF::ConvertTo(FawnDS* new_store) const
         else
             assert(false);
         if (ret != OK) {
-            pthread_rwlock_unlock(&fawnds_lock_);
+            UnlockForScan();
             return ERROR;
         }
     }
@@ -347,7 +511,7 @@ FawnDS_SF::ConvertTo(FawnDS* new_store) const
         while (++last_to != to) {
             FawnDS_Return ret = sf->data_store_->Put(RefValue(&last_to), data);
             if (ret != OK) {
-                pthread_rwlock_unlock(&fawnds_lock_);
+                UnlockForScan();
                 return ERROR;
             }
         }
@@ -358,10 +522,10 @@ FawnDS_SF::ConvertTo(FawnDS* new_store) const
 
     FawnDS_Return ret = sf->data_store_->Flush();
     if (ret != OK) {
-        pthread_rwlock_unlock(&fawnds_lock_);
+        UnlockForScan();
         return ERROR;
     }
-    pthread_rwlock_unlock(&fawnds_lock_);
+    UnlockForScan();
     return OK;
 }
 
@@ -516,16 +680,75 @@ FawnDS_SF::Delete(const ConstValue& key)
     if (key_len_ != 0 && key_len_ != key.size())
         return INVALID_KEY;
 
+    // a data store of fixed-length entries needs a full-length deletion marker
     Value empty_v;
+    if (data_len_ != 0) {
+        empty_v.resize(data_len_, false);
+        memset(empty_v.data(), 0, data_len_);
+    }
     return InsertEntry(key, empty_v, true);
 }
 
+bool
+FawnDS_SF::ConcurrentHashTable() const
+{
+    if (config_->ExistsNode("child::hashtable/child::concurrent") != 0 ||
+        atoi(config_->GetStringValue("child::hashtable/child::concurrent").c_str()) == 0)
+        return false;
+
+    // only the cuckoo hash table keeps lookups consistent while another thread inserts
+    if (config_->GetStringValue("child::hashtable/child::type") != "cuckoo") {
+        fprintf(stderr, "FawnDS_SF: <concurrent> is supported only by the cuckoo hash table; ignored\n");
+        return false;
+    }
+    return true;
+}
+
+void
+FawnDS_SF::LockForInsert()
+{
+    if (concurrent_) {
+        // the hash table keeps lookups consistent during an insert; only other inserts and
+        // scans (which also take insert_lock_) need to be excluded
+        pthread_rwlock_rdlock(&fawnds_lock_);
+        pthread_mutex_lock(&insert_lock_);
+    }
+    else
+        pthread_rwlock_wrlock(&fawnds_lock_);
+}
+
+void
+FawnDS_SF::UnlockForInsert()
+{
+    if (concurrent_)
+        pthread_mutex_unlock(&insert_lock_);
+    pthread_rwlock_unlock(&fawnds_lock_);
+}
+
+void
+FawnDS_SF::LockForScan() const
+{
+    // scans read the data store and the whole hash table, so they must not overlap an insert
+    // (an append or a cuckoo displacement); lookups may still proceed
+    pthread_rwlock_rdlock(&fawnds_lock_);
+    if (concurrent_)
+        pthread_mutex_lock(&insert_lock_);
+}
+
+void
+FawnDS_SF::UnlockForScan() const
+{
+    if (concurrent_)
+        pthread_mutex_unlock(&insert_lock_);
+    pthread_rwlock_unlock(&fawnds_lock_);
+}
+
 FawnDS_Return
 FawnDS_SF::InsertEntry(const ConstValue& key, const ConstValue& data, bool isDelete)
 {
-    assert(!isDelete || (isDelete && data.size() == 0));
+    assert(!isDelete || (isDelete && data.size() == data_len_));
 
-    pthread_rwlock_wrlock(&fawnds_lock_);
+    LockForInsert();
 
     bool newObj = true;
 
@@ -598,12 +821,17 @@ FawnDS_SF::InsertEntry(const ConstValue& key, const ConstValue& data, bool isDel
     FawnDS_Return ret_append = data_store_->Append(entry_id, buf);
     if (ret_append != OK) {
         DPRINTF(2, "FawnDS_SF::InsertEntry(): <result> failed to write entry\n");
-        pthread_rwlock_unlock(&fawnds_lock_);
+        UnlockForInsert();
         return ret_append;
     }
 
     DPRINTF(2, "FawnDS_SF::InsertEntry(): inserted entry ID=%llu\n", entry_id.as_number<long long unsigned>());
 
+    // count every entry in the log, even one that the hash table fails to index below, so that
+    // the first NUM_DATA entries of the log are exactly the entries written so far
+    header_->num_elements++;
+    log_end_ = entry_id.as_number<size_t>() + 1;
+
     // update the hashtable (since the data was successfully written).
     assert(entry_id.as_number<size_t>(-1) != static_cast<size_t>(-1));
 
@@ -611,7 +839,7 @@ FawnDS_SF::InsertEntry(const ConstValue& key, const ConstValue& data, bool isDel
         FawnDS_Return ret_put = hash_table_->Put(key, entry_id);
         if (ret_put != OK) {
             DPRINTF(2, "FawnDS_SF::InsertEntry(): <result> failed to add to hashtable\n");
-            pthread_rwlock_unlock(&fawnds_lock_);
+            UnlockForInsert();
             // TODO: at this point, the log contains data but the hash table doesn't.
             //       will this make inconsistency (with/without index reloading)
             //       i.e. merging process will consistently lose one entry.
@@ -622,7 +850,7 @@ FawnDS_SF::InsertEntry(const ConstValue& key, const ConstValue& data, bool isDel
         FawnDS_Return ret_replace = hash_it->Replace(entry_id);
         if (ret_replace != OK) {
             DPRINTF(2, "FawnDS_SF::InsertEntry(): <result> failed to update hashtable\n");
-            pthread_rwlock_unlock(&fawnds_lock_);
+            UnlockForInsert();
             // TODO: this must be rare case (maybe a bug), but this also has potential inconsistency issues
             return ret_replace;
         }
@@ -641,11 +869,10 @@ FawnDS_SF::InsertEntry(const ConstValue& key, const ConstValue& data, bool isDel
         }
         */
     }
-    header_->num_elements++;
 
     DPRINTF(2, "FawnDS_SF::InsertEntry(): <result> updated hashtable\n");
 
-    pthread_rwlock_unlock(&fawnds_lock_);
+    UnlockForInsert();
 
     if (!isDelete)
         return OK;
@@ -686,22 +913,27 @@ FawnDS_SF::Length(const ConstValue& key, size_t& len) const
     }
 #endif
 
+    len = 0;
+
     if (key.size() == 0)
         return INVALID_KEY;
 
     if (key_len_ != 0 && key_len_ != key.size())
         return INVALID_KEY;
 
-    // TODO: implement this in a better way
-    SizedValue<4096> data;
-    FawnDS_Return ret_get = Get(key, data);
+    pthread_rwlock_rdlock(&fawnds_lock_);
+
+    // only reads the header and the key of the entry, not the data
+    Value data_store_key;
+    FawnDS_Return ret_find = FindEntry(key, data_store_key, len);
+
+    pthread_rwlock_unlock(&fawnds_lock_);
 
-    len = data.size();
 #ifdef DEBUG
     if (debug_level & 2)
         DPRINTF(2, "FawnDS_SF::Length(): <result> len=%zu\n", len);
 #endif
-    return ret_get;
+    return ret_find;
 }
 
 FawnDS_Return
@@ -722,7 +954,89 @@ FawnDS_SF::Get(const ConstValue& key, Value& data, size_t offset, size_t len) co
 
     pthread_rwlock_rdlock(&fawnds_lock_);
 
-    bool newObj = true;
+    Value data_store_key;
+    size_t data_len;
+    FawnDS_Return ret_find = FindEntry(key, data_store_key, data_len);
+    if (ret_find != OK) {
+        pthread_rwlock_unlock(&fawnds_lock_);
+        return ret_find;
+    }
+
+    if (offset > data_len) {
+        pthread_rwlock_unlock(&fawnds_lock_);
+        data.resize(0);
+        return OK;
+    }
+
+    if (offset + len > data_len)
+        len = data_len - offset;
+
+    size_t dhSize;
+    if (key_len_ == 0)
+        dhSize = sizeof(DataHeaderFull);
+    else
+        dhSize = sizeof(DataHeaderSimple);
+
+    FawnDS_Return ret_data = data_store_->Get(data_store_key, data, dhSize + key.size() + offset, len);
+
+#ifdef DEBUG
+    if (debug_level & 2) {
+        DPRINTF(2, "FawnDS_SF::Get(): <result> data=\n");
+        print_payload((const u_char*)data.data(), data.size(), 4);
+    }
+#endif
+
+    pthread_rwlock_unlock(&fawnds_lock_);
+    return ret_data;
+}
+
+size_t
+FawnDS_SF::LogEnd() const
+{
+    LockForScan();
+    size_t end = log_end_;
+    UnlockForScan();
+    if (end != static_cast<size_t>(-1))
+        return end;
+
+    // nothing was written since Open(); the end of the log follows its last entry
+    pthread_rwlock_wrlock(&fawnds_lock_);
+    if (log_end_ == static_cast<size_t>(-1)) {
+        size_t last_end = 0;
+        for (FawnDS_ConstIterator it = static_cast<const FawnDS*>(data_store_)->Enumerate(); !it.IsEnd(); ++it)
+            last_end = it->key.as_number<size_t>() + 1;
+        log_end_ = last_end;
+    }
+    end = log_end_;
+    pthread_rwlock_unlock(&fawnds_lock_);
+    return end;
+}
+
+FawnDS_Return
+FawnDS_SF::FindBefore(const ConstValue& key, size_t end) const
+{
+    if (key.size() == 0)
+        return INVALID_KEY;
+
+    if (key_len_ != 0 && key_len_ != key.size())
+        return INVALID_KEY;
+
+    pthread_rwlock_rdlock(&fawnds_lock_);
+
+    Value data_store_key;
+    size_t data_len;
+    FawnDS_Return ret_find = FindEntry(key, data_store_key, data_len);
+    if ((ret_find == OK || ret_find == KEY_DELETED) && data_store_key.as_number<size_t>() >= end)
+        ret_find = END;
+
+    pthread_rwlock_unlock(&fawnds_lock_);
+    return ret_find;
+}
+
+FawnDS_Return
+FawnDS_SF::FindEntry(const ConstValue& key, Value& data_store_key, size_t& data_len) const
+{
+    // must be called with fawnds_lock_ held
 
     FawnDS_Iterator hash_it = hash_table_->Find(key);
     size_t dhSize;
@@ -733,7 +1047,7 @@ FawnDS_SF::Get(const ConstValue& key, Value& data, size_t offset, size_t len) co
 
     // Look for an existing entry in the hashtable
     // TODO: this code seems to almost redundant to InsertEntry(); any way to simplify?
-    Value data_store_key;
+    bool newObj = true;
     SizedValue<64> read_hdr;
     while (!hash_it.IsEnd()) {
         data_store_key = hash_it->data;
@@ -762,16 +1076,13 @@ FawnDS_SF::Get(const ConstValue& key, Value& data, size_t offset, size_t len) co
 
     if (newObj) {
         DPRINTF(2, "FawnDS_SF::Get(): <result> cannot find key\n");
-        pthread_rwlock_unlock(&fawnds_lock_);
         return KEY_NOT_FOUND;
     }
 
     size_t total_len = 0;
     FawnDS_Return ret_len = data_store_->Length(data_store_key, total_len);
-    if (ret_len != OK) {
-        pthread_rwlock_unlock(&fawnds_lock_);
+    if (ret_len != OK)
         return ret_len;
-    }
 
     uint8_t type;
     if (key_len_ == 0)
@@ -786,40 +1097,111 @@ FawnDS_SF::Get(const ConstValue& key, Value& data, size_t offset, size_t len) co
     }
     else if (type == 2) {
         DPRINTF(2, "FawnDS_SF::Get(): <result> deleted key\n");
-        pthread_rwlock_unlock(&fawnds_lock_);
         return KEY_DELETED;
     }
 
-    size_t data_len = total_len - dhSize - key.size();
+    data_len = total_len - dhSize - key.size();
+    return OK;
+}
 
-    if (offset > data_len) {
-        pthread_rwlock_unlock(&fawnds_lock_);
-        data.resize(0);
-        return OK;
+FawnDS_Return
+FawnDS_SF::MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const
+{
+    out.resize(keys.size());
+    rets.assign(keys.size(), KEY_NOT_FOUND);
+
+    size_t dhSize;
+    if (key_len_ == 0)
+        dhSize = sizeof(DataHeaderFull);
+    else
+        dhSize = sizeof(DataHeaderSimple);
+
+    pthread_rwlock_rdlock(&fawnds_lock_);
+
+    // probe the in-memory hash table for the whole batch before touching the data store
+    std::vector<ConstValue> probe_keys;
+    std::vector<size_t> probe_indices;
+    probe_keys.reserve(keys.size());
+    probe_indices.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i].size() == 0 || (key_len_ != 0 && key_len_ != keys[i].size())) {
+            rets[i] = INVALID_KEY;
+            continue;
+        }
+        probe_keys.push_back(keys[i]);
+        probe_indices.push_back(i);
     }
 
-    if (offset + len > data_len)
-        len = data_len - offset;
+    std::vector<FawnDS_ConstIterator> probe_its;
+    hash_table_->MultiFind(probe_keys, probe_its);
 
-    FawnDS_Return ret_data = data_store_->Get(data_store_key, data, dhSize + key.size() + offset, len);
+    // invalid keys keep an empty iterator, which IsEnd()
+    std::vector<FawnDS_ConstIterator> hash_its(keys.size());
+    for (size_t j = 0; j < probe_indices.size(); j++)
+        std::swap(hash_its[probe_indices[j]].elem, probe_its[j].elem);
 
-#ifdef DEBUG
-    if (debug_level & 2) {
-        DPRINTF(2, "FawnDS_SF::Get(): <result> data=\n");
-        print_payload((const u_char*)data.data(), data.size(), 4);
+    // read the whole entry of the next candidate for every unresolved key in one batch;
+    // only keys with a tag collision need another round
+    std::vector<ConstValue> data_store_keys;
+    std::vector<size_t> indices;
+    std::vector<Value> entries;
+    std::vector<FawnDS_Return> data_store_rets;
+    while (true) {
+        data_store_keys.clear();
+        indices.clear();
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (rets[i] == KEY_NOT_FOUND && !hash_its[i].IsEnd()) {
+                data_store_keys.push_back(hash_its[i]->data);
+                indices.push_back(i);
+            }
+        }
+        if (indices.size() == 0)
+            break;
+
+        data_store_->MultiGet(data_store_keys, entries, data_store_rets);
+
+        for (size_t j = 0; j < indices.size(); j++) {
+            size_t i = indices[j];
+            const Value& entry = entries[j];
+
+            if (data_store_rets[j] != OK ||
+                entry.size() < dhSize + keys[i].size() ||
+                (key_len_ == 0 && entry.as<DataHeaderFull>().key_len != keys[i].size()) ||
+                memcmp(entry.data() + dhSize, keys[i].data(), keys[i].size()) != 0) {
+                DPRINTF(2, "FawnDS_SF::MultiGet(): key mismatch; continue\n");
+                ++hash_its[i];
+                continue;
+            }
+
+            uint8_t type;
+            if (key_len_ == 0)
+                type = entry.as<DataHeaderFull>().type;
+            else
+                type = entry.as<DataHeaderSimple>().type;
+
+            if (type == 2) {
+                rets[i] = KEY_DELETED;
+                continue;
+            }
+            assert(type == 1);
+
+            out[i] = NewValue(entry.data() + dhSize + keys[i].size(), entry.size() - dhSize - keys[i].size());
+            rets[i] = OK;
+        }
     }
-#endif
 
     pthread_rwlock_unlock(&fawnds_lock_);
-    return ret_data;
+    return OK;
 }
 
 FawnDS_ConstIterator
 FawnDS_SF::Enumerate() const
 {
     IteratorElem* elem = new IteratorElem(this);
+    LockForScan();
     elem->data_store_it = data_store_->Enumerate();
     elem->Increment(true);
+    UnlockForScan();
     return FawnDS_ConstIterator(elem);
 }
 
@@ -827,20 +1209,48 @@ FawnDS_Iterator
 FawnDS_SF::Enumerate()
 {
     IteratorElem* elem = new IteratorElem(this);
+    LockForScan();
     elem->data_store_it = data_store_->Enumerate();
     elem->Increment(true);
+    UnlockForScan();
     return FawnDS_Iterator(elem);
 }
 
+FawnDS_ConstIterator
+FawnDS_SF::EnumerateLatest(size_t end) const
+{
+    IteratorElem* elem = new IteratorElem(this);
+    elem->latest_only = true;
+    elem->end = end;
+    LockForScan();
+    elem->data_store_it = data_store_->Enumerate();
+    elem->IncrementLatest(true);
+    UnlockForScan();
+    return FawnDS_ConstIterator(elem);
+}
+
+FawnDS_Return
+FawnDS_SF::EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size) const
+{
+    LockForScan();
+
+    BatchParser parser(callback, key_len_);
+    FawnDS_Return ret = data_store_->EnumerateBatch(parser, batch_size);
+    if (parser.error)
+        ret = ERROR;
+
+    UnlockForScan();
+    return ret;
+}
+
 FawnDS_SF::IteratorElem::IteratorElem(const FawnDS_SF* fawnds)
+    : latest_only(false), end(static_cast<size_t>(-1)), rewritten(false)
 {
     this->fawnds = fawnds;
-    pthread_rwlock_rdlock(&static_cast<const FawnDS_SF*>(fawnds)->fawnds_lock_);
 }
 
 FawnDS_SF::IteratorElem::~IteratorElem()
 {
-    pthread_rwlock_unlock(&static_cast<const FawnDS_SF*>(fawnds)->fawnds_lock_);
 }
 
 FawnDS_IteratorElem*
@@ -854,7 +1264,60 @@ FawnDS_SF::IteratorElem::Clone() const
 void
 FawnDS_SF::IteratorElem::Next()
 {
-    Increment(false);
+    // lock for one step only so that an open iterator never blocks inserts or Flush()
+    const FawnDS_SF* fawnds_sf = static_cast<const FawnDS_SF*>(fawnds);
+    fawnds_sf->LockForScan();
+    if (latest_only)
+        IncrementLatest(false);
+    else
+        Increment(false);
+    fawnds_sf->UnlockForScan();
+}
+
+void
+FawnDS_SF::IteratorElem::IncrementLatest(bool initial)
+{
+    const FawnDS_SF* fawnds_sf = static_cast<const FawnDS_SF*>(fawnds);
+
+    while (data_store_it.IsOK()) {
+        Increment(initial);
+        initial = false;
+        if (state != OK && state != KEY_DELETED)
+            break;
+        if (data_store_it->key.as_number<size_t>() >= end)
+            break;
+
+        Value data_store_key;
+        size_t data_len;
+        FawnDS_Return ret_find = fawnds_sf->FindEntry(key, data_store_key, data_len);
+        if (ret_find != OK && ret_find != KEY_DELETED)
+            continue;
+
+        size_t latest = data_store_key.as_number<size_t>();
+        if (latest == data_store_it->key.as_number<size_t>())
+            return;
+        if (latest >= end) {
+            // the last entry of the key before end is known only once the scan reaches end
+            pending[key.str()] = std::make_pair(state, NewValue(data.data(), data.size()));
+        }
+    }
+
+    if (state == ERROR)
+        return;
+
+    // stop the log scan, and return the keys written again at or after end
+    data_store_it = FawnDS_Iterator();
+    if (pending.empty()) {
+        state = END;
+        return;
+    }
+
+    std::map<std::string, std::pair<FawnDS_Return, Value> >::iterator it = pending.begin();
+    key = NewValue(it->first.data(), it->first.size());
+    state = it->second.first;
+    data = it->second.second;
+    rewritten = true;
+    pending.erase(it);
 }
 
 void
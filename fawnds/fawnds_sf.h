@@ -3,6 +3,8 @@
 #define _FAWNDS_SF_H_
 
 #include "fawnds.h"
+#include <map>
+#include <string>
 
 namespace fawn {
 
@@ -16,6 +18,7 @@ namespace fawn {
     //   <keep-datastore-on-conversion>: when converting another FawnDS_SF store to this store, assume that the previous hash table preserves the same data layout in this data store; datastore->ConvertTo() is used instead of data reorganization based on side-by-side hash table comparison.
     //   <hashtable>: the configuration for the hash table
     //                <id>: will be assigned by FawnDS_SF
+    //                <concurrent>: if 1 (cuckoo only), inserts are serialized among themselves but do not block lookups
     //   <datastore>: the configuration for the insert-order-preserving data store
     //                <id>: will be assigned by FawnDS_SF
     //                <data-len>: will be set by FawnDS_SF (zero if either key length or data length is zero, (header size) + key length + data length otherwise)
@@ -29,6 +32,8 @@ namespace fawn {
         virtual FawnDS_Return Open();
 
         virtual FawnDS_Return ConvertTo(FawnDS* new_store) const;
+        // same as ConvertTo(), and also hands every live entry (including deletion markers) to entry_callback as it is converted
+        FawnDS_Return ConvertTo(FawnDS* new_store, FawnDS_BatchCallback* entry_callback) const;
 
         virtual FawnDS_Return Flush();
         virtual FawnDS_Return Close();
@@ -45,9 +50,20 @@ namespace fawn {
         virtual FawnDS_Return Contains(const ConstValue& key) const;
         virtual FawnDS_Return Length(const ConstValue& key, size_t& len) const;
         virtual FawnDS_Return Get(const ConstValue& key, Value& data, size_t offset = 0, size_t len = -1) const;
+        virtual FawnDS_Return MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const;
 
         virtual FawnDS_ConstIterator Enumerate() const;
         virtual FawnDS_Iterator Enumerate();
+        virtual FawnDS_Return EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size = 1024) const;
+
+        // point-in-time views of the log: the entries written so far are at log positions before LogEnd()
+        size_t LogEnd() const;
+        // enumerates the last entry of each key before the log position end, including deletion markers;
+        // keys written again at or after end are held in memory until the scan reaches end and are returned last, with rewritten set
+        FawnDS_ConstIterator EnumerateLatest(size_t end = -1) const;
+        // the state (OK or KEY_DELETED) of the last entry of the key before the log position end;
+        // END if the key was written again at or after end, and its last entry before end is not indexed any more
+        FawnDS_Return FindBefore(const ConstValue& key, size_t end = -1) const;
 
         //virtual FawnDS_ConstIterator Find(const ConstValue& key) const;
         //virtual FawnDS_Iterator Find(const ConstValue& key);
@@ -60,12 +76,29 @@ namespace fawn {
             void Next();
 
             void Increment(bool initial);
+            void IncrementLatest(bool initial);
 
             FawnDS_Iterator data_store_it;
+
+            // for EnumerateLatest()
+            bool latest_only;
+            size_t end;
+            bool rewritten;
+            std::map<std::string, std::pair<FawnDS_Return, Value> > pending;
         };
 
     protected:
         FawnDS_Return InsertEntry(const ConstValue& key, const ConstValue& data, bool isDelete);
+        FawnDS_Return FindEntry(const ConstValue& key, Value& data_store_key, size_t& data_len) const;
+
+        bool ConcurrentHashTable() const;
+        void LockForInsert();
+        void UnlockForInsert();
+        void LockForScan() const;
+        void UnlockForScan() const;
+
+        class BatchParser;
+        class DataStoreRelocator;
 
         struct DbHeader {
             uint64_t magic_number;
@@ -110,6 +143,14 @@ namespace fawn {
 
         mutable pthread_rwlock_t fawnds_lock_;
 
+        // the log position after the last entry written; -1 until LogEnd() finds it after Open()
+        // written by inserts and read with LockForScan()
+        mutable size_t log_end_;
+
+        // with a concurrent hash table, inserts and scans hold fawnds_lock_ shared and insert_lock_ exclusively
+        bool concurrent_;
+        mutable pthread_mutex_t insert_lock_;
+
         friend struct IteratorElem;
     };
 
@@ -2,11 +2,30 @@
 #include "debug.h"
 #include "print.h"
 #include <sstream>
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace fawn
 {
+	// the on-disk index is this header followed by the serialized bucketing_index
+	struct trie_index_header
+	{
+		uint64_t magic;
+		uint64_t key_len;
+		uint64_t data_len;
+		uint64_t keys_per_block;
+		uint64_t size;
+		uint64_t bucket_size;
+		uint64_t skip_bits;
+		uint64_t actual_size;
+	};
+
+	static const uint64_t trie_index_magic = 0x5346547269654958LLU;	// "SFTrieIX"
+
 	FawnDS_SF_Ordered_Trie::FawnDS_SF_Ordered_Trie()
-		: index_(NULL), data_store_(NULL)
+		: index_(NULL), data_store_(NULL), index_stored_(false)
 	{
 	}
 
@@ -32,6 +51,7 @@ namespace fawn
         skip_bits_ = atoi(config_->GetStringValue("child::skip-bits").c_str());
 
 		actual_size_ = 0;
+		index_stored_ = false;
 
 		if (key_len_ == 0) {
 			fprintf(stderr, "FawnDS_SF_Ordered_Trie::Create(): invalid key length\n");
@@ -67,14 +87,7 @@ namespace fawn
 
 		DPRINTF(2, "FawnDS_SF_Ordered_Trie::Create(): creating data store\n");
 
-		Configuration* storeConfig = new Configuration(config_, true);
-		storeConfig->SetContextNode("child::datastore");
-		storeConfig->SetStringValue("child::id", config_->GetStringValue("child::id"));
-        char buf[1024];
-        //snprintf(buf, sizeof(buf), "%zu", key_len_ + data_len_);
-        snprintf(buf, sizeof(buf), "%zu", key_len_ + data_len_ + 4);    // HACK: alignment for 1020-byte entry
-        storeConfig->SetStringValue("child::data-len", buf);
-		data_store_ = FawnDS_Factory::New(storeConfig);
+		data_store_ = FawnDS_Factory::New(data_store_config());
 		if (data_store_ == NULL) {
 			DPRINTF(2, "FawnDS_SF_Ordered_Trie::Create(): could not create data store\n");
 			return ERROR;
@@ -92,8 +105,45 @@ namespace fawn
 	FawnDS_Return
 	FawnDS_SF_Ordered_Trie::Open()
 	{
-		// TODO: implement
-		return ERROR;
+		if (index_)
+			return ERROR;
+
+		if (config_->ExistsNode("child::file") != 0) {
+			fprintf(stderr, "FawnDS_SF_Ordered_Trie::Open(): no index file is specified\n");
+			return ERROR;
+		}
+
+		DPRINTF(2, "FawnDS_SF_Ordered_Trie::Open(): loading index\n");
+
+		// the geometry is restored from the index file; only the index and its header are read here, not the data
+		FawnDS_Return ret = ReadIndex();
+		if (ret != OK)
+			return ret;
+
+		DPRINTF(2, "FawnDS_SF_Ordered_Trie::Open(): opening data store\n");
+
+		data_store_ = FawnDS_Factory::New(data_store_config());
+		if (data_store_ == NULL) {
+			DPRINTF(2, "FawnDS_SF_Ordered_Trie::Open(): could not create data store\n");
+			delete index_;
+			index_ = NULL;
+			return ERROR;
+		}
+
+		ret = data_store_->Open();
+		if (ret == OK)
+			ret = ReadFirstKey();
+		if (ret != OK) {
+			delete index_;
+			index_ = NULL;
+			delete data_store_;
+			data_store_ = NULL;
+			return ret;
+		}
+
+		DPRINTF(2, "FawnDS_SF_Ordered_Trie::Open(): <result> done\n");
+
+		return OK;
 	}
 
 	FawnDS_Return
@@ -108,6 +158,24 @@ namespace fawn
 			DPRINTF(2, "FawnDS_SF_Ordered_Trie::Flush(): already finalized\n");
 		}
 
+		FawnDS_Return ret = data_store_->Flush();
+		if (ret != OK)
+			return ret;
+
+		if (first_key_.size() == 0) {
+			ret = ReadFirstKey();
+			if (ret != OK)
+				return ret;
+		}
+
+		// the index is immutable once finalized, so it is written only once
+		if (!index_stored_ && config_->ExistsNode("child::file") == 0) {
+			ret = WriteIndex();
+			if (ret != OK)
+				return ret;
+			index_stored_ = true;
+		}
+
 		return OK;
 	}
 
@@ -123,6 +191,7 @@ namespace fawn
 		index_ = NULL;
 		delete data_store_;
 		data_store_ = NULL;
+		first_key_.reset();
 
 		return OK;
 	}
@@ -130,13 +199,18 @@ namespace fawn
 	FawnDS_Return
 	FawnDS_SF_Ordered_Trie::Destroy()
 	{
-		Configuration* storeConfig = new Configuration(config_, true);
-		storeConfig->SetContextNode("child::datastore");
-		storeConfig->SetStringValue("child::id", config_->GetStringValue("child::id"));
-		FawnDS* data_store = FawnDS_Factory::New(storeConfig);
+		FawnDS* data_store = FawnDS_Factory::New(data_store_config());
 		FawnDS_Return ret_destroy_data_store = data_store->Destroy();
 		delete data_store;
 
+		// the index file may not exist if the store has never been flushed
+		if (config_->ExistsNode("child::file") == 0) {
+			if (unlink(index_filename().c_str()) && errno != ENOENT) {
+				perror("FawnDS_SF_Ordered_Trie::Destroy(): could not delete index file");
+				return ERROR;
+			}
+		}
+
 		return ret_destroy_data_store;
 	}
 
@@ -305,10 +379,10 @@ namespace fawn
 		size_t base_idx = index_->locate(reinterpret_cast<const uint8_t*>(key.data()));
 		base_idx = base_idx / keys_per_block_ * keys_per_block_;
 
+		SizedValue<64> ret_key;
 		for (size_t i = base_idx; i < base_idx + keys_per_block_; i++) {
 
 			size_t data_store_key = i;
-			SizedValue<64> ret_key;
 
 			FawnDS_Return ret_get = data_store_->Get(RefValue(&data_store_key), ret_key, 0, key_len_);
 
@@ -364,6 +438,83 @@ namespace fawn
 		return KEY_NOT_FOUND;
 	}
 
+	FawnDS_Return
+	FawnDS_SF_Ordered_Trie::MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const
+	{
+		if (!index_) {
+			DPRINTF(2, "FawnDS_SF_Ordered_Trie::MultiGet(): <result> not initialized\n");
+			return ERROR;
+		}
+
+		if (!index_->finalized()) {
+			DPRINTF(2, "FawnDS_SF_Ordered_Trie::MultiGet(): <result> not finalized\n");
+			return ERROR;
+		}
+
+		out.resize(keys.size());
+		rets.assign(keys.size(), KEY_NOT_FOUND);
+
+		// locate the I/O block of every key using the in-memory index first
+		std::vector<size_t> data_store_ids;
+		std::vector<ConstValue> data_store_keys;
+		std::vector<size_t> owners;
+		data_store_ids.reserve(keys.size() * keys_per_block_);
+		for (size_t i = 0; i < keys.size(); i++) {
+			if (keys[i].size() != key_len_) {
+				rets[i] = INVALID_KEY;
+				continue;
+			}
+
+			size_t base_idx = index_->locate(reinterpret_cast<const uint8_t*>(keys[i].data()));
+			base_idx = base_idx / keys_per_block_ * keys_per_block_;
+
+			for (size_t j = base_idx; j < base_idx + keys_per_block_; j++) {
+				data_store_ids.push_back(j);
+				owners.push_back(i);
+			}
+		}
+
+		// data_store_ids is not resized anymore, so the references below stay valid
+		data_store_keys.reserve(data_store_ids.size());
+		for (size_t j = 0; j < data_store_ids.size(); j++)
+			data_store_keys.push_back(RefValue(&data_store_ids[j]));
+
+		// then read all candidate entries together
+		std::vector<Value> entries;
+		std::vector<FawnDS_Return> data_store_rets;
+		data_store_->MultiGet(data_store_keys, entries, data_store_rets);
+
+		for (size_t j = 0; j < owners.size(); j++) {
+			size_t i = owners[j];
+			if (rets[i] != KEY_NOT_FOUND)
+				continue;
+
+			// END only means that the block is partially filled
+			if (data_store_rets[j] == END)
+				continue;
+
+			if (data_store_rets[j] != OK) {
+				DPRINTF(2, "FawnDS_SF_Ordered_Trie::MultiGet(): got non-OK, corrupted file store?\n");
+				rets[i] = data_store_rets[j];
+				continue;
+			}
+
+			if (entries[j].size() < key_len_ + data_len_) {
+				DPRINTF(2, "FawnDS_SF_Ordered_Trie::MultiGet(): got wrong entry size, corrupted file store?\n");
+				rets[i] = ERROR;
+				continue;
+			}
+
+			if (memcmp(entries[j].data(), keys[i].data(), key_len_) != 0)
+				continue;
+
+			out[i] = NewValue(entries[j].data() + key_len_, data_len_);
+			rets[i] = OK;
+		}
+
+		return OK;
+	}
+
 	FawnDS_ConstIterator
 	FawnDS_SF_Ordered_Trie::Enumerate() const
 	{
@@ -402,6 +553,176 @@ namespace fawn
 		return FawnDS_Iterator(elem);
 	}
 
+	FawnDS_ConstIterator
+	FawnDS_SF_Ordered_Trie::Find(const ConstValue& key) const
+	{
+		if (!index_) {
+			DPRINTF(2, "FawnDS_SF_Ordered_Trie::Find(): <result> not initialized\n");
+			return FawnDS_ConstIterator();
+		}
+
+		if (!index_->finalized()) {
+			DPRINTF(2, "FawnDS_SF_Ordered_Trie::Find(): <result> not finalized\n");
+			return FawnDS_ConstIterator();
+		}
+
+		size_t id;
+		if (LowerBound(key, id) != OK)
+			return FawnDS_ConstIterator();
+
+		IteratorElem* elem = new IteratorElem(this);
+		elem->data_store_it = data_store_->Find(RefValue(&id));
+		elem->Parse();
+		return FawnDS_ConstIterator(elem);
+	}
+
+	FawnDS_Iterator
+	FawnDS_SF_Ordered_Trie::Find(const ConstValue& key)
+	{
+		if (!index_) {
+			DPRINTF(2, "FawnDS_SF_Ordered_Trie::Find(): <result> not initialized\n");
+			return FawnDS_Iterator();
+		}
+
+		if (!index_->finalized()) {
+			DPRINTF(2, "FawnDS_SF_Ordered_Trie::Find(): <result> not finalized\n");
+			return FawnDS_Iterator();
+		}
+
+		size_t id;
+		if (LowerBound(key, id) != OK)
+			return FawnDS_Iterator();
+
+		IteratorElem* elem = new IteratorElem(this);
+		elem->data_store_it = data_store_->Find(RefValue(&id));
+		elem->Parse();
+		return FawnDS_Iterator(elem);
+	}
+
+	FawnDS_Return
+	FawnDS_SF_Ordered_Trie::ReadFirstKey()
+	{
+		// only lookups of keys whose skipped bits differ from those of the stored keys need it
+		first_key_.reset();
+		if (skip_bits_ == 0 || actual_size_ == 0)
+			return OK;
+
+		size_t data_store_key = 0;
+		FawnDS_Return ret_get = data_store_->Get(RefValue(&data_store_key), first_key_, 0, key_len_);
+		if (ret_get != OK || first_key_.size() != key_len_) {
+			fprintf(stderr, "FawnDS_SF_Ordered_Trie::ReadFirstKey(): cannot read the first key, corrupted file store?\n");
+			first_key_.reset();
+			return ERROR;
+		}
+		return OK;
+	}
+
+	FawnDS_Return
+	FawnDS_SF_Ordered_Trie::LowerBound(const ConstValue& key, size_t& id) const
+	{
+		if (key.size() != key_len_) {
+			DPRINTF(2, "FawnDS_SF_Ordered_Trie::LowerBound(): <result> key length mismatch\n");
+			return INVALID_KEY;
+		}
+
+		// the lower bound is within the bucket of the key or right after it; a key whose skipped bits differ from
+		// those of the stored keys precedes or follows all of them
+		size_t lo;
+		size_t hi;
+		const uint8_t* first_key = first_key_.size() != 0 ? reinterpret_cast<const uint8_t*>(first_key_.data()) : NULL;
+		index_->locate_bucket(reinterpret_cast<const uint8_t*>(key.data()), first_key, lo, hi);
+
+		SizedValue<64> ret_key;
+
+		// check the block that Get() would read first, which finds an existing key with a single I/O
+		size_t base_idx = index_->locate(reinterpret_cast<const uint8_t*>(key.data()));
+		base_idx = base_idx / keys_per_block_ * keys_per_block_;
+		size_t block_begin = std::max(base_idx, lo);
+		size_t block_end = std::min(base_idx + keys_per_block_, hi);
+		for (size_t i = block_begin; i < block_end; i++) {
+			size_t data_store_key = i;
+			FawnDS_Return ret_get = data_store_->Get(RefValue(&data_store_key), ret_key, 0, key_len_);
+			if (ret_get != OK || ret_key.size() != key_len_) {
+				DPRINTF(2, "FawnDS_SF_Ordered_Trie::LowerBound(): cannot read key, corrupted file store?\n");
+				return ERROR;
+			}
+
+			if (ret_key.compare(key) >= 0) {
+				if (i > block_begin)
+					lo = i;
+				hi = i;
+				break;
+			}
+			lo = i + 1;
+		}
+
+		// binary search for the rest of the range
+		while (lo < hi) {
+			size_t data_store_key = lo + (hi - lo) / 2;
+			FawnDS_Return ret_get = data_store_->Get(RefValue(&data_store_key), ret_key, 0, key_len_);
+			if (ret_get != OK || ret_key.size() != key_len_) {
+				DPRINTF(2, "FawnDS_SF_Ordered_Trie::LowerBound(): cannot read key, corrupted file store?\n");
+				return ERROR;
+			}
+
+			if (ret_key.compare(key) < 0)
+				lo = data_store_key + 1;
+			else
+				hi = data_store_key;
+		}
+
+		id = lo;
+		return OK;
+	}
+
+	// splits each data store entry of a batch into its key and data
+	class TrieBatchParser : public FawnDS_BatchCallback {
+	public:
+		TrieBatchParser(FawnDS_BatchCallback& callback, size_t key_len, size_t data_len)
+			: callback_(callback), key_len_(key_len), data_len_(data_len)
+		{
+		}
+
+		bool Process(const FawnDS_Batch& batch)
+		{
+			keys_.resize(batch.size);
+			data_.resize(batch.size);
+			for (size_t i = 0; i < batch.size; i++) {
+				keys_[i].data = batch.data[i].data;
+				keys_[i].size = key_len_;
+				data_[i].data = batch.data[i].data + key_len_;
+				data_[i].size = data_len_;
+			}
+
+			FawnDS_Batch parsed = { batch.size, &keys_[0], &data_[0], batch.states };
+			return callback_.Process(parsed);
+		}
+
+	private:
+		FawnDS_BatchCallback& callback_;
+		size_t key_len_;
+		size_t data_len_;
+		std::vector<FawnDS_Span> keys_;
+		std::vector<FawnDS_Span> data_;
+	};
+
+	FawnDS_Return
+	FawnDS_SF_Ordered_Trie::EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size) const
+	{
+		if (!index_) {
+			DPRINTF(2, "FawnDS_SF_Ordered_Trie::EnumerateBatch(): <result> not initialized\n");
+			return ERROR;
+		}
+
+		if (!index_->finalized()) {
+			DPRINTF(2, "FawnDS_SF_Ordered_Trie::EnumerateBatch(): <result> not finalized\n");
+			return ERROR;
+		}
+
+		TrieBatchParser parser(callback, key_len_, data_len_);
+		return data_store_->EnumerateBatch(parser, batch_size);
+	}
+
 	FawnDS_SF_Ordered_Trie::IteratorElem::IteratorElem(const FawnDS_SF_Ordered_Trie* fawnds)
 	{
 		this->fawnds = fawnds;
@@ -441,6 +762,113 @@ namespace fawn
 			state = ERROR;
 	}
 
+	Configuration*
+	FawnDS_SF_Ordered_Trie::data_store_config() const
+	{
+		Configuration* storeConfig = new Configuration(config_, true);
+		storeConfig->SetContextNode("child::datastore");
+		storeConfig->SetStringValue("child::id", config_->GetStringValue("child::id"));
+		if (index_) {
+			char buf[1024];
+			//snprintf(buf, sizeof(buf), "%zu", key_len_ + data_len_);
+			snprintf(buf, sizeof(buf), "%zu", key_len_ + data_len_ + 4);    // HACK: alignment for 1020-byte entry
+			storeConfig->SetStringValue("child::data-len", buf);
+		}
+		return storeConfig;
+	}
+
+	std::string
+	FawnDS_SF_Ordered_Trie::index_filename() const
+	{
+		std::string filename = config_->GetStringValue("child::file") + "_";
+		filename += config_->GetStringValue("child::id");
+		return filename;
+	}
+
+	FawnDS_Return
+	FawnDS_SF_Ordered_Trie::WriteIndex()
+	{
+		std::string filename = index_filename();
+		DPRINTF(2, "FawnDS_SF_Ordered_Trie::WriteIndex(): writing to %s\n", filename.c_str());
+
+		int fd;
+		if ((fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOATIME, 0666)) == -1) {
+			perror("FawnDS_SF_Ordered_Trie::WriteIndex(): could not open index file");
+			return ERROR;
+		}
+
+		// write the index before the header so that a partially written file is rejected by ReadIndex()
+		if (index_->store_to_file(fd, sizeof(trie_index_header)) < 0 || fdatasync(fd) == -1) {
+			fprintf(stderr, "FawnDS_SF_Ordered_Trie::WriteIndex(): unable to write index\n");
+			close(fd);
+			return ERROR;
+		}
+
+		trie_index_header header;
+		header.magic = trie_index_magic;
+		header.key_len = key_len_;
+		header.data_len = data_len_;
+		header.keys_per_block = keys_per_block_;
+		header.size = size_;
+		header.bucket_size = bucket_size_;
+		header.skip_bits = skip_bits_;
+		header.actual_size = actual_size_;
+
+		if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fdatasync(fd) == -1) {
+			fprintf(stderr, "FawnDS_SF_Ordered_Trie::WriteIndex(): unable to write header\n");
+			close(fd);
+			return ERROR;
+		}
+
+		if (close(fd) == -1) {
+			perror("FawnDS_SF_Ordered_Trie::WriteIndex(): could not close index file");
+			return ERROR;
+		}
+
+		return OK;
+	}
+
+	FawnDS_Return
+	FawnDS_SF_Ordered_Trie::ReadIndex()
+	{
+		std::string filename = index_filename();
+		DPRINTF(2, "FawnDS_SF_Ordered_Trie::ReadIndex(): reading from %s\n", filename.c_str());
+
+		int fd;
+		if ((fd = open(filename.c_str(), O_RDONLY | O_NOATIME)) == -1) {
+			perror("FawnDS_SF_Ordered_Trie::ReadIndex(): could not open index file");
+			return ERROR;
+		}
+
+		trie_index_header header;
+		if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != trie_index_magic) {
+			fprintf(stderr, "FawnDS_SF_Ordered_Trie::ReadIndex(): invalid header\n");
+			close(fd);
+			return ERROR;
+		}
+
+		key_len_ = header.key_len;
+		data_len_ = header.data_len;
+		keys_per_block_ = header.keys_per_block;
+		size_ = header.size;
+		bucket_size_ = header.bucket_size;
+		skip_bits_ = header.skip_bits;
+		actual_size_ = header.actual_size;
+
+		index_ = new index_type(fd, sizeof(trie_index_header));
+		close(fd);
+
+		if (!index_->finalized()) {
+			fprintf(stderr, "FawnDS_SF_Ordered_Trie::ReadIndex(): unable to read index\n");
+			delete index_;
+			index_ = NULL;
+			return ERROR;
+		}
+
+		index_stored_ = true;
+		return OK;
+	}
+
 	/*
     template <typename BucketingType>
     void
@@ -17,6 +17,7 @@ namespace fawn
     //   <size>: the total number of entries in the store
     //   <bucket-size>: the number of entires in each bucket
     //   <skip-bits>: the number of MSBs to ignore when calculating the bucket number
+    //   <file>: the file name prefix to store the index for persistence (optional; required by Open())
     //   <datastore>: the configuration for the data store
     //                <id>: will be assigned by FawnDS_SF_Ordered_Trie
     //                <data-len>: will be set by FawnDS_SF_Ordered_Trie
@@ -45,12 +46,15 @@ namespace fawn
         virtual FawnDS_Return Contains(const ConstValue& key) const;
         virtual FawnDS_Return Length(const ConstValue& key, size_t& len) const;
         virtual FawnDS_Return Get(const ConstValue& key, Value& data, size_t offset = 0, size_t len = -1) const;
+        virtual FawnDS_Return MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const;
 
         virtual FawnDS_ConstIterator Enumerate() const;
         virtual FawnDS_Iterator Enumerate();
+        virtual FawnDS_Return EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size = 1024) const;
 
-        //virtual FawnDS_ConstIterator Find(const ConstValue& key) const;
-        //virtual FawnDS_Iterator Find(const ConstValue& key);
+        // positions the iterator at the first key not less than the given key; iteration continues in key order
+        virtual FawnDS_ConstIterator Find(const ConstValue& key) const;
+        virtual FawnDS_Iterator Find(const ConstValue& key);
 
         struct IteratorElem : public FawnDS_IteratorElem {
             IteratorElem(const FawnDS_SF_Ordered_Trie* fawnds);
@@ -62,6 +66,14 @@ namespace fawn
             FawnDS_Iterator data_store_it;
         };
 
+    protected:
+        Configuration* data_store_config() const;
+        std::string index_filename() const;
+        FawnDS_Return WriteIndex();
+        FawnDS_Return ReadIndex();
+        FawnDS_Return ReadFirstKey();
+        FawnDS_Return LowerBound(const ConstValue& key, size_t& id) const;
+
 	private:
         typedef cindex::bucketing_index<cindex::twolevel_absoff_bucketing<> > index_type;
         index_type* index_;
@@ -77,6 +89,10 @@ namespace fawn
         size_t skip_bits_;
 
         size_t actual_size_;
+
+        Value first_key_;       // the first key if the index skips key bits and the store is finalized; empty otherwise
+
+        bool index_stored_;
     };
 }  // namespace fawn
 
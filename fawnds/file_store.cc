@@ -2,6 +2,7 @@
 
 #include "file_store.h"
 #include "file_io.h"
+#include "buffer_pool.h"
 #include "configuration.h"
 #include "debug.h"
 #include "print.h"
@@ -10,6 +11,7 @@
 #include <cerrno>
 #include <cstdlib>
 #include <sstream>
+#include <algorithm>
 
 #include <cassert>
 
@@ -37,15 +39,11 @@ namespace fawn {
         std::string filename = config_->GetStringValue("child::file") + "_";
         filename += config_->GetStringValue("child::id");
 
-        if (config_->ExistsNode("child::data-len") == 0)
-            data_len_ = atoi(config_->GetStringValue("child::data-len").c_str());
-        else
-            data_len_ = 0;
+        if (!int_parse_config())
+            return ERROR;
 
-        if (config_->ExistsNode("child::use-buffered-io-only") == 0)
-            use_buffered_io_only_ = atoi(config_->GetStringValue("child::use-buffered-io-only").c_str()) != 0;
-        else
-            use_buffered_io_only_ = false;
+        if (!int_attach_cache())
+            return ERROR;
 
         DPRINTF(2, "FileStore::Create(): creating file: %s\n", filename.c_str());
 
@@ -66,15 +64,11 @@ namespace fawn {
         std::string filename = config_->GetStringValue("child::file") + "_";
         filename += config_->GetStringValue("child::id");
 
-        if (config_->ExistsNode("child::data-len") == 0)
-            data_len_ = atoi(config_->GetStringValue("child::data-len").c_str());
-        else
-            data_len_ = 0;
+        if (!int_parse_config())
+            return ERROR;
 
-        if (config_->ExistsNode("child::use-buffered-io-only") == 0)
-            use_buffered_io_only_ = atoi(config_->GetStringValue("child::use-buffered-io-only").c_str()) != 0;
-        else
-            use_buffered_io_only_ = false;
+        if (!int_attach_cache())
+            return ERROR;
 
         DPRINTF(2, "FileStore::Open(): opening file: %s\n", filename.c_str());
 
@@ -82,7 +76,9 @@ namespace fawn {
             return ERROR;
 
         // TODO: move this functionality to the I/O layer
-        next_append_id_ = end_id_ = lseek(fd_buffered_sequential_, 0, SEEK_END);  // TODO: handling truncated files
+        // IDs are byte offsets for variable-length entries and entry indices for fixed-length entries
+        off_t file_size = lseek(fd_buffered_sequential_, 0, SEEK_END);  // TODO: handling truncated files
+        next_append_id_ = end_id_ = data_len_ == 0 ? file_size : file_size / static_cast<off_t>(data_len_);
         next_sync_ = 1048576 * (1 << (rand() % 4));
 
         DPRINTF(2, "FileStore::Open(): opened file: %s\n", filename.c_str());
@@ -421,6 +417,117 @@ namespace fawn {
         return OK;
     }
 
+    FawnDS_Return
+    FileStore::get_sequential(off_t id, Value& data, std::vector<char>& buf, off_t& buf_offset) const
+    {
+        // serves iterators from a read-ahead buffer instead of issuing a small read for every entry
+        data.resize(0);
+
+        if (id < 0)
+            return INVALID_KEY;
+        if (id >= end_id_)
+            return END;
+
+        off_t offset;
+        size_t len;
+        if (data_len_ == 0) {
+            if (!int_fill_sequential(id, sizeof(entry_length_t), buf, buf_offset))
+                return ERROR;
+            entry_length_t entry_len;
+            memcpy(&entry_len, &buf[id - buf_offset], sizeof(entry_length_t));
+            offset = id + sizeof(entry_length_t);
+            len = entry_len;
+        }
+        else {
+            offset = id * data_len_;
+            len = data_len_;
+        }
+
+        if (len == 0)
+            return OK;
+        if (!int_fill_sequential(offset, len, buf, buf_offset))
+            return ERROR;
+        data.resize(len, false);
+        memcpy(data.data(), &buf[offset - buf_offset], len);
+        return OK;
+    }
+
+    FawnDS_Return
+    FileStore::MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const
+    {
+        out.resize(keys.size());
+        rets.resize(keys.size());
+
+        // issue reads in file offset order so that neighboring entries can share cached pages
+        std::vector<std::pair<off_t, size_t> > order;
+        order.reserve(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            off_t id = keys[i].as_number<off_t>(-1);
+            out[i].resize(0);
+            if (id == -1)
+                rets[i] = INVALID_KEY;
+            else if (id >= end_id_)
+                rets[i] = END;
+            else {
+                rets[i] = OK;
+                order.push_back(std::make_pair(id, i));
+            }
+        }
+        std::sort(order.begin(), order.end());
+
+        std::vector<int_read_request> reqs(order.size());
+
+        if (data_len_ == 0) {
+            // read all entry lengths in one batch, and then all data in another batch
+            std::vector<entry_length_t> lens(order.size());
+            for (size_t j = 0; j < order.size(); j++) {
+                reqs[j].buf = reinterpret_cast<char*>(&lens[j]);
+                reqs[j].count = sizeof(entry_length_t);
+                reqs[j].offset = order[j].first;
+            }
+            if (!reqs.empty())
+                int_pread_batch(&reqs[0], reqs.size(), false);
+
+            for (size_t j = 0; j < order.size(); j++) {
+                size_t i = order[j].second;
+                if (!reqs[j].success || reqs[j].count != sizeof(entry_length_t)) {
+                    rets[i] = ERROR;
+                    lens[j] = 0;
+                }
+                out[i].resize(lens[j], false);
+                reqs[j].buf = out[i].data();
+                reqs[j].count = lens[j];
+                reqs[j].offset = order[j].first + sizeof(entry_length_t);
+            }
+        }
+        else {
+            for (size_t j = 0; j < order.size(); j++) {
+                size_t i = order[j].second;
+                out[i].resize(data_len_, false);
+                reqs[j].buf = out[i].data();
+                reqs[j].count = data_len_;
+                reqs[j].offset = order[j].first * data_len_;
+            }
+        }
+
+        if (!reqs.empty())
+            int_pread_batch(&reqs[0], reqs.size(), false);
+
+        for (size_t j = 0; j < order.size(); j++) {
+            size_t i = order[j].second;
+            if (rets[i] != OK)
+                continue;
+            if (!reqs[j].success) {
+                out[i].resize(0);
+                rets[i] = ERROR;
+            }
+            else
+                out[i].resize(reqs[j].count);
+        }
+
+        return OK;
+    }
+
     FawnDS_ConstIterator
     FileStore::Enumerate() const
     {
@@ -441,6 +548,83 @@ namespace fawn {
         return FawnDS_Iterator(elem);
     }
 
+    FawnDS_Return
+    FileStore::EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size) const
+    {
+        if (batch_size == 0)
+            batch_size = 1;
+
+        // entries are read in large sequential chunks that bypass the block cache; keys are the IDs of Enumerate()
+        std::vector<char> buf;
+        std::vector<off_t> ids(batch_size);
+        std::vector<FawnDS_Span> keys(batch_size);
+        std::vector<FawnDS_Span> data(batch_size);
+        std::vector<FawnDS_Return> states(batch_size, OK);
+        for (size_t i = 0; i < batch_size; i++) {
+            keys[i].data = reinterpret_cast<const char*>(&ids[i]);
+            keys[i].size = sizeof(off_t);
+        }
+
+        size_t buf_size = scan_buffer_size_;
+        off_t id = 0;
+        while (id < end_id_) {
+            size_t n = 0;
+            size_t count;
+
+            if (data_len_ != 0) {
+                count = std::min(static_cast<off_t>(batch_size), end_id_ - id) * data_len_;
+                buf.resize(count);
+                if (!int_pread_sequential(&buf[0], count, id * data_len_))
+                    return ERROR;
+
+                for (; n < count / data_len_; n++) {
+                    ids[n] = id + n;
+                    data[n].data = &buf[n * data_len_];
+                    data[n].size = data_len_;
+                }
+                if (n == 0)
+                    return ERROR;
+                id += n;
+            }
+            else {
+                count = std::min(static_cast<off_t>(buf_size), end_id_ - id);
+                buf.resize(count);
+                if (!int_pread_sequential(&buf[0], count, id))
+                    return ERROR;
+
+                // hand out the whole entries in the buffer
+                size_t pos = 0;
+                entry_length_t entry_len = 0;
+                while (n < batch_size && pos + sizeof(entry_length_t) <= count) {
+                    memcpy(&entry_len, &buf[pos], sizeof(entry_length_t));
+                    if (pos + sizeof(entry_length_t) + entry_len > count)
+                        break;
+                    ids[n] = id + pos;
+                    data[n].data = &buf[pos + sizeof(entry_length_t)];
+                    data[n].size = entry_len;
+                    n++;
+                    pos += sizeof(entry_length_t) + entry_len;
+                }
+
+                if (n == 0) {
+                    // the next entry is larger than the buffer unless the file is truncated
+                    if (count < sizeof(entry_length_t) || buf_size >= sizeof(entry_length_t) + entry_len ||
+                        id + static_cast<off_t>(sizeof(entry_length_t) + entry_len) > end_id_)
+                        return ERROR;
+                    buf_size = sizeof(entry_length_t) + entry_len;
+                    continue;
+                }
+                id += pos;
+            }
+
+            FawnDS_Batch batch = { n, &keys[0], &data[0], &states[0] };
+            if (!callback.Process(batch))
+                return OK;
+        }
+
+        return OK;
+    }
+
     FawnDS_ConstIterator
     FileStore::Find(const ConstValue& key) const
     {
@@ -480,6 +664,11 @@ namespace fawn {
     }
     */
 
+    FileStore::IteratorElem::IteratorElem()
+        : buf_offset(0)
+    {
+    }
+
     FawnDS_IteratorElem*
     FileStore::IteratorElem::Clone() const
     {
@@ -494,7 +683,7 @@ namespace fawn {
         const FileStore* file_store = static_cast<const FileStore*>(fawnds);
 
         key = NewValue(&next_id);
-        state = file_store->get(key, data, 0, static_cast<size_t>(-1), true);
+        state = file_store->get_sequential(next_id, data, buf, buf_offset);
 
         if (state == OK || state == KEY_DELETED) {
             if (file_store->data_len_ == 0)
@@ -512,7 +701,9 @@ namespace fawn {
         fd_buffered_sequential_ = -1;
         fd_buffered_random_ = -1;
         fd_direct_random_ = -1;
-        memset(cache_, 0, sizeof(cache_entry) * cache_size_);
+        io_engine_ = AsyncIO::ENGINE_IO_URING;
+        block_cache_ = NULL;
+        file_id_ = 0;
         cache_hit_ = 0;
         cache_miss_ = 0;
     }
@@ -524,6 +715,10 @@ namespace fawn {
             assert(false);
             int_close();
         }
+        if (block_cache_) {
+            BlockCache::Release(block_cache_);
+            block_cache_ = NULL;
+        }
         //fprintf(stderr, "FileStore::int_terminate(): cache hit = %zu\n", static_cast<size_t>(cache_hit_));
         //fprintf(stderr, "FileStore::int_terminate(): cache miss = %zu\n", static_cast<size_t>(cache_miss_));
     }
@@ -534,6 +729,9 @@ namespace fawn {
         if (int_is_open())
             return false;
 
+        // cached blocks of any previously opened file are never looked up again
+        file_id_ = BlockCache::NewFileID();
+
         fd_buffered_sequential_ = open(pathname, flags, mode);
         if (fd_buffered_sequential_ == -1) {
             fprintf(stderr, "FileStore::int_open(): cannot open file: %s: %s\n", pathname, strerror(errno));
@@ -630,8 +828,6 @@ namespace fawn {
         dirty_chunk_.clear();
         syncing_chunk_.clear();
 
-        memset(cache_, 0, sizeof(cache_entry) * cache_size_);
-
         return true;
     }
 
@@ -647,129 +843,273 @@ namespace fawn {
 
     bool
     FileStore::int_pread(char* buf, size_t& count, off_t offset, bool readahead) const
+    {
+        int_read_request req;
+        req.buf = buf;
+        req.count = count;
+        req.offset = offset;
+        int_pread_batch(&req, 1, readahead);
+        count = req.count;
+        return req.success;
+    }
+
+    bool
+    FileStore::int_pread_sequential(char* buf, size_t& count, off_t offset) const
     {
         if (!int_is_open())
             return false;
 
-        // extend the beginning of the read region to the latest eariler page boundary
-        size_t to_discard = offset & page_size_mask_;
-
-        off_t req_offset = offset - to_discard;
-        size_t req_count = to_discard + count;
+        // a plain buffered read for bulk scans, which would only evict useful blocks if cached
+        size_t read_len = 0;
+        while (read_len < count) {
+            ssize_t ret = pread(fd_buffered_sequential_, buf + read_len, count - read_len, offset + read_len);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                fprintf(stderr, "FileStore::int_pread_sequential(): cannot read: %s\n", strerror(errno));
+                return false;
+            }
+            if (ret == 0)
+                break;
+            read_len += ret;
+        }
+        count = read_len;
+        return true;
+    }
 
-        // extend the end of the read region to the eariest later page boundary
-        req_count = (req_count + page_size_mask_) & ~page_size_mask_;
+    bool
+    FileStore::int_fill_sequential(off_t offset, size_t count, std::vector<char>& buf, off_t& buf_offset) const
+    {
+        if (offset >= buf_offset && offset + static_cast<off_t>(count) <= buf_offset + static_cast<off_t>(buf.size()))
+            return true;
 
-        // sanity check
-        assert((req_offset & page_size_mask_) == 0);
-        assert((req_count & page_size_mask_) == 0);
-        assert(req_offset <= offset);
-        assert(req_count >= count);
+        // refill the buffer from offset, without reading beyond the last entry
+        off_t end = data_len_ == 0 ? end_id_ : end_id_ * data_len_;
+        size_t fill_len = std::max(count, iterator_readahead_size_);
+        if (offset + static_cast<off_t>(fill_len) > end)
+            fill_len = std::max(count, static_cast<size_t>(end - offset));
 
-        // allocate aligned memory
-        void* req_buf;
-        if (posix_memalign(&req_buf, page_size_, req_count)) {
-            fprintf(stderr, "FileStore::int_pread(): cannot allocate aligned memory: %s\n", strerror(errno));
+        buf.resize(fill_len);
+        buf_offset = offset;
+        if (!int_pread_sequential(&buf[0], fill_len, offset)) {
+            buf.clear();
             return false;
         }
-        //fprintf(stderr, "FileStore::int_pread(): req_buf == %p (%zu B)\n", req_buf, req_count);
-
-        // use cache if available
-        bool use_cache = false;
-        if (req_count <= page_size_ * cache_size_) {
-            bool cache_available = true;
-            tbb::queuing_rw_mutex::scoped_lock cache_lock(cache_mutex_, false);
-            for (off_t current_offset = req_offset; current_offset < req_offset + req_count; current_offset += page_size_) {
-                size_t cache_index = (current_offset / page_size_) % cache_size_;
-                if (!cache_[cache_index].valid ||
-                    cache_[cache_index].offset != current_offset) {
-                    cache_available = false;
-                    break;
-                }
-            }
-            if (cache_available) {
-                use_cache = true;
-                char* p = static_cast<char*>(req_buf);
-                for (off_t current_offset = req_offset; current_offset < req_offset + req_count; current_offset += page_size_) {
-                    size_t cache_index = (current_offset / page_size_) % cache_size_;
-                    memcpy(p, cache_[cache_index].data, page_size_);
-                    p += page_size_;
-                }
-                //++cache_hit_;
-            }
-            else {
-                //++cache_miss_;
-            }
+        buf.resize(fill_len);
+        return fill_len >= count;
+    }
+
+    void
+    FileStore::int_pread_batch(int_read_request* reqs, size_t n, bool readahead) const
+    {
+        if (!int_is_open()) {
+            for (size_t i = 0; i < n; i++)
+                reqs[i].success = false;
+            return;
         }
 
-        ssize_t read_len;
-        if (use_cache) {
-            read_len = req_count;
+        // per-request bookkeeping is borrowed from the thread's buffer pool as well as the aligned read buffers
+        PooledBuffer states_buf(sizeof(int_read_state) * n);
+        PooledBuffer io_reqs_buf(sizeof(AsyncIO::Request) * n);
+        PooledBuffer io_req_owners_buf(sizeof(size_t) * n);
+        if (!states_buf.data() || !io_reqs_buf.data() || !io_req_owners_buf.data()) {
+            fprintf(stderr, "FileStore::int_pread_batch(): cannot allocate memory\n");
+            for (size_t i = 0; i < n; i++)
+                reqs[i].success = false;
+            return;
         }
-        else {
+        int_read_state* states = static_cast<int_read_state*>(states_buf.data());
+        AsyncIO::Request* io_reqs = static_cast<AsyncIO::Request*>(io_reqs_buf.data());
+        size_t* io_req_owners = static_cast<size_t*>(io_req_owners_buf.data());
+        size_t num_io_reqs = 0;
+
+        BufferPool* pool = BufferPool::thread_pool();
+        assert(BufferPool::alignment % page_size_ == 0);
+
+        for (size_t i = 0; i < n; i++) {
+            int_read_state& state = states[i];
+            reqs[i].success = true;
+
+            // extend the beginning of the read region to the latest eariler page boundary
+            state.to_discard = reqs[i].offset & page_size_mask_;
+
+            state.req_offset = reqs[i].offset - state.to_discard;
+            state.req_count = state.to_discard + reqs[i].count;
+
+            // extend the end of the read region to the eariest later page boundary
+            state.req_count = (state.req_count + page_size_mask_) & ~page_size_mask_;
+
+            // sanity check
+            assert((state.req_offset & page_size_mask_) == 0);
+            assert((state.req_count & page_size_mask_) == 0);
+            assert(state.req_offset <= reqs[i].offset);
+            assert(state.req_count >= reqs[i].count);
+
+            // obtain aligned memory
+            state.req_buf = pool->acquire(state.req_count);
+            if (!state.req_buf) {
+                fprintf(stderr, "FileStore::int_pread_batch(): cannot allocate aligned memory\n");
+                reqs[i].success = false;
+                continue;
+            }
+
+            // use cache if available
+            if (int_cache_get(state.req_buf, state.req_offset, state.req_count)) {
+                state.read_len = state.req_count;
+                continue;
+            }
+
             // choose an appropriate file descriptor
-            int fd;
+            AsyncIO::Request io_req;
             {
                 tbb::queuing_rw_mutex::scoped_lock dirty_chunk_lock(dirty_chunk_mutex_, false);
 
                 if (readahead)
-                    fd = fd_buffered_sequential_;
+                    io_req.fd = fd_buffered_sequential_;
                 else {
-                    if (req_offset / chunk_size_ < dirty_chunk_.size() &&
-                        dirty_chunk_[req_offset / chunk_size_]) {
+                    if (state.req_offset / chunk_size_ < dirty_chunk_.size() &&
+                        dirty_chunk_[state.req_offset / chunk_size_]) {
                         // the chunk is marked as dirty -- direct I/O cannot be used
-                        fd = fd_buffered_random_;
+                        io_req.fd = fd_buffered_random_;
                     }
                     else
-                        fd = fd_direct_random_;
+                        io_req.fd = fd_direct_random_;
                 }
             }
+            io_req.buf = state.req_buf;
+            io_req.count = state.req_count;
+            io_req.offset = state.req_offset;
+            io_req.result = -EIO;
+            io_reqs[num_io_reqs] = io_req;
+            io_req_owners[num_io_reqs] = i;
+            num_io_reqs++;
+        }
 
-            // do read
-            //fprintf(stderr, "for %zu,%zu, requested %zu,%zu\n", offset, count, req_offset, req_count);
-            read_len = pread(fd, req_buf, req_count, req_offset);
+        // do read
+        if (num_io_reqs != 0) {
+            if (!AsyncIO::thread_context(io_engine_)->read(io_reqs, num_io_reqs))
+                fprintf(stderr, "FileStore::int_pread_batch(): cannot submit reads\n");
+
+            for (size_t j = 0; j < num_io_reqs; j++) {
+                size_t i = io_req_owners[j];
+                if (io_reqs[j].result < 0) {
+                    fprintf(stderr, "FileStore::int_pread_batch(): cannot read: %s\n", strerror(static_cast<int>(-io_reqs[j].result)));
+                    reqs[i].success = false;
+                    continue;
+                }
+                states[i].read_len = io_reqs[j].result;
 
-            if (read_len < 0) {
-                fprintf(stderr, "FileStore::int_pread(): cannot read: %s\n", strerror(errno));
-                return false;
+                // put to cache
+                int_cache_put(states[i].req_buf, states[i].req_offset, states[i].read_len - (states[i].read_len & page_size_mask_));
             }
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            int_read_state& state = states[i];
 
-            // put to cache
-            if (req_count <= page_size_ * cache_size_) {
-                tbb::queuing_rw_mutex::scoped_lock cache_lock(cache_mutex_, true);
-                char* p = static_cast<char*>(req_buf);
-                for (off_t current_offset = req_offset; current_offset < req_offset + (read_len - (read_len & page_size_mask_)); current_offset += page_size_) {
-                    size_t cache_index = (current_offset / page_size_) % cache_size_;
-                    cache_[cache_index].valid = true;
-                    cache_[cache_index].offset = current_offset;
-                    memcpy(cache_[cache_index].data, p, page_size_);
-                    p += page_size_;
+            if (reqs[i].success) {
+                if (state.read_len < static_cast<ssize_t>(state.to_discard)) {
+                    // no useful data read
+                    reqs[i].count = 0;
                 }
+                else if (state.read_len < static_cast<ssize_t>(state.to_discard + reqs[i].count)) {
+                    // partially read
+                    memcpy(reqs[i].buf, static_cast<char*>(state.req_buf) + state.to_discard, state.read_len - state.to_discard);
+                    reqs[i].count = state.read_len - state.to_discard;
+                }
+                else {
+                    // fully read
+                    memcpy(reqs[i].buf, static_cast<char*>(state.req_buf) + state.to_discard, reqs[i].count);
+                }
+            }
+
+            if (state.req_buf)
+                pool->release(state.req_buf, state.req_count);
+        }
+    }
+
+    bool
+    FileStore::int_parse_config()
+    {
+        if (config_->ExistsNode("child::data-len") == 0)
+            data_len_ = atoi(config_->GetStringValue("child::data-len").c_str());
+        else
+            data_len_ = 0;
+
+        if (config_->ExistsNode("child::use-buffered-io-only") == 0)
+            use_buffered_io_only_ = atoi(config_->GetStringValue("child::use-buffered-io-only").c_str()) != 0;
+        else
+            use_buffered_io_only_ = false;
+
+        io_engine_ = AsyncIO::ENGINE_IO_URING;
+        if (config_->ExistsNode("child::io-engine") == 0) {
+            if (!AsyncIO::parse_engine(config_->GetStringValue("child::io-engine"), io_engine_)) {
+                fprintf(stderr, "FileStore::int_parse_config(): unknown I/O engine: %s\n", config_->GetStringValue("child::io-engine").c_str());
+                return false;
             }
         }
 
-        if (read_len < to_discard) {
-            // no useful data read
-            //fprintf(stderr, "none read\n");
-            count = 0;
+        return true;
+    }
+
+    bool
+    FileStore::int_attach_cache()
+    {
+        assert(BlockCache::block_size == page_size_);
+
+        if (block_cache_) {
+            BlockCache::Release(block_cache_);
+            block_cache_ = NULL;
         }
-        else if (read_len < to_discard + count) {
-            // partially read
-            //fprintf(stderr, "partially read, discarding first %zu and last %zu\n", to_discard, count - to_discard - (read_len - to_discard));
-            memcpy(buf, static_cast<char*>(req_buf) + to_discard, read_len - to_discard);
-            count = read_len - to_discard;
+
+        if (config_->ExistsNode("child::block-cache") == 0) {
+            std::string name = config_->GetStringValue("child::block-cache");
+            block_cache_ = BlockCache::Acquire(name);
+            if (!block_cache_) {
+                fprintf(stderr, "FileStore::int_attach_cache(): unknown block cache: %s\n", name.c_str());
+                return false;
+            }
         }
         else {
-            // fully read
-            //fprintf(stderr, "fully read, discarding first %zu and last %zu\n", to_discard, count - to_discard - (len));
-            memcpy(buf, static_cast<char*>(req_buf) + to_discard, count);
+            size_t capacity = default_block_cache_size_;
+            if (config_->ExistsNode("child::block-cache-size") == 0)
+                capacity = strtoull(config_->GetStringValue("child::block-cache-size").c_str(), NULL, 10);
+            block_cache_ = BlockCache::Acquire("", capacity);
         }
+        return true;
+    }
 
-        free(req_buf);
+    bool
+    FileStore::int_cache_get(void* buf, off_t offset, size_t count) const
+    {
+        if (!block_cache_ || count > max_cached_read_)
+            return false;
 
+        char* p = static_cast<char*>(buf);
+        for (off_t current_offset = offset; current_offset < static_cast<off_t>(offset + count); current_offset += page_size_) {
+            if (!block_cache_->Get(file_id_, current_offset, p)) {
+                //++cache_miss_;
+                return false;
+            }
+            p += page_size_;
+        }
+        //++cache_hit_;
         return true;
     }
 
+    void
+    FileStore::int_cache_put(const void* buf, off_t offset, size_t count) const
+    {
+        if (!block_cache_ || count > max_cached_read_)
+            return;
+
+        const char* p = static_cast<const char*>(buf);
+        for (off_t current_offset = offset; current_offset < static_cast<off_t>(offset + count); current_offset += page_size_) {
+            block_cache_->Put(file_id_, current_offset, p);
+            p += page_size_;
+        }
+    }
+
     bool
     FileStore::int_pwritev(const struct iovec* iov, int count, off_t offset)
     {
@@ -814,14 +1154,10 @@ namespace fawn {
         }
 
         // invalidate cache
-        {
-            tbb::queuing_rw_mutex::scoped_lock cache_lock(cache_mutex_, true);
+        if (block_cache_) {
             off_t aligned_offset = offset - (offset & page_size_mask_);
-            for (off_t current_offset = aligned_offset; current_offset < offset + written_len; current_offset += page_size_) {
-                size_t cache_index = (current_offset / page_size_) % cache_size_;
-                if (cache_[cache_index].valid && cache_[cache_index].offset == current_offset)
-                    cache_[cache_index].valid = false;
-            }
+            for (off_t current_offset = aligned_offset; current_offset < offset + written_len; current_offset += page_size_)
+                block_cache_->Invalidate(file_id_, current_offset);
         }
         
         if (written_len < write_size) {
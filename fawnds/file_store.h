@@ -4,6 +4,8 @@
 
 #include "fawnds.h"
 #include "file_io.h"    // for iovec
+#include "async_io.h"
+#include "block_cache.h"
 #include "task.h"
 #include <tbb/atomic.h>
 #include <tbb/queuing_mutex.h>
@@ -18,6 +20,9 @@ namespace fawn {
     //   <file>: the file name prefix to store log entries for persistence
     //   <data-len>: the length of data -- zero for variable-length data (default), a positive integer for fixed-length data (space optimization is applied)
     //   <use-buffered-io-only>: with a non-zero value, use buffered I/O only and do not use direct I/O.  Default is 0 (false).  Useful for quick tests or data-len >= 4096 (direct I/O is less likely to improve read performance).
+    //   <block-cache>: the name of a shared block cache to use; set by FawnDS_Combi when it has <block-cache-size>
+    //   <block-cache-size>: the capacity in bytes of the private block cache used when <block-cache> is not given.  Default is 65536.
+    //   <io-engine>: the engine to submit reads with -- "sync" (one blocking pread per read), "libaio", "io_uring", or "auto" (default; the best available engine)
 
     class FileStore : public FawnDS {
     public:
@@ -44,18 +49,26 @@ namespace fawn {
         virtual FawnDS_Return Contains(const ConstValue& key) const;
         virtual FawnDS_Return Length(const ConstValue& key, size_t& len) const;
         virtual FawnDS_Return Get(const ConstValue& key, Value& data, size_t offset = 0, size_t len = -1) const;
+        virtual FawnDS_Return MultiGet(const std::vector<ConstValue>& keys, std::vector<Value>& out, std::vector<FawnDS_Return>& rets) const;
 
         virtual FawnDS_ConstIterator Enumerate() const;
         virtual FawnDS_Iterator Enumerate();
+        virtual FawnDS_Return EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size = 1024) const;
 
         virtual FawnDS_ConstIterator Find(const ConstValue& key) const;
         virtual FawnDS_Iterator Find(const ConstValue& key);
 
         struct IteratorElem : public FawnDS_IteratorElem {
+            IteratorElem();
+
             FawnDS_IteratorElem* Clone() const;
             void Next();
 
             off_t next_id;
+
+            // file contents read ahead of next_id
+            std::vector<char> buf;
+            off_t buf_offset;
         };
 
     protected:
@@ -63,6 +76,7 @@ namespace fawn {
 
         FawnDS_Return length(const ConstValue& key, size_t& len, bool readahead) const;
         FawnDS_Return get(const ConstValue& key, Value& data, size_t offset, size_t len, bool readahead) const;
+        FawnDS_Return get_sequential(off_t id, Value& data, std::vector<char>& buf, off_t& buf_offset) const;
 
         //int disable_readahead();
 
@@ -75,7 +89,17 @@ namespace fawn {
         bool int_close();
         static bool int_unlink(const char* pathname);
 
+        struct int_read_request {
+            char* buf;
+            size_t count;       // updated to the number of bytes read
+            off_t offset;
+            bool success;
+        };
+
         bool int_pread(char* buf, size_t& count, off_t offset, bool readahead) const;
+        bool int_pread_sequential(char* buf, size_t& count, off_t offset) const;
+        bool int_fill_sequential(off_t offset, size_t count, std::vector<char>& buf, off_t& buf_offset) const;
+        void int_pread_batch(int_read_request* reqs, size_t n, bool readahead) const;
         bool int_pwritev(const struct iovec* iov, int count, off_t offset);
         bool int_sync(bool blocking);
 
@@ -87,12 +111,16 @@ namespace fawn {
         tbb::atomic<off_t> next_sync_;
 
         bool use_buffered_io_only_;
+        AsyncIO::Engine io_engine_;
 
         // I/O layer (TODO: make this as a separate class)
         static const size_t chunk_size_ = 1048576;
         static const size_t page_size_ = 512;
         static const size_t page_size_mask_ = page_size_ - 1;
-        static const size_t cache_size_ = 128;
+        static const size_t max_cached_read_ = 65536;
+        static const size_t default_block_cache_size_ = 65536;
+        static const size_t scan_buffer_size_ = 1048576;
+        static const size_t iterator_readahead_size_ = 65536;
 
         int fd_buffered_sequential_;
         int fd_buffered_random_;
@@ -103,16 +131,24 @@ namespace fawn {
         boost::dynamic_bitset<> dirty_chunk_;
         boost::dynamic_bitset<> syncing_chunk_;
 
-        struct cache_entry {
-            bool valid;
-            off_t offset;
-            char data[page_size_];
-        };
-        mutable tbb::queuing_rw_mutex cache_mutex_;
-        mutable cache_entry cache_[cache_size_];
+        BlockCache* block_cache_;
+        uint64_t file_id_;      // identifies the opened file in block_cache_
         mutable tbb::atomic<size_t> cache_hit_;
         mutable tbb::atomic<size_t> cache_miss_;
 
+        bool int_parse_config();
+        bool int_attach_cache();
+        bool int_cache_get(void* buf, off_t offset, size_t count) const;
+        void int_cache_put(const void* buf, off_t offset, size_t count) const;
+
+        struct int_read_state {
+            size_t to_discard;
+            off_t req_offset;
+            size_t req_count;
+            void* req_buf;
+            ssize_t read_len;
+        };
+
         class SyncTask : public Task {
         public:
             virtual ~SyncTask();
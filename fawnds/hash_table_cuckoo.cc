@@ -12,11 +12,40 @@
 #include <cstdio>
 #include <cerrno>
 #include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+// orders the reads of a bucket between the two reads of its version counter
+#if defined(__i386__) || defined(__x86_64__)
+#define READ_BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+#define READ_BARRIER() __sync_synchronize()
+#endif
 
 namespace fawn {
 
+    // a per-thread xorshift generator; rand() serializes all callers on a global lock
+    static __thread uint64_t prng_state = 0;
+
+    static inline uint32_t
+    thread_rand()
+    {
+        if (prng_state == 0) {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            prng_state = (static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec) ^ reinterpret_cast<uint64_t>(pthread_self());
+            prng_state = prng_state * 0x9e3779b97f4a7c15LLU | 1;
+        }
+        prng_state ^= prng_state << 13;
+        prng_state ^= prng_state >> 7;
+        prng_state ^= prng_state << 17;
+        return static_cast<uint32_t>(prng_state >> 32);
+    }
+
     HashTableCuckoo::HashTableCuckoo()
-        :hash_table_(NULL), fpf_table_(NULL)
+        :hash_table_(NULL), fpf_table_(NULL), mmap_base_(NULL), mmap_len_(0), versions_(NULL)
     {
         DPRINTF(2, "%d-%d Cuckoo hash table\n", NUMHASH, ASSOCIATIVITY);
     }
@@ -35,10 +64,44 @@ namespace fawn {
         if (hash_table_ || fpf_table_)
             Close();
 
+        if (SetTableSize() != 0)
+            return ERROR;
+
+        if (config_->ExistsNode("child::use-offset") != 0 || atoi(config_->GetStringValue("child::use-offset").c_str()) != 0) {
+            hash_table_ = new TagValStoreEntry[max_index_];
+            fpf_table_  = NULL;
+
+            // zero out the buffer
+            memset(hash_table_, 0, sizeof(TagValStoreEntry) * max_index_);
+
+            DPRINTF(2, "HashTableCuckoo::Create(): <result> byte size=%zu\n", sizeof(TagValStoreEntry) * max_index_);
+        }
+        else {
+            hash_table_ = NULL;
+            fpf_table_  = new TagStoreEntry[max_index_];
+
+            // zero out the buffer
+            memset(fpf_table_, 0, sizeof(TagStoreEntry) * max_index_);
+
+            DPRINTF(2, "HashTableCuckoo::Create(): <result> byte size=%zu\n", sizeof(TagStoreEntry) * max_index_);
+        }
+
+        if (config_->ExistsNode("child::concurrent") == 0 && atoi(config_->GetStringValue("child::concurrent").c_str()) != 0) {
+            versions_ = new tbb::atomic<uint32_t>[VERSION_STRIPES];
+            for (uint32_t i = 0; i < VERSION_STRIPES; i++)
+                versions_[i] = 0;
+        }
+
+        return OK;
+    }
+
+    int
+    HashTableCuckoo::SetTableSize()
+    {
         string hts_string = config_->GetStringValue("child::hash-table-size");
         int hts_int = atoi(hts_string.c_str());
         if (hts_int <= 0) {
-            return ERROR;
+            return -1;
         }
         uint64_t table_size = (uint64_t)hts_int;
 
@@ -54,7 +117,7 @@ namespace fawn {
         max_entries_ = ASSOCIATIVITY * max_index_;
         current_entries_ = 0;
 
-        DPRINTF(2, "HashTableCuckoo::Create(): given table_size=%llu\n", static_cast<long long unsigned>(max_entries_));
+        DPRINTF(2, "HashTableCuckoo::SetTableSize(): given table_size=%llu\n", static_cast<long long unsigned>(max_entries_));
 
 
         DPRINTF(2, "CreateFawnDS table information:\n"
@@ -64,26 +127,7 @@ namespace fawn {
                 "\t Maximum number of entries: %ld\n",
                 KEYFRAGBITS, max_index_, current_entires, max_entries_);
 
-        if (config_->ExistsNode("child::use-offset") != 0 || atoi(config_->GetStringValue("child::use-offset").c_str()) != 0) {
-            hash_table_ = new TagValStoreEntry[max_index_];
-            fpf_table_  = NULL;
-
-            // zero out the buffer
-            memset(hash_table_, 0, sizeof(TagValStoreEntry) * max_index_);
-
-            DPRINTF(2, "HashTableCuckoo::Create(): <result> byte size=%zu\n", sizeof(TagValStoreEntry) * max_index_);
-        }
-        else {
-            hash_table_ = NULL;
-            fpf_table_  = new TagStoreEntry[max_index_];
-
-            // zero out the buffer
-            memset(fpf_table_, 0, sizeof(TagStoreEntry) * max_index_);
-
-            DPRINTF(2, "HashTableCuckoo::Create(): <result> byte size=%zu\n", sizeof(TagStoreEntry) * max_index_);
-        }
-
-        return OK;
+        return 0;
     }
 
     FawnDS_Return
@@ -93,6 +137,12 @@ namespace fawn {
         if (hash_table_ || fpf_table_)
             Close();
 
+        if (config_->ExistsNode("child::use-mmap") == 0 && atoi(config_->GetStringValue("child::use-mmap").c_str()) != 0) {
+            if (SetTableSize() == 0 && MapFile() == 0)
+                return OK;
+            return ERROR;
+        }
+
         if (Create() == OK)
             if (ReadFromFile() == 0)
                 return OK;
@@ -115,6 +165,11 @@ namespace fawn {
             return ERROR;
         }
 
+        if (new_cuckoo->mmap_base_) {
+            fprintf(stderr, "HashTableCuckoo::ConvertTo(): the destination table is read-only\n");
+            return ERROR;
+        }
+
         if (hash_table_ == NULL && new_cuckoo->hash_table_ != NULL) {
             DPRINTF(2, "HashTableCuckoo::ConvertTo(): insufficient information for conversion\n");
             return ERROR;
@@ -140,6 +195,9 @@ namespace fawn {
     HashTableCuckoo::Flush()
     {
         DPRINTF(2, "HashTableCuckoo::Flush()\n");
+        // a mapped table is read-only and thus identical to the file
+        if (mmap_base_)
+            return OK;
         if (WriteToFile())
             return ERROR;
         else
@@ -156,16 +214,27 @@ namespace fawn {
         Flush();
 
         DPRINTF(2, "HashTableCuckoo::Close()\n");
-        if (hash_table_) {
-            delete [] hash_table_;
-            DPRINTF(2, "HashTableCuckoo::Close(): HashTable deleted\n");
+        if (mmap_base_) {
+            if (munmap(mmap_base_, mmap_len_) == -1)
+                perror("HashTableCuckoo::Close(): could not unmap file");
+            DPRINTF(2, "HashTableCuckoo::Close(): table unmapped\n");
+            mmap_base_ = NULL;
+            mmap_len_ = 0;
         }
-        if (fpf_table_) {
-            delete [] fpf_table_;
-            DPRINTF(2, "HashTableCuckoo::Close(): FpfTable deleted\n");
+        else {
+            if (hash_table_) {
+                delete [] hash_table_;
+                DPRINTF(2, "HashTableCuckoo::Close(): HashTable deleted\n");
+            }
+            if (fpf_table_) {
+                delete [] fpf_table_;
+                DPRINTF(2, "HashTableCuckoo::Close(): FpfTable deleted\n");
+            }
         }
         hash_table_ = NULL;
         fpf_table_  = NULL;
+        delete [] versions_;
+        versions_ = NULL;
         return OK;
     }
 
@@ -238,6 +307,14 @@ namespace fawn {
         //print_payload((const u_char*)key.data(), key.size(), 4);
         DPRINTF(2, "HashTableCuckoo::Put(): data=%llu\n", static_cast<long long unsigned>(data.as_number<size_t>()));
         
+        if (mmap_base_) {
+            DPRINTF(2, "HashTableCuckoo::Put(): <result> read-only table\n");
+            return ERROR;
+        }
+
+        if (versions_)
+            return PutConcurrent(key, static_cast<uint32_t>(data.as_number<uint32_t>()));
+
         // for undo correctness checking
         //uint32_t init_checksum = Hashes::h1(hash_table_, sizeof(TagValStoreEntry) * max_index_);
 
@@ -248,7 +325,7 @@ namespace fawn {
         uint32_t undo_index[MAX_CUCKOO_COUNT];
         uint8_t undo_way[MAX_CUCKOO_COUNT];
 
-        uint32_t fn = rand() % NUMHASH;
+        uint32_t fn = thread_rand() % NUMHASH;
 #ifdef SPLIT_HASHTABLE
         current_index = (keyfrag(key, fn) + fn * (1 << KEYFRAGBITS)) % max_index_;
 #else
@@ -286,7 +363,7 @@ namespace fawn {
             }
 
             victim_index = current_index;
-            victim_way   = rand() % ASSOCIATIVITY;
+            victim_way   = thread_rand() % ASSOCIATIVITY;
             victim_tag   = tag(victim_index, victim_way);
             victim_val   = val(victim_index, victim_way);
 
@@ -343,6 +420,112 @@ namespace fawn {
         return INSUFFICIENT_SPACE;
     } // HashTableCuckoo:Put()
 
+    FawnDS_Return
+    HashTableCuckoo::PutConcurrent(const ConstValue& key, uint32_t id)
+    {
+        tbb::spin_mutex::scoped_lock lock(write_mutex_);
+
+        uint32_t index[NUMHASH];
+        uint32_t tags[NUMHASH];
+        for (uint32_t i = 0; i < NUMHASH; i++) {
+#ifdef SPLIT_HASHTABLE
+            index[i] = (keyfrag(key, i) + i * (1 << KEYFRAGBITS)) % max_index_;
+#else
+            index[i] = keyfrag(key, i) % max_index_;
+#endif
+            tags[i] = keyfrag(key, (i + 1) % NUMHASH) % max_index_;
+        }
+
+        uint32_t first = thread_rand() % NUMHASH;
+        for (uint32_t n = 0; n < NUMHASH; n++) {
+            uint32_t fn = (first + n) % NUMHASH;
+            uint32_t way = freeslot(index[fn]);
+            if (way < ASSOCIATIVITY) {
+                begin_write(index[fn]);
+                store(index[fn], way, tags[fn] | VALIDBITMASK, id);
+                end_write(index[fn]);
+                current_entries_++;
+                DPRINTF(2, "HashTableCuckoo::PutConcurrent(): <result> stored without cuckooing\n");
+                return OK;
+            }
+        }
+
+        // find a path to a free slot without modifying the table; a failed search needs no undo
+        uint32_t path_index[MAX_CUCKOO_COUNT];
+        uint8_t path_way[MAX_CUCKOO_COUNT];
+        uint32_t depth;
+        uint32_t free_index, free_way;
+        if (!SearchPath(index[first], path_index, path_way, depth, free_index, free_way)) {
+            DPRINTF(2, "HashTableCuckoo::PutConcurrent(): <result> no more space to put new key\n");
+            return INSUFFICIENT_SPACE;
+        }
+
+        // move entries back to front; each entry is copied to its alternative bucket before its old slot is reused,
+        // so every key stays visible to readers throughout the displacement
+        uint32_t dest_index = free_index;
+        uint32_t dest_way = free_way;
+        for (uint32_t n = depth; n > 0; n--) {
+            uint32_t src_index = path_index[n - 1];
+            uint32_t src_way = path_way[n - 1];
+            assert(alt_index(tag(src_index, src_way)) == dest_index);
+
+            begin_write(dest_index);
+            store(dest_index, dest_way, alt_tag(src_index) | VALIDBITMASK, val(src_index, src_way));
+            end_write(dest_index);
+
+            dest_index = src_index;
+            dest_way = src_way;
+        }
+
+        assert(dest_index == index[first]);
+        begin_write(dest_index);
+        store(dest_index, dest_way, tags[first] | VALIDBITMASK, id);
+        end_write(dest_index);
+
+        current_entries_++;
+        DPRINTF(2, "HashTableCuckoo::PutConcurrent(): <result> stored after moving %u entries\n", depth);
+        return OK;
+    }
+
+    bool
+    HashTableCuckoo::SearchPath(uint32_t start_index, uint32_t* path_index, uint8_t* path_way, uint32_t& depth,
+                                uint32_t& free_index, uint32_t& free_way) const
+    {
+        uint32_t current_index = start_index;
+
+        for (depth = 0; depth < MAX_CUCKOO_COUNT; depth++) {
+            // pick a random victim that is not on the path yet; moving an entry twice would lose a key
+            uint32_t way = thread_rand() % ASSOCIATIVITY;
+            uint32_t tries;
+            for (tries = 0; tries < ASSOCIATIVITY; tries++, way = (way + 1) % ASSOCIATIVITY) {
+                uint32_t n;
+                for (n = 0; n < depth; n++)
+                    if (path_index[n] == current_index && path_way[n] == way)
+                        break;
+                if (n == depth)
+                    break;
+            }
+            if (tries == ASSOCIATIVITY)
+                return false;
+
+            path_index[depth] = current_index;
+            path_way[depth] = static_cast<uint8_t>(way);
+
+            uint32_t next_index = alt_index(tag(current_index, way));
+            uint32_t next_way = freeslot(next_index);
+            if (next_way < ASSOCIATIVITY) {
+                free_index = next_index;
+                free_way = next_way;
+                depth++;
+                return true;
+            }
+
+            current_index = next_index;
+        }
+
+        return false;
+    }
+
 
     FawnDS_ConstIterator
     HashTableCuckoo::Enumerate() const
@@ -372,19 +555,53 @@ namespace fawn {
         return FawnDS_Iterator(elem);
     }
 
+    FawnDS_Return
+    HashTableCuckoo::EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size) const
+    {
+        DPRINTF(2, "HashTableCuckoo::EnumerateBatch()\n");
+        if (batch_size == 0)
+            batch_size = 1;
+
+        // keys are empty as with Enumerate(); data are the stored values
+        std::vector<uint32_t> vals(batch_size);
+        std::vector<FawnDS_Span> keys(batch_size);
+        std::vector<FawnDS_Span> data(batch_size);
+        std::vector<FawnDS_Return> states(batch_size, OK);
+        for (size_t i = 0; i < batch_size; i++) {
+            keys[i].data = NULL;
+            keys[i].size = 0;
+            data[i].data = reinterpret_cast<const char*>(&vals[i]);
+            data[i].size = sizeof(uint32_t);
+        }
+
+        size_t n = 0;
+        for (uint32_t index = 0; index < max_index_; index++) {
+            for (uint32_t way = 0; way < ASSOCIATIVITY; way++) {
+                if (!valid(index, way))
+                    continue;
+                vals[n++] = val(index, way);
+                if (n == batch_size) {
+                    FawnDS_Batch batch = { n, &keys[0], &data[0], &states[0] };
+                    if (!callback.Process(batch))
+                        return OK;
+                    n = 0;
+                }
+            }
+        }
+
+        if (n != 0) {
+            FawnDS_Batch batch = { n, &keys[0], &data[0], &states[0] };
+            callback.Process(batch);
+        }
+        return OK;
+    }
+
     FawnDS_ConstIterator
     HashTableCuckoo::Find(const ConstValue& key) const
     {
         DPRINTF(2, "HashTableCuckoo::Find() const\n");
-        IteratorElem* elem = new IteratorElem();
-        elem->fawnds = this;
-        elem->key = key;
-        for (uint32_t i = 0 ; i < NUMHASH; i++)
-            elem->keyfrag[i] = keyfrag(key, i)  % max_index_;
-
-        elem->current_keyfrag_id = static_cast<uint32_t>(-1);
-        elem->current_way = ASSOCIATIVITY - 1;
-
+        IteratorElem* elem = NewFindElem(key);
+        MatchFindElem(elem);
         elem->Next();
         return FawnDS_ConstIterator(elem);
     }
@@ -393,17 +610,114 @@ namespace fawn {
     HashTableCuckoo::Find(const ConstValue& key)
     {
         DPRINTF(2, "HashTableCuckoo::Find()\n");
+        IteratorElem* elem = NewFindElem(key);
+        MatchFindElem(elem);
+        elem->Next();
+        return FawnDS_Iterator(elem);
+    }
+
+    HashTableCuckoo::IteratorElem*
+    HashTableCuckoo::NewFindElem(const ConstValue& key) const
+    {
         IteratorElem* elem = new IteratorElem();
         elem->fawnds = this;
         elem->key = key;
         for (uint32_t i = 0 ; i < NUMHASH; i++)
             elem->keyfrag[i] = keyfrag(key, i)  % max_index_;
 
+        for (uint32_t i = 0 ; i < NUMHASH; i++) {
+#ifdef SPLIT_HASHTABLE
+            elem->index[i] = (keyfrag(key, i) + i * (1 << KEYFRAGBITS))  % max_index_;
+#else
+            elem->index[i] = keyfrag(key, i)  % max_index_;
+#endif
+        }
+        elem->match_mask = 0;
+
         elem->current_keyfrag_id = static_cast<uint32_t>(-1);
         elem->current_way = ASSOCIATIVITY - 1;
+        return elem;
+    }
 
-        elem->Next();
-        return FawnDS_Iterator(elem);
+    void
+    HashTableCuckoo::MatchFindElem(IteratorElem* elem) const
+    {
+        // match the tags of all candidate buckets up front; Next() only visits the matching ways
+        uint32_t tags[NUMHASH];
+        for (uint32_t i = 0 ; i < NUMHASH; i++)
+            tags[i] = elem->keyfrag[(i + 1) % NUMHASH];
+
+        if (!versions_) {
+            elem->match_mask = match(elem->index, tags);
+            for (uint32_t mask = elem->match_mask; mask != 0; mask &= mask - 1) {
+                uint32_t bit = __builtin_ctz(mask);
+                elem->vals[bit] = val(elem->index[bit / ASSOCIATIVITY], bit % ASSOCIATIVITY);
+            }
+            return;
+        }
+
+        // concurrent mode: read the tags and values optimistically and retry if a writer touched either bucket
+        while (true) {
+            uint32_t versions[NUMHASH];
+            bool writing = false;
+            for (uint32_t i = 0 ; i < NUMHASH; i++) {
+                versions[i] = versions_[elem->index[i] % VERSION_STRIPES];
+                if (versions[i] & 1)
+                    writing = true;
+            }
+            if (writing)
+                continue;
+
+            READ_BARRIER();
+
+            elem->match_mask = match(elem->index, tags);
+            for (uint32_t mask = elem->match_mask; mask != 0; mask &= mask - 1) {
+                uint32_t bit = __builtin_ctz(mask);
+                elem->vals[bit] = val(elem->index[bit / ASSOCIATIVITY], bit % ASSOCIATIVITY);
+            }
+
+            READ_BARRIER();
+
+            bool changed = false;
+            for (uint32_t i = 0 ; i < NUMHASH; i++)
+                if (versions_[elem->index[i] % VERSION_STRIPES] != versions[i])
+                    changed = true;
+            if (!changed)
+                return;
+        }
+    }
+
+    FawnDS_Return
+    HashTableCuckoo::MultiFind(const std::vector<ConstValue>& keys, std::vector<FawnDS_ConstIterator>& out) const
+    {
+        DPRINTF(2, "HashTableCuckoo::MultiFind()\n");
+        size_t n = keys.size();
+        out.resize(n);
+        std::vector<IteratorElem*> elems(n);
+
+        // hash keys and prefetch their candidate buckets PREFETCH_DISTANCE keys ahead of the tag matching,
+        // so that the bucket accesses of different keys overlap instead of stalling one after another
+        for (size_t i = 0; i < n + PREFETCH_DISTANCE; i++) {
+            if (i < n) {
+                elems[i] = NewFindElem(keys[i]);
+                for (uint32_t k = 0; k < NUMHASH; k++) {
+                    if (hash_table_)
+                        __builtin_prefetch(&hash_table_[elems[i]->index[k]]);
+                    else
+                        __builtin_prefetch(&fpf_table_[elems[i]->index[k]]);
+                }
+            }
+
+            if (i >= PREFETCH_DISTANCE) {
+                size_t j = i - PREFETCH_DISTANCE;
+                MatchFindElem(elems[j]);
+                elems[j]->Next();
+                delete out[j].elem;
+                out[j].elem = elems[j];
+            }
+        }
+
+        return OK;
     }
 
     FawnDS_IteratorElem*
@@ -420,6 +734,28 @@ namespace fawn {
         DPRINTF(2, "HashTableCuckoo::IteratorEnum::Next\n");
         const HashTableCuckoo* table = static_cast<const HashTableCuckoo*>(fawnds);
 
+        if (key.size() != 0) {
+            // Find()
+            if (match_mask == 0) {
+                state = END;
+                return;
+            }
+
+            uint32_t bit = __builtin_ctz(match_mask);
+            match_mask &= match_mask - 1;
+
+            current_keyfrag_id = bit / ASSOCIATIVITY;
+            current_way = bit % ASSOCIATIVITY;
+            current_index = index[current_keyfrag_id];
+            assert(current_index < table->max_index_);
+
+            state = OK;
+            uint32_t v = vals[bit];
+            data = NewValue(&v);
+            return;
+        }
+
+        // Enumerate()
         bool cont = true;
 
         while (cont) {
@@ -429,55 +765,19 @@ namespace fawn {
                 // time to go to the next index
                 current_way = 0;
 
-                if (key.size() != 0) {
-                    // Find()
-
-                    current_keyfrag_id ++;        
-
-                    if (current_keyfrag_id >= NUMHASH) {
-                        state = END;
-                        return;
-                    }
-
-#ifdef SPLIT_HASHTABLE
-                    current_index = (table->keyfrag(key, current_keyfrag_id) + current_keyfrag_id * (1 << KEYFRAGBITS))  % table->max_index_;
-#else
-                    current_index = (table->keyfrag(key, current_keyfrag_id))  % table->max_index_;
-#endif
-
-                }
-                else {
-                    // Enumerate()
-
-                    current_index++;
+                current_index++;
 
-                    if (current_index >= table->max_index_) {
-                        state = END;
-                        return;
-                    }
+                if (current_index >= table->max_index_) {
+                    state = END;
+                    return;
                 }
             }
 
-            // if (key.size() != 0) {
-            //     // for Find(), current_index is derived from current_key_id
-            // }
-
             assert(current_index < table->max_index_);
 
             DPRINTF(2, "check (row %d, col %d) ... ", current_index, current_way);
 
-            if (table->valid(current_index, current_way)) {
-                uint32_t tag = table->tag(current_index, current_way);
-                DPRINTF(2,"tag=");
-                //int_to_bit(tag, (KEYFRAGBITS ));
-
-                if (key.size() != 0 && tag != keyfrag[(current_keyfrag_id + 1) % NUMHASH] ) {
-                    // key mismatch
-                    continue;
-                }
-                
-            }
-            else {
+            if (!table->valid(current_index, current_way)) {
                 // unused space
                 continue;
             }
@@ -512,6 +812,11 @@ namespace fawn {
 #endif
         HashTableCuckoo* table = static_cast<HashTableCuckoo*>(const_cast<FawnDS*>(fawnds));
 
+        if (table->mmap_base_) {
+            DPRINTF(2, "HashTableCuckoo::IteratorElem::Replace(): read-only table\n");
+            return ERROR;
+        }
+
         uint32_t new_id = data.as_number<uint32_t>(-1);
         if (new_id == static_cast<uint32_t>(-1)) {
             DPRINTF(2, "HashTableCuckoo::IteratorElem::Replace(): could not parse data as ID\n");
@@ -519,7 +824,14 @@ namespace fawn {
         }
 
         DPRINTF(2, "HashTableCuckoo::IteratorElem::Replace(): <result> updated\n");
-        table->hash_table_[current_index].val_vector[current_way] = new_id;
+        if (table->versions_) {
+            tbb::spin_mutex::scoped_lock lock(table->write_mutex_);
+            table->begin_write(current_index);
+            table->hash_table_[current_index].val_vector[current_way] = new_id;
+            table->end_write(current_index);
+        }
+        else
+            table->hash_table_[current_index].val_vector[current_way] = new_id;
         return OK;
     } // IteratorElem::Replace
 
@@ -634,4 +946,72 @@ namespace fawn {
     }
 
 
+    // This assumes that the file was closed properly.
+    int
+    HashTableCuckoo::MapFile()
+    {
+        std::string filename = config_->GetStringValue("child::file") + "_";
+        filename += config_->GetStringValue("child::id");
+        DPRINTF(2, "HashTableCuckoo::MapFile(): mapping %s\n", filename.c_str());
+
+        size_t entry_size;
+        if (config_->ExistsNode("child::use-offset") != 0 || atoi(config_->GetStringValue("child::use-offset").c_str()) != 0)
+            entry_size = sizeof(TagValStoreEntry);
+        else
+            entry_size = sizeof(TagStoreEntry);
+        size_t length = sizeof(current_entries_) + entry_size * max_index_;
+
+        int populate = 0;
+        if (config_->ExistsNode("child::mmap-populate") == 0)
+            populate = atoi(config_->GetStringValue("child::mmap-populate").c_str());
+
+        int fd;
+        if ((fd = open(filename.c_str(), O_RDONLY|O_NOATIME)) == -1) {
+            perror("Could not open file");
+            return -1;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < length) {
+            fprintf(stderr, "HashTableCuckoo::MapFile(): file is too small for the hash table\n");
+            close(fd);
+            return -1;
+        }
+
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        if (populate >= 2)
+            flags |= MAP_POPULATE;
+#endif
+        void* base = mmap(NULL, length, PROT_READ, flags, fd, 0);
+        // the mapping stays valid after closing the file
+        close(fd);
+        if (base == MAP_FAILED) {
+            perror("Could not map file");
+            return -1;
+        }
+
+        if (populate == 1)
+            madvise(base, length, MADV_WILLNEED);
+        else if (populate == 0)
+            madvise(base, length, MADV_RANDOM);
+
+        memcpy(&current_entries_, base, sizeof(current_entries_));
+
+        char* table = static_cast<char*>(base) + sizeof(current_entries_);
+        if (entry_size == sizeof(TagValStoreEntry)) {
+            hash_table_ = reinterpret_cast<TagValStoreEntry*>(table);
+            fpf_table_ = NULL;
+        }
+        else {
+            hash_table_ = NULL;
+            fpf_table_ = reinterpret_cast<TagStoreEntry*>(table);
+        }
+        mmap_base_ = base;
+        mmap_len_ = length;
+
+        DPRINTF(2, "HashTableCuckoo::MapFile(): <result> mapped %zu bytes\n", length);
+        return 0;
+    }
+
 } // namespace fawn
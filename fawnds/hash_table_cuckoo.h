@@ -10,6 +10,13 @@
 #include "debug.h"
 
 #include <string>
+#include <cstring>
+#include <tbb/atomic.h>
+#include <tbb/spin_mutex.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 //#define SPLIT_HASHTABLE
@@ -26,6 +33,15 @@ class Configuration;
 //   <hash-table-size>: the number of entries that the hash table is expected to hold
 //   <use-offset>: 1 (default): use an explicit offset field of 4 bytes
 //                 0: do not use offsets; a location in the hash table becomes an offset
+//   <use-mmap>: 0 (default): Open() reads the hash table file into memory
+//               1: Open() maps the hash table file read-only (MAP_PRIVATE); the table can be shared
+//                  through the page cache, but the store becomes read-only
+//   <mmap-populate>: 0 (default): page in the mapped table on demand (MADV_RANDOM)
+//                    1: start asynchronous readahead of the mapped table (MADV_WILLNEED)
+//                    2: fault in the whole mapped table before Open() returns (MAP_POPULATE)
+//   <concurrent>: 0 (default): callers must exclude lookups while Put() runs
+//                 1: Put() searches for a cuckoo path first and then moves entries back to front under per-bucket
+//                    version counters, so that Find() can run concurrently with one writer without locking
 
 class HashTableCuckoo : public FawnDS {
     /*
@@ -36,6 +52,10 @@ class HashTableCuckoo : public FawnDS {
 
     static const uint32_t NUMVICTIM = 2; // size of victim table
     static const uint32_t MAX_CUCKOO_COUNT = 128;
+
+    static const size_t PREFETCH_DISTANCE = 16;   // the number of keys whose buckets are prefetched ahead in MultiFind()
+
+    static const uint32_t VERSION_STRIPES = 8192; // the number of version counters shared by buckets in concurrent mode
     /*
      * make sure KEYFRAGBITS + VALIDBITS <= 16
      */
@@ -82,10 +102,13 @@ public:
 
     virtual FawnDS_ConstIterator Enumerate() const;
     virtual FawnDS_Iterator Enumerate();
+    virtual FawnDS_Return EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size = 1024) const;
 
     virtual FawnDS_ConstIterator Find(const ConstValue& key) const;
     virtual FawnDS_Iterator Find(const ConstValue& key);
 
+    virtual FawnDS_Return MultiFind(const std::vector<ConstValue>& keys, std::vector<FawnDS_ConstIterator>& out) const;
+
     struct IteratorElem : public FawnDS_IteratorElem {
         FawnDS_IteratorElem* Clone() const;
         void Next();
@@ -94,19 +117,37 @@ public:
         uint32_t current_keyfrag_id;
         uint32_t current_index;
         uint32_t current_way;
+        uint32_t index[NUMHASH];
+        uint32_t match_mask;    // for Find(); the matching ways not visited yet
+        uint32_t vals[NUMHASH * ASSOCIATIVITY];    // for Find(); the values of the matching ways read with the tags
     };
 
 protected:
+    int SetTableSize();
     int WriteToFile();
     int ReadFromFile();
+    int MapFile();
+
+    IteratorElem* NewFindElem(const ConstValue& key) const;
+    void MatchFindElem(IteratorElem* elem) const;
+
+    FawnDS_Return PutConcurrent(const ConstValue& key, uint32_t id);
+    bool SearchPath(uint32_t start_index, uint32_t* path_index, uint8_t* path_way, uint32_t& depth,
+                    uint32_t& free_index, uint32_t& free_way) const;
 
 private:
     TagValStoreEntry* hash_table_;
     TagStoreEntry*    fpf_table_;
 
+    void*     mmap_base_;     // non-NULL if the table is mapped from the file
+    size_t    mmap_len_;
+
+    tbb::atomic<uint32_t>* versions_;   // non-NULL in concurrent mode; odd while a bucket is being written
+    tbb::spin_mutex write_mutex_;       // serializes writers in concurrent mode
+
     uint32_t  max_index_;
     uint32_t  max_entries_;
-    uint32_t  current_entries_;
+    tbb::atomic<uint32_t> current_entries_;     // read by Status() while writers insert; stored as a plain uint32_t
     
     inline bool valid(uint32_t index, uint32_t way) const {
         uint32_t pos = way * (KEYFRAGBITS + 1);
@@ -151,6 +192,66 @@ private:
         return (tmp & KEYFRAGMASK);
     }
 
+    inline const char* tag_vector(uint32_t index) const {
+        if (hash_table_)
+            return hash_table_[index].tag_vector;
+        else
+            return fpf_table_[index].tag_vector;
+    }
+
+    // compare a tag against all ways of the NUMHASH candidate buckets at once
+    // returns a bitmask of the valid ways whose tag matches; bit (i * ASSOCIATIVITY + way) is for the i-th bucket
+    inline uint32_t match(const uint32_t* indexes, const uint32_t* tags) const {
+        assert(KEYFRAGBITS == 15);
+#ifdef __SSE2__
+        if (NUMHASH == 2 && ASSOCIATIVITY == 4) {
+            // each bucket holds four 16-bit (valid bit + tag) lanes in 8 bytes; check both buckets with one comparison
+            // _mm_loadl_epi64() needs no alignment and, unlike _mm_cvtsi64_si128(), is available on 32-bit x86
+            __m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(tag_vector(indexes[0]))),
+                                           _mm_loadl_epi64(reinterpret_cast<const __m128i*>(tag_vector(indexes[1]))));
+            __m128i t = _mm_unpacklo_epi64(_mm_set1_epi16(static_cast<short>((tags[0] & KEYFRAGMASK) | VALIDBITMASK)),
+                                           _mm_set1_epi16(static_cast<short>((tags[1] & KEYFRAGMASK) | VALIDBITMASK)));
+            __m128i eq = _mm_cmpeq_epi16(v, t);
+            // narrow each 16-bit lane to a byte so that movemask yields one bit per way
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_packs_epi16(eq, _mm_setzero_si128())));
+        }
+#endif
+        uint32_t mask = 0;
+        for (uint32_t i = 0; i < NUMHASH; i++) {
+            const char* tv = tag_vector(indexes[i]);
+            for (uint32_t way = 0; way < ASSOCIATIVITY; way++) {
+                uint16_t tmp;
+                memcpy(&tmp, tv + way * (KEYFRAGBITS + 1) / 8, sizeof(tmp));
+                if ((tmp & KEYPRESENTMASK) == ((tags[i] & KEYFRAGMASK) | VALIDBITMASK))
+                    mask |= 1u << (i * ASSOCIATIVITY + way);
+            }
+        }
+        return mask;
+    }
+
+    // the bucket and the tag of an entry stored at (index, tag) after being kicked out
+    inline uint32_t alt_index(uint32_t tag) const {
+#ifdef SPLIT_HASHTABLE
+        return (tag + (1 << KEYFRAGBITS)) % max_index_;
+#else
+        return tag % max_index_;
+#endif
+    }
+
+    inline uint32_t alt_tag(uint32_t index) const {
+        return index % max_index_;
+    }
+
+    inline void begin_write(uint32_t index) {
+        if (versions_)
+            versions_[index % VERSION_STRIPES]++;
+    }
+
+    inline void end_write(uint32_t index) {
+        if (versions_)
+            versions_[index % VERSION_STRIPES]++;
+    }
+
     inline uint32_t val(uint32_t index, uint32_t way) const {
         if (hash_table_)
             return hash_table_[index].val_vector[way];
@@ -199,7 +300,7 @@ private:
 
 
     /* check if the given row has a free slot, return its way */
-    uint32_t freeslot(uint32_t index)  {
+    uint32_t freeslot(uint32_t index) const {
         uint32_t way;
         for (way = 0; way < ASSOCIATIVITY; way++) {
             DPRINTF(4, "check ... (%d, %d)\t", index, way);
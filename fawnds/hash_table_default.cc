@@ -11,6 +11,7 @@
 #include <cstdio>
 #include <cerrno>
 #include <sstream>
+#include <algorithm>
 
 namespace fawn {
 
@@ -405,6 +406,33 @@ namespace fawn {
         return FawnDS_Iterator(elem);
     }
 
+    FawnDS_Return
+    HashTableDefault::MultiFind(const std::vector<ConstValue>& keys, std::vector<FawnDS_ConstIterator>& out) const
+    {
+        size_t n = keys.size();
+        out.resize(n);
+
+        // prefetch the first probe of each key PREFETCH_DISTANCE keys ahead of the actual lookup
+        for (size_t i = 0; i < n + PREFETCH_DISTANCE; i++) {
+            if (i < n) {
+                // same as the first probe in IteratorElem::Next()
+                size_t first_index = (*(Hashes::hashes[0]))(keys[i].data(), keys[i].size());
+                first_index &= hash_table_size_ - 1;
+                size_t index = static_cast<size_t>(first_index + c_1_ + c_2_ + 0.5);
+                index &= hash_table_size_ - 1;
+                __builtin_prefetch(&hash_table_[index]);
+            }
+
+            if (i >= PREFETCH_DISTANCE) {
+                size_t j = i - PREFETCH_DISTANCE;
+                FawnDS_ConstIterator it = Find(keys[j]);
+                std::swap(out[j].elem, it.elem);
+            }
+        }
+
+        return OK;
+    }
+
     FawnDS_IteratorElem*
     HashTableDefault::IteratorElem::Clone() const
     {
@@ -34,6 +34,8 @@ class HashTableDefault : public FawnDS {
     static const double PROBES_BEFORE_REHASH = 8;
     //static const double PROBES_BEFORE_REHASH = 16;
 
+    static const size_t PREFETCH_DISTANCE = 16;   // the number of keys whose first probes are prefetched ahead in MultiFind()
+
 protected:
     /*
       Hash Entry Format
@@ -82,6 +84,8 @@ public:
     virtual FawnDS_ConstIterator Find(const ConstValue& key) const;
     virtual FawnDS_Iterator Find(const ConstValue& key);
 
+    virtual FawnDS_Return MultiFind(const std::vector<ConstValue>& keys, std::vector<FawnDS_ConstIterator>& out) const;
+
     struct IteratorElem : public FawnDS_IteratorElem {
         FawnDS_IteratorElem* Clone() const;
         void Next();
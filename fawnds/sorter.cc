@@ -3,12 +3,28 @@
 #include "debug.h"
 #include "configuration.h"
 #ifndef HAVE_LIBNSORT
+#include "file_io.h"
 #include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <tbb/atomic.h>
 #endif
 #include <cassert>
+#include <cstdio>
 
 namespace fawn {
 
+#ifndef HAVE_LIBNSORT
+    static const size_t spill_write_buffer_size = 1048576;
+    static const size_t arena_chunk_size = 4194304;
+    // buckets smaller than this are sorted by insertion sort instead of another radix pass
+    static const size_t radix_sort_cutoff = 32;
+    // runs smaller than this are sorted by a single thread
+    static const size_t parallel_sort_cutoff = 65536;
+#endif
+
     Sorter::Sorter()
         : open_(false)
     {
@@ -20,6 +36,38 @@ namespace fawn {
             Close();
     }
 
+    Configuration*
+    Sorter::NewConfig(size_t key_len, size_t data_len, const std::string& temp_file, size_t memory_limit, size_t sort_threads)
+    {
+        Configuration* config = new Configuration();
+
+        char key_len_buf[32];
+        char data_len_buf[32];
+        char memory_limit_buf[32];
+        char sort_threads_buf[32];
+        snprintf(key_len_buf, sizeof(key_len_buf), "%zu", key_len);
+        snprintf(data_len_buf, sizeof(data_len_buf), "%zu", data_len);
+        snprintf(memory_limit_buf, sizeof(memory_limit_buf), "%zu", memory_limit);
+        snprintf(sort_threads_buf, sizeof(sort_threads_buf), "%zu", sort_threads);
+
+        const char* knobs[][2] = {
+            { "type", "sorter" },
+            { "key-len", key_len_buf },
+            { "data-len", data_len_buf },
+            { "temp-file", temp_file.c_str() },
+            { "memory-limit", memory_limit_buf },
+            { "sort-threads", sort_threads_buf },
+        };
+        for (size_t i = 0; i < sizeof(knobs) / sizeof(knobs[0]); i++) {
+            if (config->CreateNodeAndAppend(knobs[i][0], ".") != 0 || config->SetStringValue(knobs[i][0], knobs[i][1]) != 0) {
+                fprintf(stderr, "Sorter::NewConfig(): cannot set <%s>\n", knobs[i][0]);
+                delete config;
+                return NULL;
+            }
+        }
+        return config;
+    }
+
     FawnDS_Return
     Sorter::Create()
     {
@@ -41,6 +89,30 @@ namespace fawn {
         else
             temp_file_ = "/tmp";
 
+#ifndef HAVE_LIBNSORT
+        if (config_->ExistsNode("child::memory-limit") == 0)
+            memory_limit_ = atoll(config_->GetStringValue("child::memory-limit").c_str());
+        else
+            memory_limit_ = 0;
+
+        int sort_threads;
+        if (config_->ExistsNode("child::sort-threads") == 0)
+            sort_threads = atoi(config_->GetStringValue("child::sort-threads").c_str());
+        else
+            sort_threads = 1;
+        if (sort_threads < 1)
+            return ERROR;
+        sort_threads_ = sort_threads;
+
+        if (memory_limit_ != 0 && key_len_ + data_len_ == 0) {
+            // spilled runs cannot hold empty records
+            return ERROR;
+        }
+
+        arena_chunk_used_ = 0;
+        memory_used_ = 0;
+#endif
+
 #ifdef HAVE_LIBNSORT
         char buf[1024];
 
@@ -73,23 +145,6 @@ namespace fawn {
         return OK;
     }
 
-#ifndef HAVE_LIBNSORT
-    struct _ordering {
-        const std::vector<Value>& key_array;
-
-        _ordering(const std::vector<Value>& key_array) : key_array(key_array) {}
-
-        bool operator()(const size_t& i, const size_t& j) {
-            // sort key = (entry key, index)
-            int cmp = key_array[i].compare(key_array[j]);
-            if (cmp != 0)
-                return cmp < 0;
-            else
-                return i < j;   // stable sorting
-        };
-    };
-#endif
-
     FawnDS_Return
     Sorter::Flush()
     {
@@ -101,15 +156,33 @@ namespace fawn {
         input_ended_ = true;
 
 #ifndef HAVE_LIBNSORT
-        refs_.reserve(key_array_.size());
-        for (size_t i = 0; i < key_array_.size(); i++)
-            refs_.push_back(i);
-
-        // uses unstable sorting with stable sort key comparison
-        // because std::sort() is often more efficient than std::stable_sort()
-        std::sort(refs_.begin(), refs_.end(), _ordering(key_array_));
-
-        refs_it_ = refs_.begin();
+        if (runs_.size() == 0) {
+            sort_memory_run();
+            refs_it_ = refs_.begin();
+        }
+        else {
+            // spill the last run as well so that the read buffers for merging runs can use all memory
+            if (refs_.size() != 0) {
+                if (spill_run() != OK)
+                    return ERROR;
+            }
+
+            size_t record_len = key_len_ + data_len_;
+            size_t buf_size = memory_limit_ / runs_.size() / record_len * record_len;
+            if (buf_size < record_len)
+                buf_size = record_len;
+
+            for (size_t i = 0; i < runs_.size(); i++) {
+                runs_[i]->buf.resize(buf_size);
+                runs_[i]->offset = 0;
+                if (!fill_run(runs_[i]))
+                    return ERROR;
+            }
+
+            loser_tree_.assign(runs_.size(), -1);
+            for (size_t i = runs_.size(); i > 0; i--)
+                adjust_loser_tree(i - 1);
+        }
 #else
         nsort_msg_t ret = nsort_release_end(&nsort_ctx_);
         if (ret != NSORT_SUCCESS)
@@ -126,9 +199,16 @@ namespace fawn {
             return ERROR;
 
 #ifndef HAVE_LIBNSORT
-        key_array_.clear();
-        data_array_.clear();
+        free_arena();
         refs_.clear();
+
+        // the spill files were unlinked when they were created
+        for (size_t i = 0; i < runs_.size(); i++) {
+            close(runs_[i]->fd);
+            delete runs_[i];
+        }
+        runs_.clear();
+        loser_tree_.clear();
 #else
         nsort_end(&nsort_ctx_);
         nsort_buf_.resize(0);
@@ -152,10 +232,19 @@ namespace fawn {
             return INVALID_DATA;
 
 #ifndef HAVE_LIBNSORT
-        NewValue copied_key(key.data(), key.size());
-        NewValue copied_value(data.data(), data.size());
-        key_array_.push_back(copied_key);
-        data_array_.push_back(copied_value);
+        char* record = alloc_record();
+        memcpy(record, key.data(), key_len_);
+        memcpy(record + key_len_, data.data(), data_len_);
+        refs_.push_back(record);
+
+        if (memory_limit_ != 0) {
+            memory_used_ += key_len_ + data_len_ + sizeof(const char*);
+            if (memory_used_ >= memory_limit_) {
+                FawnDS_Return ret = spill_run();
+                if (ret != OK)
+                    return ret;
+            }
+        }
 #else
         memcpy(nsort_buf_.data(), key.data(), key_len_);
         memcpy(nsort_buf_.data() + key_len_, data.data(), data_len_);
@@ -198,6 +287,395 @@ namespace fawn {
         return FawnDS_Iterator(elem);
     }
 
+    FawnDS_Return
+    Sorter::EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size) const
+    {
+#ifndef HAVE_LIBNSORT
+        if (!open_ || !input_ended_)
+            return ERROR;
+        if (batch_size == 0)
+            batch_size = 1;
+
+        // continues from the position of the previous enumeration as Enumerate() does
+        size_t record_len = key_len_ + data_len_;
+        std::vector<FawnDS_Span> keys(batch_size);
+        std::vector<FawnDS_Span> data(batch_size);
+        std::vector<FawnDS_Return> states(batch_size, OK);
+
+        if (runs_.size() == 0) {
+            // refers to the records in the arena without copying
+            while (refs_it_ != refs_.end()) {
+                size_t n = 0;
+                for (; n < batch_size && refs_it_ != refs_.end(); n++, ++refs_it_) {
+                    keys[n].data = *refs_it_;
+                    keys[n].size = key_len_;
+                    data[n].data = *refs_it_ + key_len_;
+                    data[n].size = data_len_;
+                }
+                FawnDS_Batch batch = { n, &keys[0], &data[0], &states[0] };
+                if (!callback.Process(batch))
+                    return OK;
+            }
+            return OK;
+        }
+
+        // merged records are copied because a run's read buffer is refilled within a batch
+        std::vector<char> buf(batch_size * record_len);
+        while (true) {
+            size_t n = 0;
+            for (; n < batch_size; n++) {
+                ssize_t winner = loser_tree_[0];
+                if (run_exhausted(winner))
+                    break;
+
+                char* record = &buf[n * record_len];
+                memcpy(record, run_record(winner), record_len);
+                keys[n].data = record;
+                keys[n].size = key_len_;
+                data[n].data = record + key_len_;
+                data[n].size = data_len_;
+
+                Run* run = runs_[winner];
+                run->buf_pos += record_len;
+                if (run->buf_pos == run->buf_len && !fill_run(run))
+                    return ERROR;
+                adjust_loser_tree(winner);
+            }
+
+            if (n == 0)
+                return OK;
+            FawnDS_Batch batch = { n, &keys[0], &data[0], &states[0] };
+            if (!callback.Process(batch))
+                return OK;
+        }
+#else
+        return FawnDS::EnumerateBatch(callback, batch_size);
+#endif
+    }
+
+#ifndef HAVE_LIBNSORT
+    char*
+    Sorter::alloc_record()
+    {
+        size_t record_len = key_len_ + data_len_;
+        if (arena_chunks_.size() == 0 || arena_chunk_used_ + record_len > arena_chunk_size) {
+            arena_chunks_.push_back(new char[std::max(arena_chunk_size, record_len)]);
+            arena_chunk_used_ = 0;
+        }
+        char* record = arena_chunks_.back() + arena_chunk_used_;
+        arena_chunk_used_ += record_len;
+        return record;
+    }
+
+    void
+    Sorter::free_arena()
+    {
+        for (size_t i = 0; i < arena_chunks_.size(); i++)
+            delete [] arena_chunks_[i];
+        arena_chunks_.clear();
+        arena_chunk_used_ = 0;
+    }
+
+    size_t
+    Sorter::radix_pass(const char** refs, const char** temp_refs, size_t n, size_t depth, size_t* counts) const
+    {
+        // partitions refs stably by the first key byte at or after depth that is not shared by all keys;
+        // returns the depth of that byte, or key_len_ if all keys are identical
+        for (; depth < key_len_; depth++) {
+            memset(counts, 0, sizeof(size_t) * 256);
+            for (size_t i = 0; i < n; i++)
+                counts[static_cast<uint8_t>(refs[i][depth])]++;
+
+            // skip the pass if all keys share this byte
+            if (counts[static_cast<uint8_t>(refs[0][depth])] != n)
+                break;
+        }
+        if (depth == key_len_)
+            return depth;
+
+        size_t offsets[256];
+        size_t offset = 0;
+        for (size_t b = 0; b < 256; b++) {
+            offsets[b] = offset;
+            offset += counts[b];
+        }
+
+        for (size_t i = 0; i < n; i++)
+            temp_refs[offsets[static_cast<uint8_t>(refs[i][depth])]++] = refs[i];
+        memcpy(refs, temp_refs, sizeof(const char*) * n);
+
+        return depth;
+    }
+
+    void
+    Sorter::radix_sort(const char** refs, const char** temp_refs, size_t n, size_t depth) const
+    {
+        // stable MSD radix sort on one key byte per pass
+        if (depth == key_len_)
+            return;
+
+        if (n < radix_sort_cutoff) {
+            for (size_t i = 1; i < n; i++) {
+                const char* ref = refs[i];
+                size_t j = i;
+                while (j > 0 && memcmp(refs[j - 1] + depth, ref + depth, key_len_ - depth) > 0) {
+                    refs[j] = refs[j - 1];
+                    j--;
+                }
+                refs[j] = ref;
+            }
+            return;
+        }
+
+        size_t counts[256];
+        depth = radix_pass(refs, temp_refs, n, depth, counts);
+        if (depth == key_len_)
+            return;
+
+        size_t offset = 0;
+        for (size_t b = 0; b < 256; b++) {
+            if (counts[b] > 1)
+                radix_sort(refs + offset, temp_refs + offset, counts[b], depth + 1);
+            offset += counts[b];
+        }
+    }
+
+    // work shared by sorting threads; each thread takes the next unclaimed item until none is left
+    struct SortWork {
+        const Sorter* sorter;
+        void (*func)(SortWork* work, size_t item);
+        size_t num_items;
+        tbb::atomic<size_t> next_item;
+
+        const char** refs;
+        const char** temp_refs;
+        size_t depth;
+        const size_t* starts;           // the first ref of each item
+        const size_t* ends;             // one past the last ref of each item
+    };
+
+    static void*
+    sort_thread_main(void* arg)
+    {
+        SortWork* work = static_cast<SortWork*>(arg);
+        while (true) {
+            size_t item = work->next_item++;
+            if (item >= work->num_items)
+                break;
+            work->func(work, item);
+        }
+        return NULL;
+    }
+
+    static void
+    run_sort_work(SortWork* work, size_t num_threads)
+    {
+        work->next_item = 0;
+
+        std::vector<pthread_t> tids;
+        for (size_t i = 1; i < num_threads && i < work->num_items; i++) {
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, sort_thread_main, work) != 0) {
+                perror("Sorter: cannot create a sorting thread");
+                break;
+            }
+            tids.push_back(tid);
+        }
+
+        // the calling thread also works
+        sort_thread_main(work);
+
+        for (size_t i = 0; i < tids.size(); i++)
+            pthread_join(tids[i], NULL);
+    }
+
+    void
+    Sorter::parallel_sort(const char** refs, const char** temp_refs, size_t n)
+    {
+        SortWork work;
+        work.sorter = this;
+        work.refs = refs;
+        work.temp_refs = temp_refs;
+
+        // the first radix pass splits refs into disjoint key ranges that need no merging
+        size_t counts[256];
+        size_t depth = radix_pass(refs, temp_refs, n, 0, counts);
+        if (depth == key_len_)
+            return;
+
+        size_t starts[256];
+        size_t ends[256];
+        size_t offset = 0;
+        for (size_t b = 0; b < 256; b++) {
+            starts[b] = offset;
+            offset += counts[b];
+            ends[b] = offset;
+        }
+
+        work.func = &Sorter::sort_radix_bucket;
+        work.num_items = 256;
+        work.depth = depth + 1;
+        work.starts = starts;
+        work.ends = ends;
+        run_sort_work(&work, sort_threads_);
+    }
+
+    void
+    Sorter::sort_radix_bucket(SortWork* work, size_t item)
+    {
+        size_t start = work->starts[item];
+        size_t n = work->ends[item] - start;
+        if (n > 1)
+            work->sorter->radix_sort(work->refs + start, work->temp_refs + start, n, work->depth);
+    }
+
+    void
+    Sorter::sort_memory_run()
+    {
+        // refs_ is in insertion order, which radix sort keeps for identical keys
+        size_t n = refs_.size();
+        if (n == 0)
+            return;
+
+        std::vector<const char*> temp_refs(n);
+        if (sort_threads_ > 1 && n >= parallel_sort_cutoff)
+            parallel_sort(&refs_[0], &temp_refs[0], n);
+        else
+            radix_sort(&refs_[0], &temp_refs[0], n, 0);
+    }
+
+    FawnDS_Return
+    Sorter::spill_run()
+    {
+        sort_memory_run();
+
+        std::string path = temp_file_ + "/sorter_XXXXXX";
+        std::vector<char> path_buf(path.begin(), path.end());
+        path_buf.push_back(0);
+
+        int fd = mkstemp(&path_buf[0]);
+        if (fd == -1) {
+            fprintf(stderr, "Sorter::spill_run(): cannot create a temporary file in %s: %s\n", temp_file_.c_str(), strerror(errno));
+            return ERROR;
+        }
+        // the file is removed as soon as it is closed
+        unlink(&path_buf[0]);
+
+        DPRINTF(2, "Sorter::spill_run(): spilling %zu entries to run %zu\n", refs_.size(), runs_.size());
+
+        Run* run = new Run();
+        run->fd = fd;
+        run->size = 0;
+        run->offset = 0;
+        run->buf_pos = 0;
+        run->buf_len = 0;
+
+        std::vector<char> buf;
+        buf.reserve(spill_write_buffer_size + key_len_ + data_len_);
+
+        for (size_t i = 0; i <= refs_.size(); i++) {
+            if (i < refs_.size()) {
+                buf.insert(buf.end(), refs_[i], refs_[i] + key_len_ + data_len_);
+                if (buf.size() < spill_write_buffer_size)
+                    continue;
+            }
+
+            size_t written = 0;
+            while (written < buf.size()) {
+                ssize_t ret = pwrite(fd, &buf[written], buf.size() - written, run->size);
+                if (ret <= 0) {
+                    if (ret == -1 && errno == EINTR)
+                        continue;
+                    fprintf(stderr, "Sorter::spill_run(): cannot write a run: %s\n", strerror(errno));
+                    close(fd);
+                    delete run;
+                    return ERROR;
+                }
+                written += ret;
+                run->size += ret;
+            }
+            buf.clear();
+        }
+
+        runs_.push_back(run);
+
+        free_arena();
+        refs_.clear();
+        memory_used_ = 0;
+
+        return OK;
+    }
+
+    bool
+    Sorter::fill_run(Run* run) const
+    {
+        size_t len = run->buf.size();
+        if (static_cast<off_t>(len) > run->size - run->offset)
+            len = run->size - run->offset;
+
+        size_t read_len = 0;
+        while (read_len < len) {
+            ssize_t ret = pread(run->fd, &run->buf[read_len], len - read_len, run->offset + read_len);
+            if (ret <= 0) {
+                if (ret == -1 && errno == EINTR)
+                    continue;
+                fprintf(stderr, "Sorter::fill_run(): cannot read a run: %s\n", ret == 0 ? "unexpected end of file" : strerror(errno));
+                return false;
+            }
+            read_len += ret;
+        }
+
+        run->offset += len;
+        run->buf_pos = 0;
+        run->buf_len = len;
+        return true;
+    }
+
+    bool
+    Sorter::run_exhausted(size_t i) const
+    {
+        return runs_[i]->buf_pos == runs_[i]->buf_len;
+    }
+
+    const char*
+    Sorter::run_record(size_t i) const
+    {
+        return &runs_[i]->buf[runs_[i]->buf_pos];
+    }
+
+    bool
+    Sorter::run_precedes(ssize_t i, ssize_t j) const
+    {
+        // -1 is a placeholder used while building the tree and precedes every run
+        if (i == -1)
+            return true;
+        if (j == -1)
+            return false;
+        if (run_exhausted(i))
+            return false;
+        if (run_exhausted(j))
+            return true;
+
+        int cmp = memcmp(run_record(i), run_record(j), key_len_);
+        if (cmp != 0)
+            return cmp < 0;
+        else
+            return i < j;   // stable merging; earlier runs hold earlier entries
+    }
+
+    void
+    Sorter::adjust_loser_tree(ssize_t i) const
+    {
+        // replay the matches from the leaf of run i to the root
+        ssize_t winner = i;
+        for (size_t node = (i + runs_.size()) / 2; node > 0; node /= 2) {
+            if (run_precedes(loser_tree_[node], winner))
+                std::swap(loser_tree_[node], winner);
+        }
+        loser_tree_[0] = winner;
+    }
+#endif
+
     Sorter::IteratorElem::IteratorElem(const Sorter* fawnds)
     {
         this->fawnds = fawnds;
@@ -227,7 +705,34 @@ namespace fawn {
 
 #ifndef HAVE_LIBNSORT
 
-        std::vector<size_t>::const_iterator& refs_it = sorter->refs_it_;
+        if (sorter->runs_.size() != 0) {
+            if (!initial) {
+                ssize_t winner = sorter->loser_tree_[0];
+                Run* run = sorter->runs_[winner];
+                run->buf_pos += sorter->key_len_ + sorter->data_len_;
+                if (run->buf_pos == run->buf_len && !sorter->fill_run(run)) {
+                    assert(false);
+                    state = END;
+                    return;
+                }
+                sorter->adjust_loser_tree(winner);
+            }
+
+            ssize_t winner = sorter->loser_tree_[0];
+            if (sorter->run_exhausted(winner)) {
+                state = END;
+                return;
+            }
+
+            // the record is copied because the read buffer is reused
+            const char* record = sorter->run_record(winner);
+            state = OK;
+            key = NewValue(record, sorter->key_len_);
+            data = NewValue(record + sorter->key_len_, sorter->data_len_);
+            return;
+        }
+
+        std::vector<const char*>::const_iterator& refs_it = sorter->refs_it_;
 
         if (!initial)
             ++refs_it;
@@ -238,8 +743,10 @@ namespace fawn {
         }
 
         state = OK;
-        key = sorter->key_array_[*refs_it];
-        data = sorter->data_array_[*refs_it];
+        // refers to the record without copying; valid until the sorter is closed
+        char* record = const_cast<char*>(*refs_it);
+        key = RefValue(record, sorter->key_len_);
+        data = RefValue(record + sorter->key_len_, sorter->data_len_);
 
 #else
 
@@ -13,17 +13,26 @@
 
 namespace fawn {
 
+#ifndef HAVE_LIBNSORT
+    struct SortWork;
+#endif
+
     // configuration
     //   <type>: "sorter" (fixed)
-    //   <key-len>: the length of keys -- zero for variable-length keys (default), a positive integer for fixed-length keys
-    //   <data-len>: the length of data -- zero for variable-length data (default), a positive integer for fixed-length data
+    //   <key-len>: the length of every key.  Entries are sorted as fixed-length records, so all keys must have this length.  0 is default.
+    //   <data-len>: the length of every data.  0 is default.  <key-len> and <data-len> must not both be zero with <memory-limit>.
     //   <temp-file>: the path of the temporary files/directory. "/tmp" is the default.
+    //   <memory-limit>: the approximate number of bytes of entries to keep in memory; sorted runs that exceed it are spilled to files in <temp-file> and merged at the end.  0 keeps all entries in memory (default).  Ignored with Nsort.
+    //   <sort-threads>: the number of threads used to sort entries in memory.  1 is default.  Ignored with Nsort.
 
     class Sorter : public FawnDS {
     public:
         Sorter();
         virtual ~Sorter();
 
+        // makes a configuration with all of the knobs above; NULL on failure
+        static Configuration* NewConfig(size_t key_len, size_t data_len, const std::string& temp_file = "/tmp", size_t memory_limit = 0, size_t sort_threads = 1);
+
         virtual FawnDS_Return Create();
         //virtual FawnDS_Return Open();
 
@@ -43,6 +52,7 @@ namespace fawn {
 
         virtual FawnDS_ConstIterator Enumerate() const;
         virtual FawnDS_Iterator Enumerate();
+        virtual FawnDS_Return EnumerateBatch(FawnDS_BatchCallback& callback, size_t batch_size = 1024) const;
 
         //virtual FawnDS_ConstIterator Find(const ConstValue& key) const;
         //virtual FawnDS_Iterator Find(const ConstValue& key);
@@ -66,10 +76,43 @@ namespace fawn {
         std::string temp_file_;
 
 #ifndef HAVE_LIBNSORT
-        std::vector<Value> key_array_;
-        std::vector<Value> data_array_;
-        std::vector<size_t> refs_;
-        mutable std::vector<size_t>::const_iterator refs_it_;
+        // a sorted run spilled to a temporary file and the buffered read position used while merging runs
+        struct Run {
+            int fd;
+            off_t size;
+            off_t offset;
+            std::vector<char> buf;
+            size_t buf_pos;
+            size_t buf_len;
+        };
+
+        char* alloc_record();
+        void free_arena();
+        size_t radix_pass(const char** refs, const char** temp_refs, size_t n, size_t depth, size_t* counts) const;
+        void radix_sort(const char** refs, const char** temp_refs, size_t n, size_t depth) const;
+        void parallel_sort(const char** refs, const char** temp_refs, size_t n);
+        static void sort_radix_bucket(SortWork* work, size_t item);
+        void sort_memory_run();
+        FawnDS_Return spill_run();
+        bool fill_run(Run* run) const;
+        bool run_exhausted(size_t i) const;
+        const char* run_record(size_t i) const;
+        bool run_precedes(ssize_t i, ssize_t j) const;
+        void adjust_loser_tree(ssize_t i) const;
+
+        // entries are stored as fixed-length records (key followed by data) appended to large arena chunks;
+        // refs_ points to the records in insertion order and is sorted by radix sort
+        std::vector<char*> arena_chunks_;
+        size_t arena_chunk_used_;
+        std::vector<const char*> refs_;
+        mutable std::vector<const char*>::const_iterator refs_it_;
+
+        size_t memory_limit_;
+        size_t sort_threads_;
+        size_t memory_used_;
+        std::vector<Run*> runs_;
+        // runs_.size() - 1 internal nodes holding the losers, with the winner (the run of the next record) in [0]
+        mutable std::vector<ssize_t> loser_tree_;
 #else
         mutable nsort_t nsort_ctx_;
         mutable Value nsort_buf_;
@@ -9,6 +9,9 @@
 
 namespace fawn {
 
+    // a value either refers to external memory, owns a small buffer inline, or shares a heap block with its copies;
+    // copying an inline value copies its bytes, and a heap block holds its share count in front of the data
+
 	class ConstValue
 	{
     public:
@@ -23,6 +26,13 @@ namespace fawn {
             copy_from(rhs);
 		}
 
+#if __cplusplus >= 201103L
+		ConstValue(ConstValue&& rhs)
+		{
+            move_from(rhs);
+		}
+#endif
+
 		~ConstValue()
 		{
             // Decendant classes must not define a destructor
@@ -31,10 +41,8 @@ namespace fawn {
 
         void reset()
         {
-			if (share_count_ptr_ && !--*share_count_ptr_) {
-				delete [] data_;
-				delete share_count_ptr_;
-			}
+			if (share_count_ptr_ && !--*share_count_ptr_)
+				delete [] reinterpret_cast<char*>(share_count_ptr_);
             data_ = NULL;
             size_ = 0;
             capacity_ = 0;
@@ -43,10 +51,34 @@ namespace fawn {
 
 		ConstValue& operator=(const ConstValue& rhs)
 		{
-            reset();
-            copy_from(rhs);
+            if (this != &rhs) {
+                reset();
+                copy_from(rhs);
+            }
+			return *this;
+		}
+
+#if __cplusplus >= 201103L
+		ConstValue& operator=(ConstValue&& rhs)
+		{
+            if (this != &rhs) {
+                reset();
+                move_from(rhs);
+            }
 			return *this;
 		}
+#endif
+
+        // exchanges contents without touching share counts
+        void swap(ConstValue& rhs)
+        {
+            if (this == &rhs)
+                return;
+            ConstValue t;
+            t.move_from(*this);
+            move_from(rhs);
+            rhs.move_from(t);
+        }
 
         bool operator==(const ConstValue& rhs) const
         {
@@ -157,16 +189,35 @@ namespace fawn {
         }
 
     protected:
+        static const size_t inline_capacity_ = 64;
+
+        bool is_inline() const { return data_ == inline_buf_; }
+
+        // allocates a heap block with a share count of 1
+        static char* new_shared(size_t capacity, size_t*& share_count_ptr)
+        {
+            char* block = new char[sizeof(size_t) + capacity];
+            share_count_ptr = reinterpret_cast<size_t*>(block);
+            *share_count_ptr = 1;
+            return block + sizeof(size_t);
+        }
+
         void init_copy(const char* data, size_t size, size_t capacity)
         {
             // must be called at most once
             if (capacity < size)
                 capacity = size;
-            data_ = new char[capacity];
+            if (capacity <= inline_capacity_) {
+                data_ = inline_buf_;
+                capacity_ = inline_capacity_;
+                share_count_ptr_ = NULL;
+            }
+            else {
+                data_ = new_shared(capacity, share_count_ptr_);
+                capacity_ = capacity;
+            }
             memcpy(const_cast<char*>(data_), data, size);
             size_ = size;
-            capacity_ = capacity;
-            share_count_ptr_ = new size_t(1);
         }
 
         void init_ref(const char* data, size_t size, size_t capacity)
@@ -183,17 +234,41 @@ namespace fawn {
         void copy_from(const ConstValue& rhs)
         {
             // reset() is required if this object was holding data
-			data_ = rhs.data_;
+            if (rhs.is_inline()) {
+                memcpy(inline_buf_, rhs.inline_buf_, inline_capacity_);
+                data_ = inline_buf_;
+            }
+            else
+                data_ = rhs.data_;
 			size_ = rhs.size_;
 			capacity_ = rhs.capacity_;
 			if ((share_count_ptr_ = rhs.share_count_ptr_))
 				++*rhs.share_count_ptr_;
         }
 
+        void move_from(ConstValue& rhs)
+        {
+            // reset() is required if this object was holding data; rhs becomes empty
+            if (rhs.is_inline()) {
+                memcpy(inline_buf_, rhs.inline_buf_, inline_capacity_);
+                data_ = inline_buf_;
+            }
+            else
+                data_ = rhs.data_;
+            size_ = rhs.size_;
+            capacity_ = rhs.capacity_;
+            share_count_ptr_ = rhs.share_count_ptr_;
+            rhs.data_ = NULL;
+            rhs.size_ = 0;
+            rhs.capacity_ = 0;
+            rhs.share_count_ptr_ = NULL;
+        }
+
 		const char* data_;
 		size_t size_;
         size_t capacity_;
 		size_t* share_count_ptr_;
+        char inline_buf_[inline_capacity_];
     };
 
 	class Value : public ConstValue
@@ -205,6 +280,10 @@ namespace fawn {
 
 		explicit Value(const ConstValue& rhs) : ConstValue(rhs) { } // not safe initialization
 
+#if __cplusplus >= 201103L
+		Value(Value&& rhs) : ConstValue(static_cast<ConstValue&&>(rhs)) { }
+#endif
+
 		Value& operator=(const Value& rhs)
 		{
             return (*this = static_cast<const ConstValue&>(rhs));
@@ -212,11 +291,24 @@ namespace fawn {
 
 		Value& operator=(const ConstValue& rhs)
 		{
-            reset();
-            copy_from(rhs);
+            if (this != &rhs) {
+                reset();
+                copy_from(rhs);
+            }
 			return *this;
         }
 
+#if __cplusplus >= 201103L
+		Value& operator=(Value&& rhs)
+		{
+            if (this != &rhs) {
+                reset();
+                move_from(rhs);
+            }
+			return *this;
+        }
+#endif
+
 		const char* data() const { return data_; }
 		char* data() { return const_cast<char*>(data_); }
 
@@ -228,23 +320,27 @@ namespace fawn {
                 return;
             }
 
-            if (preserve)
+            if (new_size <= inline_capacity_)
             {
-                char* new_data = new char[new_size];
-                memcpy(new_data, data_, size_);
+                // data_ is not inline here, so it never overlaps the inline buffer
+                if (preserve && size_ != 0)
+                    memcpy(inline_buf_, data_, size_);
                 reset();
-                data_ = new_data;
+                data_ = inline_buf_;
                 size_ = new_size;
-                capacity_ = new_size;
-                share_count_ptr_ = new size_t(1);
+                capacity_ = inline_capacity_;
             }
             else
             {
+                size_t* new_share_count_ptr;
+                char* new_data = new_shared(new_size, new_share_count_ptr);
+                if (preserve)
+                    memcpy(new_data, data_, size_);
                 reset();
-                data_ = new char[new_size];
+                data_ = new_data;
                 size_ = new_size;
                 capacity_ = new_size;
-                share_count_ptr_ = new size_t(1);
+                share_count_ptr_ = new_share_count_ptr;
             }
         }
 
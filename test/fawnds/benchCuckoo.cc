@@ -185,6 +185,44 @@ void benchmark(std::string name)
 		printf("%s: %lf lookups/sec (%s)\n", name.c_str(), (double)lookup_count / (double)(end_time - start_time) * 1000000L, lookup_mode == 0 ? "hit" : "miss");
 	}
 
+    for (size_t lookup_mode = 0; lookup_mode < 2; lookup_mode++)
+	{
+		const size_t batch_size = 64;
+		std::vector<ConstValue> keys(batch_size);
+		std::vector<size_t> ids(batch_size);
+		std::vector<FawnDS_ConstIterator> its;
+
+		uint64_t lookup_count = 0;
+		gettimeofday(&tv, NULL);
+		start_time = tv.tv_sec * 1000000L + tv.tv_usec;
+
+        lookup_count = 10000000;
+		for (size_t k = 0; k < lookup_count; k += batch_size)
+        {
+            size_t i = rand() % indexes.size();
+            for (size_t b = 0; b < batch_size; b++) {
+                ids[b] = rand() % index_size;
+                keys[b] = lookup_mode == 0 ? arr[ids[b]].key : arr2[ids[b]].key;
+            }
+
+            indexes[i]->MultiFind(keys, its);
+
+            for (size_t b = 0; b < batch_size; b++) {
+                FawnDS_ConstIterator& it = its[b];
+                while (!it.IsEnd()) {
+                    if (lookup_mode == 0 && it->data.as_number<size_t>() == ids[b])
+                        break;
+                    ++it;
+                }
+            }
+		}
+
+		gettimeofday(&tv, NULL);
+		end_time = tv.tv_sec * 1000000L + tv.tv_usec;
+
+		printf("%s: %lf lookups/sec (%s, batch of %zu)\n", name.c_str(), (double)lookup_count / (double)(end_time - start_time) * 1000000L, lookup_mode == 0 ? "hit" : "miss", batch_size);
+	}
+
     for (size_t i = 0; i < indexes.size(); i++)
         delete indexes[i];
     indexes.clear();
@@ -0,0 +1,122 @@
+#include "fawnds_factory.h"
+#include "sorter.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <sys/time.h>
+
+using namespace fawn;
+
+// the comparison-based sort that Sorter used before radix sorting fixed-length entries
+struct value_ordering {
+    const std::vector<Value>& key_array;
+
+    value_ordering(const std::vector<Value>& key_array) : key_array(key_array) {}
+
+    bool operator()(const size_t& i, const size_t& j) {
+        int cmp = key_array[i].compare(key_array[j]);
+        if (cmp != 0)
+            return cmp < 0;
+        else
+            return i < j;
+    };
+};
+
+static uint64_t
+now_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+static FawnDS*
+create_sorter(size_t key_len, size_t data_len, size_t sort_threads)
+{
+    Configuration* sorter_config = Sorter::NewConfig(key_len, data_len, "/tmp", 0, sort_threads);
+    FawnDS* sorter = sorter_config ? FawnDS_Factory::New(sorter_config) : NULL;
+    if (!sorter || sorter->Create() != OK) {
+        fprintf(stderr, "cannot create a sorter\n");
+        exit(1);
+    }
+    return sorter;
+}
+
+int main(int argc, char** argv)
+{
+    size_t size = argc > 1 ? atol(argv[1]) : 100000000;
+    size_t key_len = argc > 2 ? atoi(argv[2]) : 20;
+    size_t data_len = argc > 3 ? atoi(argv[3]) : 5;
+    size_t sort_threads = argc > 4 ? atoi(argv[4]) : 1;
+    size_t kv_len = key_len + data_len;
+
+    srand(0);
+    char* buf = new char[kv_len * size];
+    for (size_t i = 0; i < kv_len * size; i++)
+        buf[i] = rand() & 0xff;
+
+    uint64_t start_time, end_time;
+
+    {
+        std::vector<Value> key_array;
+        std::vector<Value> data_array;
+        std::vector<size_t> refs;
+
+        start_time = now_us();
+        for (size_t i = 0; i < size; i++) {
+            key_array.push_back(NewValue(buf + i * kv_len, key_len));
+            data_array.push_back(NewValue(buf + i * kv_len + key_len, data_len));
+        }
+        end_time = now_us();
+        printf("comparison sort: %lf puts/sec\n", (double)size / (double)(end_time - start_time) * 1000000L);
+
+        start_time = now_us();
+        refs.reserve(size);
+        for (size_t i = 0; i < size; i++)
+            refs.push_back(i);
+        std::sort(refs.begin(), refs.end(), value_ordering(key_array));
+        end_time = now_us();
+        printf("comparison sort: %lf sec to sort %zu entries\n", (double)(end_time - start_time) / 1000000., size);
+    }
+
+    {
+        FawnDS* sorter = create_sorter(key_len, data_len, sort_threads);
+
+        start_time = now_us();
+        for (size_t i = 0; i < size; i++) {
+            if (sorter->Put(ConstRefValue(buf + i * kv_len, key_len), ConstRefValue(buf + i * kv_len + key_len, data_len)) != OK)
+                assert(false);
+        }
+        end_time = now_us();
+        printf("radix sort: %lf puts/sec\n", (double)size / (double)(end_time - start_time) * 1000000L);
+
+        start_time = now_us();
+        if (sorter->Flush() != OK)
+            assert(false);
+        end_time = now_us();
+        printf("radix sort: %lf sec to sort %zu entries with %zu threads\n", (double)(end_time - start_time) / 1000000., size, sort_threads);
+
+        start_time = now_us();
+        size_t count = 0;
+        Value prev_key;
+        FawnDS_ConstIterator it = sorter->Enumerate();
+        while (!it.IsEnd()) {
+            assert(count == 0 || prev_key.compare(it->key) <= 0);
+            prev_key = it->key;
+            count++;
+            ++it;
+        }
+        assert(count == size);
+        end_time = now_us();
+        printf("radix sort: %lf sec to enumerate %zu entries\n", (double)(end_time - start_time) / 1000000., count);
+
+        delete sorter;
+    }
+
+    delete [] buf;
+    return 0;
+}
@@ -0,0 +1,117 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "async_io.h"
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fawn {
+
+    class AsyncIOTest : public testing::Test {
+    protected:
+        virtual void SetUp() {
+            // each block is filled with its index
+            fd_ = open(filename_, O_RDWR | O_CREAT | O_TRUNC, 0666);
+            ASSERT_LE(0, fd_);
+            char block[block_size_];
+            for (size_t i = 0; i < num_blocks_; i++) {
+                memset(block, static_cast<int>(i & 0xff), block_size_);
+                ASSERT_EQ(static_cast<ssize_t>(block_size_), pwrite(fd_, block, block_size_, i * block_size_));
+            }
+        }
+
+        virtual void TearDown() {
+            close(fd_);
+            unlink(filename_);
+        }
+
+        // reads every block in a scrambled order, more than one submission batch at once
+        void ReadBlocks(AsyncIO::Engine engine) {
+            AsyncIO* aio = AsyncIO::thread_context(engine);
+            ASSERT_TRUE(aio != NULL);
+            EXPECT_LE(aio->engine(), engine);
+
+            std::vector<char> bufs(num_blocks_ * block_size_);
+            std::vector<AsyncIO::Request> reqs(num_blocks_);
+            for (size_t i = 0; i < num_blocks_; i++) {
+                size_t block = (i * 7) % num_blocks_;
+                reqs[i].fd = fd_;
+                reqs[i].buf = &bufs[i * block_size_];
+                reqs[i].count = block_size_;
+                reqs[i].offset = block * block_size_;
+                reqs[i].result = -EIO;
+            }
+            EXPECT_TRUE(aio->read(&reqs[0], reqs.size()));
+
+            for (size_t i = 0; i < num_blocks_; i++) {
+                size_t block = (i * 7) % num_blocks_;
+                ASSERT_EQ(static_cast<ssize_t>(block_size_), reqs[i].result);
+                for (size_t j = 0; j < block_size_; j++)
+                    ASSERT_EQ(static_cast<char>(block & 0xff), bufs[i * block_size_ + j]);
+            }
+
+            // a read past the end returns no data; a read from a bad descriptor fails alone
+            char buf[block_size_];
+            AsyncIO::Request tail[2];
+            tail[0].fd = fd_;
+            tail[0].buf = buf;
+            tail[0].count = block_size_;
+            tail[0].offset = num_blocks_ * block_size_;
+            tail[0].result = -EIO;
+            tail[1] = tail[0];
+            tail[1].fd = -1;
+            aio->read(tail, 2);
+            EXPECT_EQ(0, tail[0].result);
+            EXPECT_GT(0, tail[1].result);
+        }
+
+        static const char* filename_;
+        static const size_t block_size_ = 512;
+        static const size_t num_blocks_ = 300;
+
+        int fd_;
+    };
+
+    const char* AsyncIOTest::filename_ = "./testFiles/async_io";
+
+    TEST_F(AsyncIOTest, TestParseEngine) {
+        AsyncIO::Engine engine;
+        EXPECT_TRUE(AsyncIO::parse_engine("sync", engine));
+        EXPECT_EQ(AsyncIO::ENGINE_SYNC, engine);
+        EXPECT_TRUE(AsyncIO::parse_engine("libaio", engine));
+        EXPECT_EQ(AsyncIO::ENGINE_LIBAIO, engine);
+        EXPECT_TRUE(AsyncIO::parse_engine("io_uring", engine));
+        EXPECT_EQ(AsyncIO::ENGINE_IO_URING, engine);
+        EXPECT_FALSE(AsyncIO::parse_engine("posix", engine));
+    }
+
+    TEST_F(AsyncIOTest, TestReadSync) {
+        ReadBlocks(AsyncIO::ENGINE_SYNC);
+        EXPECT_EQ(AsyncIO::ENGINE_SYNC, AsyncIO::thread_context(AsyncIO::ENGINE_SYNC)->engine());
+    }
+
+    TEST_F(AsyncIOTest, TestReadLibaio) {
+        // falls back to synchronous reads if libaio is not available
+        ReadBlocks(AsyncIO::ENGINE_LIBAIO);
+    }
+
+    TEST_F(AsyncIOTest, TestReadIOUring) {
+        // falls back to libaio or synchronous reads if io_uring is not available
+        ReadBlocks(AsyncIO::ENGINE_IO_URING);
+    }
+
+    TEST_F(AsyncIOTest, TestReadRepeated) {
+        // each call must leave the context idle for the next one
+        for (size_t i = 0; i < 10; i++)
+            ReadBlocks(AsyncIO::ENGINE_IO_URING);
+    }
+
+}  // namespace fawn
+
+int main(int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
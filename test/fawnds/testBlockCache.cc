@@ -0,0 +1,155 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "block_cache.h"
+#include <gtest/gtest.h>
+#include <cstring>
+
+namespace fawn {
+
+    static void
+    fill_block(char* buf, uint64_t file_id, off_t offset)
+    {
+        memset(buf, static_cast<int>((file_id * 31 + offset / BlockCache::block_size) & 0xff), BlockCache::block_size);
+    }
+
+    static bool
+    check_block(const BlockCache* cache, uint64_t file_id, off_t offset)
+    {
+        char expected[BlockCache::block_size];
+        char buf[BlockCache::block_size];
+        fill_block(expected, file_id, offset);
+        if (!cache->Get(file_id, offset, buf))
+            return false;
+        EXPECT_EQ(0, memcmp(expected, buf, BlockCache::block_size));
+        return true;
+    }
+
+    TEST(BlockCacheTest, TestGetPut) {
+        BlockCache* cache = BlockCache::Acquire("", 1048576);
+        EXPECT_EQ(1048576u, cache->capacity());
+
+        uint64_t file_id = BlockCache::NewFileID();
+        uint64_t other_file_id = BlockCache::NewFileID();
+        EXPECT_NE(file_id, other_file_id);
+
+        char buf[BlockCache::block_size];
+        for (size_t i = 0; i < 100; i++) {
+            EXPECT_FALSE(cache->Get(file_id, i * BlockCache::block_size, buf));
+            fill_block(buf, file_id, i * BlockCache::block_size);
+            cache->Put(file_id, i * BlockCache::block_size, buf);
+        }
+        for (size_t i = 0; i < 100; i++) {
+            EXPECT_TRUE(check_block(cache, file_id, i * BlockCache::block_size));
+            // blocks of different files do not collide
+            EXPECT_FALSE(cache->Get(other_file_id, i * BlockCache::block_size, buf));
+        }
+
+        // overwriting a cached block replaces its data
+        fill_block(buf, other_file_id, 0);
+        cache->Put(file_id, 0, buf);
+        ASSERT_TRUE(cache->Get(file_id, 0, buf));
+        char expected[BlockCache::block_size];
+        fill_block(expected, other_file_id, 0);
+        EXPECT_EQ(0, memcmp(expected, buf, BlockCache::block_size));
+
+        cache->Invalidate(file_id, BlockCache::block_size);
+        EXPECT_FALSE(cache->Get(file_id, BlockCache::block_size, buf));
+        EXPECT_TRUE(check_block(cache, file_id, 2 * BlockCache::block_size));
+
+        BlockCache::Release(cache);
+    }
+
+    TEST(BlockCacheTest, TestSmallCacheKeepsAllBlocks) {
+        // the default private cache of a file store holds 128 blocks; all of them must be usable
+        BlockCache* cache = BlockCache::Acquire("", 65536);
+        EXPECT_EQ(65536u, cache->capacity());
+
+        uint64_t file_id = BlockCache::NewFileID();
+        char buf[BlockCache::block_size];
+        size_t num_blocks = cache->capacity() / BlockCache::block_size;
+        for (size_t i = 0; i < num_blocks; i++) {
+            fill_block(buf, file_id, i * BlockCache::block_size);
+            cache->Put(file_id, i * BlockCache::block_size, buf);
+        }
+        size_t hits = 0;
+        for (size_t i = 0; i < num_blocks; i++) {
+            if (check_block(cache, file_id, i * BlockCache::block_size))
+                hits++;
+        }
+        // hashing may overfill a shard, but nearly all blocks stay cached
+        EXPECT_LE(num_blocks * 7 / 8, hits);
+
+        BlockCache::Release(cache);
+    }
+
+    TEST(BlockCacheTest, TestClockEviction) {
+        // a single shard of 16 blocks
+        BlockCache* cache = BlockCache::Acquire("", 16 * BlockCache::block_size);
+        EXPECT_EQ(16 * BlockCache::block_size, cache->capacity());
+
+        uint64_t file_id = BlockCache::NewFileID();
+        char buf[BlockCache::block_size];
+        for (size_t i = 0; i < 16; i++) {
+            fill_block(buf, file_id, i * BlockCache::block_size);
+            cache->Put(file_id, i * BlockCache::block_size, buf);
+        }
+        for (size_t i = 0; i < 16; i++)
+            EXPECT_TRUE(check_block(cache, file_id, i * BlockCache::block_size));
+
+        // every block is referenced, so the clock clears all bits and evicts the block under the hand
+        fill_block(buf, file_id, 16 * BlockCache::block_size);
+        cache->Put(file_id, 16 * BlockCache::block_size, buf);
+        EXPECT_FALSE(check_block(cache, file_id, 0));
+        EXPECT_TRUE(check_block(cache, file_id, 16 * BlockCache::block_size));
+
+        // block 2 is referenced, so block 1 (not referenced since the sweep) is evicted next, then block 3
+        EXPECT_TRUE(check_block(cache, file_id, 2 * BlockCache::block_size));
+        fill_block(buf, file_id, 17 * BlockCache::block_size);
+        cache->Put(file_id, 17 * BlockCache::block_size, buf);
+        EXPECT_FALSE(check_block(cache, file_id, BlockCache::block_size));
+        EXPECT_TRUE(check_block(cache, file_id, 2 * BlockCache::block_size));
+
+        fill_block(buf, file_id, 18 * BlockCache::block_size);
+        cache->Put(file_id, 18 * BlockCache::block_size, buf);
+        EXPECT_FALSE(check_block(cache, file_id, 3 * BlockCache::block_size));
+        EXPECT_TRUE(check_block(cache, file_id, 2 * BlockCache::block_size));
+
+        BlockCache::Release(cache);
+    }
+
+    TEST(BlockCacheTest, TestSharing) {
+        EXPECT_TRUE(BlockCache::Acquire("testBlockCache") == NULL);
+
+        BlockCache* cache = BlockCache::Acquire("testBlockCache", 1048576);
+        BlockCache* cache2 = BlockCache::Acquire("testBlockCache", 65536);
+        BlockCache* cache3 = BlockCache::Acquire("testBlockCache");
+        // the capacity of the first acquisition is used
+        EXPECT_EQ(cache, cache2);
+        EXPECT_EQ(cache, cache3);
+        EXPECT_EQ(1048576u, cache->capacity());
+
+        // unnamed caches are never shared
+        BlockCache* private_cache = BlockCache::Acquire("", 65536);
+        EXPECT_NE(cache, private_cache);
+        BlockCache::Release(private_cache);
+
+        uint64_t file_id = BlockCache::NewFileID();
+        char buf[BlockCache::block_size];
+        fill_block(buf, file_id, 0);
+        cache->Put(file_id, 0, buf);
+        EXPECT_TRUE(check_block(cache3, file_id, 0));
+
+        BlockCache::Release(cache);
+        BlockCache::Release(cache2);
+        EXPECT_TRUE(check_block(cache3, file_id, 0));
+        BlockCache::Release(cache3);
+
+        // the cache is destroyed with the last reference
+        EXPECT_TRUE(BlockCache::Acquire("testBlockCache") == NULL);
+    }
+
+}  // namespace fawn
+
+int main(int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
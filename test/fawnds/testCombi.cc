@@ -1,9 +1,19 @@
 #include "fawnds_factory.h"
+#include "fawnds_combi.h"
 #include "rate_limiter.h"
 
 #include <gtest/gtest.h>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include <cassert>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 struct kv_pair {
 	fawn::Value key;
@@ -81,6 +91,148 @@ namespace fawn
             delete fawnds_;
         }
 
+        // the configuration of a combi store without the monitor (to reach FawnDS_Combi methods)
+        // knobs are (path, value) pairs such as ("store2-runs", "3") or ("store2/datastore/io-engine", "sync")
+        Configuration* NewCombiConfig(const std::vector<std::pair<std::string, std::string> >& knobs) {
+			Configuration* config = new Configuration(conf_file);
+			EXPECT_EQ(0, config->DeleteNode("child::type"));
+			for (size_t i = 0; i < knobs.size(); i++) {
+				std::string parent = ".";
+				std::string name = knobs[i].first;
+				std::string path = "child::" + name;
+				size_t slash = name.rfind('/');
+				if (slash != std::string::npos) {
+					parent.clear();
+					path.clear();
+					size_t begin = 0;
+					while (true) {
+						size_t end = name.find('/', begin);
+						std::string part = "child::" + name.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+						path += (path.empty() ? "" : "/") + part;
+						if (end == std::string::npos)
+							break;
+						parent = path;
+						begin = end + 1;
+					}
+					name = name.substr(slash + 1);
+				}
+				if (config->ExistsNode(path) != 0)
+					EXPECT_EQ(0, config->CreateNodeAndAppend(name, parent));
+				EXPECT_EQ(0, config->SetStringValue(path, knobs[i].second));
+			}
+			return config;
+		}
+
+        // replaces the store made by SetUp() with a new combi store
+        FawnDS_Combi* NewCombi(const std::vector<std::pair<std::string, std::string> >& knobs) {
+			delete fawnds_;
+			fawnds_ = NULL;
+
+			FawnDS_Combi* combi = dynamic_cast<FawnDS_Combi*>(FawnDS_Factory::New(NewCombiConfig(knobs)));
+			assert(combi);
+			fawnds_ = combi;
+			EXPECT_EQ(OK, fawnds_->Create());
+			return combi;
+		}
+
+		FawnDS_Combi* NewCombi() {
+			return NewCombi(std::vector<std::pair<std::string, std::string> >());
+		}
+
+		// puts keys in rounds; after round 1, the first num_updates keys are updated and the next num_deletes keys are deleted
+		// so that they shadow entries that may already be in the back stage
+		void WriteRounds(size_t num_rounds, size_t num_puts_per_round, size_t num_updates, size_t num_deletes, std::map<std::string, std::string>& expected) {
+			for (size_t round = 0; round < num_rounds; round++) {
+				for (size_t i = round * num_puts_per_round; i < (round + 1) * num_puts_per_round; i++) {
+					EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+					expected[arr_[i].key.str()] = arr_[i].data.str();
+				}
+
+				if (round == 1) {
+					for (size_t i = 0; i < num_updates; i++) {
+						arr_[i].data.data()[0] = 255 - arr_[i].data.data()[0];
+						EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+						expected[arr_[i].key.str()] = arr_[i].data.str();
+					}
+					for (size_t i = num_updates; i < num_updates + num_deletes; i++) {
+						EXPECT_EQ(OK, fawnds_->Delete(arr_[i].key));
+						expected.erase(arr_[i].key.str());
+					}
+				}
+			}
+		}
+
+		// checks every lookup method and both scans against the expected contents; the first num_multiget_keys keys of arr_ go through MultiGet()
+		void VerifyContents(FawnDS_Combi* combi, const std::map<std::string, std::string>& expected, size_t num_multiget_keys) {
+			std::vector<ConstValue> keys;
+			for (size_t i = 0; i < arr_.size(); i++) {
+				if (i < num_multiget_keys)
+					keys.push_back(arr_[i].key);
+
+				std::map<std::string, std::string>::const_iterator it = expected.find(arr_[i].key.str());
+				size_t len;
+				if (it == expected.end()) {
+					EXPECT_NE(OK, fawnds_->Get(arr_[i].key, ret_data_));
+					EXPECT_NE(OK, fawnds_->Length(arr_[i].key, len));
+					EXPECT_EQ(KEY_NOT_FOUND, fawnds_->Contains(arr_[i].key));
+					continue;
+				}
+				ASSERT_EQ(OK, fawnds_->Get(arr_[i].key, ret_data_));
+				EXPECT_TRUE(it->second == ret_data_.str());
+				EXPECT_EQ(OK, fawnds_->Length(arr_[i].key, len));
+				EXPECT_EQ(data_len_, len);
+			}
+
+			std::vector<Value> ret_data;
+			std::vector<FawnDS_Return> rets;
+			EXPECT_EQ(OK, fawnds_->MultiGet(keys, ret_data, rets));
+			for (size_t j = 0; j < keys.size(); j++) {
+				std::map<std::string, std::string>::const_iterator it = expected.find(keys[j].str());
+				if (it == expected.end())
+					EXPECT_NE(OK, rets[j]);
+				else {
+					ASSERT_EQ(OK, rets[j]);
+					EXPECT_TRUE(it->second == ret_data[j].str());
+				}
+			}
+
+			std::map<std::string, std::string> seen;
+			for (FawnDS_ConstIterator it = fawnds_->Enumerate(); !it.IsEnd(); ++it) {
+				ASSERT_EQ(OK, it->state);
+				EXPECT_TRUE(seen.insert(std::make_pair(it->key.str(), it->data.str())).second);
+			}
+			EXPECT_TRUE(expected == seen);
+
+			seen.clear();
+			std::string last_key;
+			for (FawnDS_ConstIterator it = combi->EnumerateInOrder(); !it.IsEnd(); ++it) {
+				ASSERT_EQ(OK, it->state);
+				if (!seen.empty())
+					EXPECT_LT(last_key, it->key.str());
+				last_key = it->key.str();
+				seen[last_key] = it->data.str();
+			}
+			EXPECT_TRUE(expected == seen);
+		}
+
+		// the number of entries in each back store, from the status of the combi store
+		std::vector<size_t> BackStoreSizes() {
+			Value status;
+			EXPECT_EQ(OK, fawnds_->Status(NUM_DATA, status));
+			std::string status_str = status.str();
+			std::string back_status = status_str.substr(status_str.rfind('[') + 1);
+			std::vector<size_t> sizes;
+			const char* p = back_status.c_str();
+			while (*p >= '0' && *p <= '9') {
+				char* end;
+				sizes.push_back(strtoull(p, &end, 10));
+				p = end;
+				if (*p == ',')
+					p++;
+			}
+			return sizes;
+		}
+
         // Objects declared here can be used by all tests in the test case for HashDB.
 
         size_t key_len_;
@@ -196,6 +348,43 @@ namespace fawn
 		free_kv(arr_);
     }
 
+    TEST_F(FawnDS_Combi_Test, TestMultiGet) {
+		generate_random_kv(arr_, key_len_, data_len_, size_);
+
+		int64_t operations_per_sec = 100000L;
+		RateLimiter rate_limiter(0, operations_per_sec, operations_per_sec / 1000L, 1000000000L / 1000L);
+
+		// leave the last 100 keys out to check negative lookups in the same batch
+        for (size_t i = 0; i < size_ - 100; i++) {
+			rate_limiter.remove_tokens(1);
+            EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+		}
+
+		std::vector<ConstValue> keys;
+		std::vector<Value> ret_data;
+		std::vector<FawnDS_Return> rets;
+        for (size_t i = 0; i < size_; i += 1000) {
+			keys.clear();
+			for (size_t j = i; j < i + 1000 && j < size_; j++)
+				keys.push_back(arr_[j].key);
+
+			EXPECT_EQ(OK, fawnds_->MultiGet(keys, ret_data, rets));
+			ASSERT_EQ(keys.size(), rets.size());
+
+			for (size_t j = 0; j < keys.size(); j++) {
+				if (i + j < size_ - 100) {
+					EXPECT_EQ(OK, rets[j]);
+					EXPECT_EQ(data_len_, ret_data[j].size());
+					EXPECT_EQ(0, memcmp(arr_[i + j].data.data(), ret_data[j].data(), data_len_));
+				}
+				else
+					EXPECT_EQ(KEY_NOT_FOUND, rets[j]);
+			}
+        }
+
+		free_kv(arr_);
+    }
+
     TEST_F(FawnDS_Combi_Test, TestSimpleSortedInsertRetrieveMany) {
 		generate_random_kv(arr_, key_len_, data_len_, size_);
 
@@ -272,6 +461,580 @@ namespace fawn
 		sleep(5);
 	}
 
+    TEST_F(FawnDS_Combi_Test, TestSnapshotIterator) {
+		FawnDS_Combi* combi = NewCombi();
+
+		size_t num_puts = 200000;
+		size_t num_updates = 1000;
+		size_t num_deletes = 1000;
+		size_t num_later_puts = 100000;
+		generate_random_kv(arr_, key_len_, data_len_, num_puts + num_later_puts);
+
+		int64_t operations_per_sec = 100000L;
+		RateLimiter rate_limiter(0, operations_per_sec, operations_per_sec / 1000L, 1000000000L / 1000L);
+
+        for (size_t i = 0; i < num_puts; i++) {
+			rate_limiter.remove_tokens(1);
+            EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+		}
+        for (size_t i = 0; i < num_updates; i++) {
+			arr_[i].data.data()[0] = 255 - arr_[i].data.data()[0];
+            EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+		}
+        for (size_t i = num_updates; i < num_updates + num_deletes; i++)
+            EXPECT_EQ(OK, fawnds_->Delete(arr_[i].key));
+
+		std::map<std::string, std::string> expected;
+        for (size_t i = 0; i < num_puts; i++) {
+			if (i >= num_updates && i < num_updates + num_deletes)
+				continue;
+			expected[arr_[i].key.str()] = arr_[i].data.str();
+		}
+
+		FawnDS_ConstIterator it = fawnds_->Enumerate();
+		FawnDS_ConstIterator it_ordered = combi->EnumerateInOrder();
+
+		// writes, conversions and merges proceed while the iterators are alive, and do not affect them
+		// (including updates and deletions of keys in the snapshot, of both recent and old entries)
+		size_t num_later_changes = 1000;
+		Value later_data;
+		later_data.resize(data_len_);
+		memset(later_data.data(), 0, data_len_);
+        for (size_t i = num_puts; i < num_puts + num_later_puts; i++) {
+			rate_limiter.remove_tokens(1);
+            EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+			if (i - num_puts < num_later_changes) {
+				size_t j = num_puts - 1 - (i - num_puts) * 2;
+				EXPECT_EQ(OK, fawnds_->Put(arr_[j].key, later_data));
+				EXPECT_EQ(OK, fawnds_->Delete(arr_[j - 1].key));
+				EXPECT_EQ(OK, fawnds_->Put(arr_[i - num_puts].key, later_data));
+			}
+		}
+		EXPECT_EQ(OK, fawnds_->Flush());
+
+		std::map<std::string, std::string> seen;
+		for (; !it.IsEnd(); ++it) {
+			ASSERT_EQ(OK, it->state);
+			EXPECT_TRUE(seen.insert(std::make_pair(it->key.str(), it->data.str())).second);
+		}
+		EXPECT_TRUE(expected == seen);
+
+		seen.clear();
+		std::string last_key;
+		for (; !it_ordered.IsEnd(); ++it_ordered) {
+			ASSERT_EQ(OK, it_ordered->state);
+			if (!seen.empty())
+				EXPECT_LT(last_key, it_ordered->key.str());
+			last_key = it_ordered->key.str();
+			seen[last_key] = it_ordered->data.str();
+		}
+		EXPECT_TRUE(expected == seen);
+
+		size_t count = 0;
+		for (FawnDS_ConstIterator it_all = fawnds_->Enumerate(); !it_all.IsEnd(); ++it_all)
+			count++;
+		EXPECT_EQ(expected.size() + num_later_puts - num_later_changes, count);
+
+		free_kv(arr_);
+    }
+
+	struct ConcurrentGetArgs {
+		FawnDS* fawnds;
+		const kv_array_type* arr;
+		size_t num_keys;
+		size_t data_len;
+		volatile bool* stop;
+		size_t num_gets;
+		size_t num_errors;
+	};
+
+	static void*
+	concurrent_get_main(void* p)
+	{
+		ConcurrentGetArgs* args = static_cast<ConcurrentGetArgs*>(p);
+		Value data;
+		size_t i = 0;
+
+		// throttle readers; the lock of a front store favors readers and could otherwise starve the writer
+		int64_t operations_per_sec = 20000L;
+		RateLimiter rate_limiter(0, operations_per_sec, operations_per_sec / 1000L, 1000000000L / 1000L);
+
+		while (!*args->stop) {
+			rate_limiter.remove_tokens(1);
+			const kv_pair& kv = (*args->arr)[i];
+			if (args->fawnds->Get(kv.key, data) != OK || data.size() != args->data_len || memcmp(kv.data.data(), data.data(), args->data_len) != 0)
+				args->num_errors++;
+			args->num_gets++;
+			i = (i + 1) % args->num_keys;
+		}
+		return NULL;
+	}
+
+    TEST_F(FawnDS_Combi_Test, TestConcurrentGet) {
+		size_t num_puts = 100000;
+		size_t num_later_puts = 200000;
+		generate_random_kv(arr_, key_len_, data_len_, num_puts + num_later_puts);
+
+        for (size_t i = 0; i < num_puts; i++)
+            EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+
+		// readers run while later puts add front stores and trigger conversions and merges
+		const size_t num_readers = 4;
+		volatile bool stop = false;
+		ConcurrentGetArgs args[num_readers];
+		pthread_t threads[num_readers];
+		for (size_t t = 0; t < num_readers; t++) {
+			args[t].fawnds = fawnds_;
+			args[t].arr = &arr_;
+			args[t].num_keys = num_puts;
+			args[t].data_len = data_len_;
+			args[t].stop = &stop;
+			args[t].num_gets = 0;
+			args[t].num_errors = 0;
+			ASSERT_EQ(0, pthread_create(&threads[t], NULL, concurrent_get_main, &args[t]));
+		}
+
+        for (size_t i = num_puts; i < num_puts + num_later_puts; i++)
+            EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+		EXPECT_EQ(OK, fawnds_->Flush());
+
+		stop = true;
+		for (size_t t = 0; t < num_readers; t++) {
+			ASSERT_EQ(0, pthread_join(threads[t], NULL));
+			EXPECT_LT(0u, args[t].num_gets);
+			EXPECT_EQ(0u, args[t].num_errors);
+		}
+
+        for (size_t i = 0; i < num_puts + num_later_puts; i++)
+            EXPECT_EQ(OK, fawnds_->Get(arr_[i].key, ret_data_));
+
+		free_kv(arr_);
+    }
+
+	struct ConcurrentPutArgs {
+		FawnDS* fawnds;
+		const kv_array_type* arr;
+		size_t begin;
+		size_t end;
+		size_t num_errors;
+	};
+
+	static void*
+	concurrent_put_main(void* p)
+	{
+		ConcurrentPutArgs* args = static_cast<ConcurrentPutArgs*>(p);
+		int64_t operations_per_sec = 100000L;
+		RateLimiter rate_limiter(0, operations_per_sec, operations_per_sec / 1000L, 1000000000L / 1000L);
+
+		for (size_t i = args->begin; i < args->end; i++) {
+			rate_limiter.remove_tokens(1);
+			if (args->fawnds->Put((*args->arr)[i].key, (*args->arr)[i].data) != OK)
+				args->num_errors++;
+		}
+		return NULL;
+	}
+
+    TEST_F(FawnDS_Combi_Test, TestSnapshotIteratorConcurrentPut) {
+		size_t num_puts = 100000;
+		size_t num_later_puts = 200000;
+		generate_random_kv(arr_, key_len_, data_len_, num_puts + num_later_puts);
+
+        for (size_t i = 0; i < num_puts; i++)
+            EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+
+		std::map<std::string, size_t> index;
+		for (size_t i = 0; i < num_puts + num_later_puts; i++)
+			index[arr_[i].key.str()] = i;
+
+		// snapshots are taken while the front store is being written, without sealing it
+		ConcurrentPutArgs args;
+		args.fawnds = fawnds_;
+		args.arr = &arr_;
+		args.begin = num_puts;
+		args.end = num_puts + num_later_puts;
+		args.num_errors = 0;
+		pthread_t thread;
+		ASSERT_EQ(0, pthread_create(&thread, NULL, concurrent_put_main, &args));
+
+		size_t num_snapshots = 0;
+		size_t max_included = 0;
+		for (; num_snapshots < 20; num_snapshots++) {
+			// a single writer puts keys in order, so a snapshot holds a prefix of its puts
+			std::vector<bool> seen(num_puts + num_later_puts, false);
+			size_t count = 0;
+			for (FawnDS_ConstIterator it = fawnds_->Enumerate(); !it.IsEnd(); ++it) {
+				ASSERT_EQ(OK, it->state);
+				std::map<std::string, size_t>::const_iterator it_index = index.find(it->key.str());
+				ASSERT_TRUE(it_index != index.end());
+				EXPECT_FALSE(seen[it_index->second]);
+				seen[it_index->second] = true;
+				EXPECT_TRUE(arr_[it_index->second].data == it->data);
+				count++;
+			}
+			for (size_t i = 0; i < count; i++)
+				ASSERT_TRUE(seen[i]);
+			max_included = std::max(max_included, count - num_puts);
+			usleep(100000);
+		}
+
+		ASSERT_EQ(0, pthread_join(thread, NULL));
+		EXPECT_EQ(0u, args.num_errors);
+		EXPECT_LT(0u, max_included);
+
+		size_t count = 0;
+		for (FawnDS_ConstIterator it = fawnds_->Enumerate(); !it.IsEnd(); ++it)
+			count++;
+		EXPECT_EQ(num_puts + num_later_puts, count);
+
+		free_kv(arr_);
+    }
+
+    TEST_F(FawnDS_Combi_Test, TestMultipleRuns) {
+		// keep up to 3 back store runs and merge only runs beyond the limit
+		std::vector<std::pair<std::string, std::string> > knobs;
+		knobs.push_back(std::make_pair("store2-runs", "3"));
+		knobs.push_back(std::make_pair("store2-size-ratio", "0"));
+		FawnDS_Combi* combi = NewCombi(knobs);
+
+		size_t num_rounds = 5;
+		size_t num_puts_per_round = 120000;
+		size_t num_updates = 1000;
+		size_t num_deletes = 1000;
+		generate_random_kv(arr_, key_len_, data_len_, num_rounds * num_puts_per_round);
+
+		// the updates and deletions reach the back stage while the original entries are in an older run
+		std::map<std::string, std::string> expected;
+		WriteRounds(num_rounds, num_puts_per_round, num_updates, num_deletes, expected);
+		EXPECT_EQ(OK, fawnds_->Flush());
+
+		// the back stage holds several runs, but no more than the limit
+		std::vector<size_t> sizes = BackStoreSizes();
+		EXPECT_LT(1u, sizes.size());
+		EXPECT_GE(3u, sizes.size());
+
+		VerifyContents(combi, expected, 2 * (num_updates + num_deletes));
+
+		free_kv(arr_);
+    }
+
+    TEST_F(FawnDS_Combi_Test, TestMergeThreads) {
+		// out-of-range thread counts are rejected instead of wrapping around
+		const char* bad_merge_threads[] = { "0", "-1", "100000" };
+		for (size_t i = 0; i < sizeof(bad_merge_threads) / sizeof(bad_merge_threads[0]); i++) {
+			Configuration* config = new Configuration(conf_file);
+			EXPECT_EQ(0, config->DeleteNode("child::type"));
+			EXPECT_EQ(0, config->CreateNodeAndAppend("merge-threads", "."));
+			EXPECT_EQ(0, config->SetStringValue("child::merge-threads", bad_merge_threads[i]));
+			FawnDS* combi = FawnDS_Factory::New(config);
+			ASSERT_TRUE(combi != NULL);
+			EXPECT_NE(OK, combi->Create());
+			delete combi;
+		}
+
+		// sort shards in parallel, each with several threads, and pipeline reading the merge inputs with writing the back store
+		std::vector<std::pair<std::string, std::string> > knobs;
+		knobs.push_back(std::make_pair("merge-threads", "4"));
+		knobs.push_back(std::make_pair("merge-sort-threads", "2"));
+		FawnDS_Combi* combi = NewCombi(knobs);
+
+		size_t num_rounds = 3;
+		size_t num_puts_per_round = 120000;
+		size_t num_updates = 1000;
+		size_t num_deletes = 1000;
+		generate_random_kv(arr_, key_len_, data_len_, num_rounds * num_puts_per_round);
+
+		std::map<std::string, std::string> expected;
+		WriteRounds(num_rounds, num_puts_per_round, num_updates, num_deletes, expected);
+		EXPECT_EQ(OK, fawnds_->Flush());
+
+		VerifyContents(combi, expected, 2 * (num_updates + num_deletes));
+
+		free_kv(arr_);
+    }
+
+    TEST_F(FawnDS_Combi_Test, TestMergeMemoryLimit) {
+		// merge sorters spill many runs to temporary files; updates must still win over the entries they replace
+		std::vector<std::pair<std::string, std::string> > knobs;
+		knobs.push_back(std::make_pair("merge-memory-limit", "262144"));
+		knobs.push_back(std::make_pair("temp-file", "./testFiles"));
+		FawnDS_Combi* combi = NewCombi(knobs);
+
+		size_t num_rounds = 3;
+		size_t num_puts_per_round = 120000;
+		size_t num_updates = 1000;
+		size_t num_deletes = 1000;
+		generate_random_kv(arr_, key_len_, data_len_, num_rounds * num_puts_per_round);
+
+		std::map<std::string, std::string> expected;
+		WriteRounds(num_rounds, num_puts_per_round, num_updates, num_deletes, expected);
+		EXPECT_EQ(OK, fawnds_->Flush());
+
+		VerifyContents(combi, expected, 2 * (num_updates + num_deletes));
+
+		free_kv(arr_);
+    }
+
+    TEST_F(FawnDS_Combi_Test, TestMergeFailureKeepsData) {
+		// spilling sorted runs fails, so every merge is cancelled; the middle stores must keep serving the data
+		std::vector<std::pair<std::string, std::string> > knobs;
+		knobs.push_back(std::make_pair("merge-memory-limit", "262144"));
+		knobs.push_back(std::make_pair("temp-file", "./testFiles/merge_failure_dir"));
+		rmdir("./testFiles/merge_failure_dir");
+		FawnDS_Combi* combi = NewCombi(knobs);
+
+		size_t num_rounds = 3;
+		size_t num_puts_per_round = 120000;
+		size_t num_updates = 1000;
+		size_t num_deletes = 1000;
+		generate_random_kv(arr_, key_len_, data_len_, num_rounds * num_puts_per_round);
+
+		std::map<std::string, std::string> expected;
+		WriteRounds(num_rounds, num_puts_per_round, num_updates, num_deletes, expected);
+		// the middle stores stay above the watermark with no merge running
+		EXPECT_EQ(ERROR, fawnds_->Flush());
+
+		// sorting for EnumerateInOrder() spills to the same directory
+		EXPECT_EQ(0, mkdir("./testFiles/merge_failure_dir", 0755));
+		VerifyContents(combi, expected, 2 * (num_updates + num_deletes));
+		rmdir("./testFiles/merge_failure_dir");
+
+		free_kv(arr_);
+    }
+
+    TEST_F(FawnDS_Combi_Test, TestReopen) {
+		// Flush() writes the list of stores, and Open() reopens them instead of starting empty
+		std::vector<std::pair<std::string, std::string> > knobs;
+		knobs.push_back(std::make_pair("file", "./testFiles/combi_manifest"));
+		knobs.push_back(std::make_pair("store2/file", "./testFiles/back_index"));
+		knobs.push_back(std::make_pair("store2-runs", "2"));
+		NewCombi(knobs);
+
+		size_t num_rounds = 3;
+		size_t num_puts_per_round = 120000;
+		size_t num_updates = 1000;
+		size_t num_deletes = 1000;
+		size_t num_later_puts = 10000;
+		generate_random_kv(arr_, key_len_, data_len_, num_rounds * num_puts_per_round + num_later_puts);
+
+		std::map<std::string, std::string> expected;
+		WriteRounds(num_rounds, num_puts_per_round, num_updates, num_deletes, expected);
+		EXPECT_EQ(OK, fawnds_->Flush());
+
+		// leaves the data only in the files
+		delete fawnds_;
+		FawnDS_Combi* combi = dynamic_cast<FawnDS_Combi*>(FawnDS_Factory::New(NewCombiConfig(knobs)));
+		assert(combi);
+		fawnds_ = combi;
+		ASSERT_EQ(OK, fawnds_->Open());
+
+		// the reopened store takes new writes on top of the old data
+		for (size_t i = num_rounds * num_puts_per_round; i < arr_.size(); i++) {
+			EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+			expected[arr_[i].key.str()] = arr_[i].data.str();
+		}
+		for (size_t i = num_updates + num_deletes; i < num_updates + num_deletes + num_later_puts; i++) {
+			EXPECT_EQ(OK, fawnds_->Delete(arr_[i].key));
+			expected.erase(arr_[i].key.str());
+		}
+		EXPECT_EQ(OK, fawnds_->Flush());
+
+		VerifyContents(combi, expected, 2 * (num_updates + num_deletes));
+
+		free_kv(arr_);
+    }
+
+	struct DiskWatchArgs {
+		std::string dir;
+		std::string prefix;
+		volatile bool* stop;
+		size_t max_files;
+	};
+
+	// tracks the largest number of files with the prefix in the directory
+	static void*
+	disk_watch_main(void* p)
+	{
+		DiskWatchArgs* args = static_cast<DiskWatchArgs*>(p);
+		while (!*args->stop) {
+			size_t num_files = 0;
+			DIR* dir = opendir(args->dir.c_str());
+			if (dir) {
+				struct dirent* ent;
+				while ((ent = readdir(dir)) != NULL) {
+					if (strncmp(ent->d_name, args->prefix.c_str(), args->prefix.size()) == 0)
+						num_files++;
+				}
+				closedir(dir);
+			}
+			if (args->max_files < num_files)
+				args->max_files = num_files;
+			usleep(1000);
+		}
+		return NULL;
+	}
+
+	static void
+	remove_files(const std::string& dir_name, const std::string& prefix)
+	{
+		DIR* dir = opendir(dir_name.c_str());
+		if (!dir)
+			return;
+		struct dirent* ent;
+		while ((ent = readdir(dir)) != NULL) {
+			if (strncmp(ent->d_name, prefix.c_str(), prefix.size()) == 0)
+				unlink((dir_name + "/" + ent->d_name).c_str());
+		}
+		closedir(dir);
+	}
+
+    TEST_F(FawnDS_Combi_Test, TestSegments) {
+		// files of back stores left by earlier tests would be counted
+		remove_files("./testFiles", "back_datastore_0_");
+
+		// split the back stage into 4 key-range segments merged one at a time
+		std::vector<std::pair<std::string, std::string> > knobs;
+		knobs.push_back(std::make_pair("store2-segments", "4"));
+		FawnDS_Combi* combi = NewCombi(knobs);
+
+		size_t num_rounds = 2;
+		size_t num_puts_per_round = 120000;
+		size_t num_updates = 1000;
+		size_t num_deletes = 1000;
+		size_t num_segment0_puts = 130000;      // more than a front store holds
+		generate_random_kv(arr_, key_len_, data_len_, num_rounds * num_puts_per_round + 2 * num_segment0_puts);
+
+		// the last keys fall in segment 0 (the first two key bits are 0)
+		for (size_t i = num_rounds * num_puts_per_round; i < arr_.size(); i++)
+			arr_[i].key.data()[0] &= 0x3f;
+
+		DiskWatchArgs watch_args;
+		watch_args.dir = "./testFiles";
+		watch_args.prefix = "back_datastore_0_";
+		volatile bool stop = false;
+		watch_args.stop = &stop;
+		watch_args.max_files = 0;
+		pthread_t watch_thread;
+		ASSERT_EQ(0, pthread_create(&watch_thread, NULL, disk_watch_main, &watch_args));
+
+		std::map<std::string, std::string> expected;
+		WriteRounds(num_rounds, num_puts_per_round, num_updates, num_deletes, expected);
+
+		// the front store still holds keys of all segments after Flush(); these keys fill it up so that it is merged,
+		// and the next front store holds keys of segment 0 only
+		for (size_t i = num_rounds * num_puts_per_round; i < num_rounds * num_puts_per_round + num_segment0_puts; i++) {
+			EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+			expected[arr_[i].key.str()] = arr_[i].data.str();
+		}
+		EXPECT_EQ(OK, fawnds_->Flush());
+
+		// one back store per segment
+		std::vector<size_t> sizes = BackStoreSizes();
+		ASSERT_EQ(4u, sizes.size());
+
+		// merges of entries that fall in segment 0 leave the back stores of the other segments as they are
+		for (size_t i = num_rounds * num_puts_per_round + num_segment0_puts; i < arr_.size(); i++) {
+			EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+			expected[arr_[i].key.str()] = arr_[i].data.str();
+		}
+		EXPECT_EQ(OK, fawnds_->Flush());
+
+		std::vector<size_t> new_sizes = BackStoreSizes();
+		ASSERT_EQ(4u, new_sizes.size());
+		size_t num_unchanged = 0;
+		for (size_t i = 0; i < sizes.size(); i++) {
+			if (std::find(new_sizes.begin(), new_sizes.end(), sizes[i]) != new_sizes.end())
+				num_unchanged++;
+		}
+		EXPECT_EQ(3u, num_unchanged);
+
+		// a merge rewrites one segment at a time, so at most one back store more than the segments exists at any moment
+		stop = true;
+		ASSERT_EQ(0, pthread_join(watch_thread, NULL));
+		EXPECT_LE(4u, watch_args.max_files);
+		EXPECT_GE(5u, watch_args.max_files);
+
+		VerifyContents(combi, expected, 2 * (num_updates + num_deletes));
+
+		free_kv(arr_);
+    }
+
+	// the number of read system calls made by this process so far
+	static size_t
+	read_syscalls()
+	{
+		FILE* fp = fopen("/proc/self/io", "r");
+		if (!fp)
+			return 0;
+		char line[256];
+		size_t syscr = 0;
+		while (fgets(line, sizeof(line), fp)) {
+			if (strncmp(line, "syscr:", 6) == 0)
+				syscr = strtoull(line + 6, NULL, 10);
+		}
+		fclose(fp);
+		return syscr;
+	}
+
+    TEST_F(FawnDS_Combi_Test, TestFilterSkipsIO) {
+		// synchronous reads make every data store read a system call
+		std::vector<std::pair<std::string, std::string> > knobs;
+		knobs.push_back(std::make_pair("filter-bits-per-key", "10"));
+		knobs.push_back(std::make_pair("store1/datastore/io-engine", "sync"));
+		knobs.push_back(std::make_pair("store2/datastore/io-engine", "sync"));
+		NewCombi(knobs);
+
+		size_t num_puts = 300000;
+		size_t num_gets = 10000;
+		generate_random_kv(arr_, key_len_, data_len_, num_puts + num_gets);
+
+        for (size_t i = 0; i < num_puts; i++)
+            EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+		EXPECT_EQ(OK, fawnds_->Flush());
+		if (read_syscalls() == 0) {
+			fprintf(stderr, "/proc/self/io is not available; skipping\n");
+			free_kv(arr_);
+			return;
+		}
+
+		// a lookup of a stored key reads the back store (the trie index cannot rule out any key)
+		size_t reads = read_syscalls();
+		for (size_t i = 0; i < num_gets; i++)
+			EXPECT_EQ(OK, fawnds_->Get(arr_[i * (num_puts / num_gets)].key, ret_data_));
+		size_t positive_reads = read_syscalls() - reads;
+		EXPECT_LE(num_gets / 2, positive_reads);
+
+		// a lookup of a missing key skips the stores whose filters rule it out, so nearly none of them read
+		reads = read_syscalls();
+		for (size_t i = num_puts; i < num_puts + num_gets; i++)
+			EXPECT_NE(OK, fawnds_->Get(arr_[i].key, ret_data_));
+		size_t negative_reads = read_syscalls() - reads;
+		EXPECT_GE(num_gets / 20, negative_reads);
+
+		free_kv(arr_);
+    }
+
+    TEST_F(FawnDS_Combi_Test, TestSharedBlockCacheAndFilters) {
+		// the data stores of all stages share one block cache, and lookups consult the filters of middle and back stores
+		std::vector<std::pair<std::string, std::string> > knobs;
+		knobs.push_back(std::make_pair("block-cache-size", "1048576"));
+		knobs.push_back(std::make_pair("filter-bits-per-key", "10"));
+		FawnDS_Combi* combi = NewCombi(knobs);
+
+		size_t num_rounds = 3;
+		size_t num_puts_per_round = 120000;
+		size_t num_updates = 1000;
+		size_t num_deletes = 1000;
+		generate_random_kv(arr_, key_len_, data_len_, num_rounds * num_puts_per_round);
+
+		std::map<std::string, std::string> expected;
+		WriteRounds(num_rounds, num_puts_per_round, num_updates, num_deletes, expected);
+		EXPECT_EQ(OK, fawnds_->Flush());
+
+		VerifyContents(combi, expected, 2 * (num_updates + num_deletes));
+
+		free_kv(arr_);
+    }
+
     TEST_F(FawnDS_Combi_Test, TestFlush) {
         EXPECT_EQ(OK, fawnds_->Flush());
         EXPECT_EQ(OK, fawnds_->Flush());
@@ -1,5 +1,8 @@
 #include <vector>
+#include <pthread.h>
+#include <tbb/atomic.h>
 #include "fawnds_factory.h"
+#include "configuration.h"
 
 #include "gtest/gtest.h"
 
@@ -89,6 +92,29 @@ namespace fawn
         h->Close();
     }
 
+    static const uint32_t num_concurrent_writers = 4;
+
+    struct ConcurrentWriter {
+        FawnDS* h;
+        uint32_t begin;
+        uint32_t end;
+        tbb::atomic<uint32_t> progress;     // keys in [begin, progress) are inserted
+        tbb::atomic<bool> done;
+    };
+
+    // inserts keys until the range or the table is exhausted
+    void* concurrent_writer_main(void* arg) {
+        ConcurrentWriter* w = static_cast<ConcurrentWriter*>(arg);
+        for (uint32_t i = w->begin; i < w->end; i++) {
+            FawnDS_Return ret = w->h->Put(ConstRefValue((char*) &(key_vec1[i]), 8), ConstRefValue((char*) &(val_vec1[i]), 4));
+            if (ret != OK)
+                break;
+            w->progress = i + 1;
+        }
+        w->done = true;
+        return NULL;
+    }
+
     void test_put_undo_get(FawnDS *&h) {
         char *key;
         char *val;
@@ -162,6 +188,93 @@ namespace fawn
         test_put_get(1000000, h, true);
     }
 
+    TEST_F(FawnDS_Cuckoo_Test, SimpleTest_PutGetMmapReloaded) {
+        test_put_get(1000, h);
+        delete h;
+
+        Configuration* config = new Configuration(conf_file);
+        ASSERT_EQ(0, config->CreateNodeAndAppend("use-mmap", "child::hashtable"));
+        ASSERT_EQ(0, config->SetStringValue("child::hashtable/child::use-mmap", "1"));
+        h = FawnDS_Factory::New(config);
+        ASSERT_TRUE(h->Open() == OK);
+
+        for (uint32_t i = 0; i < 1000; i++) {
+            char* key = (char*) &(key_vec1[i]);
+            char* val = (char*) &(val_vec1[i]);
+            SizedValue<64> read_data;
+            ASSERT_TRUE(h->Get(ConstRefValue(key, 8), read_data) == OK);
+            EXPECT_EQ((unsigned) 4, read_data.size());
+            EXPECT_EQ(strncmp(val, read_data.data(), 4), 0);
+        }
+
+        h->Close();
+    }
+
+    TEST_F(FawnDS_Cuckoo_Test, SimpleTest_PutGetManyKeysConcurrent) {
+        delete h;
+
+        Configuration* config = new Configuration(conf_file);
+        ASSERT_EQ(0, config->CreateNodeAndAppend("concurrent", "child::hashtable"));
+        ASSERT_EQ(0, config->SetStringValue("child::hashtable/child::concurrent", "1"));
+        h = FawnDS_Factory::New(config);
+        ASSERT_TRUE(h->Create() == OK);
+
+        // writers insert disjoint key ranges while a reader checks the keys the first writer has inserted
+        pthread_t writers[num_concurrent_writers];
+        ConcurrentWriter args[num_concurrent_writers];
+        for (uint32_t t = 0; t < num_concurrent_writers; t++) {
+            args[t].h = h;
+            args[t].begin = t * (MAXNUM / num_concurrent_writers);
+            args[t].end = (t + 1) * (MAXNUM / num_concurrent_writers);
+            args[t].progress = args[t].begin;
+            args[t].done = false;
+        }
+        for (uint32_t t = 0; t < num_concurrent_writers; t++)
+            ASSERT_EQ(0, pthread_create(&writers[t], NULL, concurrent_writer_main, &args[t]));
+
+        uint32_t num_reads = 0;
+        uint32_t num_read_errors = 0;
+        while (!args[0].done) {
+            uint32_t end = args[0].progress;
+            for (uint32_t i = args[0].begin; i < end; i += 97) {
+                SizedValue<64> read_data;
+                if (h->Get(ConstRefValue((char*) &(key_vec1[i]), 8), read_data) != OK ||
+                    memcmp(&(val_vec1[i]), read_data.data(), 4) != 0)
+                    num_read_errors++;
+                num_reads++;
+            }
+        }
+
+        uint32_t num_inserted = 0;
+        for (uint32_t t = 0; t < num_concurrent_writers; t++) {
+            pthread_join(writers[t], NULL);
+            num_inserted += args[t].progress - args[t].begin;
+        }
+        EXPECT_LT(0u, num_reads);
+        EXPECT_EQ(0u, num_read_errors);
+
+        Value status;
+        ASSERT_TRUE(h->Status(NUM_DATA, status) == OK);
+        EXPECT_EQ(num_inserted, (uint32_t) atoi(status.str().c_str()));
+
+        // the writers stop when the table fills up; concurrent displacement still reaches a high load factor
+        Value table_size;
+        ASSERT_TRUE(h->Status(CAPACITY, table_size) == OK);
+        EXPECT_LT((uint32_t) atoi(table_size.str().c_str()) / 2, num_inserted);
+
+        // every inserted key is visible
+        for (uint32_t t = 0; t < num_concurrent_writers; t++) {
+            for (uint32_t i = args[t].begin; i < args[t].progress; i++) {
+                SizedValue<64> read_data;
+                ASSERT_TRUE(h->Get(ConstRefValue((char*) &(key_vec1[i]), 8), read_data) == OK);
+                EXPECT_EQ((unsigned) 4, read_data.size());
+                EXPECT_EQ(0, memcmp(&(val_vec1[i]), read_data.data(), 4));
+            }
+        }
+
+        h->Close();
+    }
+
     TEST_F(FawnDS_Cuckoo_Test, SimpleTest_PutUndoGet) {
         test_put_undo_get(h);
     }
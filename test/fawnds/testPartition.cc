@@ -0,0 +1,444 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "fawnds_factory.h"
+#include "fawnds_partition.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+namespace fawn {
+
+    static std::string conf_file = "testConfigs/testPartition.xml";
+
+    // spreads key prefixes evenly over the partitions
+    static uint64_t
+    key_of(size_t i)
+    {
+        return static_cast<uint64_t>(i) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    // the inverse of key_of(); the multiplier is odd and thus invertible modulo 2^64
+    static size_t
+    index_of(uint64_t key)
+    {
+        uint64_t inverse = 0x9e3779b97f4a7c15ULL;
+        for (size_t i = 0; i < 5; i++)
+            inverse *= 2 - 0x9e3779b97f4a7c15ULL * inverse;
+        return static_cast<size_t>(key * inverse);
+    }
+
+    static void
+    fill_data(char* data, size_t i, size_t version)
+    {
+        memset(data, static_cast<int>(i + version), 16);
+        memcpy(data, &i, sizeof(i));
+    }
+
+    // the 32 MSBs of the key, which decide the partition (no skip bits)
+    static uint32_t
+    prefix_of(const char* key)
+    {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(key);
+        return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+    }
+
+    class FawnDS_Partition_Test : public testing::Test {
+    protected:
+        virtual void SetUp() {
+            fawnds_ = NULL;
+        }
+
+        virtual void TearDown() {
+            if (fawnds_) {
+                fawnds_->Close();
+                fawnds_->Destroy();
+            }
+            delete fawnds_;
+        }
+
+        // creates an empty store; knobs are (name, value) pairs of top-level settings such as ("dispatch", "per-core")
+        void NewPartition(const std::vector<std::pair<std::string, std::string> >& knobs) {
+            Configuration* config = new Configuration(conf_file);
+            for (size_t i = 0; i < knobs.size(); i++) {
+                std::string path = "child::" + knobs[i].first;
+                if (config->ExistsNode(path) != 0)
+                    ASSERT_EQ(0, config->CreateNodeAndAppend(knobs[i].first, "."));
+                ASSERT_EQ(0, config->SetStringValue(path, knobs[i].second));
+            }
+
+            fawnds_ = dynamic_cast<FawnDS_Partition*>(FawnDS_Factory::New(config));
+            ASSERT_TRUE(fawnds_ != NULL);
+            // remove the files of an earlier run that did not finish
+            fawnds_->Destroy();
+            ASSERT_EQ(OK, fawnds_->Create());
+        }
+
+        void NewPartition() {
+            NewPartition(std::vector<std::pair<std::string, std::string> >());
+        }
+
+        void NewPerCorePartition() {
+            std::vector<std::pair<std::string, std::string> > knobs;
+            knobs.push_back(std::make_pair("dispatch", "per-core"));
+            knobs.push_back(std::make_pair("dispatch-threads", "2"));
+            NewPartition(knobs);
+        }
+
+        void PutEntries(size_t begin, size_t end, size_t version) {
+            for (size_t i = begin; i < end; i++) {
+                uint64_t key = key_of(i);
+                char data[data_len_];
+                fill_data(data, i, version);
+                ASSERT_EQ(OK, fawnds_->Put(ConstRefValue(&key), ConstRefValue(data, data_len_)));
+            }
+        }
+
+        void DeleteEntries(size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                uint64_t key = key_of(i);
+                ASSERT_EQ(OK, fawnds_->Delete(ConstRefValue(&key)));
+            }
+        }
+
+        // checks keys in [0, num_keys) against versions: keys in [deleted_begin, deleted_end) are absent, keys below num_updated have version 1, and others version 0
+        void CheckEntries(size_t num_keys, size_t num_updated, size_t deleted_begin, size_t deleted_end) {
+            for (size_t i = 0; i < num_keys; i++) {
+                uint64_t key = key_of(i);
+                Value data;
+                FawnDS_Return ret = fawnds_->Get(ConstRefValue(&key), data);
+                if (i >= deleted_begin && i < deleted_end) {
+                    ASSERT_NE(OK, ret) << "key " << i;
+                    continue;
+                }
+                char expected[data_len_];
+                fill_data(expected, i, i < num_updated ? 1 : 0);
+                ASSERT_EQ(OK, ret) << "key " << i;
+                ASSERT_EQ(data_len_, data.size());
+                ASSERT_EQ(0, memcmp(expected, data.data(), data_len_)) << "key " << i;
+            }
+        }
+
+        // records the entries of each key index in [0, num_keys); FawnDS_SF scans return every version and deletion marker in write order
+        class Collector : public FawnDS_BatchCallback {
+        public:
+            Collector(size_t num_keys) : counts_(num_keys, 0), last_states_(num_keys, END), last_data_(num_keys), unknown_(0) {
+                pthread_mutex_init(&mutex_, NULL);
+            }
+
+            ~Collector() {
+                pthread_mutex_destroy(&mutex_);
+            }
+
+            bool Process(const FawnDS_Batch& batch) {
+                pthread_mutex_lock(&mutex_);
+                for (size_t i = 0; i < batch.size; i++) {
+                    uint64_t key;
+                    memcpy(&key, batch.keys[i].data, sizeof(key));
+                    size_t index = index_of(key);
+                    if (index >= counts_.size()) {
+                        unknown_++;
+                        continue;
+                    }
+                    counts_[index]++;
+                    last_states_[index] = batch.states[i];
+                    last_data_[index].assign(batch.data[i].data, batch.data[i].size);
+                }
+                pthread_mutex_unlock(&mutex_);
+                return true;
+            }
+
+            // every key was written once with version 0
+            void ExpectOnce() const {
+                EXPECT_EQ(0u, unknown_);
+                for (size_t i = 0; i < counts_.size(); i++) {
+                    ASSERT_EQ(1u, counts_[i]) << "key " << i;
+                    ASSERT_EQ(OK, last_states_[i]) << "key " << i;
+                    char expected[data_len_];
+                    fill_data(expected, i, 0);
+                    ASSERT_EQ(std::string(expected, data_len_), last_data_[i]) << "key " << i;
+                }
+            }
+
+            // the last entry of each key matches CheckEntries(); a key in more than one partition would break the order
+            void ExpectLatest(size_t num_updated, size_t deleted_begin, size_t deleted_end) const {
+                EXPECT_EQ(0u, unknown_);
+                for (size_t i = 0; i < counts_.size(); i++) {
+                    if (i >= deleted_begin && i < deleted_end) {
+                        if (counts_[i] != 0)
+                            ASSERT_EQ(KEY_DELETED, last_states_[i]) << "key " << i;
+                        continue;
+                    }
+                    ASSERT_LT(0u, counts_[i]) << "key " << i;
+                    ASSERT_EQ(OK, last_states_[i]) << "key " << i;
+                    char expected[data_len_];
+                    fill_data(expected, i, i < num_updated ? 1 : 0);
+                    ASSERT_EQ(std::string(expected, data_len_), last_data_[i]) << "key " << i;
+                }
+            }
+
+        private:
+            std::vector<size_t> counts_;
+            std::vector<FawnDS_Return> last_states_;
+            std::vector<std::string> last_data_;
+            size_t unknown_;
+            pthread_mutex_t mutex_;
+        };
+
+        // checks that every scan returns each key exactly once; keys in [0, num_keys) must have been put once
+        void CheckScans(size_t num_keys) {
+            {
+                Collector collector(num_keys);
+                ASSERT_EQ(OK, fawnds_->EnumerateBatchParallel(collector, 100));
+                collector.ExpectOnce();
+            }
+            {
+                Collector collector(num_keys);
+                ASSERT_EQ(OK, fawnds_->EnumerateBatch(collector, 100));
+                collector.ExpectOnce();
+            }
+
+            size_t count = 0;
+            for (FawnDS_ConstIterator it = fawnds_->Enumerate(); !it.IsEnd(); ++it) {
+                ASSERT_EQ(OK, it->state);
+                count++;
+            }
+            EXPECT_EQ(num_keys, count);
+
+            count = 0;
+            for (size_t p = 0; p < fawnds_->NumPartitions(); p++)
+                for (FawnDS_ConstIterator it = fawnds_->EnumeratePartition(p); !it.IsEnd(); ++it)
+                    count++;
+            EXPECT_EQ(num_keys, count);
+        }
+
+        // checks that scans after updates end each key with the entry that Get() returns
+        void CheckLatestScans(size_t num_keys, size_t num_updated, size_t deleted_begin, size_t deleted_end) {
+            {
+                Collector collector(num_keys);
+                ASSERT_EQ(OK, fawnds_->EnumerateBatchParallel(collector, 100));
+                collector.ExpectLatest(num_updated, deleted_begin, deleted_end);
+            }
+            {
+                Collector collector(num_keys);
+                ASSERT_EQ(OK, fawnds_->EnumerateBatch(collector, 100));
+                collector.ExpectLatest(num_updated, deleted_begin, deleted_end);
+            }
+        }
+
+        void TestRoundTrip() {
+            PutEntries(0, 30000, 0);
+            CheckScans(30000);
+
+            PutEntries(0, 5000, 1);
+            DeleteEntries(5000, 6000);
+            CheckEntries(30000, 5000, 5000, 6000);
+
+            uint64_t key = key_of(10);
+            EXPECT_EQ(OK, fawnds_->Contains(ConstRefValue(&key)));
+            size_t len = 0;
+            EXPECT_EQ(OK, fawnds_->Length(ConstRefValue(&key), len));
+            EXPECT_EQ(data_len_, len);
+            key = key_of(5500);
+            EXPECT_NE(OK, fawnds_->Contains(ConstRefValue(&key)));
+            key = key_of(30000);
+            EXPECT_NE(OK, fawnds_->Contains(ConstRefValue(&key)));
+
+            // keys from every partition in one call, including deleted and missing keys
+            std::vector<uint64_t> raw_keys;
+            for (size_t i = 0; i < 32000; i += 7)
+                raw_keys.push_back(key_of(i));
+            std::vector<ConstValue> keys;
+            for (size_t j = 0; j < raw_keys.size(); j++)
+                keys.push_back(ConstRefValue(&raw_keys[j]));
+            std::vector<Value> out;
+            std::vector<FawnDS_Return> rets;
+            ASSERT_EQ(OK, fawnds_->MultiGet(keys, out, rets));
+            ASSERT_EQ(keys.size(), out.size());
+            ASSERT_EQ(keys.size(), rets.size());
+            for (size_t j = 0; j < keys.size(); j++) {
+                size_t i = j * 7;
+                if ((i >= 5000 && i < 6000) || i >= 30000) {
+                    EXPECT_NE(OK, rets[j]) << "key " << i;
+                    continue;
+                }
+                char expected[data_len_];
+                fill_data(expected, i, i < 5000 ? 1 : 0);
+                ASSERT_EQ(OK, rets[j]) << "key " << i;
+                ASSERT_EQ(data_len_, out[j].size());
+                EXPECT_EQ(0, memcmp(expected, out[j].data(), data_len_)) << "key " << i;
+            }
+
+            CheckLatestScans(30000, 5000, 5000, 6000);
+
+            // stores write their files on Flush()
+            ASSERT_EQ(OK, fawnds_->Flush());
+            ASSERT_EQ(OK, fawnds_->Close());
+            ASSERT_EQ(OK, fawnds_->Open());
+            CheckEntries(30000, 5000, 5000, 6000);
+            CheckLatestScans(30000, 5000, 5000, 6000);
+        }
+
+        struct WriterArgs {
+            FawnDS_Partition* fawnds;
+            bool failed;
+        };
+
+        // rewrites keys [0, 10000) with version 1 and deletes keys [10000, 11000) several times
+        static void* writer_main(void* arg) {
+            WriterArgs* args = static_cast<WriterArgs*>(arg);
+            for (size_t round = 0; round < 3; round++) {
+                for (size_t i = 0; i < 10000; i++) {
+                    uint64_t key = key_of(i);
+                    char data[data_len_];
+                    fill_data(data, i, 1);
+                    if (args->fawnds->Put(ConstRefValue(&key), ConstRefValue(data, data_len_)) != OK)
+                        args->failed = true;
+                }
+                for (size_t i = 10000; i < 11000; i++) {
+                    uint64_t key = key_of(i);
+                    if (args->fawnds->Delete(ConstRefValue(&key)) != OK)
+                        args->failed = true;
+                }
+            }
+            return NULL;
+        }
+
+        void TestSplitUnderWrites() {
+            PutEntries(0, 40000, 0);
+            ASSERT_EQ(3u, fawnds_->NumPartitions());
+
+            // an iterator made before a split keeps reading the old store
+            FawnDS_ConstIterator old_it = fawnds_->Enumerate();
+            ASSERT_EQ(OK, fawnds_->SplitPartition(1));
+            ASSERT_EQ(OK, fawnds_->Flush());
+            ASSERT_EQ(4u, fawnds_->NumPartitions());
+            size_t count = 0;
+            for (; !old_it.IsEnd(); ++old_it)
+                count++;
+            EXPECT_EQ(40000u, count);
+            old_it = FawnDS_ConstIterator();
+
+            // the new stores hold a copy of the latest entry of each key
+            CheckScans(40000);
+
+            WriterArgs args;
+            args.fawnds = fawnds_;
+            args.failed = false;
+            pthread_t writer;
+            ASSERT_EQ(0, pthread_create(&writer, NULL, writer_main, &args));
+            EXPECT_EQ(OK, fawnds_->SplitPartition(3));
+            EXPECT_EQ(OK, fawnds_->SplitPartition(0));
+            pthread_join(writer, NULL);
+            EXPECT_FALSE(args.failed);
+
+            // Flush() waits for the splits
+            ASSERT_EQ(OK, fawnds_->Flush());
+            EXPECT_EQ(6u, fawnds_->NumPartitions());
+            CheckEntries(40000, 10000, 10000, 11000);
+            CheckLatestScans(40000, 10000, 10000, 11000);
+
+            // partitions cover increasing key ranges
+            uint32_t last_prefix = 0;
+            for (size_t p = 0; p < fawnds_->NumPartitions(); p++) {
+                uint32_t min_prefix = static_cast<uint32_t>(-1);
+                uint32_t max_prefix = 0;
+                size_t num = 0;
+                for (FawnDS_ConstIterator it = fawnds_->EnumeratePartition(p); !it.IsEnd(); ++it) {
+                    uint32_t prefix = prefix_of(it->key.data());
+                    min_prefix = std::min(min_prefix, prefix);
+                    max_prefix = std::max(max_prefix, prefix);
+                    num++;
+                }
+                ASSERT_LT(0u, num);
+                if (p > 0)
+                    EXPECT_LT(last_prefix, min_prefix);
+                last_prefix = max_prefix;
+            }
+
+            // the routing table keeps the split partitions across Close() and Open()
+            ASSERT_EQ(OK, fawnds_->Close());
+            ASSERT_EQ(OK, fawnds_->Open());
+            EXPECT_EQ(6u, fawnds_->NumPartitions());
+            CheckEntries(40000, 10000, 10000, 11000);
+            CheckLatestScans(40000, 10000, 10000, 11000);
+
+            // the new stores take writes
+            PutEntries(40000, 45000, 0);
+            CheckEntries(45000, 10000, 10000, 11000);
+        }
+
+        static const size_t data_len_ = 16;
+
+        FawnDS_Partition* fawnds_;
+    };
+
+    const size_t FawnDS_Partition_Test::data_len_;
+
+    TEST_F(FawnDS_Partition_Test, TestRoundTrip) {
+        NewPartition();
+        TestRoundTrip();
+    }
+
+    TEST_F(FawnDS_Partition_Test, TestPerCoreRoundTrip) {
+        NewPerCorePartition();
+        TestRoundTrip();
+    }
+
+    TEST_F(FawnDS_Partition_Test, TestUnequalPartitions) {
+        NewPartition();
+        PutEntries(0, 30000, 0);
+        ASSERT_EQ(3u, fawnds_->NumPartitions());
+
+        // three partitions divide the prefix space into thirds
+        const uint64_t range = (1ULL << 32) / 3;
+        for (size_t p = 0; p < 3; p++) {
+            size_t num = 0;
+            for (FawnDS_ConstIterator it = fawnds_->EnumeratePartition(p); !it.IsEnd(); ++it) {
+                uint64_t prefix = prefix_of(it->key.data());
+                ASSERT_LE(p * range, prefix);
+                if (p < 2)
+                    ASSERT_GT((p + 1) * range, prefix);
+                num++;
+            }
+            EXPECT_LT(9000u, num);
+            EXPECT_GT(11000u, num);
+        }
+    }
+
+    TEST_F(FawnDS_Partition_Test, TestSplitUnderWrites) {
+        NewPartition();
+        TestSplitUnderWrites();
+    }
+
+    TEST_F(FawnDS_Partition_Test, TestPerCoreSplitUnderWrites) {
+        NewPerCorePartition();
+        TestSplitUnderWrites();
+    }
+
+    TEST_F(FawnDS_Partition_Test, TestInvalidSplit) {
+        NewPartition();
+        EXPECT_NE(OK, fawnds_->SplitPartition(3));
+        EXPECT_NE(OK, fawnds_->SplitPartition(static_cast<size_t>(-1)));
+        EXPECT_EQ(3u, fawnds_->NumPartitions());
+
+        // a split is not recorded without a routing table on disk
+        ASSERT_EQ(OK, fawnds_->Close());
+        ASSERT_EQ(OK, fawnds_->Destroy());
+        delete fawnds_;
+        Configuration* config = new Configuration(conf_file);
+        ASSERT_EQ(0, config->DeleteNode("child::file"));
+        fawnds_ = dynamic_cast<FawnDS_Partition*>(FawnDS_Factory::New(config));
+        ASSERT_TRUE(fawnds_ != NULL);
+        ASSERT_EQ(OK, fawnds_->Create());
+        EXPECT_NE(OK, fawnds_->SplitPartition(0));
+        EXPECT_EQ(3u, fawnds_->NumPartitions());
+    }
+
+}  // namespace fawn
+
+int main(int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,188 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "sorter.h"
+#include "configuration.h"
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace fawn {
+
+#ifndef HAVE_LIBNSORT
+
+    // exposes the number of runs spilled to temporary files
+    class SpillCountingSorter : public Sorter {
+    public:
+        size_t num_runs() const { return runs_.size(); }
+    };
+
+    class SorterTest : public testing::Test {
+    protected:
+        virtual void SetUp() {
+            sorter_ = NULL;
+        }
+
+        virtual void TearDown() {
+            delete sorter_;
+        }
+
+        void NewSorter(size_t memory_limit, size_t sort_threads) {
+            Configuration* config = Sorter::NewConfig(key_len_, data_len_, "./testFiles", memory_limit, sort_threads);
+            ASSERT_TRUE(config != NULL);
+
+            delete sorter_;
+            sorter_ = new SpillCountingSorter();
+            ASSERT_EQ(OK, sorter_->SetConfig(config));
+            ASSERT_EQ(OK, sorter_->Create());
+        }
+
+        // puts num_entries entries whose keys take num_distinct_keys values; the data is the insertion sequence number
+        void PutEntries(size_t num_entries, size_t num_distinct_keys) {
+            srand(1);
+            char key[key_len_];
+            memset(key, 0, key_len_);
+            for (size_t i = 0; i < num_entries; i++) {
+                // the first bytes spread entries over radix buckets; the last bytes make duplicates
+                uint32_t k = static_cast<uint32_t>(rand()) % num_distinct_keys;
+                key[0] = static_cast<char>(k * 2654435761u >> 24);
+                memcpy(key + key_len_ - sizeof(k), &k, sizeof(k));
+                uint64_t seq = i;
+                ASSERT_EQ(OK, sorter_->Put(ConstRefValue(key, key_len_), ConstRefValue(&seq)));
+            }
+            ASSERT_EQ(OK, sorter_->Flush());
+        }
+
+        // checks that keys are in order and that entries with the same key keep their insertion order
+        void CheckOrder(size_t num_entries, bool use_batches) {
+            std::vector<std::string> keys;
+            std::vector<uint64_t> seqs;
+            if (use_batches) {
+                Collector collector(keys, seqs);
+                ASSERT_EQ(OK, sorter_->EnumerateBatch(collector, 100));
+            }
+            else {
+                for (FawnDS_ConstIterator it = sorter_->Enumerate(); !it.IsEnd(); ++it) {
+                    ASSERT_EQ(OK, it->state);
+                    keys.push_back(it->key.str());
+                    seqs.push_back(it->data.as_number<uint64_t>());
+                }
+            }
+
+            ASSERT_EQ(num_entries, keys.size());
+            std::vector<bool> seen(num_entries, false);
+            for (size_t i = 0; i < keys.size(); i++) {
+                ASSERT_LT(seqs[i], num_entries);
+                EXPECT_FALSE(seen[seqs[i]]);
+                seen[seqs[i]] = true;
+                if (i == 0)
+                    continue;
+                ASSERT_LE(keys[i - 1], keys[i]);
+                if (keys[i - 1] == keys[i])
+                    ASSERT_LT(seqs[i - 1], seqs[i]);
+            }
+        }
+
+        class Collector : public FawnDS_BatchCallback {
+        public:
+            Collector(std::vector<std::string>& keys, std::vector<uint64_t>& seqs) : keys_(keys), seqs_(seqs) {}
+
+            bool Process(const FawnDS_Batch& batch) {
+                for (size_t i = 0; i < batch.size; i++) {
+                    EXPECT_EQ(OK, batch.states[i]);
+                    keys_.push_back(std::string(static_cast<const char*>(batch.keys[i].data), batch.keys[i].size));
+                    uint64_t seq;
+                    memcpy(&seq, batch.data[i].data, sizeof(seq));
+                    seqs_.push_back(seq);
+                }
+                return true;
+            }
+
+        private:
+            std::vector<std::string>& keys_;
+            std::vector<uint64_t>& seqs_;
+        };
+
+        static const size_t key_len_ = 16;
+        static const size_t data_len_ = 8;
+
+        SpillCountingSorter* sorter_;
+    };
+
+    TEST_F(SorterTest, TestInMemory) {
+        NewSorter(0, 1);
+        PutEntries(100000, 5000);
+        EXPECT_EQ(0u, sorter_->num_runs());
+        CheckOrder(100000, false);
+    }
+
+    TEST_F(SorterTest, TestSpilledRuns) {
+        // each entry takes a record and a pointer (32 bytes), so a 64 KiB limit spills about every 2000 entries
+        NewSorter(65536, 1);
+        PutEntries(100000, 5000);
+        EXPECT_LT(40u, sorter_->num_runs());
+        CheckOrder(100000, false);
+    }
+
+    TEST_F(SorterTest, TestSpilledRunsBatch) {
+        NewSorter(65536, 1);
+        PutEntries(100000, 5000);
+        EXPECT_LT(40u, sorter_->num_runs());
+        CheckOrder(100000, true);
+    }
+
+    TEST_F(SorterTest, TestSpilledRunsTies) {
+        // every key occurs in many runs, so the merge must order ties by run
+        NewSorter(65536, 1);
+        PutEntries(100000, 10);
+        EXPECT_LT(40u, sorter_->num_runs());
+        CheckOrder(100000, false);
+    }
+
+    TEST_F(SorterTest, TestParallelSort) {
+        // more entries than the cutoff for sorting with a single thread
+        NewSorter(0, 4);
+        PutEntries(300000, 50000);
+        EXPECT_EQ(0u, sorter_->num_runs());
+        CheckOrder(300000, false);
+    }
+
+    TEST_F(SorterTest, TestParallelSortTies) {
+        // radix buckets of many identical keys are sorted by different threads
+        NewSorter(0, 4);
+        PutEntries(300000, 10);
+        CheckOrder(300000, true);
+    }
+
+    TEST_F(SorterTest, TestParallelSortSpilledRuns) {
+        // each spilled run holds about 130000 entries, so every run is sorted in parallel
+        NewSorter(4194304, 4);
+        PutEntries(600000, 50000);
+        EXPECT_LT(3u, sorter_->num_runs());
+        CheckOrder(600000, false);
+    }
+
+    TEST_F(SorterTest, TestInvalidConfig) {
+        // spilled runs need fixed-length records
+        Configuration* config = Sorter::NewConfig(0, 0, "./testFiles", 65536);
+        ASSERT_TRUE(config != NULL);
+        Sorter sorter;
+        ASSERT_EQ(OK, sorter.SetConfig(config));
+        EXPECT_NE(OK, sorter.Create());
+
+        config = Sorter::NewConfig(key_len_, 0);
+        ASSERT_TRUE(config != NULL);
+        ASSERT_EQ(0, config->SetStringValue("sort-threads", "-1"));
+        Sorter sorter2;
+        ASSERT_EQ(OK, sorter2.SetConfig(config));
+        EXPECT_NE(OK, sorter2.Create());
+    }
+
+#endif  // #ifndef HAVE_LIBNSORT
+
+}  // namespace fawn
+
+int main(int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -257,24 +257,54 @@ namespace fawn
         }
     }
 
-//    TEST_F(FawnDS_SF_Ordered_Trie_Test, TestSimpleSortedInsertRetrieveManyReloaded) {
-//        sort_keys(arr_, key_len_, 0, size_);
-// 
-//        for (size_t i = 0; i < size_; i++)
-//            EXPECT_EQ(0, fawnds_->Insert(arr_[i], key_len_, arr_[i] + key_len_, data_len_));
-//        EXPECT_EQ(0, fawnds_->Flush());
-//
-//        delete fawnds_;
-//        fawnds_ = FawnDS_Factory::Open_FawnDS(conf_file);
-//
-//        for (size_t i = 0; i < size_; i++)
-//        {
-//            EXPECT_EQ(0, fawnds_->Get(arr_[i], key_len_, ret_data_, ret_data_len_));
-//            EXPECT_EQ(data_len_, ret_data_len_);
-//            EXPECT_EQ(0, memcmp(arr_[i] + key_len_, ret_data_, ret_data_len_));
-//        }
-//    }
-//
+    TEST_F(FawnDS_SF_Ordered_Trie_Test, TestSimpleSortedInsertMultiGet) {
+        sort_keys(arr_, key_len_, 0, 100);
+
+        for (size_t i = 0; i < 100; i += 2)
+            EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+        EXPECT_EQ(OK, fawnds_->Flush());
+
+        std::vector<ConstValue> keys;
+        for (size_t i = 0; i < 100; i++)
+            keys.push_back(arr_[i].key);
+
+        std::vector<Value> ret_data;
+        std::vector<FawnDS_Return> rets;
+        EXPECT_EQ(OK, fawnds_->MultiGet(keys, ret_data, rets));
+        ASSERT_EQ(100u, rets.size());
+
+        for (size_t i = 0; i < 100; i++)
+        {
+            if (i % 2 == 0) {
+                EXPECT_EQ(OK, rets[i]);
+                EXPECT_EQ(data_len_, ret_data[i].size());
+                EXPECT_EQ(0, memcmp(arr_[i].data.data(), ret_data[i].data(), data_len_));
+            }
+            else
+                EXPECT_EQ(KEY_NOT_FOUND, rets[i]);
+        }
+    }
+
+    TEST_F(FawnDS_SF_Ordered_Trie_Test, TestSimpleSortedInsertRetrieveManyReloaded) {
+        sort_keys(arr_, key_len_, 0, size_);
+ 
+        for (size_t i = 0; i < size_; i++)
+            EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+        EXPECT_EQ(OK, fawnds_->Flush());
+        EXPECT_EQ(OK, fawnds_->Close());
+
+        delete fawnds_;
+        fawnds_ = FawnDS_Factory::New(new Configuration(conf_file));
+        EXPECT_EQ(OK, fawnds_->Open());
+
+        for (size_t i = 0; i < size_; i++)
+        {
+            EXPECT_EQ(OK, fawnds_->Get(arr_[i].key, ret_data_));
+            EXPECT_EQ(data_len_, ret_data_.size());
+            EXPECT_EQ(0, memcmp(arr_[i].data.data(), ret_data_.data(), data_len_));
+        }
+    }
+
     TEST_F(FawnDS_SF_Ordered_Trie_Test, TestSimpleIterator) {
         sort_keys(arr_, key_len_, 0, size_);
  
@@ -296,6 +326,133 @@ namespace fawn
         EXPECT_EQ(size_, idx);
     }
 
+    static const size_t trie_batch_size = 100;
+
+    // checks each batch entry against arr_ in order
+    class TrieBatchChecker : public FawnDS_BatchCallback {
+    public:
+        TrieBatchChecker(const kv_array_type& arr, size_t key_len, size_t data_len)
+            : idx(0), arr_(arr), key_len_(key_len), data_len_(data_len)
+        {
+        }
+
+        bool Process(const FawnDS_Batch& batch)
+        {
+            EXPECT_GE(trie_batch_size, batch.size);
+            for (size_t i = 0; i < batch.size; i++, idx++) {
+                EXPECT_EQ(OK, batch.states[i]);
+                EXPECT_EQ(key_len_, batch.keys[i].size);
+                EXPECT_EQ(data_len_, batch.data[i].size);
+                if (idx < arr_.size()) {
+                    EXPECT_EQ(0, memcmp(arr_[idx].key.data(), batch.keys[i].data, key_len_));
+                    EXPECT_EQ(0, memcmp(arr_[idx].data.data(), batch.data[i].data, data_len_));
+                }
+            }
+            return true;
+        }
+
+        size_t idx;
+
+    private:
+        const kv_array_type& arr_;
+        size_t key_len_;
+        size_t data_len_;
+    };
+
+    TEST_F(FawnDS_SF_Ordered_Trie_Test, TestBatchIterator) {
+        sort_keys(arr_, key_len_, 0, size_);
+ 
+        for (size_t i = 0; i < size_; i++)
+            EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+        EXPECT_EQ(OK, fawnds_->Flush());
+
+        TrieBatchChecker checker(arr_, key_len_, data_len_);
+        EXPECT_EQ(OK, fawnds_->EnumerateBatch(checker, trie_batch_size));
+        EXPECT_EQ(size_, checker.idx);
+    }
+
+    TEST_F(FawnDS_SF_Ordered_Trie_Test, TestFind) {
+        sort_keys(arr_, key_len_, 0, size_);
+ 
+        for (size_t i = 0; i < size_; i++)
+            EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+        EXPECT_EQ(OK, fawnds_->Flush());
+
+        for (size_t i = 0; i < size_; i += 7) {
+            // an existing key and the following key
+            FawnDS_ConstIterator it = fawnds_->Find(arr_[i].key);
+            ASSERT_FALSE(it.IsEnd());
+            EXPECT_EQ(0, memcmp(arr_[i].key.data(), it->key.data(), key_len_));
+            EXPECT_EQ(0, memcmp(arr_[i].data.data(), it->data.data(), data_len_));
+            ++it;
+            if (i + 1 < size_) {
+                ASSERT_FALSE(it.IsEnd());
+                EXPECT_EQ(0, memcmp(arr_[i + 1].key.data(), it->key.data(), key_len_));
+            }
+            else
+                EXPECT_TRUE(it.IsEnd());
+
+            // a missing key right after an existing key is located at the next key
+            Value key = NewValue(arr_[i].key.data(), key_len_);
+            size_t j = key_len_;
+            while (j > 0 && ++reinterpret_cast<uint8_t&>(key.data()[j - 1]) == 0)
+                j--;
+            if (j == 0 || (i + 1 < size_ && key == arr_[i + 1].key))
+                continue;
+            it = fawnds_->Find(key);
+            if (i + 1 < size_) {
+                ASSERT_FALSE(it.IsEnd());
+                EXPECT_EQ(0, memcmp(arr_[i + 1].key.data(), it->key.data(), key_len_));
+            }
+            else
+                EXPECT_TRUE(it.IsEnd());
+        }
+
+        // with skipped bits, all keys share their first 4 bits (0x5); keys with other leading bits precede or follow
+        // every stored key even though their remaining bits select a bucket in the middle of the index
+        delete fawnds_;
+        Configuration* config = new Configuration(conf_file);
+        EXPECT_EQ(0, config->SetStringValue("child::skip-bits", "4"));
+        fawnds_ = FawnDS_Factory::New(config);
+        ASSERT_EQ(OK, fawnds_->Create());
+
+        for (size_t i = 0; i < size_; i++)
+            arr_[i].key.data()[0] = static_cast<char>(0x50 | (arr_[i].key.data()[0] & 0x0f));
+        sort_keys(arr_, key_len_, 0, size_);
+        for (size_t i = 0; i < size_; i++)
+            EXPECT_EQ(OK, fawnds_->Put(arr_[i].key, arr_[i].data));
+        EXPECT_EQ(OK, fawnds_->Flush());
+
+        for (int reopen = 0; reopen < 2; reopen++) {
+            if (reopen) {
+                EXPECT_EQ(OK, fawnds_->Close());
+                delete fawnds_;
+                config = new Configuration(conf_file);
+                EXPECT_EQ(0, config->SetStringValue("child::skip-bits", "4"));
+                fawnds_ = FawnDS_Factory::New(config);
+                ASSERT_EQ(OK, fawnds_->Open());
+            }
+
+            for (size_t i = 0; i < size_; i += 97) {
+                Value key = NewValue(arr_[i].key.data(), key_len_);
+
+                key.data()[0] = static_cast<char>(0x30 | (key.data()[0] & 0x0f));
+                FawnDS_ConstIterator it = fawnds_->Find(key);
+                ASSERT_FALSE(it.IsEnd());
+                EXPECT_EQ(0, memcmp(arr_[0].key.data(), it->key.data(), key_len_));
+
+                key.data()[0] = static_cast<char>(0xf0 | (key.data()[0] & 0x0f));
+                it = fawnds_->Find(key);
+                EXPECT_TRUE(it.IsEnd());
+
+                // the remaining keys are still found in their buckets
+                it = fawnds_->Find(arr_[i].key);
+                ASSERT_FALSE(it.IsEnd());
+                EXPECT_EQ(0, memcmp(arr_[i].key.data(), it->key.data(), key_len_));
+            }
+        }
+    }
+
     TEST_F(FawnDS_SF_Ordered_Trie_Test, TestGetBeforeFinalizing) {
         sort_keys(arr_, key_len_, 0, size_);
  
@@ -0,0 +1,261 @@
+/* -*- Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "value.h"
+#include <gtest/gtest.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace fawn {
+
+    // true if the data of the value is stored in the value object itself
+    static bool
+    is_inline(const ConstValue& v)
+    {
+        const char* begin = reinterpret_cast<const char*>(&v);
+        return v.data() >= begin && v.data() < begin + sizeof(v);
+    }
+
+    static std::string
+    pattern(size_t size, char seed)
+    {
+        std::string s(size, 0);
+        for (size_t i = 0; i < size; i++)
+            s[i] = static_cast<char>(seed + i);
+        return s;
+    }
+
+    // a value whose heap block or inline buffer holds a copy of s
+    static Value
+    make_value(const std::string& s)
+    {
+        return NewValue(s.data(), s.size());
+    }
+
+    TEST(ValueTest, TestInlineAndHeap) {
+        std::string small = pattern(10, 'a');
+        NewValue v1(small.data(), small.size());
+        EXPECT_TRUE(is_inline(v1));
+        EXPECT_EQ(64u, v1.capacity());
+        EXPECT_EQ(small, v1.str());
+
+        // the inline buffer is used up to its capacity
+        std::string full = pattern(64, 'b');
+        NewValue v2(full.data(), full.size());
+        EXPECT_TRUE(is_inline(v2));
+        EXPECT_EQ(full, v2.str());
+
+        std::string large = pattern(65, 'c');
+        NewValue v3(large.data(), large.size());
+        EXPECT_FALSE(is_inline(v3));
+        EXPECT_EQ(65u, v3.capacity());
+        EXPECT_EQ(large, v3.str());
+
+        // a requested capacity beyond the inline buffer allocates a heap block
+        NewValue v4(small.data(), small.size(), 100);
+        EXPECT_FALSE(is_inline(v4));
+        EXPECT_EQ(100u, v4.capacity());
+        EXPECT_EQ(small, v4.str());
+
+        // references never copy
+        char buf[8] = "abcdefg";
+        RefValue v5(buf, sizeof(buf));
+        EXPECT_EQ(buf, v5.data());
+    }
+
+    TEST(ValueTest, TestCopyInline) {
+        std::string s = pattern(20, 'a');
+        Value* v1 = new Value(make_value(s));
+        Value v2(*v1);
+        ASSERT_TRUE(is_inline(v2));
+        EXPECT_NE(v1->data(), v2.data());
+        EXPECT_EQ(s, v2.str());
+
+        // the copy owns its bytes
+        v2.data()[0] = 'x';
+        EXPECT_EQ(s, v1->str());
+        delete v1;
+        EXPECT_EQ('x', v2.data()[0]);
+        EXPECT_EQ(s.substr(1), v2.str().substr(1));
+    }
+
+    TEST(ValueTest, TestCopyHeap) {
+        std::string s = pattern(200, 'a');
+        Value* v1 = new Value(make_value(s));
+        Value v2(*v1);
+        Value v3;
+        v3 = *v1;
+        EXPECT_FALSE(is_inline(v2));
+        // copies share the heap block
+        EXPECT_EQ(v1->data(), v2.data());
+        EXPECT_EQ(v1->data(), v3.data());
+
+        // the block lives as long as any copy
+        delete v1;
+        EXPECT_EQ(s, v2.str());
+        v2.reset();
+        EXPECT_EQ(s, v3.str());
+    }
+
+    TEST(ValueTest, TestAssignBetweenInlineAndHeap) {
+        std::string small = pattern(10, 'a');
+        std::string large = pattern(100, 'b');
+
+        Value v1 = make_value(small);
+        Value v2 = make_value(large);
+        Value v3 = make_value(large);
+
+        // heap over inline
+        v1 = v2;
+        EXPECT_FALSE(is_inline(v1));
+        EXPECT_EQ(v2.data(), v1.data());
+        EXPECT_EQ(large, v1.str());
+
+        // inline over heap; v1 and v3 still hold the block of v2 and v3
+        v2 = make_value(small);
+        EXPECT_TRUE(is_inline(v2));
+        EXPECT_EQ(small, v2.str());
+        EXPECT_EQ(large, v1.str());
+
+        v3 = v2;
+        EXPECT_TRUE(is_inline(v3));
+        EXPECT_EQ(small, v3.str());
+
+        // self-assignment keeps the contents
+        Value& v1_ref = v1;
+        v1 = v1_ref;
+        EXPECT_EQ(large, v1.str());
+        v3 = static_cast<const ConstValue&>(v3);
+        EXPECT_TRUE(is_inline(v3));
+        EXPECT_EQ(small, v3.str());
+    }
+
+    TEST(ValueTest, TestSwap) {
+        std::string small = pattern(10, 'a');
+        std::string large = pattern(100, 'b');
+
+        Value v1 = make_value(small);
+        Value v2 = make_value(large);
+        const char* large_data = v2.data();
+
+        v1.swap(v2);
+        EXPECT_FALSE(is_inline(v1));
+        EXPECT_EQ(large_data, v1.data());
+        EXPECT_EQ(large, v1.str());
+        EXPECT_TRUE(is_inline(v2));
+        EXPECT_EQ(small, v2.str());
+
+        v1.swap(v1);
+        EXPECT_EQ(large, v1.str());
+    }
+
+#if __cplusplus >= 201103L
+    TEST(ValueTest, TestMove) {
+        std::string small = pattern(10, 'a');
+        std::string large = pattern(100, 'b');
+
+        // moving an inline value copies its bytes into the target's own buffer
+        Value v1 = make_value(small);
+        Value v2(std::move(v1));
+        EXPECT_TRUE(is_inline(v2));
+        EXPECT_EQ(small, v2.str());
+        EXPECT_EQ(0u, v1.size());
+        EXPECT_TRUE(v1.data() == NULL);
+
+        // moving a heap value takes its block
+        Value v3 = make_value(large);
+        const char* large_data = v3.data();
+        Value v4(std::move(v3));
+        EXPECT_EQ(large_data, v4.data());
+        EXPECT_EQ(large, v4.str());
+        EXPECT_EQ(0u, v3.size());
+
+        // move assignment in both directions
+        v2 = std::move(v4);
+        EXPECT_EQ(large_data, v2.data());
+        EXPECT_EQ(large, v2.str());
+        v4 = make_value(small);
+        v2 = std::move(v4);
+        EXPECT_TRUE(is_inline(v2));
+        EXPECT_EQ(small, v2.str());
+    }
+#endif
+
+    TEST(ValueTest, TestResizeAcrossInlineCapacity) {
+        Value v;
+        v.resize(10);
+        ASSERT_TRUE(is_inline(v));
+        memcpy(v.data(), pattern(10, 'a').data(), 10);
+
+        // growing within the inline buffer keeps the buffer and the data
+        const char* inline_data = v.data();
+        v.resize(64);
+        EXPECT_EQ(inline_data, v.data());
+        memcpy(v.data() + 10, pattern(54, 'k').data(), 54);
+        std::string expected = pattern(10, 'a') + pattern(54, 'k');
+        EXPECT_EQ(expected, v.str());
+
+        // growing beyond it moves the data to the heap
+        v.resize(65);
+        EXPECT_FALSE(is_inline(v));
+        EXPECT_EQ(65u, v.capacity());
+        EXPECT_EQ(expected, v.str().substr(0, 64));
+
+        // shrinking keeps the heap block
+        const char* heap_data = v.data();
+        v.resize(10);
+        EXPECT_EQ(heap_data, v.data());
+        EXPECT_EQ(pattern(10, 'a'), v.str());
+
+        // a copy keeps the old block when the original grows
+        Value copy(v);
+        v.resize(1000);
+        EXPECT_NE(heap_data, v.data());
+        EXPECT_EQ(heap_data, copy.data());
+        EXPECT_EQ(pattern(10, 'a'), v.str().substr(0, 10));
+        EXPECT_EQ(pattern(10, 'a'), copy.str());
+
+        // data is dropped without preserve
+        Value v2 = make_value(pattern(100, 'z'));
+        v2.resize(200, false);
+        EXPECT_EQ(200u, v2.size());
+    }
+
+    TEST(ValueTest, TestResizeReference) {
+        char buf[8];
+        memcpy(buf, "abcdefgh", 8);
+        RefValue v(buf, 8);
+
+        // growing a reference copies the data; the referenced memory is left alone
+        v.resize(32);
+        EXPECT_TRUE(is_inline(v));
+        EXPECT_EQ(std::string("abcdefgh"), v.str().substr(0, 8));
+        v.data()[0] = 'x';
+        EXPECT_EQ('a', buf[0]);
+
+        v.resize(100);
+        EXPECT_FALSE(is_inline(v));
+        EXPECT_EQ(std::string("xbcdefgh"), v.str().substr(0, 8));
+    }
+
+    TEST(ValueTest, TestVectorOfValues) {
+        // reallocation copies inline values, which must point to their new buffers
+        std::vector<Value> values;
+        for (size_t i = 0; i < 1000; i++)
+            values.push_back(make_value(pattern(i % 130, static_cast<char>(i))));
+        for (size_t i = 0; i < values.size(); i++) {
+            EXPECT_EQ(i % 130 <= 64, is_inline(values[i]));
+            EXPECT_EQ(pattern(i % 130, static_cast<char>(i)), values[i].str());
+        }
+
+        std::vector<Value> copies(values);
+        values.clear();
+        for (size_t i = 0; i < copies.size(); i++)
+            EXPECT_EQ(pattern(i % 130, static_cast<char>(i)), copies[i].str());
+    }
+
+}  // namespace fawn
+
+int main(int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}